@@ -40,6 +40,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 /* The version number of this program. */
 #define ARCHER_MAJOR_VERSION 0
@@ -48,15 +49,60 @@
 
 /* Global variables */
 
-/* The document/word/position matrix */
-bow_wi2pv *archer_wi2pv;
+/* A segment of the document/word/position matrix: the PV's of the
+   documents with indices from FIRST_DI up to, but not including,
+   END_DI.  New documents are added to the last segment until it is
+   sealed.  After that a segment is never changed, only replaced by
+   merging it with its neighbours. */
+typedef struct _archer_segment {
+  int id;			/* names its files; 0 for "wi2pv" and "pv" */
+  bow_wi2pv *wi2pv;
+  int first_di;
+  int end_di;
+  int sealed;
+} archer_segment;
+
+/* The segments of the document/word/position matrix, in order of
+   document index. */
+archer_segment *archer_segments;
+int archer_segments_count;
+int archer_segments_size;
+
+/* The ID of the next new segment. */
+int archer_segments_next_id;
 
 /* The list of documents. */
 bow_sarray *archer_docs;
 
+/* The number of documents in ARCHER_DOCS that have been deleted, but
+   whose entries are still in the PV's of a segment. */
+int archer_docs_deleted_count;
+
 /* The file descriptor of the socket on which we can act as a query-server. */
 int archer_sockfd;
 
+/* Held for reading while a query is answered, and for writing while a
+   server command changes the index, so that every query sees the
+   index as it was either wholly before or wholly after each change. */
+static pthread_rwlock_t archer_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Held by a writer while it waits for ARCHER_INDEX_LOCK, so that new
+   queries wait behind it instead of keeping it out for ever. */
+static pthread_mutex_t archer_index_turnstile = PTHREAD_MUTEX_INITIALIZER;
+
+/* The lexer counts the words of the text it is reading in a global
+   variable, so queries are lexed one at a time. */
+static pthread_mutex_t archer_lexer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held by whatever writes PV's or changes the documents: the server
+   commands, and merging.  Taken before ARCHER_INDEX_LOCK, so that
+   queries go on while segments are merged, and only the commands
+   wait for it. */
+static pthread_mutex_t archer_segments_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when the commands may have left segments to merge. */
+static pthread_cond_t archer_segments_changed = PTHREAD_COND_INITIALIZER;
+
 /* The variables that are set by command-line options. */
 struct archer_arg_state
 {
@@ -69,11 +115,42 @@ struct archer_arg_state
   const char *query_string;
   const char *server_port_num;
   int serve_with_forking;
+  int serve_with_threads;
   int score_is_raw_count;
+  int top_hits_only;
+  int segment_docs;
+  int max_segments;
+  int index_threads;
 } archer_arg_state;
 
 
 
+/* Wait until the index may be read by a query. */
+static void
+archer_index_read_lock ()
+{
+  pthread_mutex_lock (&archer_index_turnstile);
+  pthread_mutex_unlock (&archer_index_turnstile);
+  pthread_rwlock_rdlock (&archer_index_lock);
+}
+
+/* Wait until the queries reading the index have finished, and keep
+   new ones from starting until archer_index_unlock(). */
+static void
+archer_index_write_lock ()
+{
+  pthread_mutex_lock (&archer_index_turnstile);
+  pthread_rwlock_wrlock (&archer_index_lock);
+  pthread_mutex_unlock (&archer_index_turnstile);
+}
+
+static void
+archer_index_unlock ()
+{
+  pthread_rwlock_unlock (&archer_index_lock);
+}
+
+
 /* Functions for creating, reading, writing a archer_doc */
 
 int
@@ -106,6 +183,206 @@ archer_doc_free (archer_doc *doc)
 }
 
 
+
+/* Segments of the index */
+
+/* Put into FILENAME the pathname of the file holding the WI2PV of the
+   segment with ID. */
+static void
+archer_segment_filename (int id, char *filename)
+{
+  if (id == 0)
+    sprintf (filename, "%s/wi2pv", bow_data_dirname);
+  else
+    sprintf (filename, "%s/wi2pv-%d", bow_data_dirname, id);
+}
+
+/* Make room at the end of ARCHER_SEGMENTS for one more segment, and
+   return it, not filled in. */
+static archer_segment *
+archer_segments_append ()
+{
+  if (archer_segments_count == archer_segments_size)
+    {
+      archer_segments_size = (archer_segments_size
+			      ? 2 * archer_segments_size : 8);
+      archer_segments = bow_realloc (archer_segments, (archer_segments_size
+						       * sizeof (archer_segment)));
+    }
+  return &(archer_segments[archer_segments_count++]);
+}
+
+/* Add to the end of ARCHER_SEGMENTS a new, empty segment with ID, for
+   documents starting at FIRST_DI, and return it. */
+static archer_segment *
+archer_segment_add (int id, int first_di)
+{
+  char pv_filename[BOW_MAX_WORD_LENGTH];
+  archer_segment *seg;
+
+  seg = archer_segments_append ();
+  seg->id = id;
+  if (id == 0)
+    strcpy (pv_filename, "pv");
+  else
+    sprintf (pv_filename, "pv-%d", id);
+  seg->wi2pv = bow_wi2pv_new (0, pv_filename);
+  seg->first_di = seg->end_di = first_di;
+  seg->sealed = 0;
+  return seg;
+}
+
+/* Return the segment to which new documents are added, starting a new
+   one if the last has been sealed. */
+static archer_segment *
+archer_segment_open ()
+{
+  if (archer_segments_count > 0
+      && !archer_segments[archer_segments_count-1].sealed)
+    return &(archer_segments[archer_segments_count-1]);
+  return archer_segment_add (archer_segments_next_id++,
+			     archer_docs->array->length);
+}
+
+/* Write SEG to disk, never to be changed again. */
+static void
+archer_segment_seal (archer_segment *seg)
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+
+  archer_segment_filename (seg->id, filename);
+  bow_wi2pv_write_to_filename (seg->wi2pv, filename);
+  seg->sealed = 1;
+}
+
+/* Free the memory held by SEG, but not SEG itself.  If UNLINK_FILES,
+   also remove its files from disk. */
+static void
+archer_segment_free (archer_segment *seg, int unlink_files)
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+
+  if (unlink_files)
+    {
+      archer_segment_filename (seg->id, filename);
+      unlink (filename);
+      if (strchr (seg->wi2pv->pv_filename, '/'))
+	sprintf (filename, "%s/pv", bow_data_dirname);
+      else
+	sprintf (filename, "%s/%s", bow_data_dirname,
+		 seg->wi2pv->pv_filename);
+      unlink (filename);
+    }
+  bow_wi2pv_free (seg->wi2pv);
+}
+
+/* Free all the segments, leaving their files on disk. */
+static void
+archer_segments_free ()
+{
+  int s;
+
+  for (s = 0; s < archer_segments_count; s++)
+    archer_segment_free (&(archer_segments[s]), 0);
+  archer_segments_count = 0;
+}
+
+/* Make whatever was written to the segments readable by the queries
+   that follow.  The caller holds ARCHER_INDEX_LOCK for writing, or is
+   the only thread. */
+static void
+archer_segments_sync ()
+{
+  int s;
+
+  for (s = 0; s < archer_segments_count; s++)
+    bow_wi2pv_sync (archer_segments[s].wi2pv);
+}
+
+/* Write the list of sealed segments to disk, replacing the old list
+   in one step, so that the archive refers either wholly to the old
+   segments or wholly to the new. */
+static void
+archer_segments_write ()
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+  char new_filename[BOW_MAX_WORD_LENGTH];
+  FILE *fp;
+  int s, count;
+
+  for (count = 0; (count < archer_segments_count
+		   && archer_segments[count].sealed); count++)
+    ;
+  sprintf (filename, "%s/segments", bow_data_dirname);
+  sprintf (new_filename, "%s/segments-new", bow_data_dirname);
+  fp = bow_fopen (new_filename, "wb");
+  bow_fwrite_int (count, fp);
+  bow_fwrite_int (archer_segments_next_id, fp);
+  for (s = 0; s < count; s++)
+    {
+      bow_fwrite_int (archer_segments[s].id, fp);
+      bow_fwrite_int (archer_segments[s].first_di, fp);
+      bow_fwrite_int (archer_segments[s].end_di, fp);
+    }
+  fclose (fp);
+  if (rename (new_filename, filename))
+    {
+      perror ("archer segments rename");
+      bow_error ("Couldn't replace %s", filename);
+    }
+}
+
+/* Read the list of segments from disk, and their WI2PV's.  An archive
+   written before there were segments has just one, with all the
+   documents of ARCHER_DOCS. */
+static void
+archer_segments_read ()
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+  archer_segment *seg;
+  FILE *fp;
+  int count, id, first_di, end_di;
+
+  archer_segments_count = 0;
+  sprintf (filename, "%s/segments", bow_data_dirname);
+  fp = fopen (filename, "rb");
+  if (fp)
+    {
+      bow_fread_int (&count, fp);
+      bow_fread_int (&archer_segments_next_id, fp);
+    }
+  else
+    {
+      count = 1;
+      archer_segments_next_id = 1;
+    }
+  while (count-- > 0)
+    {
+      if (fp)
+	{
+	  bow_fread_int (&id, fp);
+	  bow_fread_int (&first_di, fp);
+	  bow_fread_int (&end_di, fp);
+	}
+      else
+	{
+	  id = 0;
+	  first_di = 0;
+	  end_di = archer_docs->array->length;
+	}
+      seg = archer_segments_append ();
+      seg->id = id;
+      archer_segment_filename (id, filename);
+      seg->wi2pv = bow_wi2pv_new_from_filename (filename);
+      seg->first_di = first_di;
+      seg->end_di = end_di;
+      seg->sealed = 1;
+    }
+  if (fp)
+    fclose (fp);
+}
+
+
 
 /* Writing and reading the word/document stats to disk. */
 
@@ -116,20 +393,23 @@ archer_archive ()
   char filename[BOW_MAX_WORD_LENGTH];
   FILE *fp;
 
+  /* Seal the segment to which documents were being added, so that
+     the archive has all of them. */
+  if (archer_segments_count > 0
+      && !archer_segments[archer_segments_count-1].sealed)
+    archer_segment_seal (&(archer_segments[archer_segments_count-1]));
+
   sprintf (filename, "%s/vocabulary", bow_data_dirname);
   fp = bow_fopen (filename, "wb");
   bow_words_write (fp);
   fclose (fp);
 
-  sprintf (filename, "%s/wi2pv", bow_data_dirname);
-  bow_wi2pv_write_to_filename (archer_wi2pv, filename);
-
   sprintf (filename, "%s/docs", bow_data_dirname);
   fp = bow_fopen (filename, "wb");
   bow_sarray_write (archer_docs, (int(*)(void*,FILE*))archer_doc_write, fp);
   fclose (fp);
 
-  fflush (archer_wi2pv->fp);
+  archer_segments_write ();
 }
 
 /* Read the stats from the directory DATA_DIRNAME. */
@@ -138,15 +418,14 @@ archer_unarchive ()
 {
   char filename[BOW_MAX_WORD_LENGTH];
   FILE *fp;
+  archer_doc *doc;
+  int di;
 
   bow_verbosify (bow_progress, "Loading data files...");
 
   sprintf (filename, "%s/vocabulary", bow_data_dirname);
   bow_words_read_from_file (filename);
 
-  sprintf (filename, "%s/wi2pv", bow_data_dirname);
-  archer_wi2pv = bow_wi2pv_new_from_filename (filename);
-
   sprintf (filename, "%s/docs", bow_data_dirname);
   fp = bow_fopen (filename, "rb");
   archer_docs = 
@@ -154,19 +433,295 @@ archer_unarchive ()
 				archer_doc_free, fp);
   fclose (fp);
 
+  archer_segments_read ();
+  archer_docs_deleted_count = 0;
+  for (di = 0; di < archer_docs->array->length; di++)
+    {
+      doc = bow_sarray_entry_at_index (archer_docs, di);
+      if (doc->word_count < 0)
+	archer_docs_deleted_count++;
+    }
+
   bow_verbosify (bow_progress, "\n");
 }
 
+
+
+/* Merging segments */
+
+/* The number of "document index" and "position index" pairs read at
+   once from a PV by merging and by the query functions. */
+#define ARCHER_PV_BATCH 256
+
+/* Put in place of the sealed segments numbered FIRST up to but not
+   including END a single new one with all their pairs, except those
+   of documents that have been deleted.  The caller holds
+   ARCHER_SEGMENTS_LOCK, so no command changes the documents while the
+   new segment is written, and queries go on reading the old segments
+   until it is in place. */
+static void
+archer_segments_merge (int first, int end)
+{
+  archer_segment merged, *old;
+  char pv_filename[BOW_MAX_WORD_LENGTH];
+  char filename[BOW_MAX_WORD_LENGTH];
+  bow_pv_cursor cursor;
+  archer_doc *doc;
+  char buried[64];
+  int di[ARCHER_PV_BATCH], pi[ARCHER_PV_BATCH];
+  int num_words = 0;
+  int s, wi, n, i;
+
+  assert (first < end && end <= archer_segments_count);
+  merged.id = archer_segments_next_id++;
+  sprintf (pv_filename, "pv-%d", merged.id);
+  merged.wi2pv = bow_wi2pv_new (0, pv_filename);
+  merged.first_di = archer_segments[first].first_di;
+  merged.end_di = archer_segments[end-1].end_di;
+  bow_verbosify (bow_progress, "Merging %d segments of documents %d-%d\n",
+		 end - first, merged.first_di, merged.end_di - 1);
+  for (s = first; s < end; s++)
+    {
+      assert (archer_segments[s].sealed);
+      if (archer_segments[s].wi2pv->num_words > num_words)
+	num_words = archer_segments[s].wi2pv->num_words;
+    }
+
+  /* The segments are in order of document index, so reading them one
+     after the other appends each word's pairs in order. */
+  for (wi = 0; wi < num_words; wi++)
+    {
+      for (s = first; s < end; s++)
+	{
+	  bow_wi2pv_wi_cursor_init (archer_segments[s].wi2pv, wi, &cursor);
+	  do
+	    {
+	      n = bow_pv_cursor_next_di_pi_batch (&cursor, di, pi,
+						  ARCHER_PV_BATCH);
+	      for (i = 0; i < n; i++)
+		{
+		  doc = bow_sarray_entry_at_index (archer_docs, di[i]);
+		  if (doc->word_count >= 0)
+		    bow_wi2pv_append_wi_di_pi (merged.wi2pv, wi, di[i], pi[i]);
+		}
+	    }
+	  while (n == ARCHER_PV_BATCH);
+	  bow_pv_cursor_free (&cursor);
+	}
+      /* Write each word's PV in one piece. */
+      bow_wi2pv_flush_wi (merged.wi2pv, wi);
+    }
+  archer_segment_filename (merged.id, filename);
+  bow_wi2pv_write_to_filename (merged.wi2pv, filename);
+  merged.sealed = 1;
+
+  /* Swap the new segment in while no query is reading. */
+  old = alloca ((end - first) * sizeof (archer_segment));
+  archer_index_write_lock ();
+  /* The deleted documents are gone for good; they stay in the list
+     of documents, but with no words, and under another name, so that
+     their files may be indexed again as new documents. */
+  for (i = merged.first_di; i < merged.end_di; i++)
+    {
+      doc = bow_sarray_entry_at_index (archer_docs, i);
+      if (doc->word_count < 0)
+	{
+	  sprintf (buried, "(deleted document %d)", i);
+	  bow_sarray_set_keystr_at_index (archer_docs, i, buried);
+	  doc->word_count = 0;
+	  archer_docs_deleted_count--;
+	}
+    }
+  memcpy (old, &(archer_segments[first]),
+	  (end - first) * sizeof (archer_segment));
+  archer_segments[first] = merged;
+  memmove (&(archer_segments[first+1]), &(archer_segments[end]),
+	   (archer_segments_count - end) * sizeof (archer_segment));
+  archer_segments_count -= end - first - 1;
+  /* Point the archive on disk at the new segment before the old ones
+     are removed.  Only the list of segments is written, so that the
+     segment to which documents are being added stays open; the
+     documents are written with it by the next archer_archive(). */
+  archer_segments_write ();
+  archer_index_unlock ();
+
+  for (s = 0; s < end - first; s++)
+    archer_segment_free (&(old[s]), 1);
+}
+
+/* Merge some of the sealed segments, if any need it, and return
+   non-zero if it did.  A segment at least a quarter of whose
+   documents have been deleted is rewritten without them; otherwise,
+   if there are more than ARCHER_ARG_STATE.MAX_SEGMENTS, the two
+   neighbours with the fewest documents between them are merged. */
+static int
+archer_segments_merge_some ()
+{
+  archer_segment *seg;
+  archer_doc *doc;
+  int sealed_count, deleted_count;
+  int s, best, di;
+
+  for (sealed_count = 0; (sealed_count < archer_segments_count
+			  && archer_segments[sealed_count].sealed);
+       sealed_count++)
+    ;
+  for (s = 0; archer_docs_deleted_count > 0 && s < sealed_count; s++)
+    {
+      seg = &(archer_segments[s]);
+      deleted_count = 0;
+      for (di = seg->first_di; di < seg->end_di; di++)
+	{
+	  doc = bow_sarray_entry_at_index (archer_docs, di);
+	  if (doc->word_count < 0)
+	    deleted_count++;
+	}
+      if (deleted_count > 0 && 4 * deleted_count >= seg->end_di - seg->first_di)
+	{
+	  archer_segments_merge (s, s + 1);
+	  return 1;
+	}
+    }
+  if (sealed_count > 1 && sealed_count > archer_arg_state.max_segments)
+    {
+      best = 0;
+      for (s = 1; s + 1 < sealed_count; s++)
+	if (archer_segments[s+1].end_di - archer_segments[s].first_di
+	    < archer_segments[best+1].end_di - archer_segments[best].first_di)
+	  best = s;
+      archer_segments_merge (best, best + 2);
+      return 1;
+    }
+  return 0;
+}
+
+/* Merge all of the sealed segments into one. */
+void
+archer_merge ()
+{
+  int sealed_count;
+
+  for (sealed_count = 0; (sealed_count < archer_segments_count
+			  && archer_segments[sealed_count].sealed);
+       sealed_count++)
+    ;
+  if (sealed_count > 1
+      || (sealed_count == 1 && archer_docs_deleted_count > 0))
+    {
+      archer_segments_merge (0, sealed_count);
+      /* Write out the documents whose deletion it made final. */
+      archer_archive ();
+    }
+  archer_segments_free ();
+}
+
+/* Merge segments as the commands of the threaded query server leave
+   them needing it, while the queries go on. */
+static void *
+archer_segments_merge_thread (void *unused)
+{
+  pthread_mutex_lock (&archer_segments_lock);
+  for (;;)
+    while (!archer_segments_merge_some ())
+      pthread_cond_wait (&archer_segments_changed, &archer_segments_lock);
+  return NULL;
+}
+
+#define USE_FAST_LEXER 1
+
+#if USE_FAST_LEXER
+/* Add to WI2PV, as document DI, the words of the file FILENAME, with
+   their indices in MAP, and return the number of them, or -1 if the
+   file can't be read.  Nothing but MAP and WI2PV is changed, so
+   threads with their own of each may do this at once. */
+static int
+archer_index_lex_file (const char *filename, bow_int4str *map,
+		       bow_wi2pv *wi2pv, int di)
+{
+  int fd, c, wordlen;
+  int wi;
+  int pi = 0;
+  char word[BOW_MAX_WORD_LENGTH];
+  unsigned hashid;
+  char *docbuf;
+  char *docbufptr;
+  char *docbufptr_end;
+  struct stat statbuf;
+
+  fd = open (filename, O_RDONLY);
+  if (fd == -1)
+    {
+      perror ("archer index_filename open");
+      return -1;
+    }
+  fstat (fd, &statbuf);
+  docbuf = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (docbuf == (void*)-1)
+    {
+      fprintf (stderr, "\narcher index_filename(%s)\n", filename);
+      perror (" mmap");
+      return -1;
+    }
+  docbufptr_end = docbuf + statbuf.st_size;
+
+  /* One time through this loop for each word */
+  for (docbufptr = docbuf;;)
+    {
+      hashid = wordlen = 0;
+      /* Ignore characters until we get a beginning character. */
+      while (!isalpha((unsigned)*docbufptr))
+	if (++docbufptr >= docbufptr_end)
+	  goto done_with_file;
+      /* Add alphabetics to the word */
+      do
+	{
+	  c = tolower((unsigned)*docbufptr);
+	  word[wordlen++] = c;
+	  /* The following must exactly match the behavior of
+	     int4str.c:_str2id */
+	  hashid = 131 * hashid + c;
+	  docbufptr++;
+	}
+      while (wordlen < BOW_MAX_WORD_LENGTH
+	     && isalnum((unsigned)*docbufptr));
+      if (wordlen == BOW_MAX_WORD_LENGTH)
+	{
+	  /* Word is longer than MAX, consume it and skip it. */
+	  while (isalpha(*docbufptr++))
+	    ;
+	  continue;
+	}
+      word[wordlen] = '\0';
+      /* Token is now in WORD; next see if it's too short or a stopword */
+      if (wordlen < 2 
+	  || wordlen > 30
+	  || bow_stoplist_present_hash (word, hashid))
+	continue;
+      /* Get the integer index of the word in WORD */
+      wi = _bow_str2int (map, word, hashid);
+      bow_wi2pv_add_wi_di_pi (wi2pv, wi, di, pi);
+      pi++;
+      if (docbufptr >= docbufptr_end)
+	break;
+    }
+ done_with_file:
+  munmap (docbuf, statbuf.st_size);
+  return pi;
+}
+#endif /* USE_FAST_LEXER */
+
 int
 archer_index_filename (const char *filename, void *unused)
 {
   int di;
   archer_doc doc, *doc_ptr;
-  int wi;
+  archer_segment *seg;
+  bow_wi2pv *wi2pv;
   int pi = 0;
-  char word[BOW_MAX_WORD_LENGTH];
-#define USE_FAST_LEXER 1
 #if !USE_FAST_LEXER
+  int wi;
+  char word[BOW_MAX_WORD_LENGTH];
   bow_lex *lex;
   FILE *fp;
 #endif
@@ -177,13 +732,18 @@ archer_index_filename (const char *filename, void *unused)
   if (doc_ptr)
     {
       if (doc_ptr->word_count < 0)
-	doc_ptr->word_count = -(doc_ptr->word_count);
+	{
+	  doc_ptr->word_count = -(doc_ptr->word_count);
+	  archer_docs_deleted_count--;
+	}
       return 1;
     }
 
   /* The index of this new document is the next available index in the
      array of documents. */
   di = archer_docs->array->length;
+  seg = archer_segment_open ();
+  wi2pv = seg->wi2pv;
 
 #if !USE_FAST_LEXER
   fp = fopen (filename, "r");
@@ -205,12 +765,12 @@ archer_index_filename (const char *filename, void *unused)
       wi = bow_word2int_add_occurrence (word);
       if (wi < 0)
 	continue;
-      bow_wi2pv_add_wi_di_pi (archer_wi2pv, wi, di, pi);
+      bow_wi2pv_add_wi_di_pi (wi2pv, wi, di, pi);
 #if 0
       /* Debugging */
       {
 	int di_read, pi_read;
-	bow_wi2pv_wi_next_di_pi (archer_wi2pv, wi, &di_read, &pi_read);
+	bow_wi2pv_wi_next_di_pi (wi2pv, wi, &di_read, &pi_read);
 	assert (di_read == di);
 	assert (pi_read == pi);
 	if (di == 0)
@@ -223,87 +783,18 @@ archer_index_filename (const char *filename, void *unused)
   fclose (fp);
 
 #else /* USE_FAST_LEXER */
-  {
-    int fd, c, wordlen;
-    //bow_strtrie *strie;
-    //int strtrie_index;
-    unsigned hashid;
-    char *docbuf;
-    char *docbufptr;
-    char *docbufptr_end;
-    //size_t page_size = (size_t) sysconf (_SC_PAGESIZE);
-    struct stat statbuf;
-
-    if (!word_map)
-      bow_words_set_map (NULL, 0);
-
-    fd = open (filename, O_RDONLY);
-    if (fd == -1)
-      {
-				perror ("archer index_filename open");
-				return 0;
-      }
-    fstat (fd, &statbuf);
-    //statbuf.st_size = 20 * 1024;
-    docbuf = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close (fd);
-    if (docbuf == (void*)-1)
-      {
-				fprintf (stderr, "\narcher index_filename(%s)\n", filename);
-				perror (" mmap");
-				return 0;
-      }
-    docbufptr_end = docbuf + statbuf.st_size;
-
-    /* One time through this loop for each word */
-    for (docbufptr = docbuf;;)
-      {
-	hashid = wordlen = 0;
-	/* Ignore characters until we get a beginning character. */
-	while (!isalpha((unsigned)*docbufptr))
-	  if (++docbufptr >= docbufptr_end)
-	    goto done_with_file;
-	/* Add alphabetics to the word */
-	do
-	  {
-	    c = tolower((unsigned)*docbufptr);
-	    word[wordlen++] = c;
-	    /* The following must exactly match the behavior of
-               int4str.c:_str2id */
-	    hashid = 131 * hashid + c;
-	    docbufptr++;
-	  }
-	while (wordlen < BOW_MAX_WORD_LENGTH
-	       && isalnum((unsigned)*docbufptr));
-	if (wordlen == BOW_MAX_WORD_LENGTH)
-	  {
-	    /* Word is longer than MAX, consume it and skip it. */
-	    while (isalpha(*docbufptr++))
-	      ;
-	    continue;
-	  }
-	word[wordlen] = '\0';
-	/* Token is now in WORD; next see if it's too short or a stopword */
-	if (wordlen < 2 
-	    || wordlen > 30
-	    || bow_stoplist_present_hash (word, hashid))
-	  continue;
-	/* Get the integer index of the word in WORD */
-	wi = _bow_str2int (word_map, word, hashid);
-	bow_wi2pv_add_wi_di_pi (archer_wi2pv, wi, di, pi);
-	if (docbufptr >= docbufptr_end)
-	  break;
-	pi++;
-      }
-  done_with_file:
-    munmap (docbuf, statbuf.st_size);
-  }
+  if (!word_map)
+    bow_words_set_map (NULL, 0);
+  pi = archer_index_lex_file (filename, word_map, wi2pv, di);
+  if (pi < 0)
+    return 0;
 #endif /* USE_FAST_LEXER */
 
   doc.tag = bow_doc_train;
   doc.word_count = pi;
   doc.di = di;
   bow_sarray_add_entry_with_keystr (archer_docs, &doc, filename);
+  seg->end_di = di + 1;
       
   if (di % 200 == 0)
     bow_verbosify (bow_progress, "\r%8d |V|=%10d", di, bow_num_words());
@@ -313,19 +804,218 @@ archer_index_filename (const char *filename, void *unused)
 }
 
 
+#if USE_FAST_LEXER
+/* The files to be indexed by archer_index_parallel(), in order. */
+struct archer_index_files {
+  char **filename;
+  int count;
+  int size;
+};
+
+/* Add FILENAME to the end of the list FILES. */
+static int
+archer_index_files_add (const char *filename, void *files)
+{
+  struct archer_index_files *f = files;
+
+  if (f->count == f->size)
+    {
+      f->size = f->size ? 2 * f->size : 1024;
+      f->filename = bow_realloc (f->filename, f->size * sizeof (char*));
+    }
+  f->filename[f->count] = strdup (filename);
+  assert (f->filename[f->count]);
+  f->count++;
+  return 1;
+}
+
+/* One of the threads of archer_index_parallel(), with a range of the
+   files, and a vocabulary and PV's of its own. */
+struct archer_index_worker {
+  pthread_t tid;
+  struct archer_index_files *files;
+  int *word_count;		/* of each file, or -1 if unreadable */
+  int first, end;		/* the files this one indexes */
+  bow_int4str *map;		/* its words, by its own word indices */
+  bow_wi2pv *wi2pv;		/* their PV's */
+  int *local_wi;		/* for each word index of the index, the
+				   same word's in MAP, or -1 */
+};
+
+/* Index the files of one worker, numbering each document after the
+   position of its file in the list. */
+static void *
+archer_index_worker_run (void *arg)
+{
+  struct archer_index_worker *w = arg;
+  int i;
+
+  for (i = w->first; i < w->end; i++)
+    w->word_count[i] = archer_index_lex_file (w->files->filename[i], w->map,
+					      w->wi2pv, i);
+  return NULL;
+}
+
+/* Index the files under ARCHER_ARG_STATE.DIRNAME into SEG with
+   ARCHER_ARG_STATE.INDEX_THREADS threads, each lexing a contiguous
+   range of them into PV's of its own, in a file of its own, and
+   keeping the PVM's within an equal share of BOW_PVM_MAX_TOTAL_BYTES.
+   Then merge their PV's word by word into SEG.  The documents, word
+   indices and pairs come out the same as from indexing the files one
+   at a time, but each word's PV is in one piece on disk. */
+static void
+archer_index_parallel (archer_segment *seg)
+{
+  struct archer_index_files files;
+  struct archer_index_worker *workers, *w;
+  int *word_count, *new_di;
+  int num_workers, num_words;
+  int di[ARCHER_PV_BATCH], pi[ARCHER_PV_BATCH];
+  int i, k, n, wi, lwi;
+  char pv_filename[BOW_MAX_WORD_LENGTH];
+  bow_pv_cursor cursor;
+  archer_doc doc;
+
+  files.filename = NULL;
+  files.count = files.size = 0;
+  bow_map_filenames_from_dir (archer_index_files_add, &files,
+			      archer_arg_state.dirname, "");
+  num_workers = MIN (archer_arg_state.index_threads, files.count);
+  if (num_workers < 1)
+    num_workers = 1;
+  bow_verbosify (bow_progress, "Indexing %d files with %d threads\n",
+		 files.count, num_workers);
+
+  word_count = bow_malloc ((files.count + 1) * sizeof (int));
+  workers = bow_malloc (num_workers * sizeof (struct archer_index_worker));
+  for (k = 0; k < num_workers; k++)
+    {
+      w = &(workers[k]);
+      w->files = &files;
+      w->word_count = word_count;
+      w->first = (int) ((long long) files.count * k / num_workers);
+      w->end = (int) ((long long) files.count * (k + 1) / num_workers);
+      w->map = bow_int4str_new (0);
+      sprintf (pv_filename, "pv-index-%d", k);
+      w->wi2pv = bow_wi2pv_new (0, pv_filename);
+      w->wi2pv->pvm_max_total_bytes = bow_pvm_max_total_bytes / num_workers;
+      if (pthread_create (&(w->tid), NULL, archer_index_worker_run, w))
+	bow_error ("Couldn't create a thread for indexing");
+    }
+  for (k = 0; k < num_workers; k++)
+    pthread_join (workers[k].tid, NULL);
+
+  /* Number the documents anew, leaving out the files that couldn't be
+     read, or were already there. */
+  new_di = bow_malloc ((files.count + 1) * sizeof (int));
+  for (i = 0; i < files.count; i++)
+    {
+      if (word_count[i] < 0
+	  || bow_sarray_entry_at_keystr (archer_docs, files.filename[i]))
+	{
+	  new_di[i] = -1;
+	  continue;
+	}
+      doc.tag = bow_doc_train;
+      doc.word_count = word_count[i];
+      doc.di = new_di[i] = archer_docs->array->length;
+      bow_sarray_add_entry_with_keystr (archer_docs, &doc, files.filename[i]);
+    }
+  seg->end_di = archer_docs->array->length;
+
+  /* Add the words of each worker to the vocabulary in order, so that
+     each word gets the index it would have from the first file in
+     which it occurs. */
+  if (!word_map)
+    bow_words_set_map (NULL, 0);
+  for (k = 0; k < num_workers; k++)
+    for (lwi = 0; lwi < workers[k].map->str_array_length; lwi++)
+      bow_str2int (word_map, bow_int2str (workers[k].map, lwi));
+  num_words = bow_num_words ();
+  for (k = 0; k < num_workers; k++)
+    {
+      w = &(workers[k]);
+      w->local_wi = bow_malloc ((num_words + 1) * sizeof (int));
+      for (wi = 0; wi < num_words; wi++)
+	w->local_wi[wi] = -1;
+      for (lwi = 0; lwi < w->map->str_array_length; lwi++)
+	w->local_wi[bow_str2int (word_map, bow_int2str (w->map, lwi))] = lwi;
+      bow_wi2pv_sync (w->wi2pv);
+    }
+
+  /* The workers' ranges are in order of document index, so reading
+     them one after the other appends each word's pairs in order. */
+  bow_verbosify (bow_progress, "Merging position vectors:           ");
+  for (wi = 0; wi < num_words; wi++)
+    {
+      for (k = 0; k < num_workers; k++)
+	{
+	  w = &(workers[k]);
+	  if (w->local_wi[wi] < 0)
+	    continue;
+	  bow_wi2pv_wi_cursor_init (w->wi2pv, w->local_wi[wi], &cursor);
+	  do
+	    {
+	      n = bow_pv_cursor_next_di_pi_batch (&cursor, di, pi,
+						  ARCHER_PV_BATCH);
+	      for (i = 0; i < n; i++)
+		if (new_di[di[i]] >= 0)
+		  bow_wi2pv_append_wi_di_pi (seg->wi2pv, wi, new_di[di[i]],
+					     pi[i]);
+	    }
+	  while (n == ARCHER_PV_BATCH);
+	  bow_pv_cursor_free (&cursor);
+	}
+      bow_wi2pv_flush_wi (seg->wi2pv, wi);
+      if (wi % 1000 == 0)
+	bow_verbosify (bow_progress, "\b\b\b\b\b\b\b\b\b\b%10d",
+		       num_words - wi);
+    }
+  bow_verbosify (bow_progress, "\n");
+
+  for (k = 0; k < num_workers; k++)
+    {
+      w = &(workers[k]);
+      sprintf (pv_filename, "%s/%s", bow_data_dirname, w->wi2pv->pv_filename);
+      bow_wi2pv_free (w->wi2pv);
+      unlink (pv_filename);
+      bow_int4str_free (w->map);
+      bow_free (w->local_wi);
+    }
+  for (i = 0; i < files.count; i++)
+    free (files.filename[i]);
+  bow_free (files.filename);
+  bow_free (workers);
+  bow_free (word_count);
+  bow_free (new_di);
+}
+#endif /* USE_FAST_LEXER */
+
 void
 archer_index ()
 {
+  archer_segment *seg;
+
   archer_docs = bow_sarray_new (0, sizeof (archer_doc), archer_doc_free);
-  archer_wi2pv = bow_wi2pv_new (0, "pv");
-  bow_verbosify (bow_progress, "Indexing files:              ");
-  bow_map_filenames_from_dir (archer_index_filename, NULL,
-			      archer_arg_state.dirname, "");
-  bow_verbosify (bow_progress, "\n");
+  /* All the documents go in one segment. */
+  archer_segments_count = 0;
+  archer_segments_next_id = 1;
+  seg = archer_segment_add (0, 0);
+#if USE_FAST_LEXER
+  if (archer_arg_state.index_threads > 1)
+    archer_index_parallel (seg);
+  else
+#endif
+    {
+      bow_verbosify (bow_progress, "Indexing files:              ");
+      bow_map_filenames_from_dir (archer_index_filename, NULL,
+				  archer_arg_state.dirname, "");
+      bow_verbosify (bow_progress, "\n");
+    }
 
   archer_archive ();
   /* To close the FP for FILENAME_PV */
-  bow_wi2pv_free (archer_wi2pv);
+  archer_segments_free ();
 }
 
 /* Index each line of ARCHER_ARG_STATE.DIRNAME as if it were a
@@ -337,13 +1027,17 @@ archer_index_lines ()
   char buf[max_line_length];
   FILE *fp;
   archer_doc doc;
+  archer_segment *seg;
   bow_lex *lex;
   char word[BOW_MAX_WORD_LENGTH];
   int wi, di, pi;
   char filename[1024];
 
   archer_docs = bow_sarray_new (0, sizeof (archer_doc), archer_doc_free);
-  archer_wi2pv = bow_wi2pv_new (0, "pv");
+  /* All the documents go in one segment. */
+  archer_segments_count = 0;
+  archer_segments_next_id = 1;
+  seg = archer_segment_add (0, 0);
   fp = bow_fopen (archer_arg_state.dirname, "r");
   bow_verbosify (bow_progress, "Indexing lines:              ");
   while (fgets (buf, max_line_length, fp))
@@ -360,21 +1054,22 @@ archer_index_lines ()
 	  wi = bow_word2int_add_occurrence (word);
 	  if (wi < 0)
 	    continue;
-	  bow_wi2pv_add_wi_di_pi (archer_wi2pv, wi, di, pi);
+	  bow_wi2pv_add_wi_di_pi (seg->wi2pv, wi, di, pi);
+	  pi++;
 	}
       bow_default_lexer->close (bow_default_lexer, lex);
       doc.tag = bow_doc_train;
       doc.word_count = pi;
       doc.di = di;
       bow_sarray_add_entry_with_keystr (archer_docs, &doc, filename);
-      pi++;
+      seg->end_di = di + 1;
     }
   fclose (fp);
   bow_verbosify (bow_progress, "\n");
 
   archer_archive ();
   /* To close the FP for FILENAME_PV */
-  bow_wi2pv_free (archer_wi2pv);
+  archer_segments_free ();
 }
 
 /* Set the special flag in FILENAME's doc structure indicating that
@@ -389,28 +1084,184 @@ archer_delete_filename (const char *filename)
   if (doc)
     {
       doc->word_count = -(doc->word_count);
+      if (doc->word_count < 0)
+	archer_docs_deleted_count++;
+      else if (doc->word_count > 0)
+	archer_docs_deleted_count--;
       return 0;
     }
   return 1;
 }
 
+/* A batch of pairs read from the PV's of one query word, one segment
+   after another. */
+struct archer_pv_batch {
+  bow_pv_cursor cursor;
+  int wi;			/* the word */
+  int segment;			/* index in ARCHER_SEGMENTS of CURSOR's */
+  int count;			/* number of pairs in DI and PI */
+  int next;			/* index of the next pair to hand out */
+  int di[ARCHER_PV_BATCH];
+  int pi[ARCHER_PV_BATCH];
+};
+
+/* Point the cursor of BATCH at the start of its word's PV in segment
+   number S, or at nothing if there is no such segment. */
+static void
+archer_pv_batch_segment (struct archer_pv_batch *batch, int s)
+{
+  batch->segment = s;
+  if (s < archer_segments_count)
+    bow_wi2pv_wi_cursor_init (archer_segments[s].wi2pv, batch->wi,
+			      &(batch->cursor));
+  else
+    bow_pv_cursor_init (&(batch->cursor), NULL, NULL);
+  batch->count = batch->next = 0;
+}
+
+/* Set up BATCH to read the pairs of word WI from the first segment. */
+static void
+archer_pv_batch_init (struct archer_pv_batch *batch, int wi)
+{
+  batch->wi = wi;
+  archer_pv_batch_segment (batch, 0);
+}
+
+/* Free the memory held by BATCH, but not BATCH itself. */
+static void
+archer_pv_batch_free (struct archer_pv_batch *batch)
+{
+  bow_pv_cursor_free (&(batch->cursor));
+}
+
+/* Put into DI and PI the next pair of BATCH, reading another batch
+   from its word's PV if necessary, and going on to the next segment
+   at the end of each.  Both are -1 at the end of the last segment. */
+static inline void
+archer_pv_batch_next (struct archer_pv_batch *batch, int *di, int *pi)
+{
+  while (batch->next == batch->count)
+    {
+      if (batch->segment >= archer_segments_count)
+	{
+	  *di = *pi = -1;
+	  return;
+	}
+      batch->count = bow_pv_cursor_next_di_pi_batch
+	(&(batch->cursor), batch->di, batch->pi, ARCHER_PV_BATCH);
+      batch->next = 0;
+      if (batch->count == 0)
+	{
+	  bow_pv_cursor_free (&(batch->cursor));
+	  archer_pv_batch_segment (batch, batch->segment + 1);
+	}
+    }
+  *di = batch->di[batch->next];
+  *pi = batch->pi[batch->next++];
+}
+
+/* Move BATCH forward so that the next pair it hands out is its word's
+   first with a "document index" of DI or more.  Within the pairs
+   already read this is a bisection; past them, the cursor is skipped
+   forward and the pairs are read anew. */
+static void
+archer_pv_batch_skip_to (struct archer_pv_batch *batch, int di)
+{
+  int lo, hi, mid;
+
+  if (batch->next < batch->count && batch->di[batch->count-1] >= di)
+    {
+      lo = batch->next;
+      hi = batch->count - 1;
+      while (lo < hi)
+	{
+	  mid = (lo + hi) / 2;
+	  if (batch->di[mid] < di)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      batch->next = lo;
+      return;
+    }
+  /* Go straight to the segment that would hold DI. */
+  if (batch->segment < archer_segments_count
+      && archer_segments[batch->segment].end_di <= di)
+    {
+      int s;
+      for (s = batch->segment + 1;
+	   s < archer_segments_count && archer_segments[s].end_di <= di; s++)
+	;
+      bow_pv_cursor_free (&(batch->cursor));
+      archer_pv_batch_segment (batch, s);
+    }
+  batch->next = batch->count = 0;
+  if (batch->segment < archer_segments_count)
+    bow_pv_cursor_skip_to_di (&(batch->cursor), di);
+}
+
+/* Return the index of the first entry of WA at or after index WAI
+   whose "document index" is DI or more, or -1 if there is none.
+   Probes at growing distances from WAI, then bisects. */
+static int
+archer_wa_seek (bow_wa *wa, int wai, int di)
+{
+  int step = 1;
+  int hi;
+
+  if (wai == -1 || wai >= wa->length)
+    return -1;
+  if (wa->entry[wai].wi >= di)
+    return wai;
+  /* Invariant: WA->ENTRY[WAI].wi < DI */
+  while (wai + step < wa->length && wa->entry[wai + step].wi < di)
+    {
+      wai += step;
+      step *= 2;
+    }
+  hi = (wai + step < wa->length) ? wai + step : wa->length;
+  while (hi - wai > 1)
+    {
+      int mid = (wai + hi) / 2;
+      if (wa->entry[mid].wi < di)
+	wai = mid;
+      else
+	hi = mid;
+    }
+  return (hi < wa->length) ? hi : -1;
+}
+
 bow_wa *
 archer_query_hits_matching_wi (int wi, int *occurrence_count)
 {
   int count = 0;
-  int di, pi;
+  int di[ARCHER_PV_BATCH], pi[ARCHER_PV_BATCH];
+  int n, i, s;
+  bow_pv_cursor cursor;
+  archer_doc *doc;
   bow_wa *wa;
 
-  if (wi >= archer_wi2pv->entry_count && archer_wi2pv->entry[wi].word_count <= 0)
-    return NULL;
   wa = bow_wa_new (0);
-  bow_pv_rewind (&(archer_wi2pv->entry[wi]), archer_wi2pv->fp);
-  bow_wi2pv_wi_next_di_pi (archer_wi2pv, wi, &di, &pi);
-  while (di != -1)
+  for (s = 0; s < archer_segments_count; s++)
     {
-      bow_wa_add_to_end (wa, di, 1);
-      count++;
-      bow_wi2pv_wi_next_di_pi (archer_wi2pv, wi, &di, &pi);
+      bow_wi2pv_wi_cursor_init (archer_segments[s].wi2pv, wi, &cursor);
+      do
+	{
+	  n = bow_pv_cursor_next_di_pi_batch (&cursor, di, pi,
+					      ARCHER_PV_BATCH);
+	  for (i = 0; i < n; i++)
+	    {
+	      /* Pass over documents that have been deleted. */
+	      doc = bow_sarray_entry_at_index (archer_docs, di[i]);
+	      if (doc->word_count >= 0)
+		{
+		  bow_wa_add_to_end (wa, di[i], 1);
+		  count++;
+		}
+	    }
+	}
+      while (n == ARCHER_PV_BATCH);
+      bow_pv_cursor_free (&cursor);
     }
   *occurrence_count = count;
   return wa;
@@ -419,28 +1270,26 @@ archer_query_hits_matching_wi (int wi, int *occurrence_count)
 /* Temporary constant.  Fix this soon! */
 #define MAX_QUERY_WORDS 50
 
-bow_wa *
-archer_query_hits_matching_sequence (const char *query_string,
-				     const char *suffix_string)
+/* Put into QUERY the word indices of the words of QUERY_STRING, each
+   with SUFFIX_STRING added, and return how many there are, 0 if they
+   were all in the stoplist.  Return -1 if no document can match. */
+static int
+archer_query_wis (const char *query_string, const char *suffix_string,
+		  int *query)
 {
-  int query[MAX_QUERY_WORDS];		/* WI's in the query */
-  int di[MAX_QUERY_WORDS];
-  int pi[MAX_QUERY_WORDS];
   int query_len;
-  int max_di, max_pi;
-  int wi, i;
+  int wi;
   bow_lex *lex;
   char word[BOW_MAX_WORD_LENGTH];
-  int sequence_occurrence_count = 0;
-  int something_was_greater_than_max;
-  bow_wa *wa;
-  float scaler;
-  archer_doc *doc;
 
   /* Parse the query */
+  pthread_mutex_lock (&archer_lexer_lock);
   lex = bow_default_lexer->open_str (bow_default_lexer, (char*)query_string);
   if (lex == NULL)
-    return NULL;
+    {
+      pthread_mutex_unlock (&archer_lexer_lock);
+      return 0;
+    }
   query_len = 0;
   while (bow_default_lexer->get_word (bow_default_lexer, lex,
 				      word, BOW_MAX_WORD_LENGTH))
@@ -454,10 +1303,7 @@ archer_query_hits_matching_sequence (const char *query_string,
 	}
       wi = bow_word2int_no_add (word);
       if (wi >= 0)
-	{
-	  di[query_len] = pi[query_len] = -300;
-	  query[query_len++] = wi;
-	}
+	query[query_len++] = wi;
       else if ((bow_lexer_stoplist_func
 		&& !(*bow_lexer_stoplist_func) (word))
 	       || (!bow_lexer_stoplist_func
@@ -466,7 +1312,7 @@ archer_query_hits_matching_sequence (const char *query_string,
 	  /* If a query term wasn't present, and its not because it
 	     was in the stoplist or the word is a single char, then
 	     return no hits. */
-	  query_len = 0;
+	  query_len = -1;
 	  break;
 	}
       /* If we have no more room for more query terms, just don't use
@@ -475,8 +1321,32 @@ archer_query_hits_matching_sequence (const char *query_string,
 	break;
     }
   bow_default_lexer->close (bow_default_lexer, lex);
-  if (query_len == 0)
-    return NULL;
+  pthread_mutex_unlock (&archer_lexer_lock);
+  return query_len;
+}
+
+/* Return the documents in which the QUERY_LEN words of QUERY appear
+   in sequence, weighted by the number of times they do, or NULL if
+   there are none. */
+static bow_wa *
+archer_query_hits_matching_wis (const int *query, int query_len)
+{
+  /* The pairs read from the PV of each query word, by a cursor of
+     this query's own.  A word repeated in the query has a cursor for
+     each time, since each is read to a different position. */
+  struct archer_pv_batch *batch[MAX_QUERY_WORDS];
+  int di[MAX_QUERY_WORDS];
+  int pi[MAX_QUERY_WORDS];
+  int max_di, max_pi;
+  int i;
+  int sequence_occurrence_count = 0;
+  int something_was_greater_than_max;
+  bow_wa *wa;
+  float scaler;
+  archer_doc *doc;
+
+  for (i = 0; i < query_len; i++)
+    di[i] = pi[i] = -300;
 
   if (query_len == 1)
     {
@@ -485,89 +1355,416 @@ archer_query_hits_matching_sequence (const char *query_string,
       goto search_done;
     }
 
-  /* Initialize the array of document scores */
+  /* Initialize the array of document scores */
+  wa = bow_wa_new (0);
+
+  for (i = 0; i < query_len; i++)
+    {
+      batch[i] = alloca (sizeof (struct archer_pv_batch));
+      archer_pv_batch_init (batch[i], query[i]);
+    }
+
+  /* Search for documents containing the query words in the same order
+     as the query. */
+  max_di = max_pi = -200;
+  /* Loop while we look for matches.  We'll break out of this loop when
+     any of the query words are at the end of their PV's. */
+  for (;;)
+    {
+      /* Keep reading DI and PI from one or more of the query-word PVs
+	 until none of the DIs or PIs is greater than the MAX_DI or
+	 MAX_PI.  At this point the DIs and PI's should all be equal,
+	 indicating a match.  Break out of this loop if all PVs are
+	 at the end, (at which piont they return -1 for both DI and
+	 PI). */
+      do
+	{
+	  something_was_greater_than_max = 0;
+	  for (i = 0; i < query_len; i++)
+	    {
+	      /* Keep looking for instances of word query[wi] */
+	      while (di[i] != -1
+		  && (di[i] < max_di
+		      || (di[i] <= max_di && pi[i] < max_pi)))
+		{
+		  /* Pass over whole documents that can't match. */
+		  if (di[i] < max_di)
+		    archer_pv_batch_skip_to (batch[i], max_di);
+		  archer_pv_batch_next (batch[i], &(di[i]), &(pi[i]));
+
+		  /* If any of the query words is at the end of their
+		     PV, then we're not going to find any more
+		     matches, and we're done setting the scores.  Go
+		     print the matching documents. */
+		  if (di[i] == -1)
+		    goto search_done;
+
+		  /* Make it so that all PI's will be equal if the words
+		     are in order. */
+		  pi[i] -= i;
+		  bow_verbosify (bow_verbose, "%20s %10d %10d %10d %10d\n", 
+				 bow_int2word (query[i]), 
+				 di[i], pi[i], max_di, max_pi);
+		}
+	      if (di[i] > max_di) 
+		{
+		  max_di = di[i];
+		  max_pi = pi[i];
+		  something_was_greater_than_max = 1;
+		}
+	      else if (pi[i] > max_pi && di[i] == max_di) 
+		{
+		  max_pi = pi[i];
+		  something_was_greater_than_max = 1;
+		}
+	    }
+	}
+      while (something_was_greater_than_max);
+      bow_verbosify (bow_verbose, 
+		     "something_was_greater_than_max di=%d\n", di[0]);
+      for (i = 1; i < query_len; i++)
+	assert (di[i] == di[0] && pi[i] == pi[0]);
+      
+      /* Make sure this DI'th document hasn't been deleted.  If it
+         hasn't then add this DI to the WA---the list of hits */
+      doc = bow_sarray_entry_at_index (archer_docs, di[0]);
+      if (doc->word_count >= 0)
+	{
+	  bow_wa_add_to_end (wa, di[0], 1);
+	  sequence_occurrence_count++;
+	}
+
+      /* Set up so that next time through we'll read the next words
+         from each PV. */
+      for (i = 0; i < query_len; i++)
+	{
+	  if (di[i] != -1)
+	    di[i] = -300;
+	  if (pi[i] != -1)
+	    pi[i] = -300;
+	}
+    }
+ search_done:
+  /* A single word was read without the batches. */
+  for (i = 0; query_len > 1 && i < query_len; i++)
+    archer_pv_batch_free (batch[i]);
+
+  if (wa->length == 0)
+    {
+      bow_wa_free (wa);
+      return NULL;
+    }
+
+  /* Scale the scores by the log of the occurrence count of this sequence,
+     and take the log of the count (shifted) to encourage documents that
+     have all query term to be ranked above documents that have many 
+     repetitions of a few terms. */
+  if (!archer_arg_state.score_is_raw_count)
+    {
+      double document_frequency = wa->length;
+      scaler = 1.0 / log (5 + document_frequency);
+      for (i = 0; i < wa->length; i++)
+	wa->entry[i].weight = scaler * log (5 + wa->entry[i].weight);
+    }
+
+  return wa;
+}
+
+bow_wa *
+archer_query_hits_matching_sequence (const char *query_string,
+				     const char *suffix_string)
+{
+  int query[MAX_QUERY_WORDS];		/* WI's in the query */
+  int query_len;
+
+  query_len = archer_query_wis (query_string, suffix_string, query);
+  if (query_len <= 0)
+    return NULL;
+  return archer_query_hits_matching_wis (query, query_len);
+}
+
+/* Positional proximity.  The words of a query term may be joined by
+   the operators "NEAR/N", under which the next word must be no more
+   than N words away from the one before it, on either side, and
+   "ONEAR/N", under which it must also come after it.  Words not
+   joined by an operator must be adjacent and in order, as in a
+   phrase, so "ONEAR/1" is the same as a space, whether or not the
+   query repeats a word. */
+
+/* The most candidate positions looked at for the windows of one
+   document, to keep a query of many words with wide windows from
+   taking too long over one with many occurrences of them. */
+#define ARCHER_WINDOW_STEPS 100000
+
+/* If S begins with a proximity operator followed by a space or the
+   end of S, put its N into WINDOW and whether it is the ordered one
+   into ORDERED, and return its length.  Otherwise return 0. */
+static int
+archer_query_operator (const char *s, int *window, int *ordered)
+{
+  const char *p = s;
+  char *end;
+  long n;
+
+  if (*p == 'O')
+    p++;
+  if (strncmp (p, "NEAR/", 5) != 0 || !isdigit ((unsigned char)p[5]))
+    return 0;
+  n = strtol (p + 5, &end, 10);
+  if (*end && !isspace ((unsigned char)*end))
+    return 0;
+  *window = MIN (n, INT_MAX / 2);
+  *ordered = (*s == 'O');
+  return end - s;
+}
+
+/* Put into QUERY the word indices of the words of QUERY_STRING, with
+   SUFFIX_STRING added, as archer_query_wis() does, and into GAP[I]
+   and ORDERED[I] the window of word I after word I-1, and whether it
+   must come after it.  Return how many words there are, 0 if no
+   document can match, or -1 if QUERY_STRING has no proximity
+   operators. */
+static int
+archer_query_window_wis (const char *query_string, const char *suffix_string,
+			 int *query, int *gap, char *ordered)
+{
+  int wis[MAX_QUERY_WORDS];
+  char token[BOW_MAX_WORD_LENGTH];
+  const char *s, *end;
+  int query_len = 0, length, wis_len, i;
+  int window = 1, is_ordered = 1;
+  int found_operator = 0, found_unknown = 0;
+
+  for (s = query_string; *s; s = end)
+    {
+      while (isspace ((unsigned char)*s))
+	s++;
+      for (end = s; *end && !isspace ((unsigned char)*end); end++)
+	;
+      if (end == s)
+	break;
+      if (archer_query_operator (s, &window, &is_ordered))
+	{
+	  found_operator = 1;
+	  continue;
+	}
+      if (found_unknown || query_len >= MAX_QUERY_WORDS)
+	continue;
+      length = MIN (end - s, BOW_MAX_WORD_LENGTH-1);
+      memcpy (token, s, length);
+      token[length] = '\0';
+      wis_len = archer_query_wis (token, suffix_string, wis);
+      if (wis_len < 0)
+	{
+	  found_unknown = 1;
+	  continue;
+	}
+      /* A word left out by the stoplist doesn't use up the operator
+	 before it, since it has no position in the documents either. */
+      if (wis_len == 0)
+	continue;
+      for (i = 0; i < wis_len && query_len < MAX_QUERY_WORDS; i++)
+	{
+	  query[query_len] = wis[i];
+	  gap[query_len] = (i == 0 ? window : 1);
+	  ordered[query_len] = (i == 0 ? is_ordered : 1);
+	  query_len++;
+	}
+      window = is_ordered = 1;
+    }
+  if (!found_operator)
+    return -1;
+  if (found_unknown)
+    return 0;
+  return query_len;
+}
+
+/* The positions of the words of a proximity query in one document. */
+struct archer_window {
+  int length;			/* the number of query words */
+  const int *gap;		/* the window of each after the one before */
+  const char *ordered;		/* whether each must come after it */
+  int word[MAX_QUERY_WORDS];	/* the index among the different words
+				   of each query word */
+  int *positions[MAX_QUERY_WORDS]; /* of each different word, in order */
+  int count[MAX_QUERY_WORDS];	/* the number in POSITIONS */
+  int size[MAX_QUERY_WORDS];	/* the room in POSITIONS */
+  int chosen[MAX_QUERY_WORDS];	/* the position taken for each query word */
+  int steps;			/* candidates left to look at */
+};
+
+/* Return the narrowest span of positions for the query words of W,
+   from number I on, that keep to their windows after those chosen
+   for the words before them, which span LO to HI.  Return BEST if
+   there is none narrower than it. */
+static int
+archer_window_span (struct archer_window *w, int i, int lo, int hi, int best)
+{
+  int *p, n, from, to, k, j, mid, high;
+
+  if (i == w->length)
+    return hi - lo;
+
+  p = w->positions[w->word[i]];
+  n = w->count[w->word[i]];
+  from = (w->ordered[i]
+	  ? w->chosen[i-1] + 1 : w->chosen[i-1] - w->gap[i]);
+  to = w->chosen[i-1] + w->gap[i];
+  for (k = 0, high = n; k < high; )
+    {
+      mid = (k + high) / 2;
+      if (p[mid] < from)
+	k = mid + 1;
+      else
+	high = mid;
+    }
+  for (; k < n && p[k] <= to && w->steps-- > 0; k++)
+    {
+      if (MAX (hi, p[k]) - MIN (lo, p[k]) >= best)
+	{
+	  /* Positions further on only make it wider still. */
+	  if (p[k] > hi)
+	    break;
+	  continue;
+	}
+      /* A word repeated in the query takes a different position each
+	 time. */
+      for (j = 0; j < i && w->chosen[j] != p[k]; j++)
+	;
+      if (j < i)
+	continue;
+      w->chosen[i] = p[k];
+      best = archer_window_span (w, i + 1, MIN (lo, p[k]), MAX (hi, p[k]),
+				 best);
+    }
+  return best;
+}
+
+/* Return the sum, over the positions of the first query word of W at
+   which a match starts, of how close the narrowest such match is: 1
+   when its words are adjacent, and less the more words come between
+   them. */
+static float
+archer_window_closeness (struct archer_window *w)
+{
+  int *p = w->positions[w->word[0]];
+  int n = w->count[w->word[0]];
+  float closeness = 0;
+  int k, span;
+
+  w->steps = ARCHER_WINDOW_STEPS;
+  for (k = 0; k < n && w->steps > 0; k++)
+    {
+      w->chosen[0] = p[k];
+      span = archer_window_span (w, 1, p[k], p[k], INT_MAX);
+      if (span < INT_MAX)
+	closeness += (float)(w->length - 1) / span;
+    }
+  return closeness;
+}
+
+/* Return the documents in which the QUERY_LEN words of QUERY appear
+   within the windows GAP and ORDERED made by archer_query_window_wis(),
+   weighted by how many times and how closely they do, or NULL if
+   there are none.  The PV cursors of the words leapfrog each other to
+   the documents that have them all, and their positions there are
+   gathered to find the windows. */
+static bow_wa *
+archer_query_hits_matching_window (const int *query, const int *gap,
+				   const char *ordered, int query_len)
+{
+  struct archer_pv_batch *batch[MAX_QUERY_WORDS];
+  struct archer_window w;
+  int num_words = 0;
+  int max_di, di, pi, moved;
+  int i, j;
+  float closeness, scaler;
+  bow_wa *wa;
+  archer_doc *doc;
+
+  w.length = query_len;
+  w.gap = gap;
+  w.ordered = ordered;
+  for (i = 0; i < query_len; i++)
+    {
+      for (j = 0; j < i && query[j] != query[i]; j++)
+	;
+      if (j < i)
+	{
+	  w.word[i] = w.word[j];
+	  continue;
+	}
+      w.word[i] = num_words;
+      batch[num_words] = alloca (sizeof (struct archer_pv_batch));
+      archer_pv_batch_init (batch[num_words], query[i]);
+      w.size[num_words] = 16;
+      w.positions[num_words] = bow_malloc (w.size[num_words] * sizeof (int));
+      num_words++;
+    }
+
   wa = bow_wa_new (0);
-
-  /* Search for documents containing the query words in the same order
-     as the query. */
-  bow_wi2pv_rewind (archer_wi2pv);
-  max_di = max_pi = -200;
-  /* Loop while we look for matches.  We'll break out of this loop when
-     any of the query words are at the end of their PV's. */
+  max_di = 0;
   for (;;)
     {
-      /* Keep reading DI and PI from one or more of the query-word PVs
-	 until none of the DIs or PIs is greater than the MAX_DI or
-	 MAX_PI.  At this point the DIs and PI's should all be equal,
-	 indicating a match.  Break out of this loop if all PVs are
-	 at the end, (at which piont they return -1 for both DI and
-	 PI). */
+      /* Move every cursor to the first document at or after MAX_DI
+	 that has all the words, leaving the pair there to be handed
+	 out again. */
       do
 	{
-	  something_was_greater_than_max = 0;
-	  for (i = 0; i < query_len; i++)
+	  moved = 0;
+	  for (i = 0; i < num_words; i++)
 	    {
-	      /* Keep looking for instances of word query[wi] */
-	      while (di[i] != -1
-		  && (di[i] < max_di
-		      || (di[i] <= max_di && pi[i] < max_pi)))
-		{
-		  bow_wi2pv_wi_next_di_pi (archer_wi2pv, query[i],
-					   &(di[i]), &(pi[i]));
-
-		  /* If any of the query words is at the end of their
-		     PV, then we're not going to find any more
-		     matches, and we're done setting the scores.  Go
-		     print the matching documents. */
-		  if (di[i] == -1)
-		    goto search_done;
-
-		  /* Make it so that all PI's will be equal if the words
-		     are in order. */
-		  pi[i] -= i;
-		  bow_verbosify (bow_verbose, "%20s %10d %10d %10d %10d\n", 
-				 bow_int2word (query[i]), 
-				 di[i], pi[i], max_di, max_pi);
-		}
-	      if (di[i] > max_di) 
-		{
-		  max_di = di[i];
-		  max_pi = pi[i];
-		  something_was_greater_than_max = 1;
-		}
-	      else if (pi[i] > max_pi && di[i] == max_di) 
+	      archer_pv_batch_skip_to (batch[i], max_di);
+	      archer_pv_batch_next (batch[i], &di, &pi);
+	      if (di == -1)
+		goto search_done;
+	      batch[i]->next--;
+	      if (di > max_di)
 		{
-		  max_pi = pi[i];
-		  something_was_greater_than_max = 1;
+		  max_di = di;
+		  moved = 1;
 		}
 	    }
 	}
-      while (something_was_greater_than_max);
-      bow_verbosify (bow_verbose, 
-		     "something_was_greater_than_max di=%d\n", di[0]);
-      for (i = 1; i < query_len; i++)
-	assert (di[i] == di[0] && pi[i] == pi[0]);
-      
-      /* Make sure this DI'th document hasn't been deleted.  If it
-         hasn't then add this DI to the WA---the list of hits */
-      doc = bow_sarray_entry_at_index (archer_docs, di[0]);
-      if (doc->word_count > 0)
+      while (moved);
+
+      /* Gather the positions of each word in it. */
+      for (i = 0; i < num_words; i++)
 	{
-	  bow_wa_add_to_end (wa, di[0], 1);
-	  sequence_occurrence_count++;
+	  w.count[i] = 0;
+	  for (;;)
+	    {
+	      archer_pv_batch_next (batch[i], &di, &pi);
+	      if (di != max_di)
+		break;
+	      if (w.count[i] == w.size[i])
+		{
+		  w.size[i] *= 2;
+		  w.positions[i] = bow_realloc (w.positions[i],
+						w.size[i] * sizeof (int));
+		}
+	      w.positions[i][w.count[i]++] = pi;
+	    }
+	  if (di != -1)
+	    batch[i]->next--;
 	}
 
-      /* Set up so that next time through we'll read the next words
-         from each PV. */
-      for (i = 0; i < query_len; i++)
+      /* Make sure this document hasn't been deleted. */
+      doc = bow_sarray_entry_at_index (archer_docs, max_di);
+      if (doc->word_count >= 0)
 	{
-	  if (di[i] != -1)
-	    di[i] = -300;
-	  if (pi[i] != -1)
-	    pi[i] = -300;
+	  closeness = archer_window_closeness (&w);
+	  if (closeness > 0)
+	    bow_wa_add_to_end (wa, max_di, closeness);
 	}
+      max_di++;
     }
  search_done:
+  for (i = 0; i < num_words; i++)
+    {
+      archer_pv_batch_free (batch[i]);
+      bow_free (w.positions[i]);
+    }
 
   if (wa->length == 0)
     {
@@ -575,10 +1772,9 @@ archer_query_hits_matching_sequence (const char *query_string,
       return NULL;
     }
 
-  /* Scale the scores by the log of the occurrence count of this sequence,
-     and take the log of the count (shifted) to encourage documents that
-     have all query term to be ranked above documents that have many 
-     repetitions of a few terms. */
+  /* Weight as archer_query_hits_matching_wis() does, with the
+     closeness in place of the count, so that a match of adjacent
+     words counts the same as a phrase, repeated words and all. */
   if (!archer_arg_state.score_is_raw_count)
     {
       double document_frequency = wa->length;
@@ -590,93 +1786,272 @@ archer_query_hits_matching_sequence (const char *query_string,
   return wa;
 }
 
-/* A temporary hack.  Also, does not work for queries containing
-   repeated words */
+/* A score can come out a little above the sum of the bounds of its
+   terms, because of the rounding in its float sums, so the bounds are
+   stretched by this fraction. */
+#define ARCHER_BOUND_SLACK 1e-5
+
+/* A term of a query, with the documents it matches visited in order
+   of document index.  They come from a list made beforehand, or, for
+   a single word, are read from its PV as they are needed, so that
+   documents passed over are never decoded. */
+struct archer_term {
+  const char *term;
+  bow_wa *wa;			/* the documents, or NULL if read from the PV */
+  int wai;			/* index in WA of DI */
+  int wi;			/* the word, if WA is NULL */
+  struct archer_pv_batch *batch; /* pairs read from its PV, if WA is NULL */
+  float scaler;			/* for the weight of each document */
+  int document_count;		/* number of documents matched */
+  int di;			/* current document, -1 before the first and
+				   INT_MAX after the last */
+  float weight;			/* the weight of the term in DI */
+  float bound;			/* WEIGHT is never more than this */
+};
+
+/* Return the weight of a word that occurs COUNT times in a document,
+   where SCALER is that of the word. */
+static inline float
+archer_term_weight (float scaler, int count)
+{
+  if (archer_arg_state.score_is_raw_count)
+    return count;
+  return scaler * log (5 + (float) count);
+}
+
+/* Set up T for the documents of WA, made beforehand.  Return zero,
+   and leave T alone, if WA is NULL. */
+static int
+archer_term_init_wa (struct archer_term *t, bow_wa *wa)
+{
+  int wai;
+
+  if (wa == NULL)
+    return 0;
+  t->wa = wa;
+  t->wai = 0;
+  t->document_count = t->wa->length;
+  t->bound = 0;
+  for (wai = 0; wai < t->wa->length; wai++)
+    if (t->wa->entry[wai].weight > t->bound)
+      t->bound = t->wa->entry[wai].weight;
+  return 1;
+}
+
+/* Set up T for the documents of the QUERY_LEN words of QUERY, in
+   sequence, with the same weights as archer_query_hits_matching_wis()
+   would give them.  Return zero if there are none. */
+static int
+archer_term_init (struct archer_term *t, const int *query, int query_len)
+{
+  bow_pv *pv;
+  int document_count = 0, max_document_word_count = 0;
+  int s;
+
+  t->di = -1;
+  t->batch = NULL;
+  /* Read a single word from its PV's if its numbers of documents are
+     known in every segment.  They count deleted documents too, so
+     only if there are none. */
+  for (s = 0; query_len == 1 && s < archer_segments_count; s++)
+    {
+      pv = (query[0] < archer_segments[s].wi2pv->entry_count
+	    ? &(archer_segments[s].wi2pv->entry[query[0]]) : NULL);
+      if (pv == NULL || pv->word_count <= 0)
+	continue;
+      if (pv->document_count < 0)
+	break;
+      document_count += pv->document_count;
+      if (pv->max_document_word_count > max_document_word_count)
+	max_document_word_count = pv->max_document_word_count;
+    }
+  if (query_len == 1 && s == archer_segments_count && document_count > 0
+      && archer_docs_deleted_count == 0)
+    {
+      t->wa = NULL;
+      t->wi = query[0];
+      t->document_count = document_count;
+      t->scaler = 1.0 / log (5 + (double) document_count);
+      t->bound = archer_term_weight (t->scaler, max_document_word_count);
+      t->batch = bow_malloc (sizeof (struct archer_pv_batch));
+      archer_pv_batch_init (t->batch, t->wi);
+      return 1;
+    }
+
+  return archer_term_init_wa (t, archer_query_hits_matching_wis (query,
+								 query_len));
+}
+
+/* Set up T for the documents of the QUERY_LEN words of QUERY, within
+   the windows GAP and ORDERED, with the weights that
+   archer_query_hits_matching_window() gives them.  Return zero if
+   there are none. */
+static int
+archer_term_init_window (struct archer_term *t, const int *query,
+			 const int *gap, const char *ordered, int query_len)
+{
+  t->di = -1;
+  t->batch = NULL;
+  return archer_term_init_wa (t, archer_query_hits_matching_window
+			      (query, gap, ordered, query_len));
+}
+
+/* Move T to the first of its documents with an index of DI or more,
+   and set its weight there.  Does nothing if it is there already. */
+static void
+archer_term_seek (struct archer_term *t, int di)
+{
+  int next_di, pi, count;
+  archer_doc *doc;
+
+  if (t->di >= di)
+    return;
+  if (t->wa)
+    {
+      t->wai = archer_wa_seek (t->wa, t->wai, di);
+      if (t->wai == -1)
+	t->di = INT_MAX;
+      else
+	{
+	  t->di = t->wa->entry[t->wai].wi;
+	  t->weight = t->wa->entry[t->wai].weight;
+	}
+      return;
+    }
+
+  archer_pv_batch_skip_to (t->batch, di);
+  for (;;)
+    {
+      archer_pv_batch_next (t->batch, &(t->di), &pi);
+      if (t->di == -1)
+	{
+	  t->di = INT_MAX;
+	  return;
+	}
+      /* Count the entries of this document, and hand out again the
+	 first of the next. */
+      count = 1;
+      for (;;)
+	{
+	  archer_pv_batch_next (t->batch, &next_di, &pi);
+	  if (next_di != t->di)
+	    break;
+	  count++;
+	}
+      if (next_di != -1)
+	t->batch->next--;
+      doc = bow_sarray_entry_at_index (archer_docs, t->di);
+      if (doc->word_count >= 0)
+	break;
+    }
+  t->weight = archer_term_weight (t->scaler, count);
+}
+
+/* Move T back to before its first document. */
+static void
+archer_term_rewind (struct archer_term *t)
+{
+  t->di = -1;
+  if (t->wa)
+    t->wai = 0;
+  else
+    {
+      archer_pv_batch_free (t->batch);
+      archer_pv_batch_init (t->batch, t->wi);
+    }
+}
+
+/* Free the memory held by T, but not T itself. */
+static void
+archer_term_free (struct archer_term *t)
+{
+  bow_free ((char*)t->term);
+  if (t->wa)
+    bow_wa_free (t->wa);
+  if (t->batch)
+    {
+      archer_pv_batch_free (t->batch);
+      bow_free (t->batch);
+    }
+}
+
+/* Put the NUM_TERMS entries of ORDER in order of their current
+   document. */
+static void
+archer_terms_sort (struct archer_term **order, int num_terms)
+{
+  struct archer_term *t;
+  int i, j;
+
+  for (i = 1; i < num_terms; i++)
+    {
+      t = order[i];
+      for (j = i; j > 0 && order[j-1]->di > t->di; j--)
+	order[j] = order[j-1];
+      order[j] = t;
+    }
+}
+
+static int
+archer_score_compare_di (const void *s1, const void *s2)
+{
+  return ((bow_score*)s1)->di - ((bow_score*)s2)->di;
+}
+
+/* Answer QUERY, printing the first NUM_HITS_TO_PRINT of the
+   documents that match to OUT.  Reads the index, but doesn't change
+   it, so several queries may be answered at once.  A term is a word,
+   a quoted phrase, or either of these joined to more by proximity
+   operators, as in `waq NEAR/5 "wbq wcq" ONEAR/3 wdq'.  A temporary
+   hack.  Also, does not work for queries containing repeated words */
 void
-archer_query ()
+archer_query_answer (const char *query, int num_hits_to_print, FILE *out)
 {
   int i;
-  int num_hits_to_print;
 #define NUM_FLAGS 3
   enum {pos = 0,
 	reg,
 	neg,
 	num_flags};
-  struct _word_hit {
-    const char *term;
-    bow_wa *wa;
-    int flag;
-  } word_hits[num_flags][MAX_QUERY_WORDS];
+  struct archer_term word_hits[num_flags][MAX_QUERY_WORDS];
   int word_hits_count[num_flags];
-  int current_wai[num_flags][MAX_QUERY_WORDS];
-  struct _doc_hit {
-    int di;
-    float score;
-    const char **terms;
-    int terms_count;
-  } *doc_hits;
-  int doc_hits_count;
-  int doc_hits_size;
-  bow_wa *term_wa;
-  int current_di, h, f, min_di;
+  struct archer_term *t;
+  /* The regular terms in order of their current document */
+  struct archer_term *order[MAX_QUERY_WORDS];
+  int query_wis[MAX_QUERY_WORDS];
+  int query_gap[MAX_QUERY_WORDS];
+  char query_ordered[MAX_QUERY_WORDS];
+  int query_len, matched;
+  int window, window_ordered, operator_length;
+  char *next, *operand;
+  bow_score *top_hits;		/* a heap of the best NUM_HITS_TO_PRINT */
+  int top_hits_count;
+  int doc_hits_count;		/* the number of documents that match */
+  bow_score hit, *by_di;
+  char *reg_matched;
+  float score;
+  double reg_bound, bound_sum;
+  int prune;
+  int current_di, h, f, p;
   int something_was_greater_than_max;
   char *query_copy, *query_remaining, *end;
   char query_string[BOW_MAX_WORD_LENGTH];
   char suffix_string[BOW_MAX_WORD_LENGTH];
   int found_flag, flag, length;
 
-  /* For sorting the combined list of document hits */
-  int compare_doc_hits (struct _doc_hit *hit1, struct _doc_hit *hit2)
-    {
-      if (hit1->score < hit2->score)
-	return 1;
-      else if (hit1->score == hit2->score)
-	return 0;
-      else
-	return -1;
-    }
-
-  void archer_sort_hits (struct _doc_hit *hits, int hits_count, 
-			 int num_to_sort)
-    {
-      int i, j,max_j;
-      float max_score;
-      struct _doc_hit tmp;
-      /* Find the highest score NUM_TO_SORT times */
-      for (i = 0; i < num_to_sort;  i++)
-	{
-	  /* Find the next highest score */
-	  max_score = -FLT_MAX;
-	  max_j = -1;
-	  for (j = i; j < hits_count; j++)
-	    {
-	      if (hits[j].score > max_score)
-		{
-		  max_score = hits[j].score;
-		  max_j = j;
-		}
-	    }
-	  /* Move the high score into position */
-	  assert (max_j >= 0);
-	  tmp = hits[i];
-	  hits[i] = hits[max_j];
-	  hits[max_j] = tmp;
-	}
-    }
-	
-
   /* Initialize the list of target documents associated with each term */
   for (i = 0; i < num_flags; i++)
     word_hits_count[i] = 0;
 
-  /* Initialize the combined list of target documents */
-  doc_hits_size = 1000;
+  /* Initialize the collection of the best documents */
+  num_hits_to_print = MAX (num_hits_to_print, 0);
+  top_hits = bow_malloc ((num_hits_to_print + 1) * sizeof (bow_score));
+  top_hits_count = 0;
   doc_hits_count = 0;
-  doc_hits = bow_malloc (doc_hits_size * sizeof (struct _doc_hit));
 
   /* Process each term in the query.  Quoted sections count as one
      term here. */
-  query_remaining = query_copy = strdup (archer_arg_state.query_string);
+  query_remaining = query_copy = strdup (query);
   assert (query_copy);
   /* Chop any trailing newline or carriage return. */
   end = strpbrk (query_remaining, "\n\r");
@@ -752,12 +2127,59 @@ archer_query ()
 	query_remaining = end;
       if (length == 0)
 	continue;
+
+      /* A proximity operator after the term joins the term after it
+	 on to this one, "waq NEAR/5 wbq" being a single term. */
+      for (;;)
+	{
+	  for (next = query_remaining; *next == ' ' || *next == '\t'; next++)
+	    ;
+	  operator_length = archer_query_operator (next, &window,
+						   &window_ordered);
+	  if (operator_length == 0)
+	    break;
+	  operand = next + operator_length;
+	  while (*operand == ' ' || *operand == '\t')
+	    operand++;
+	  if (*operand == '"')
+	    {
+	      operand++;
+	      end = strchr (operand, '"');
+	    }
+	  else
+	    end = strpbrk (operand, " \t");
+	  if (end == NULL)
+	    end = strchr (operand, '\0');
+	  if (end == operand
+	      || (length + 2 + operator_length + (end - operand)
+		  >= BOW_MAX_WORD_LENGTH))
+	    break;
+	  query_string[length++] = ' ';
+	  memcpy (query_string + length, next, operator_length);
+	  length += operator_length;
+	  query_string[length++] = ' ';
+	  memcpy (query_string + length, operand, end - operand);
+	  length += end - operand;
+	  query_string[length] = '\0';
+	  query_remaining = (*end == '"' ? end + 1 : end);
+	}
       /* printf ("%d %s\n", flag, query_string); */
 
-      /* Get the list of documents matching the term */
-      term_wa = archer_query_hits_matching_sequence (query_string, 
-						     suffix_string);
-      if (!term_wa)
+      /* Get the documents matching the term */
+      t = &(word_hits[flag][word_hits_count[flag]]);
+      query_len = archer_query_window_wis (query_string, suffix_string,
+					   query_wis, query_gap, query_ordered);
+      if (query_len > 1)
+	matched = archer_term_init_window (t, query_wis, query_gap,
+					   query_ordered, query_len);
+      else
+	{
+	  if (query_len < 0)
+	    query_len = archer_query_wis (query_string, suffix_string,
+					  query_wis);
+	  matched = (query_len > 0 && archer_term_init (t, query_wis, query_len));
+	}
+      if (!matched)
 	{
 	  if (flag == pos)
 	    /* A required term didn't appear anywhere.  Print nothing */
@@ -766,150 +2188,119 @@ archer_query ()
 	    continue;
 	}
 
-      word_hits[flag][word_hits_count[flag]].term = strdup (query_string);
-      word_hits[flag][word_hits_count[flag]].wa = term_wa;
-      word_hits[flag][word_hits_count[flag]].flag = flag;
+      t->term = strdup (query_string);
       word_hits_count[flag]++;
       assert (word_hits_count[flag] < MAX_QUERY_WORDS);
-      bow_verbosify (bow_progress, "%8d %s\n", term_wa->length, query_string);
+      bow_verbosify (bow_progress, "%8d %s\n", t->document_count,
+		     query_string);
     }
 
   /* Bring together the WORD_HITS[*], following the correct +/-
-     semantics */
+     semantics.  A document that couldn't score among the best
+     NUM_HITS_TO_PRINT so far, even with every regular term in it at
+     its bound, is passed over without reading those terms there.
+     Without +terms the regular terms decide which documents are
+     visited, so that skips documents altogether, and only if we are
+     asked to, since they then go uncounted. */
+  prune = (archer_arg_state.top_hits_only && num_hits_to_print > 0);
+  reg_bound = 0;
+  for (h = 0; h < word_hits_count[reg]; h++)
+    {
+      reg_bound += word_hits[reg][h].bound;
+      order[h] = &(word_hits[reg][h]);
+    }
   current_di = 0;
-  for (f = 0; f < num_flags; f++)
-    for (h = 0; h < word_hits_count[f]; h++)
-      current_wai[f][h] = 0;
 
  next_current_di:
   if (word_hits_count[pos] == 0)
     {
-      /* Find a document in which a regular term appears, and align the
-	 CURRENT_WAI[REG][*] to point to the document if exists in that list */
-      min_di = INT_MAX;
+      /* Find a document in which a regular term appears. */
       for (h = 0; h < word_hits_count[reg]; h++)
+	archer_term_seek (order[h], current_di);
+      archer_terms_sort (order, word_hits_count[reg]);
+      if (word_hits_count[reg] == 0 || order[0]->di == INT_MAX)
+	goto hit_combination_done;
+
+      if (prune && top_hits_count == num_hits_to_print)
 	{
-	  if (current_wai[reg][h] != -1
-	      && (word_hits[reg][h].wa->entry[current_wai[reg][h]].wi
-		  < current_di))
+	  /* Find the pivot: the first term by which the bounds of the
+	     terms before it add up to more than the lowest score kept.
+	     No document before the pivot's can beat that score.  This
+	     is the WAND method of Broder et al. */
+	  bound_sum = 0;
+	  for (p = 0; p < word_hits_count[reg] && order[p]->di != INT_MAX; p++)
+	    {
+	      bound_sum += order[p]->bound;
+	      if (bound_sum * (1 + ARCHER_BOUND_SLACK) > top_hits[0].weight)
+		break;
+	    }
+	  if (p == word_hits_count[reg] || order[p]->di == INT_MAX)
+	    goto hit_combination_done;
+	  if (order[0]->di != order[p]->di)
 	    {
-	      if (current_wai[reg][h] < word_hits[reg][h].wa->length - 1)
-		current_wai[reg][h]++;
-	      else
-		current_wai[reg][h] = -1;
+	      current_di = order[p]->di;
+	      goto next_current_di;
 	    }
-	  assert (current_wai[reg][h] == -1
-		  || (word_hits[reg][h].wa->entry[current_wai[reg][h]].wi
-		      >= current_di));
-	  if (current_wai[reg][h] != -1
-	      && word_hits[reg][h].wa->entry[current_wai[reg][h]].wi < min_di)
-	    min_di = word_hits[reg][h].wa->entry[current_wai[reg][h]].wi;
 	}
-      if (min_di == INT_MAX)
-	goto hit_combination_done;
-	
-      current_di = min_di;
+      current_di = order[0]->di;
     }
   else
     {
       /* Find a document index in which all the +terms appear */
-      /* Loop until current_wai[pos][*] all point to the same document index */
       do
 	{
 	  something_was_greater_than_max = 0;
 	  for (h = 0; h < word_hits_count[pos]; h++)
 	    {
-	      while (word_hits[pos][h].wa->entry[current_wai[pos][h]].wi
-		     < current_di)
-		{
-		  if (current_wai[pos][h] < word_hits[pos][h].wa->length - 1)
-		    current_wai[pos][h]++;
-		  else
-		    /* We are at the end of a + list, and thus are done. */
-		    goto hit_combination_done;
-		}
-	      if (word_hits[pos][h].wa->entry[current_wai[pos][h]].wi 
-		  > current_di)
+	      archer_term_seek (&(word_hits[pos][h]), current_di);
+	      /* If we are at the end of a + list, we are done. */
+	      if (word_hits[pos][h].di == INT_MAX)
+		goto hit_combination_done;
+	      if (word_hits[pos][h].di > current_di)
 		{
-		  current_di = 
-		    word_hits[pos][h].wa->entry[current_wai[pos][h]].wi;
+		  current_di = word_hits[pos][h].di;
 		  something_was_greater_than_max = 1;
 		}
 	    }
 	}
       while (something_was_greater_than_max);
-      /* At this point all the CURRENT_WAI[pos][*] should be pointing to the
-	 same document.  Verify this. */
-      for (h = 1; h < word_hits_count[pos]; h++)
-	assert (word_hits[pos][h].wa->entry[current_wai[pos][h]].wi
-		== word_hits[pos][0].wa->entry[current_wai[pos][0]].wi);
     }
 
   /* Make sure the CURRENT_DI doesn't appear in any of the -term lists. */
   for (h = 0; h < word_hits_count[neg]; h++)
     {
-      /* Loop until we might have found the CURRENT_DI in this neg list */
-      while (current_wai[neg][h] != -1
-	     && (word_hits[neg][h].wa->entry[current_wai[neg][h]].wi
-		 < current_di))
-	{
-	  if (current_wai[neg][h] < word_hits[neg][h].wa->length - 1)
-	    current_wai[neg][h]++;
-	  else
-	    current_wai[neg][h] = -1;
-	}
-      if (word_hits[neg][h].wa->entry[current_wai[neg][h]].wi == current_di)
-	{
-	  current_di++;
-	  goto next_current_di;
-	}
+      archer_term_seek (&(word_hits[neg][h]), current_di);
+      if (word_hits[neg][h].di == current_di)
+	goto current_di_done;
     }
 
-  /* Add this CURRENT_DI to the combinted list of hits in DOC_HITS */
+  /* Score this CURRENT_DI, and keep it if it is among the best so far */
   assert (current_di < archer_docs->array->length);
-  doc_hits[doc_hits_count].di = current_di;
-  doc_hits[doc_hits_count].score = 0;
+  score = 0;
   for (h = 0; h < word_hits_count[pos]; h++)
-    doc_hits[doc_hits_count].score += 
-      word_hits[pos][h].wa->entry[current_wai[pos][h]].weight;
-  doc_hits[doc_hits_count].terms_count = 0;
-  doc_hits[doc_hits_count].terms = bow_malloc (MAX_QUERY_WORDS*sizeof (char*));
+    score += word_hits[pos][h].weight;
+  doc_hits_count++;
+  if (top_hits_count == num_hits_to_print
+      && (num_hits_to_print == 0
+	  || ((score + reg_bound) * (1 + ARCHER_BOUND_SLACK)
+	      <= top_hits[0].weight)))
+    goto current_di_done;
 
   /* Add score value from the regular terms, if CURRENT_DI appears there */
   for (h = 0; h < word_hits_count[reg]; h++)
     {
-      if (word_hits_count[pos] != 0)
-	{
-	  while (current_wai[reg][h] != -1
-		 && (word_hits[reg][h].wa->entry[current_wai[reg][h]].wi
-		     < current_di))
-	    {
-	      if (current_wai[reg][h] < word_hits[reg][h].wa->length - 1)
-		current_wai[reg][h]++;
-	      else
-		current_wai[reg][h] = -1;
-	    }
-	}
-      if (word_hits[reg][h].wa->entry[current_wai[reg][h]].wi
-	  == current_di)
-	{
-	  doc_hits[doc_hits_count].score += 
-	    word_hits[reg][h].wa->entry[current_wai[reg][h]].weight;
-	  doc_hits[doc_hits_count].
-	    terms[doc_hits[doc_hits_count].terms_count]
-	    = word_hits[reg][h].term;
-	  doc_hits[doc_hits_count].terms_count++;
-	}
+      archer_term_seek (&(word_hits[reg][h]), current_di);
+      if (word_hits[reg][h].di == current_di)
+	score += word_hits[reg][h].weight;
     }
 
-  doc_hits_count++;
-  if (doc_hits_count >= doc_hits_size)
-    {
-      doc_hits_size *= 2;
-      doc_hits = bow_realloc (doc_hits, (doc_hits_size
-					 * sizeof (struct _doc_hit)));
-    }
+  hit.di = current_di;
+  hit.weight = score;
+  hit.name = NULL;
+  top_hits_count = bow_scores_offer (top_hits, top_hits_count,
+				     num_hits_to_print, &hit);
 
+ current_di_done:
   current_di++;
   goto next_current_di;
 
@@ -917,50 +2308,69 @@ archer_query ()
 
   if (doc_hits_count)
     {
-      fprintf (archer_arg_state.query_out_fp, ",HITCOUNT %d\n", 
+      fprintf (out, ",HITCOUNT %d\n", 
 	       doc_hits_count);
-      num_hits_to_print = MIN (doc_hits_count, 
-			       archer_arg_state.num_hits_to_print);
-
-      /* Sort the DOC_HITS list */
-#if 1
-      archer_sort_hits (doc_hits, doc_hits_count, num_hits_to_print);
-#else
-      qsort (doc_hits, doc_hits_count, sizeof (struct _doc_hit), 
-	     (int(*)(const void*,const void*))compare_doc_hits);
-#endif
+      /* Best first; ties go to the lower document index. */
+      bow_scores_sort (top_hits, top_hits_count);
+
+      /* Only for these few documents, look up which of the regular
+	 terms they contain, visiting them in order of document index. */
+      by_di = bow_malloc ((top_hits_count + 1) * sizeof (bow_score));
+      memcpy (by_di, top_hits, top_hits_count * sizeof (bow_score));
+      qsort (by_di, top_hits_count, sizeof (bow_score),
+	     archer_score_compare_di);
+      reg_matched = bow_malloc (top_hits_count * word_hits_count[reg] + 1);
+      for (h = 0; h < word_hits_count[reg]; h++)
+	{
+	  archer_term_rewind (&(word_hits[reg][h]));
+	  for (i = 0; i < top_hits_count; i++)
+	    {
+	      archer_term_seek (&(word_hits[reg][h]), by_di[i].di);
+	      reg_matched[i * word_hits_count[reg] + h] =
+		(word_hits[reg][h].di == by_di[i].di);
+	    }
+	}
 
-      for (i = 0; i < num_hits_to_print; i++)
+      for (i = 0; i < top_hits_count; i++)
 	{
-	  fprintf (archer_arg_state.query_out_fp,
-		   "%s %f ", bow_sarray_keystr_at_index (archer_docs, doc_hits[i].di), 
-		   doc_hits[i].score);
+	  fprintf (out,
+		   "%s %f ", bow_sarray_keystr_at_index (archer_docs, top_hits[i].di), 
+		   top_hits[i].weight);
 	  for (h = 0; h < word_hits_count[pos]; h++)
-	    fprintf (archer_arg_state.query_out_fp, 
+	    fprintf (out, 
 		     "%s, ", word_hits[pos][h].term);
-	  for (h = 0; h < doc_hits[i].terms_count-1; h++)
-	    fprintf (archer_arg_state.query_out_fp, 
-		     "%s, ", doc_hits[i].terms[h]);
-	  h = doc_hits[i].terms_count - 1;
-	  if (h >= 0)
-	    fprintf (archer_arg_state.query_out_fp, 
-		     "%s", doc_hits[i].terms[h]);
-	  fprintf (archer_arg_state.query_out_fp, "\n");
+	  p = ((bow_score*) bsearch (&(top_hits[i]), by_di, top_hits_count,
+				     sizeof (bow_score),
+				     archer_score_compare_di)
+	       - by_di);
+	  for (h = 0, f = 0; h < word_hits_count[reg]; h++)
+	    if (reg_matched[p * word_hits_count[reg] + h])
+	      fprintf (out, f++ ? ", %s" : "%s", word_hits[reg][h].term);
+	  fprintf (out, "\n");
 	}
+      bow_free (by_di);
+      bow_free (reg_matched);
     }
-  fprintf (archer_arg_state.query_out_fp, ".\n");
-  fflush (archer_arg_state.query_out_fp);
+  fprintf (out, ".\n");
+  fflush (out);
 
   /* Free all the junk we malloc'ed */
   for (f = 0; f < num_flags; f++)
     for (h = 0; h < word_hits_count[f]; h++)
-      bow_free ((char*)word_hits[f][h].term);
-  for (h = 0; h < doc_hits_count; h++)
-    bow_free (doc_hits[h].terms);
-  bow_free (doc_hits);
+      archer_term_free (&(word_hits[f][h]));
+  bow_free (top_hits);
   bow_free (query_copy);
 }
 
+/* Answer the query given on the command line. */
+void
+archer_query ()
+{
+  archer_query_answer (archer_arg_state.query_string,
+		       archer_arg_state.num_hits_to_print,
+		       archer_arg_state.query_out_fp);
+}
+
 /* Set up to listen for queries on a socket */
 void
 archer_query_socket_init (const char *socket_name, int use_unix_socket)
@@ -997,21 +2407,28 @@ archer_query_socket_init (const char *socket_name, int use_unix_socket)
 
 
 /* We assume that commands are no longer than 1024 characters in length */
-/* At the moment, we assume that the only possible command is ",HITS <num>" */
+/* Process the command lines at the beginning of FP: if
+   DOING_PRE_FORK_COMMANDS, those beginning with ';', which change the
+   index, and if DOING_POST_FORK_COMMANDS, those beginning with ',',
+   of which the only one at the moment is ",HITS <num>", setting
+   *NUM_HITS_TO_PRINT. */
 void
-archer_query_server_process_commands (FILE *fp, int doing_pre_fork_commands)
+archer_query_server_process_commands (FILE *fp, int doing_pre_fork_commands,
+				      int doing_post_fork_commands,
+				      int *num_hits_to_print)
 {
   int first;
   char buf[1024];
   int i;
   char s[1024];
+  archer_segment *seg;
 
   /* See if the first character of the line is the special char ',' 
      which indicates that this is a command line. */
   while ((first = fgetc (fp)))
     {
-      if ((doing_pre_fork_commands && first != ';')
-	  || (!doing_pre_fork_commands && first != ','))
+      if (!(doing_pre_fork_commands && first == ';')
+	  && !(doing_post_fork_commands && first == ','))
 	{
 	  ungetc (first, fp);
 	  return;
@@ -1019,10 +2436,21 @@ archer_query_server_process_commands (FILE *fp, int doing_pre_fork_commands)
 
       /* Retrieve the rest of the line, and process the command. */
       fgets ((char *) buf, 1024, fp);
-      if (doing_pre_fork_commands) 
+      if (first == ';')
 	{
+	  /* Change the index while no query is reading it, and no
+	     segments are being merged. */
+	  pthread_mutex_lock (&archer_segments_lock);
+	  archer_index_write_lock ();
 	  if (sscanf (buf, "INDEX %1023s", s) == 1)
-	    archer_index_filename (s, NULL);
+	    {
+	      archer_index_filename (s, NULL);
+	      /* Seal the segment once it has enough documents. */
+	      seg = &(archer_segments[archer_segments_count-1]);
+	      if (archer_segments_count > 0 && !seg->sealed
+		  && seg->end_di - seg->first_di >= archer_arg_state.segment_docs)
+		archer_archive ();
+	    }
 	  else if (sscanf (buf, "DELETE %1023s", s) == 1)
 	    archer_delete_filename (s);
 	  else if (strstr (buf, "ARCHIVE") == buf)
@@ -1035,11 +2463,21 @@ archer_query_server_process_commands (FILE *fp, int doing_pre_fork_commands)
 	  else
 	    bow_verbosify (bow_progress,
 			   "Unknown pre-fork command `%s'\n", buf);
+	  /* Whatever was flushed to disk must be readable by the
+	     queries that follow. */
+	  archer_segments_sync ();
+	  archer_index_unlock ();
+	  pthread_cond_signal (&archer_segments_changed);
+	  pthread_mutex_unlock (&archer_segments_lock);
+	  /* Without a thread for it, merge here, between queries. */
+	  if (!archer_arg_state.serve_with_threads)
+	    while (archer_segments_merge_some ())
+	      ;
 	}
       else
 	{
 	  if (sscanf (buf, "HITS %d", &i) == 1)
-	    archer_arg_state.num_hits_to_print = i;
+	    *num_hits_to_print = i;
 	  else
 	    bow_verbosify (bow_progress,
 			   "Unknown post-fork command `%s'\n", buf);
@@ -1054,7 +2492,7 @@ archer_query_serve_one_query ()
   int newsockfd, clilen;
   struct sockaddr cli_addr;
   FILE *in, *out;
-  int pid;
+  int pid, i;
   char query_buf[BOW_MAX_WORD_LENGTH];
  
   clilen = sizeof (cli_addr);
@@ -1070,7 +2508,8 @@ archer_query_serve_one_query ()
   archer_arg_state.query_out_fp = out;
   archer_arg_state.query_string = query_buf;
 
-  archer_query_server_process_commands (in, 1);
+  archer_query_server_process_commands
+    (in, 1, 0, &archer_arg_state.num_hits_to_print);
 
   if (archer_arg_state.serve_with_forking)
     {
@@ -1084,8 +2523,9 @@ archer_query_serve_one_query ()
 	}
       else
 	{
-	  /* child - reopen the PV file so we get our own lseek() position */
-	  bow_wi2pv_reopen_pv (archer_wi2pv);
+	  /* child - reopen the PV files so we get our own lseek() position */
+	  for (i = 0; i < archer_segments_count; i++)
+	    bow_wi2pv_reopen_pv (archer_segments[i].wi2pv);
 	}
     }
 
@@ -1094,10 +2534,14 @@ archer_query_serve_one_query ()
     {
       /* Strips any special commands from the beginning of the stream */
       archer_query_server_process_commands
-	(in, archer_arg_state.serve_with_forking ? 0 : 1);
+	(in, !archer_arg_state.serve_with_forking,
+	 archer_arg_state.serve_with_forking,
+	 &archer_arg_state.num_hits_to_print);
 
       fgets (query_buf, BOW_MAX_WORD_LENGTH, in);
+      archer_index_read_lock ();
       archer_query ();
+      archer_index_unlock ();
     }
 
   fclose (in);
@@ -1110,38 +2554,169 @@ archer_query_serve_one_query ()
     exit (0);
 }
 
+/* A connection to the threaded query server. */
+struct archer_connection {
+  int sockfd;
+  int num_hits_to_print;	/* as set by this connection's ",HITS" */
+};
+
+/* Answer the queries of one connection, in a thread of its own.
+   Commands that change the index wait for the queries being answered
+   in other threads, and are seen by all the queries after them. */
+static void *
+archer_query_serve_connection (void *arg)
+{
+  struct archer_connection *c = arg;
+  char query_buf[BOW_MAX_WORD_LENGTH];
+  FILE *in, *out;
+
+  /* Give each stream its own descriptor, so that each can be closed. */
+  in = fdopen (c->sockfd, "r");
+  out = fdopen (dup (c->sockfd), "w");
+  if (in == NULL || out == NULL)
+    bow_error ("Couldn't open the connection's socket");
+
+  bow_verbosify (bow_progress, "Processing query...\n");
+  for (;;)
+    {
+      archer_query_server_process_commands (in, 1, 1,
+					    &(c->num_hits_to_print));
+      if (fgets (query_buf, BOW_MAX_WORD_LENGTH, in) == NULL)
+	break;
+      archer_index_read_lock ();
+      archer_query_answer (query_buf, c->num_hits_to_print, out);
+      archer_index_unlock ();
+    }
+
+  fclose (in);
+  fclose (out);
+  bow_free (c);
+  bow_verbosify (bow_progress, "Closed connection.\n");
+  return NULL;
+}
+
+/* Accept connections for ever, answering each in a new thread.  All
+   of the threads share the one index in memory. */
+static void
+archer_query_serve_threads ()
+{
+  struct archer_connection *c;
+  struct sockaddr cli_addr;
+  socklen_t clilen;
+  pthread_attr_t attr;
+  pthread_t tid;
+  int newsockfd;
+
+  /* A client that goes away must not take the server with it. */
+  signal (SIGPIPE, SIG_IGN);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&tid, &attr, archer_segments_merge_thread, NULL))
+    bow_error ("Couldn't create a thread for merging segments");
+  for (;;)
+    {
+      clilen = sizeof (cli_addr);
+      newsockfd = accept (archer_sockfd, &cli_addr, &clilen);
+      if (newsockfd == -1)
+	bow_error ("Not able to accept connections!\n");
+      bow_verbosify (bow_progress, "Accepted connection\n");
+      c = bow_malloc (sizeof (struct archer_connection));
+      c->sockfd = newsockfd;
+      c->num_hits_to_print = archer_arg_state.num_hits_to_print;
+      if (pthread_create (&tid, &attr, archer_query_serve_connection, c))
+	bow_error ("Couldn't create a thread for a connection");
+    }
+}
+
 void
 archer_query_serve ()
 {
   archer_query_socket_init (archer_arg_state.server_port_num, 0);
+  if (archer_arg_state.serve_with_threads)
+    archer_query_serve_threads ();
   for (;;)
     archer_query_serve_one_query ();
 }
 
+/* Rewrite the position vectors of each segment so that each word's
+   are contiguous on disk, then point the archive at the new files and
+   remove the old. */
+void
+archer_compact ()
+{
+  char filename[BOW_MAX_WORD_LENGTH];
+  char new_filename[BOW_MAX_WORD_LENGTH + 4]; /* FILENAME and "-new" */
+  char old_pv_pathname[BOW_MAX_WORD_LENGTH];
+  char pv_filename[BOW_MAX_WORD_LENGTH];
+  char compact_pv_filename[BOW_MAX_WORD_LENGTH];
+  bow_wi2pv *wi2pv;
+  int s;
+
+  for (s = 0; s < archer_segments_count; s++)
+    {
+      wi2pv = archer_segments[s].wi2pv;
+      if (strchr (wi2pv->pv_filename, '/'))
+	sprintf (old_pv_pathname, "%s/pv", bow_data_dirname);
+      else
+	sprintf (old_pv_pathname, "%s/%s", bow_data_dirname,
+		 wi2pv->pv_filename);
+      /* Alternate between two names, so that the new file never
+	 overwrites the one the archive on disk still refers to. */
+      if (archer_segments[s].id == 0)
+	strcpy (pv_filename, "pv");
+      else
+	sprintf (pv_filename, "pv-%d", archer_segments[s].id);
+      sprintf (compact_pv_filename, "%s-compact", pv_filename);
+      if (strcmp (wi2pv->pv_filename, compact_pv_filename))
+	bow_wi2pv_compact (wi2pv, compact_pv_filename);
+      else
+	bow_wi2pv_compact (wi2pv, pv_filename);
+
+      /* Replace the map of word indices in one step, so that the
+	 archive refers either wholly to the old file or wholly to the
+	 new. */
+      archer_segment_filename (archer_segments[s].id, filename);
+      sprintf (new_filename, "%s-new", filename);
+      bow_wi2pv_write_to_filename (wi2pv, new_filename);
+      if (rename (new_filename, filename))
+	{
+	  perror ("archer compact rename");
+	  bow_error ("Couldn't replace %s", filename);
+	}
+      unlink (old_pv_pathname);
+    }
+  archer_segments_free ();
+}
+
 void
 archer_print_all ()
 {
   int wi;
   int di;
   int pi;
+  struct archer_pv_batch batch;
 
-  bow_wi2pv_rewind (archer_wi2pv);
   for (wi = 0; wi < bow_num_words (); wi++)
     {
+      archer_pv_batch_init (&batch, wi);
       for (;;)
 	{
-	  bow_wi2pv_wi_next_di_pi (archer_wi2pv, wi, &di, &pi);
+	  archer_pv_batch_next (&batch, &di, &pi);
 	  if (di == -1)
 	    break;
 	  printf ("%010d %010d %s\n", di, pi, bow_int2word (wi));
 	}
+      archer_pv_batch_free (&batch);
     }
 }
 
 void
 archer_print_word_stats ()
 {
-  bow_wi2pv_print_stats (archer_wi2pv);
+  int s;
+
+  for (s = 0; s < archer_segments_count; s++)
+    bow_wi2pv_print_stats (archer_segments[s].wi2pv);
 }
 
 
@@ -1160,8 +2735,15 @@ static char archer_argp_args_doc[] = "[ARG...]";
 enum {
   QUERY_SERVER_KEY = 3000,
   QUERY_FORK_SERVER_KEY,
+  QUERY_THREAD_SERVER_KEY,
   INDEX_LINES_KEY,
   SCORE_IS_RAW_COUNT_KEY,
+  COMPACT_KEY,
+  TOP_HITS_ONLY_KEY,
+  MERGE_KEY,
+  SEGMENT_DOCS_KEY,
+  MAX_SEGMENTS_KEY,
+  INDEX_THREADS_KEY,
 };
 
 static struct argp_option archer_options[] =
@@ -1174,6 +2756,15 @@ static struct argp_option archer_options[] =
   {"index-lines", INDEX_LINES_KEY, "FILENAME", 0,
    "Like --index, except index each line of FILENAME as if it were a "
    "separate document.  Documents are named after sequential line numbers."},
+  {"compact", COMPACT_KEY, 0, 0,
+   "Rewrite the position vectors of the index so that those of each word "
+   "are contiguous on disk, for faster reading."},
+  {"index-threads", INDEX_THREADS_KEY, "N", 0,
+   "With --index, lex the files in N threads at once, each with its own "
+   "range of them, then merge what they found (default N=1)."},
+  {"merge", MERGE_KEY, 0, 0,
+   "Merge the segments of the index into one, leaving out the documents "
+   "that have been deleted."},
 
   {0, 0, 0, 0,
    "For doing document retreival using the data structures built with -i:", 2},
@@ -1184,12 +2775,27 @@ static struct argp_option archer_options[] =
   {"query-forking-server", QUERY_FORK_SERVER_KEY, "PORTNUM", 0,
    "Run archer in socket server mode, forking a new process with every "
    "connection.  Allows multiple simultaneous connections."},
+  {"query-threaded-server", QUERY_THREAD_SERVER_KEY, "PORTNUM", 0,
+   "Run archer in socket server mode, answering each connection in a "
+   "thread of its own, all sharing one copy of the index.  Allows multiple "
+   "simultaneous connections."},
   {"num-hits-to-show", 'n', "N", 0,
    "Show the N documents that are most similar to the query text "
    "(default N=1)"},
   {"score-is-raw-count", SCORE_IS_RAW_COUNT_KEY, 0, 0,
    "Instead of using a weighted sum of logs, the score of a document "
    "will be simply the number of terms in both the query and the document."},
+  {"top-hits-only", TOP_HITS_ONLY_KEY, 0, 0,
+   "Skip over documents that cannot score among the N shown, which is "
+   "faster for queries of many words.  The HITCOUNT of a query with no "
+   "+terms then counts only the documents that were scored."},
+  {"segment-docs", SEGMENT_DOCS_KEY, "N", 0,
+   "When a query server indexes documents, write them to disk as a new "
+   "segment of the index after every N of them (default N=1000)."},
+  {"max-segments", MAX_SEGMENTS_KEY, "N", 0,
+   "When a query server has more than N segments on disk, merge the "
+   "smallest neighbouring ones, while it goes on answering queries "
+   "(default N=8)."},
 
   {0, 0, 0, 0,
    "Diagnostics", 3},
@@ -1218,6 +2824,17 @@ archer_parse_opt (int key, char *arg, struct argp_state *state)
       archer_arg_state.what_doing = archer_index_lines;
       archer_arg_state.dirname = arg;
       break;
+    case COMPACT_KEY:
+      archer_arg_state.what_doing = archer_compact;
+      break;
+    case MERGE_KEY:
+      archer_arg_state.what_doing = archer_merge;
+      break;
+    case INDEX_THREADS_KEY:
+      archer_arg_state.index_threads = atoi (arg);
+      if (archer_arg_state.index_threads < 1)
+	argp_error (state, "--index-threads must be at least 1");
+      break;
     case 'p':
       archer_arg_state.what_doing = archer_print_all;
       break;
@@ -1230,6 +2847,24 @@ archer_parse_opt (int key, char *arg, struct argp_state *state)
     case SCORE_IS_RAW_COUNT_KEY:
       archer_arg_state.score_is_raw_count = 1;
       break;
+    case TOP_HITS_ONLY_KEY:
+      archer_arg_state.top_hits_only = 1;
+      break;
+    case SEGMENT_DOCS_KEY:
+      archer_arg_state.segment_docs = atoi (arg);
+      if (archer_arg_state.segment_docs < 1)
+	argp_error (state, "--segment-docs must be at least 1");
+      break;
+    case MAX_SEGMENTS_KEY:
+      archer_arg_state.max_segments = atoi (arg);
+      if (archer_arg_state.max_segments < 1)
+	argp_error (state, "--max-segments must be at least 1");
+      break;
+    case QUERY_THREAD_SERVER_KEY:
+      archer_arg_state.serve_with_threads = 1;
+      archer_arg_state.what_doing = archer_query_serve;
+      archer_arg_state.server_port_num = arg;
+      break;
     case QUERY_FORK_SERVER_KEY:
       archer_arg_state.serve_with_forking = 1;
     case QUERY_SERVER_KEY:
@@ -1280,8 +2915,13 @@ main (int argc, char *argv[])
   archer_arg_state.dirname = NULL;
   archer_arg_state.query_string = NULL;
   archer_arg_state.serve_with_forking = 0;
+  archer_arg_state.serve_with_threads = 0;
   archer_arg_state.query_out_fp = stdout;
   archer_arg_state.score_is_raw_count = 0;
+  archer_arg_state.top_hits_only = 0;
+  archer_arg_state.segment_docs = 1000;
+  archer_arg_state.max_segments = 8;
+  archer_arg_state.index_threads = 1;
 
   /* Parse the command-line arguments. */
   argp_parse (&archer_argp, argc, argv, 0, 0, &archer_arg_state);
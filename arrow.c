@@ -387,7 +387,9 @@ arrow_query (FILE *in, FILE *out, int num_hits_to_show)
   if (query_wv->normalizer == 0)
     return 0;
 
-  /* Get the best matching documents. */
+  /* Get the best matching documents, and the words of the query
+     they contain, for printing. */
+  bow_tfidf_explain = 1;
   actual_num_hits = bow_barrel_score (arrow_barrel, query_wv,
 				      hits, num_hits_to_show,
 				      -1);
@@ -435,6 +437,15 @@ arrow_compare (bow_wv *wv1, bow_wv *wv2)
   bow_wv_normalize_weights_by_vector_length (wv1);
   bow_wv_normalize_weights_by_vector_length (wv2);
 
+  /* Without per-word output the score is just a dot product. */
+  if (!bow_print_word_scores)
+    {
+      score = (bow_wv_dot (wv1, wv2)
+	       * wv1->normalizer * wv2->normalizer);
+      printf ("%g\n", score);
+      return;
+    }
+
   /* Loop over all words in WV1, summing the score. */
   for (wvi1 = 0, wvi2 = 0; wvi1 < wv1->num_entries; wvi1++)
     {
@@ -714,7 +725,9 @@ arrow_serve2 ()
   bow_wv_normalize_weights (query_wv, arrow_barrel);
 
 
-  /* Get the best matching documents. */
+  /* Get the best matching documents.  A "rank" command only needs
+     their filenames, not the words of the query they contain. */
+  bow_tfidf_explain = (filename[0] == '\0');
   actual_num_hits = bow_barrel_score (arrow_barrel, query_wv,
 				      hits, num_hits_to_show, -1);
  print:
@@ -42,6 +42,8 @@ bow_barrel_new (int word_capacity,
   ret->classnames = NULL;
   /* return a document barrel by default */
   ret->is_vpc = 0;
+  ret->fstats = NULL;
+  ret->nb_loo = NULL;
   return ret;
 }
 
@@ -379,11 +381,11 @@ bow_barrel_keep_top_words_by_infogain (int num_words_to_keep,
   bow_wi2dvf_unhide_all_wi (barrel->wi2dvf);
 
   /* Get the information gain of all the words. */
-  wi2ig = bow_infogain_per_wi_new (barrel, num_classes, &wi2ig_size);
+  wi2ig = bow_feature_score_per_wi_new (barrel, num_classes, &wi2ig_size);
 
   /* Make a list of the info gain numbers paired with their WI's,
      in prepartion for sorting. */
-  wiig_list = alloca (sizeof (struct wiig_list_entry) * wi2ig_size);
+  wiig_list = bow_malloc (sizeof (struct wiig_list_entry) * wi2ig_size);
   for (wi = 0; wi < wi2ig_size; wi++)
     {
       wiig_list[wi].wi = wi;
@@ -417,6 +419,8 @@ bow_barrel_keep_top_words_by_infogain (int num_words_to_keep,
       if (i % 100 == 0)
 	bow_verbosify (bow_progress, "\b\b\b\b\b\b\b\b\b%9d", wi2ig_size - i); 
     }
+  bow_free (wiig_list);
+  bow_free (wi2ig);
   /* Now that we have reduce vocabulary size, don't add more words to the
      vocabulary.  For example, when doing --test-files, don't include
      in the QUERY_WV words that aren't in the current reduced vocabulary,
@@ -539,6 +543,8 @@ bow_barrel_new_from_data_fp (FILE *fp)
     bow_error ("Trying to read bow_barrel's with different version numbers");
   _bow_barrel_version = version_tag;
   ret = bow_malloc (sizeof (bow_barrel));
+  ret->fstats = NULL;
+  ret->nb_loo = NULL;
   if (_bow_barrel_version < 3)
     {
       bow_fread_int (&method_id, fp);
@@ -1217,5 +1223,125 @@ bow_barrel_free (bow_barrel *barrel)
     bow_array_free (barrel->cdocs);
   if (barrel->classnames)
     bow_int4str_free (barrel->classnames);
+  if (barrel->fstats)
+    bow_fstats_free (barrel->fstats);
   bow_free (barrel);
 }
+
+/* Non-zero if score A belongs below score B in a list of BOW_SCOREs,
+   highest first, with ties going to the lower class index. */
+#define BOW_SCORE_WORSE(A,B) \
+((A).weight < (B).weight || ((A).weight == (B).weight && (A).di > (B).di))
+
+/* Restore the heap of the LENGTH entries of BSCORES, which has its
+   worst entry on top, after entry I has been made better. */
+static void
+bow_scores_sift_down (bow_score *bscores, int length, int i)
+{
+  bow_score tmp;
+  int child;
+
+  while ((child = 2 * i + 1) < length)
+    {
+      if (child + 1 < length
+	  && BOW_SCORE_WORSE (bscores[child+1], bscores[child]))
+	child++;
+      if (!BOW_SCORE_WORSE (bscores[child], bscores[i]))
+	break;
+      tmp = bscores[i];
+      bscores[i] = bscores[child];
+      bscores[child] = tmp;
+      i = child;
+    }
+}
+
+/* Put into BSCORES, highest first, the BSCORES_LEN highest of the
+   NUM_SCORES entries of SCORES, which is indexed by class, and return
+   how many were put there.  Ties go to the lower class index, as with
+   the insertion sorts that the scoring functions used to do.  The best
+   ones so far are kept in a heap with the worst on top, so this costs
+   O(NUM_SCORES log BSCORES_LEN) instead of O(NUM_SCORES BSCORES_LEN). */
+int
+bow_scores_select_top (const double *scores, int num_scores,
+		       bow_score *bscores, int bscores_len)
+{
+  int length = 0;
+  int ci, i;
+
+  if (bscores_len <= 0)
+    return 0;
+  for (ci = 0; ci < num_scores; ci++)
+    {
+      if (length < bscores_len)
+	{
+	  /* Sift the new score up from the bottom.  It is worse than
+	     an equal score already there, whose CI is smaller. */
+	  for (i = length++; i > 0; i = (i - 1) / 2)
+	    {
+	      if (scores[ci] > bscores[(i-1)/2].weight)
+		break;
+	      bscores[i] = bscores[(i-1)/2];
+	    }
+	  bscores[i].weight = scores[ci];
+	  bscores[i].di = ci;
+	}
+      else if (bscores[0].weight < scores[ci])
+	{
+	  /* Larger than the worst we have; replace it.  A tie never
+	     replaces it, because CI is larger than any index there. */
+	  bscores[0].weight = scores[ci];
+	  bscores[0].di = ci;
+	  bow_scores_sift_down (bscores, length, 0);
+	}
+    }
+
+  bow_scores_sort (bscores, length);
+  return length;
+}
+
+/* Offer SCORE to the heap of the LENGTH best scores so far in
+   BSCORES, which has room for BSCORES_LEN and keeps its worst score
+   on top, and return the heap's new length.  Ties go to the lower
+   document index, whatever the order the scores are offered in. */
+int
+bow_scores_offer (bow_score *bscores, int length, int bscores_len,
+		  const bow_score *score)
+{
+  int i;
+
+  if (length < bscores_len)
+    {
+      for (i = length++; i > 0; i = (i - 1) / 2)
+	{
+	  if (!BOW_SCORE_WORSE (*score, bscores[(i-1)/2]))
+	    break;
+	  bscores[i] = bscores[(i-1)/2];
+	}
+      bscores[i] = *score;
+    }
+  else if (bscores_len > 0 && BOW_SCORE_WORSE (bscores[0], *score))
+    {
+      bscores[0] = *score;
+      bow_scores_sift_down (bscores, length, 0);
+    }
+  return length;
+}
+
+/* Turn the heap of LENGTH scores in BSCORES, built by
+   bow_scores_offer(), into a list sorted highest first. */
+void
+bow_scores_sort (bow_score *bscores, int length)
+{
+  bow_score tmp;
+  int i;
+
+  /* Take the worst off the top of the heap, one by one, and put each
+     at the end. */
+  for (i = length - 1; i > 0; i--)
+    {
+      tmp = bscores[0];
+      bscores[0] = bscores[i];
+      bscores[i] = tmp;
+      bow_scores_sift_down (bscores, i, 0);
+    }
+}
@@ -47,27 +47,78 @@ typedef union {
 /* Position Vector in Memory */
 typedef struct _bow_pvm {
   int size;
-  int read_end;
+  int read_end;			/* unused; reading is by bow_pv_cursor */
   int write_end;
   unsigned char contents[0];
 } bow_pvm;
  
+/* Position Vector Skip entry: where the entries for a document begin,
+   so that reading can start there instead of at the beginning */
+typedef struct _bow_pv_skip {
+  int di;			/* the document whose entries begin here */
+  int last_di;			/* the document before it in the PV */
+  int count;			/* number of entries before this point */
+  int segment_bytes_remaining;	/* bytes of its segment from here on, or
+				   -1 if it is still in the PVM */
+  off_t seek;			/* disk position of the first entry, or
+				   offset in the PVM if still there */
+} bow_pv_skip;
+
+/* The Skip entries of a PV, in order */
+typedef struct _bow_pv_skips {
+  int length;
+  int size;
+  bow_pv_skip entry[0];
+} bow_pv_skips;
+
+/* Position Vector read Buffer, a block of a PV read from disk */
+typedef struct _bow_pvb {
+  off_t seek;			/* disk position of CONTENTS[0] */
+  int size;			/* number of bytes allocated in CONTENTS */
+  int length;			/* number of bytes read into CONTENTS */
+  unsigned char contents[0];
+} bow_pvb;
+
 /* (word, document) Position Vector */
 typedef struct _bow_pv {
   //int byte_count;		/* total number of bytes in PV */
   int word_count;		/* total number of word occurrences in PV */
   //int document_count;		/* total number of unique documents in PV */
   off_t seek_start;		/* disk position where this PV starts */
-  off_t read_seek_end;		/* disk position from which to read next */
-  int read_last_di;		/* doc index last read */
-  int read_last_pi;		/* position index last read */
+  /* These four are unused, and kept for the layout of the files
+     written by bow_pv_write(); reading is done by a bow_pv_cursor. */
+  off_t read_seek_end;
+  int read_last_di;
+  int read_last_pi;
   int read_segment_bytes_remaining;
   int write_last_di;
   int write_last_pi;
   off_t write_seek_last_tailer;
+  /* Only the fields above are written to disk by bow_pv_write(). */
   bow_pvm *pvm;
+  bow_pv_skips *skips;
+  /* These are -1 for a PV read from a file written before they were
+     kept. */
+  int document_count;		/* number of unique documents in PV */
+  int max_document_word_count;	/* most entries of any one document */
+  int write_document_word_count; /* entries of document WRITE_LAST_DI */
 } bow_pv;
 
+/* A reading position in a PV.  All of the state of reading is kept
+   here, so a PV is never changed by reading it, and any number of
+   cursors may read the same PV at once. */
+typedef struct _bow_pv_cursor {
+  bow_pv *pv;			/* NULL for a word with no entries */
+  FILE *fp;			/* where the segments of PV are */
+  off_t read_seek_end;		/* disk position from which to read next */
+  int read_segment_bytes_remaining; /* -1 before the first is read */
+  int read_last_di;		/* doc index last read */
+  int read_last_pi;		/* position index last read */
+  int pvm_read_end;		/* position in the PVM, once past the disk */
+  int unnext;			/* set by bow_pv_cursor_unnext() */
+  bow_pvb *pvb;
+} bow_pv_cursor;
+
 /* (map of) Word Index to Position Vector */
 typedef struct _bow_wi2pv {
   const char *pv_filename;
@@ -75,6 +126,9 @@ typedef struct _bow_wi2pv {
   int num_words;
   int entry_count;
   bow_pv *entry;
+  int pvm_total_bytes;		/* memory taken by the PVM's of ENTRY */
+  int pvm_max_total_bytes;	/* flush the PVM's when over this */
+  int fp_dirty;			/* FP's buffer may hold unwritten PV's */
 } bow_wi2pv;
 
 
@@ -90,14 +144,27 @@ typedef struct archer_doc {
 bow_wi2pv *bow_wi2pv_new (int capacity, const char *pv_filename);
 void bow_wi2pv_free (bow_wi2pv *wi2pv);
 void bow_wi2pv_add_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi);
-void bow_wi2pv_rewind (bow_wi2pv *wi2pv);
-void bow_wi2pv_wi_next_di_pi (bow_wi2pv *wi2pv, int wi, int *di, int *pi);
-void bow_wi2pv_wi_unnext (bow_wi2pv *wi2pv, int wi);
+/* Like bow_wi2pv_add_wi_di_pi(), but write nothing to disk until
+   bow_wi2pv_flush_wi() is called for WI. */
+void bow_wi2pv_append_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi);
+void bow_wi2pv_flush_wi (bow_wi2pv *wi2pv, int wi);
+/* Set up CURSOR for reading the PV of word WI from its beginning. */
+void bow_wi2pv_wi_cursor_init (bow_wi2pv *wi2pv, int wi,
+			       bow_pv_cursor *cursor);
 int bow_wi2pv_wi_count (bow_wi2pv *wi2pv, int wi);
 void bow_wi2pv_write_to_filename (bow_wi2pv *wi2pv, const char *filename);
 bow_wi2pv *bow_wi2pv_new_from_filename (const char *filename);
 void bow_wi2pv_print_stats (bow_wi2pv *wi2pv);
 
+/* Make everything written to the PV's of WI2PV readable by cursors.
+   Call this after writing, before several threads read WI2PV. */
+void bow_wi2pv_sync (bow_wi2pv *wi2pv);
+
+/* Rewrite the PV's of WI2PV into a new file named PV_FILENAME in
+   BOW_DATA_DIRNAME, each one in a single contiguous segment, and
+   switch WI2PV over to the new file. */
+void bow_wi2pv_compact (bow_wi2pv *wi2pv, const char *pv_filename);
+
 
 /* Fill in PV with the correct initial values, and write the first
    segment header to disk.  What this function does must match what
@@ -111,19 +178,44 @@ void bow_pv_init (bow_pv *pv, FILE *fp);
    equal to the last DI and PI written, respectively. */
 void bow_pv_add_di_pi (bow_pv *pv, int di, int pi, FILE *fp);
 
-/* Read the next "document index" DI and "position index" PI.  Does
-   not assume that FP is already seek'ed to the correct position.
-   Will jump to a new PV segment on disk if necessary. */
-void bow_pv_next_di_pi (bow_pv *pv, int *di, int *pi, FILE *fp);
-
-/* Undo the effect of the last call to bow_pv_next_di_pi().  That is,
-   make the next call to bow_pv_next_di_pi() return the same DI and PI
-   as the last call did.  This function may not be called multiple
-   times in a row without calling bow_pv_next_di_pi() in between. */
-void bow_pv_unnext (bow_pv *pv);
-
-/* Rewind the read position to the beginning of the PV */
-void bow_pv_rewind (bow_pv *pv, FILE *fp);
+/* Set up CURSOR for reading PV, whose segments are on disk in FP,
+   from its beginning.  PV may be NULL, for a word with no entries.
+   Nothing is read until the first call to bow_pv_cursor_next_di_pi(). */
+void bow_pv_cursor_init (bow_pv_cursor *cursor, bow_pv *pv, FILE *fp);
+
+/* Free the memory held by CURSOR, but not CURSOR itself. */
+void bow_pv_cursor_free (bow_pv_cursor *cursor);
+
+/* Read the next "document index" DI and "position index" PI at
+   CURSOR.  Will jump to a new PV segment on disk if necessary.  Both
+   are -1 at the end of the PV. */
+void bow_pv_cursor_next_di_pi (bow_pv_cursor *cursor, int *di, int *pi);
+
+/* Read up to N of the next "document index" and "position index"
+   pairs at CURSOR into the arrays DI and PI, and return how many were
+   read.  Fewer than N means the end of the PV was reached. */
+int bow_pv_cursor_next_di_pi_batch (bow_pv_cursor *cursor,
+				    int *di, int *pi, int n);
+
+/* Move CURSOR forward, so that the next call to
+   bow_pv_cursor_next_di_pi() returns the first entry of its PV with a
+   "document index" of DI or more, jumping by the PV's skip entries
+   where it can.  Does nothing if the next entry is already there. */
+void bow_pv_cursor_skip_to_di (bow_pv_cursor *cursor, int di);
+
+/* Write the skip entries of PV to FP, and read them back. */
+void bow_pv_write_skips (bow_pv *pv, FILE *fp);
+void bow_pv_read_skips (bow_pv *pv, FILE *fp);
+
+/* Write the document counts of PV to FP, and read them back. */
+void bow_pv_write_document_counts (bow_pv *pv, FILE *fp);
+void bow_pv_read_document_counts (bow_pv *pv, FILE *fp);
+
+/* Undo the effect of the last call to bow_pv_cursor_next_di_pi().
+   That is, make the next call return the same DI and PI as the last
+   call did.  This function may not be called multiple times in a row
+   without calling bow_pv_cursor_next_di_pi() in between. */
+void bow_pv_cursor_unnext (bow_pv_cursor *cursor);
 
 /* Write the in-memory portion of PV to FP */
 void bow_pv_write (bow_pv *pv, FILE *fp, FILE *pvfp);
@@ -136,11 +228,25 @@ void bow_pv_read (bow_pv *pv, FILE *fp);
    positions otherwise. */
 void bow_wi2pv_reopen_pv (bow_wi2pv *wi2pv);
 
-/* Write the PV to disk */
+/* Write the PV to disk, at the end of FP, where FP must be. */
 void bow_pv_flush (bow_pv *pv, FILE *fp);
 
-extern int bow_pvm_total_bytes;
+/* Copy the segments of PV on FP into a single segment at the end of
+   NEW_FP, which must be positioned there, and make PV refer to that
+   one. */
+void bow_pv_compact (bow_pv *pv, FILE *fp, FILE *new_fp);
+
+/* The size of the blocks on which bow_pv_compact() lays out PV's. */
+extern int bow_pv_block_size;
+
+/* The largest number of bytes that bow_pv_cursor_next_di_pi() reads
+   from disk at once into the buffer of a cursor. */
+extern int bow_pv_read_block_size;
+
+/* The least number of entries between the skip entries of a PV. */
+extern int bow_pv_skip_interval;
 
+/* The initial PVM_MAX_TOTAL_BYTES of a new bow_wi2pv. */
 extern int bow_pvm_max_total_bytes;
 
 #endif /* __archer_h_INCLUDE */
@@ -448,6 +448,7 @@ typedef struct _bow_int4str {
   int str_array_size;
   int *str_hash;
   int str_hash_size;
+  int str_hash_renamed;		/* entries of STR_HASH for renamed strings */
 } bow_int4str;
 
 /* Allocate, initialize and return a new int/string mapping structure.
@@ -472,6 +473,10 @@ int _bow_str2int (bow_int4str *map, const char *string, unsigned id);
    is not yet in the mapping, return -1. */
 int bow_str2int_no_add (bow_int4str *map, const char *string);
 
+/* Make STRING, which must not be in MAP already, the string at INDEX
+   of MAP in place of the one there. */
+void bow_int4str_rename (bow_int4str *map, int index, const char *string);
+
 /* Create a new int-str mapping by lexing words from FILE. */
 bow_int4str *bow_int4str_new_from_text_file (const char *filename);
 
@@ -537,6 +542,11 @@ const char *bow_sarray_keystr_at_index (bow_sarray *sa, int index);
 /* Return the index of the entry associated with the string KEYSTR. */
 int bow_sarray_index_at_keystr (bow_sarray *sa, const char *keystr);
 
+/* Associate the entry at index INDEX with the string KEYSTR, which
+   must not be in use already, instead of its old one. */
+void bow_sarray_set_keystr_at_index (bow_sarray *sa, int index,
+				     const char *keystr);
+
 /* Write the sarray SARRAY to the file-pointer FP, using the function
    WRITE_FUNC to write each of the entries in SARRAY. */
 void bow_sarray_write (bow_sarray *sarray, int (*write_func)(void*,FILE*), 
@@ -856,6 +866,90 @@ bow_wv *bow_wv_new_from_data_fp (FILE *fp);
 /* Free the memory held by the "word vector" WV. */
 void bow_wv_free (bow_wv *wv);
 
+
+/* Running a loop over several threads. */
+
+/* Return the number of threads that bow_parallel_for() will use for a
+   range of N elements. */
+int bow_num_threads_for (int n);
+
+/* Split the range [0,N) into contiguous pieces, one per thread, and
+   call FN (LO, HI, THREAD, CTX) on each piece [LO,HI) in its own
+   thread, returning when they have all finished.  Returns the number
+   of threads used; THREAD runs from 0 to one less than that. */
+int bow_parallel_for (int n,
+		      void (*fn) (int lo, int hi, int thread, void *ctx),
+		      void *ctx);
+
+/* The number of scratch buffers each thread has, and their alignment. */
+#define BOW_THREAD_BUFFERS 4
+#define BOW_CACHE_LINE_SIZE 64
+
+/* Return a buffer of at least SIZE bytes, aligned to a cache line,
+   that belongs to the calling thread and is reused by its later calls
+   with the same WHICH, from 0 to BOW_THREAD_BUFFERS-1.  Its contents
+   are not kept when it grows. */
+void *bow_thread_buffer (int which, size_t size);
+
+/* Like bow_thread_buffer(), but all zeros when first returned and
+   whenever it grows; the caller must zero whatever it changed before
+   its next call with the same WHICH. */
+void *bow_thread_cleared_buffer (int which, size_t size);
+
+
+/* Dot products between sparse "word vectors". */
+
+/* Return the sum over all words of the product of the WEIGHT fields
+   of WV1 and WV2.  When one vector is much shorter than the other,
+   the longer one is searched by galloping instead of being merged. */
+double bow_wv_dot (bow_wv *wv1, bow_wv *wv2);
+
+/* Return the sum, over the words that appear in both WV1 and WV2, of
+   the squared difference of their WEIGHT fields. */
+double bow_wv_dist2_common (bow_wv *wv1, bow_wv *wv2);
+
+/* A "word vector" scattered into a dense array indexed by WI, so
+   that it can be multiplied against many other "word vectors" at a
+   cost proportional only to the length of the other vector. */
+typedef struct _bow_wvd {
+  int size;			/* the number of entries allocated */
+  float *weight;		/* WEIGHT of word WI, or 0 */
+  unsigned char *present;	/* non-zero if word WI is in the vector */
+  int *wis;			/* the WI's currently scattered */
+  int num_wis;			/* the number of WI's in WIS */
+  int wis_size;			/* the number of entries allocated in WIS */
+} bow_wvd;
+
+/* Create a new, empty dense vector with room for SIZE words; it grows
+   as needed. */
+bow_wvd *bow_wvd_new (int size);
+
+/* Clear D, then scatter the WEIGHT fields of WV into it.  Clearing
+   only touches the words that were previously scattered. */
+void bow_wvd_scatter (bow_wvd *d, bow_wv *wv);
+
+/* Return the weight of word WI in D, or 0 if it is not there. */
+#define bow_wvd_weight(D, WI) \
+  ((WI) < (D)->size ? (D)->weight[(WI)] : 0.0f)
+
+/* Return the dot product of WV and the vector scattered into D.  With
+   AVX2 the products are added in another order than bow_wv_dot()
+   adds them, so the two may differ in their last bits. */
+double bow_wvd_dot (bow_wvd *d, bow_wv *wv);
+
+/* Return the same value as bow_wv_dist2_common() of WV and the vector
+   scattered into D. */
+double bow_wvd_dist2_common (bow_wvd *d, bow_wv *wv);
+
+/* Free the memory held by the dense vector D. */
+void bow_wvd_free (bow_wvd *d);
+
+/* Return a dense vector that belongs to the calling thread and is
+   reused by its later calls with the same WHICH, from 0 to
+   BOW_THREAD_BUFFERS-1, made with room for SIZE words the first time.
+   Freed when the thread exits. */
+bow_wvd *bow_thread_wvd (int which, int size);
+
 /* Collections of "word vectors. */
 
 /* An array that maps "document indices" to "word vectors" */
@@ -1076,6 +1170,9 @@ typedef struct _bow_dv {
 /* Create a new, empty "document vector". */
 bow_dv *bow_dv_new (int capacity);
 
+/* The number of "document vectors" currently in existence. */
+extern unsigned int bow_dv_count;
+
 /* The default capacity used when 0 is passed for CAPACITY above. */
 extern unsigned int bow_dv_default_capacity; 
 
@@ -1089,6 +1186,10 @@ void bow_dv_set_di_count_weight (bow_dv **dv, int di, int count, float weight);
    creating a new entry in the document vector if necessary. */
 void bow_dv_add_di_weight (bow_dv **dv, int di, float weight);
 
+/* Return the index of the first entry of DV whose document index is
+   DI or more, or DV->LENGTH if there is none. */
+int bow_dv_index_at_di (bow_dv *dv, int di);
+
 /* Return a pointer to the BOW_DE for a particular document, or return
    NULL if there is no entry for that document. */
 bow_de *bow_dv_entry_at_di (bow_dv *dv, int di);
@@ -1179,6 +1280,44 @@ void bow_wi2dvf_add_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
 void bow_wi2dvf_set_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
 					int di, int count, float weight);
 
+/* A dense row of per-"document" sums for one word, from which the
+   word's "document vector" is made in one step. */
+typedef struct _bow_dv_row {
+  int num_dis;			/* the number of entries allocated */
+  int length;			/* the number of entries added to */
+  int *count;
+  float *weight;
+  char *present;
+  float idf;			/* the IDF to give the "document vector" */
+} bow_dv_row;
+
+/* Create a dense row of NUM_DIS per-"document" sums. */
+bow_dv_row *bow_dv_row_new (int num_dis);
+
+/* Increase by COUNT and WEIGHT the entry of ROW for "document index"
+   DI, the way bow_dv_add_di_count_weight() would. */
+void bow_dv_row_add (bow_dv_row *row, int di, int count, float weight);
+
+/* Free the memory held by ROW. */
+void bow_dv_row_free (bow_dv_row *row);
+
+/* Make the "document vectors" of the words 0 through MAX_WI-1 in the
+   map WI2DVF, which must not have any for them yet.  For each word
+   WI, FILL (WI, ROW, CTX) adds the word's entries to ROW, a cleared
+   row of NUM_DIS sums, and the entries of ROW become WI's "document
+   vector".  The words are split among bow_num_threads threads, so
+   FILL should only read shared data, and any "document vectors" it
+   reads from a file-backed WI2DVF should have been read in already
+   with bow_wi2dvf_read_in(). */
+void bow_wi2dvf_fill_by_rows (bow_wi2dvf **wi2dvf, int max_wi, int num_dis,
+			      void (*fill) (int wi, bow_dv_row *row,
+					    void *ctx),
+			      void *ctx);
+
+/* Read in the "document vectors" of the words 0 through MAX_WI-1 that
+   haven't been read out of the file backing WI2DVF yet. */
+void bow_wi2dvf_read_in (bow_wi2dvf *wi2dvf, int max_wi);
+
 /* Remove the word with index WI from the vocabulary of the map WI2DVF */
 void bow_wi2dvf_remove_wi (bow_wi2dvf *wi2dvf, int wi);
 
@@ -1263,6 +1402,8 @@ typedef struct _bow_barrel {
   bow_wi2dvf *wi2dvf;		/* The matrix of words vs documents */
   bow_int4str *classnames;	/* A map between classnames and indices */
   int is_vpc;			/* non-zero if each `document' is a `class' */
+  struct _bow_fstats *fstats;	/* Cached counts for feature selection */
+  struct _bow_naivebayes_loo *nb_loo; /* Cached for leave-one-out scoring */
 } bow_barrel;
 
 /* An array of these is filled in by the method's scoring function. */
@@ -1316,6 +1457,25 @@ if ((*(BARREL)->method->normalize_weights))		\
 #define bow_barrel_score(BARREL, QUERY_WV, SCORES, NUM_SCORES, LOO_CLASS) \
 ((*(BARREL)->method->score)(BARREL, QUERY_WV, SCORES, NUM_SCORES, LOO_CLASS))
 
+/* Put into BSCORES, highest first, the BSCORES_LEN highest of the
+   NUM_SCORES entries of SCORES, which is indexed by class, and return
+   how many were put there.  Ties go to the lower class index.  Keeps
+   the best ones in a bounded heap, so asking for a few of many classes
+   costs little more than looking at each once. */
+int bow_scores_select_top (const double *scores, int num_scores,
+			   bow_score *bscores, int bscores_len);
+
+/* Offer SCORE to the heap of the LENGTH best scores so far in
+   BSCORES, which has room for BSCORES_LEN and keeps its worst score
+   on top, and return the heap's new length.  Ties go to the lower
+   document index, whatever the order the scores are offered in. */
+int bow_scores_offer (bow_score *bscores, int length, int bscores_len,
+		      const bow_score *score);
+
+/* Turn the heap of LENGTH scores in BSCORES, built by
+   bow_scores_offer(), into a list sorted highest first. */
+void bow_scores_sort (bow_score *bscores, int length);
+
 #define bow_wv_set_weights(WV,BARREL)		\
 if ((*(BARREL)->method->wv_set_weights))	\
   ((*(BARREL)->method->wv_set_weights)(WV, BARREL))
@@ -1425,6 +1585,39 @@ bow_barrel_new_vpc_weight_then_merge (bow_barrel *doc_barrel);
 void bow_barrel_set_vpc_priors_by_counting (bow_barrel *vpc_barrel,
 					    bow_barrel *doc_barrel);
 
+/* The counts of each word in each class of each of the folds that the
+   documents of a barrel are split into for cross-validation, from
+   which the class barrel of any fold's complement can be made without
+   looking at the documents again. */
+typedef struct _bow_vpc_folds {
+  bow_barrel *doc_barrel;
+  int num_folds;
+  int num_classes;
+  int *fold_of_di;		/* each document's fold, or -1 for none */
+  bow_wi2dvf *wi2dvf;		/* a word's sums at FOLD*NUM_CLASSES+CLASS */
+} bow_vpc_folds;
+
+/* Return non-zero if the class barrel that the method of DOC_BARREL
+   makes depends only on the sums, over the training documents of each
+   class, of their counts of each word, so that it can be made with
+   bow_barrel_new_vpc_for_fold(). */
+int bow_barrel_vpc_is_sum_of_counts (bow_barrel *doc_barrel);
+
+/* Split the documents of DOC_BARREL into NUM_FOLDS folds, document DI
+   going into fold FOLD_OF_DI[DI], or into none if that is negative,
+   and sum the counts of each word in each class of each fold. */
+bow_vpc_folds *bow_vpc_folds_new (bow_barrel *doc_barrel, int num_folds,
+				  const int *fold_of_di);
+
+/* Free the memory held by FOLDS. */
+void bow_vpc_folds_free (bow_vpc_folds *folds);
+
+/* Return the same class barrel as bow_barrel_new_vpc_merge_then_weight()
+   would when the training documents are those of every fold but
+   HELD_OUT, made from the sums in FOLDS.  The document types must
+   already be set that way. */
+bow_barrel *bow_barrel_new_vpc_for_fold (bow_vpc_folds *folds, int held_out);
+
 /* Like bow_barrel_new_vpc, but uses both labeled and unlabeled data.
    It uses the class_probs of each doc to determine its class
    membership. The counts in the wi2dvf are set to bogus numbers.  The
@@ -1931,6 +2124,61 @@ bow_dv_heap *bow_make_dv_heap_from_wi2dvf_hidden (bow_wi2dvf *wi2dvf,
    with each word in the word vector. */
 bow_dv_heap *bow_make_dv_heap_from_wv (bow_wi2dvf *wi2dvf, bow_wv *wv);
 
+
+/* Retrieving the K documents with the highest dot product with a query */
+
+/* For each word, an upper bound on the absolute weight of the entries
+   of its "document vector", for skipping documents that can't score
+   high enough. */
+typedef struct _bow_topk_bounds {
+  bow_wi2dvf *wi2dvf;		/* The map the bounds are for */
+  int use_normalizer;		/* Non-zero to include each cdoc's NORMALIZER */
+  int size;
+  float *bound;			/* Indexed by WI; -1 until it's needed */
+} bow_topk_bounds;
+
+/* A query word, and its cursor in the "document vector" being merged
+   by bow_topk_search(). */
+typedef struct _bow_topk_term {
+  int wi;
+  float weight;			/* The query's weight for the word */
+  bow_dv *dv;
+  int dvi;			/* The entry of DV at the cursor */
+  int di;			/* ...and its document, or INT_MAX at the end */
+  double bound;			/* The most a document can get from the word */
+} bow_topk_term;
+
+/* Return the score of document DI, given the NUM_TERMS query words
+   whose cursors are at its entries, in order of word index. */
+typedef double (*bow_topk_scorer) (int di, bow_topk_term **terms,
+				   int num_terms, void *ctx);
+
+/* Flags for bow_topk_search(). */
+#define BOW_TOPK_TRAIN_ONLY 1	/* Only score bow_doc_train documents */
+#define BOW_TOPK_NONZERO 2	/* Leave out documents that score 0 */
+
+/* Create an empty set of bounds for the "document vectors" of
+   BARREL, each to be filled in the first time it is needed.  If
+   USE_NORMALIZER is non-zero, the weights are taken multiplied by
+   the NORMALIZER of their documents. */
+bow_topk_bounds *bow_topk_bounds_new (bow_barrel *barrel, int use_normalizer);
+
+/* Free the memory held by BOUNDS. */
+void bow_topk_bounds_free (bow_topk_bounds *bounds);
+
+/* Put into SCORES, highest first, the K documents of BARREL that
+   contain a word of QUERY_WV and that SCORER gives the highest
+   scores, and return how many were put there.  Ties go to the lower
+   document index.  If BOUNDS is non-NULL, SCORER's result must be no
+   more than SCALE times the sum of each term's absolute query weight
+   times its bound, and documents that can't beat the K best so far
+   are skipped over without being scored.  If NUM_HITS is non-NULL,
+   none are skipped, and it is set to the number scoring other than 0. */
+int bow_topk_search (bow_barrel *barrel, bow_topk_bounds *bounds,
+		     bow_wv *query_wv, double scale, int flags,
+		     bow_topk_scorer scorer, void *ctx,
+		     bow_score *scores, int k, int *num_hits);
+
 
 /* Classes for classification.  In some cases each document will
    be in its own class. */
@@ -2033,6 +2281,51 @@ int bow_model_next_wv(bow_dv_heap *heap, bow_barrel *barrel, bow_wv **wv);
 /* Return the entropy given counts for each type of element. */
 double bow_entropy (float *counts, int num_counts);
 
+/* How the documents containing each word of a barrel are spread among
+   its classes.  Feature selection scores are all computed from these
+   counts, which are gathered once and then kept up to date as the
+   class, prior or train/test tag of the documents change. */
+typedef struct _bow_fstats {
+  int num_classes;
+  int num_dis;
+  int max_wi;
+  bow_wi2dvf *wi2dvf;		/* The map the counts were gathered from */
+  int generation;		/* Incremented whenever a document changes */
+  /* For each document, a copy of the parts of its cdoc that the
+     counts depend on, and the GENERATION in which it last changed. */
+  int *di_class;
+  float *di_prior;
+  char *di_train;
+  int *di_generation;
+  /* For each word, the GENERATION in which its row of counts was
+     gathered (0 if never), the length of the "document vector" they
+     were gathered from, and whether that vector is currently
+     unhidden. */
+  int *wi_generation;
+  int *wi_dv_length;
+  char *wi_visible;
+  /* Rows of NUM_CLASSES counts for each word, at WI*NUM_CLASSES+CI:
+     the sum of the priors of the training documents containing the
+     word, the number of times it occurs in training documents, and
+     the number of documents of any type that contain it. */
+  float *train_prior;
+  float *train_count;
+  int *doc_count;
+  /* The same, totalled over all documents and visible words. */
+  float *class_train_prior;
+  float *class_train_count;
+  int *class_doc_count;
+} bow_fstats;
+
+/* Return BARREL's feature selection counts for NUM_CLASSES classes,
+   gathering them if this is the first call, or bringing up to date
+   the rows of the words whose documents have changed since the last
+   one.  The return value belongs to BARREL. */
+bow_fstats *bow_barrel_fstats (bow_barrel *barrel, int num_classes);
+
+/* Free the memory held by FS. */
+void bow_fstats_free (bow_fstats *fs);
+
 /* Return a malloc()'ed array containing an infomation-gain score for
    each word index; it is the caller's responsibility to free this
    array.  NUM_CLASSES should be the total number of classes in the
@@ -2041,6 +2334,24 @@ double bow_entropy (float *counts, int num_counts);
 float *bow_infogain_per_wi_new (bow_barrel *barrel, int num_classes, 
 				int *size);
 
+/* Return a malloc()'ed array containing the chi-squared statistic
+   between each word's occurrence in a document and that document's
+   class, maximized over classes.  The number of entries is put in
+   SIZE. */
+float *bow_chi2_per_wi_new (bow_barrel *barrel, int num_classes, int *size);
+
+/* Return a malloc()'ed array containing the log odds ratio of each
+   word's occurrence in a document of a class against its occurrence
+   in a document of any other class, maximized over classes.  The
+   number of entries is put in SIZE. */
+float *bow_oddsratio_per_wi_new (bow_barrel *barrel, int num_classes,
+				 int *size);
+
+/* Return a malloc()'ed array containing the score of each word index
+   by the measure selected with `--prune-vocab-score'. */
+float *bow_feature_score_per_wi_new (bow_barrel *barrel, int num_classes,
+				     int *size);
+
 /* Return a word array containing information gain scores, unsorted.
    Only includes words with non-zero infogain. */
 bow_wa *bow_infogain_wa (bow_barrel *barrel, int num_classes);
@@ -2143,6 +2454,17 @@ extern int bow_prune_vocab_by_infogain_n;
 /* N for removing words that occur less than N times */
 extern int bow_prune_vocab_by_occur_count_n;
 
+/* The measures by which words can be ranked for feature selection. */
+typedef enum {
+  bow_feature_score_infogain = 0,
+  bow_feature_score_chi2,
+  bow_feature_score_oddsratio
+} bow_feature_scores;
+
+/* The measure by which `--prune-vocab-by-infogain' ranks words.
+   Defaults to bow_feature_score_infogain. */
+extern bow_feature_scores bow_prune_vocab_score;
+
 /* The weight-setting and scoring method */
 extern bow_method *bow_argp_method;
 
@@ -2191,6 +2513,10 @@ extern int bow_xxx_words_only;
 /* Random seed to use for srand, if not equal to -1 */
 extern int bow_random_seed;
 
+/* Number of threads to use for the parts of training and scoring that
+   run in parallel; 0 means one per processor.  Defaults to 1. */
+extern int bow_num_threads;
+
 /* What "event-model" we will use for the probabilistic models. */
 typedef enum {
   bow_event_word = 0,		/* the multinomial model */
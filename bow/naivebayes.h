@@ -92,5 +92,39 @@ double bow_naivebayes_pr_wi_ci (bow_barrel *barrel,
 				float loo_wi_count, float loo_w_count,
 				bow_dv **last_dv, int *last_dvi);
 
+/* The class counts of a naivebayes class barrel, laid out densely so
+   that documents can be scored with leave-one-out evaluation without
+   searching the "document vectors".  Only the probabilities of the
+   class a document was removed from need to be worked out again. */
+typedef struct _bow_naivebayes_loo {
+  int num_classes;
+  int max_wi;
+  bow_wi2dvf *wi2dvf;		/* The map the counts were taken from */
+  int num_words;		/* Its NUM_WORDS when they were taken */
+  int *word_count;		/* The CDOC->WORD_COUNT of each class */
+  /* The smoothing the probabilities were worked out with */
+  int event_model;
+  int smoothing_method;
+  double m_est_m;
+  int smoothing_generation;	/* Of the Good-Turing and Dirichlet state */
+  float *normalizer;		/* The CDOC->NORMALIZER of each class */
+  /* At WI*NUM_CLASSES+CI, the weight of the entry for class CI in the
+     "document vector" of WI, and log P(w|c) with nothing removed. */
+  float *count;
+  double *log_pr;
+} bow_naivebayes_loo;
+
+/* Return the dense class counts of BARREL, taking them the first time
+   this is called, or again if the barrel has been rebuilt underneath
+   them.  The return value belongs to BARREL.  The first call mustn't
+   be made from several threads at once. */
+bow_naivebayes_loo *bow_barrel_naivebayes_loo (bow_barrel *barrel);
+
+/* Free the memory held by LOO. */
+void bow_naivebayes_loo_free (bow_naivebayes_loo *loo);
+
+/* Free BARREL, along with its dense class counts. */
+void bow_naivebayes_free_barrel (bow_barrel *barrel);
+
 
 #endif /* __BOW_NAIVEBAYES_H */
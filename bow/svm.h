@@ -140,6 +140,8 @@ extern int svm_remove_misclassified;
 extern int svm_weight_style;
 /* this is included here so that the kcache call count can be reset  */
 extern int svm_nkc_calls;
+/* # of kernel evaluations done on kernel cache misses */
+extern int svm_nkernel_evals;
 
 extern int svm_init_al_tset;
 extern int svm_al_qsize;
@@ -176,11 +178,19 @@ void kcache_clear();
 void kcache_age();
 double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2);
 double svm_kernel_cache_lookup(bow_wv *wv1, bow_wv *wv2);
+/* d holds the scattered weights of wv1; used to evaluate misses */
+double svm_kernel_cache_dense(bow_wv *wv1, bow_wvd *d, bow_wv *wv2);
+/* evaluate the kernel against a dense vector d scattered from dwv */
+double svm_kernel_dense(bow_wv *wv, bow_wvd *d, bow_wv *dwv);
 
 int build_svm_guts(bow_wv **docs, int *yvect, double *weights, double *b, 
 		   double **W, int ndocs, double *s, float *cvect, int *nsv);
 int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W, 
 	int ndocs, double *error, float *cvect, int *nsv);
+/* resume from the solution over docs [0,nold) after [nold,ndocs) were added */
+int smo_resume(bow_wv **docs, int *yvect, double *weights, double *a_b, 
+	       double **W, int nold, int ndocs, double *error, float *cvect, 
+	       int *nsv);
 
 
 inline int solve_svm(bow_wv **docs, int *yvect, double *weights, double *tb,
@@ -188,9 +198,14 @@ inline int solve_svm(bow_wv **docs, int *yvect, double *weights, double *tb,
 int svm_trans_or_chunk(bow_wv **docs, int *yvect, int *trans_yvect, 
 		       double *weights, double *tvals, double *ab, double **W,
 		       int ntrans, int ndocs, int *nsv);
+int svm_resume(bow_wv **docs, int *yvect, double *weights, double *tvals, 
+	       double *ab, double **W, int nold, int ndocs, int *nsv);
 
 
 inline double evaluate_model_hyperplane(double *W, double b, bow_wv *query_wv);
+void svm_evaluate_pool(bow_wv **docs, double *weights, int *yvect, double b,
+		       int nsv, double *W, bow_wv **pool, int npool, 
+		       double *scores);
 inline double evaluate_model_cache(bow_wv **docs, double *weights, int *yvect, double b, 
 				   bow_wv *query_wv, int nsv);
 inline double evaluate_model(bow_wv **docs, double *weights, int *yvect, double b, 
@@ -41,4 +41,9 @@ typedef struct _bow_tfidf_params {
    Set in bow_tfidf_score(). */
 extern int bow_tfidf_num_hit_documents;
 
+/* If non-zero, bow_tfidf_score() sets the NAME of each score to a
+   newly allocated string of the query words that appear in its
+   document; otherwise NAME is NULL.  Off by default. */
+extern int bow_tfidf_explain;
+
 #endif /* __BOW_TFIDF_H */
@@ -0,0 +1,281 @@
+/* Dot products between sparse "word vectors". */
+
+/* Copyright (C) 1997, 1998, 1999 Andrew McCallum
+
+   Written by:  Andrew Kachites McCallum <mccallum@cs.cmu.edu>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#if __AVX2__
+#include <immintrin.h>
+#endif
+
+/* When the longer vector has more than this many times as many
+   entries as the shorter one, look up the words of the shorter vector
+   by galloping through the longer one instead of merging the two. */
+#define BOW_WV_GALLOP_RATIO 16
+
+/* Return the smallest index I >= LO in the ENTRY array of length N
+   such that ENTRY[I].wi >= WI, or N if there is none.  Probes at
+   exponentially growing distances from LO, then binary searches. */
+static inline int
+bow_we_gallop (bow_we *entry, int lo, int n, int wi)
+{
+  int step = 1;
+  int hi;
+
+  if (lo >= n || entry[lo].wi >= wi)
+    return lo;
+  /* Invariant: ENTRY[LO].wi < WI */
+  while (lo + step < n && entry[lo + step].wi < wi)
+    {
+      lo += step;
+      step *= 2;
+    }
+  hi = (lo + step < n) ? lo + step : n;
+  /* Now ENTRY[LO].wi < WI and (HI == N or ENTRY[HI].wi >= WI) */
+  while (hi - lo > 1)
+    {
+      int mid = (lo + hi) / 2;
+      if (entry[mid].wi < wi)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  return hi;
+}
+
+/* Dot product of the short vector S and the long vector L by galloping. */
+static double
+bow_wv_dot_gallop (bow_wv *s, bow_wv *l)
+{
+  int i, j;
+  double sum = 0;
+
+  for (i = 0, j = 0; i < s->num_entries; i++)
+    {
+      j = bow_we_gallop (l->entry, j, l->num_entries, s->entry[i].wi);
+      if (j >= l->num_entries)
+	break;
+      if (l->entry[j].wi == s->entry[i].wi)
+	sum += s->entry[i].weight * l->entry[j].weight;
+    }
+  return sum;
+}
+
+/* Return the sum over all words of the product of the WEIGHT fields
+   of WV1 and WV2.  When one vector is much shorter than the other,
+   the longer one is searched by galloping instead of being merged. */
+double
+bow_wv_dot (bow_wv *wv1, bow_wv *wv2)
+{
+  bow_we *v1, *v2;
+  int i1, i2, n1, n2;
+  double sum = 0;
+
+  n1 = wv1->num_entries;
+  n2 = wv2->num_entries;
+  if (n1 * BOW_WV_GALLOP_RATIO < n2)
+    return bow_wv_dot_gallop (wv1, wv2);
+  if (n2 * BOW_WV_GALLOP_RATIO < n1)
+    return bow_wv_dot_gallop (wv2, wv1);
+
+  /* Merge, advancing the indices arithmetically rather than with
+     data-dependent branches. */
+  v1 = wv1->entry;
+  v2 = wv2->entry;
+  i1 = i2 = 0;
+  while (i1 < n1 && i2 < n2)
+    {
+      int a = v1[i1].wi, b = v2[i2].wi;
+      if (a == b)
+	sum += v1[i1].weight * v2[i2].weight;
+      i1 += (a <= b);
+      i2 += (b <= a);
+    }
+  return sum;
+}
+
+/* Return the sum, over the words that appear in both WV1 and WV2, of
+   the squared difference of their WEIGHT fields. */
+double
+bow_wv_dist2_common (bow_wv *wv1, bow_wv *wv2)
+{
+  bow_we *v1, *v2;
+  int i1, i2, n1, n2;
+  double sum = 0;
+  double tmp;
+
+  v1 = wv1->entry;
+  v2 = wv2->entry;
+  n1 = wv1->num_entries;
+  n2 = wv2->num_entries;
+  i1 = i2 = 0;
+  while (i1 < n1 && i2 < n2)
+    {
+      int a = v1[i1].wi, b = v2[i2].wi;
+      if (a == b)
+	{
+	  tmp = v1[i1].weight - v2[i2].weight;
+	  sum += tmp * tmp;
+	}
+      i1 += (a <= b);
+      i2 += (b <= a);
+    }
+  return sum;
+}
+
+/* Create a new, empty dense vector with room for SIZE words; it grows
+   as needed. */
+bow_wvd *
+bow_wvd_new (int size)
+{
+  bow_wvd *d;
+
+  if (size <= 0)
+    size = 1024;		/* default */
+  d = bow_malloc (sizeof (bow_wvd));
+  d->size = size;
+  d->weight = bow_malloc (size * sizeof (float));
+  d->present = bow_malloc (size);
+  memset (d->weight, 0, size * sizeof (float));
+  memset (d->present, 0, size);
+  d->wis_size = 64;
+  d->wis = bow_malloc (d->wis_size * sizeof (int));
+  d->num_wis = 0;
+  return d;
+}
+
+/* Clear D, then scatter the WEIGHT fields of WV into it.  Clearing
+   only touches the words that were previously scattered. */
+void
+bow_wvd_scatter (bow_wvd *d, bow_wv *wv)
+{
+  int i, wi;
+
+  for (i = 0; i < d->num_wis; i++)
+    {
+      d->weight[d->wis[i]] = 0;
+      d->present[d->wis[i]] = 0;
+    }
+  d->num_wis = 0;
+
+  /* The entries are sorted, so the last one has the largest WI. */
+  if (wv->num_entries > 0
+      && wv->entry[wv->num_entries-1].wi >= d->size)
+    {
+      int old_size = d->size;
+      while (d->size <= wv->entry[wv->num_entries-1].wi)
+	d->size *= 2;
+      d->weight = bow_realloc (d->weight, d->size * sizeof (float));
+      d->present = bow_realloc (d->present, d->size);
+      memset (d->weight + old_size, 0,
+	      (d->size - old_size) * sizeof (float));
+      memset (d->present + old_size, 0, d->size - old_size);
+    }
+  if (wv->num_entries > d->wis_size)
+    {
+      d->wis_size = wv->num_entries;
+      d->wis = bow_realloc (d->wis, d->wis_size * sizeof (int));
+    }
+
+  for (i = 0; i < wv->num_entries; i++)
+    {
+      wi = wv->entry[i].wi;
+      d->weight[wi] = wv->entry[i].weight;
+      d->present[wi] = 1;
+      d->wis[i] = wi;
+    }
+  d->num_wis = wv->num_entries;
+}
+
+/* Return the same value as bow_wv_dot() of WV and the vector
+   scattered into D. */
+double
+bow_wvd_dot (bow_wvd *d, bow_wv *wv)
+{
+  bow_we *v = wv->entry;
+  int n = wv->num_entries;
+  int i = 0;
+  double sum = 0;
+
+#if __AVX2__
+  /* Gather eight entries at a time.  A bow_we is three ints wide, so
+     the WI's and WEIGHT's are at a stride of three from each other. */
+  if (n >= 8)
+    {
+      const __m256i stride = _mm256_setr_epi32 (0, 3, 6, 9, 12, 15, 18, 21);
+      const __m256i size = _mm256_set1_epi32 (d->size);
+      __m256d acc_lo = _mm256_setzero_pd ();
+      __m256d acc_hi = _mm256_setzero_pd ();
+      double lanes[4];
+
+      for (; i + 8 <= n; i += 8)
+	{
+	  __m256i wis = _mm256_i32gather_epi32 ((const int *)(v + i),
+						stride, 4);
+	  __m256 w = _mm256_i32gather_ps ((const float *)(v + i) + 2,
+					  stride, 4);
+	  __m256 inside = _mm256_castsi256_ps (_mm256_cmpgt_epi32 (size, wis));
+	  __m256 dw = _mm256_mask_i32gather_ps (_mm256_setzero_ps (),
+						d->weight, wis, inside, 4);
+	  __m256 p = _mm256_mul_ps (w, dw);
+	  acc_lo = _mm256_add_pd (acc_lo,
+				  _mm256_cvtps_pd (_mm256_castps256_ps128 (p)));
+	  acc_hi = _mm256_add_pd (acc_hi,
+				  _mm256_cvtps_pd (_mm256_extractf128_ps (p, 1)));
+	}
+      _mm256_storeu_pd (lanes, _mm256_add_pd (acc_lo, acc_hi));
+      sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif /* __AVX2__ */
+
+  for (; i < n; i++)
+    sum += v[i].weight * bow_wvd_weight (d, v[i].wi);
+  return sum;
+}
+
+/* Return the same value as bow_wv_dist2_common() of WV and the vector
+   scattered into D. */
+double
+bow_wvd_dist2_common (bow_wvd *d, bow_wv *wv)
+{
+  int i, wi;
+  double sum = 0;
+  double tmp;
+
+  for (i = 0; i < wv->num_entries; i++)
+    {
+      wi = wv->entry[i].wi;
+      if (wi < d->size && d->present[wi])
+	{
+	  tmp = wv->entry[i].weight - d->weight[wi];
+	  sum += tmp * tmp;
+	}
+    }
+  return sum;
+}
+
+/* Free the memory held by the dense vector D. */
+void
+bow_wvd_free (bow_wvd *d)
+{
+  bow_free (d->weight);
+  bow_free (d->present);
+  bow_free (d->wis);
+  bow_free (d);
+}
@@ -188,18 +188,34 @@ bow_dv_set_di_count_weight (bow_dv **dv, int di, int count, float weight)
   (*dv)->entry[dv_index].weight = weight;
 }
 
+/* Return the index of the first entry of DV whose document index is
+   DI or more, or DV->LENGTH if there is none.  The entries are in
+   order of document index, so they are bisected. */
+int
+bow_dv_index_at_di (bow_dv *dv, int di)
+{
+  int lo = 0, hi = dv->length, mid;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (dv->entry[mid].di < di)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
 /* Return a pointer to the BOW_DE for a particular document, or return
    NULL if there is no entry for that document. */
 bow_de *
 bow_dv_entry_at_di (bow_dv *dv, int di)
 {
-  int dvi;
+  int dvi = bow_dv_index_at_di (dv, di);
 
-  for (dvi = 0; dvi < dv->length && dv->entry[dvi].di <= di; dvi++)
-    {
-      if (dv->entry[dvi].di == di)
-	return &(dv->entry[dvi]);
-    }
+  if (dvi < dv->length && dv->entry[dvi].di == di)
+    return &(dv->entry[dvi]);
   return NULL;
 }
 
@@ -576,6 +576,229 @@ bow_em_perturb_weights (bow_barrel *doc_barrel, bow_barrel *vpc_barrel)
   
 
 
+/* The documents that each E-step classifies, read out of the
+   document barrel once so that the E-step can be split among threads
+   without sharing a heap. */
+typedef struct _em_estep_docs {
+  int length;
+  int size;
+  int *dis;			/* their document indices */
+  bow_wv **wvs;			/* their word vectors, as the heap gave them */
+  int max_num_entries;
+} em_estep_docs;
+
+static em_estep_docs *
+em_estep_docs_new (bow_barrel *doc_barrel, int (*use_if_true)(bow_cdoc *))
+{
+  em_estep_docs *docs;
+  bow_dv_heap *heap;
+  bow_wv *query_wv;
+  int di;
+
+  docs = bow_malloc (sizeof (em_estep_docs));
+  docs->length = 0;
+  docs->size = 1024;
+  docs->dis = bow_malloc (docs->size * sizeof (int));
+  docs->wvs = bow_malloc (docs->size * sizeof (bow_wv*));
+  docs->max_num_entries = 0;
+
+  query_wv = NULL;
+  heap = bow_test_new_heap (doc_barrel);
+  while ((di = bow_heap_next_wv (heap, doc_barrel, &query_wv, use_if_true))
+	 != -1)
+    {
+      if (docs->length == docs->size)
+	{
+	  docs->size *= 2;
+	  docs->dis = bow_realloc (docs->dis, docs->size * sizeof (int));
+	  docs->wvs = bow_realloc (docs->wvs, docs->size * sizeof (bow_wv*));
+	}
+      docs->dis[docs->length] = di;
+      docs->wvs[docs->length] = bow_wv_copy (query_wv);
+      docs->wvs[docs->length]->normalizer = query_wv->normalizer;
+      if (query_wv->num_entries > docs->max_num_entries)
+	docs->max_num_entries = query_wv->num_entries;
+      docs->length++;
+    }
+  return docs;
+}
+
+static void
+em_estep_docs_free (em_estep_docs *docs)
+{
+  int i;
+
+  for (i = 0; i < docs->length; i++)
+    bow_wv_free (docs->wvs[i]);
+  bow_free (docs->wvs);
+  bow_free (docs->dis);
+  bow_free (docs);
+}
+
+/* What the threads of an E-step share. */
+typedef struct _em_estep_context {
+  em_estep_docs *docs;
+  bow_barrel *doc_barrel;
+  bow_barrel *vpc_barrel;
+  int max_new_ci;
+} em_estep_context;
+
+/* Classify the documents LO through HI-1 of the E-step with the
+   class barrel, and set their CLASS_PROBS.  The class barrel is only
+   read, and each document's CLASS_PROBS are written only by the thread
+   that classifies it, so several ranges may run at once. */
+static void
+em_estep_range (int begin, int end, int thread, void *arg)
+{
+  em_estep_context *c = arg;
+  int max_new_ci = c->max_new_ci;
+  bow_score *hits;
+  bow_wv *query_wv;
+  bow_cdoc *doc_cdoc;
+  int actual_num_hits;
+  int hi;				/* hit index */
+  int ci;
+  int i;
+
+  hits = alloca (sizeof (bow_score) * max_new_ci);
+  /* Setting the weights changes the word vector, so score a copy. */
+  query_wv = bow_wv_new (c->docs->max_num_entries);
+
+  for (i = begin; i < end; i++)
+    {
+      bow_wv *wv = c->docs->wvs[i];
+
+      query_wv->num_entries = wv->num_entries;
+      query_wv->normalizer = wv->normalizer;
+      memcpy (query_wv->entry, wv->entry, wv->num_entries * sizeof (bow_we));
+      doc_cdoc = bow_array_entry_at_index (c->doc_barrel->cdocs, 
+					   c->docs->dis[i]);
+      bow_wv_set_weights (query_wv, c->vpc_barrel);
+      bow_wv_normalize_weights (query_wv, c->vpc_barrel);
+      actual_num_hits = 
+	bow_barrel_score (c->vpc_barrel, 
+			  query_wv, hits,
+			  max_new_ci, (int) NULL);
+      assert (actual_num_hits == max_new_ci);
+
+      if (em_stat_method == simple)
+	{
+	  /* set the class probs to 1 for the maximally likely class */
+	  for (ci = 0; ci < max_new_ci; ci++)
+	    doc_cdoc->class_probs[ci] = 0.0;
+	  
+	  doc_cdoc->class_probs[hits[0].di] = unlabeled_normalizer;
+	}
+      else if (em_stat_method == nb_score)
+	{
+	  /* set the class probs to the naive bayes score */
+	  for (hi = 0; hi < actual_num_hits; hi++)
+	    doc_cdoc->class_probs[hits[hi].di] = unlabeled_normalizer *
+	      hits[hi].weight;
+	  
+	  /* this is a neg training doc.  Zero out the pos
+	     component. */		      
+	  if (bow_em_multi_hump_neg > 1 &&
+	      doc_cdoc->type == bow_doc_train)
+	    {
+	      double new_total = 0;
+
+	      doc_cdoc->class_probs[binary_pos_ci] = 0;
+	      for (ci = 0; ci < max_new_ci; ci++)
+		new_total += doc_cdoc->class_probs[ci];
+
+	      if (new_total != 0)
+		{
+		  for (ci = 0; ci < max_new_ci; ci++)
+		    doc_cdoc->class_probs[ci] = unlabeled_normalizer *
+		      doc_cdoc->class_probs[ci] / new_total;
+		}
+	      else
+		{
+		  /* blech.  we got hosed on roundoff. */
+		  for (ci = 0; ci < max_new_ci; ci++)
+		    doc_cdoc->class_probs[ci] = 
+		      (float) unlabeled_normalizer /
+		      ((float) max_new_ci - 1.0);
+		  doc_cdoc->class_probs[binary_pos_ci] = 0;
+		}
+	    }
+	}
+      else
+	bow_error ("No method for this type.");
+    }
+
+  bow_wv_free (query_wv);
+}
+
+/* Add into ROW, indexed by class, the weights of word WI in the
+   training and unlabeled documents of the document barrel ARG, spread
+   over the classes by each document's CLASS_PROBS.  This is the body
+   of the M-step for one word. */
+static void
+em_mstep_fill_wi (int wi, bow_dv_row *row, void *arg)
+{
+  bow_barrel *doc_barrel = arg;
+  int max_new_ci = row->num_dis;
+  bow_dv *dv;
+  bow_cdoc *cdoc;
+  int dvi, ci;
+
+  dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+  if (!dv)
+    return;
+
+#if 0
+  /* create the dv in the class barrel if there's an
+     entry in the doc barrel.  This ensures that
+     perplexity calculations happen correctly. */
+  vpc_barrel->wi2dvf->entry[wi].dv = bow_dv_new (0);
+  vpc_barrel->wi2dvf->entry[wi].seek_start = 2;
+  (vpc_barrel->wi2dvf->num_words)++;
+#endif
+
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, dv->entry[dvi].di);
+
+      if (cdoc->type == bow_doc_train ||
+	  cdoc->type == bow_doc_unlabeled)
+	{
+	  assert(cdoc->word_count > 0);
+	  for (ci=0; ci < max_new_ci; ci++)
+	    {
+	      /* it's important to do this even when class_prob is 0 to 
+		 ensure that perplexity calculations happen ok. */
+
+#if 0
+	      if (cdoc->class_probs[ci] > 0)
+#endif
+		{
+		  if (bow_event_model == bow_event_document_then_word)
+		    bow_dv_row_add 
+		      (row, ci, 
+		       1,  /* hopelessly dummy value */
+		       (cdoc->class_probs[ci] *
+			(float) dv->entry[dvi].count * 
+			(float) bow_event_document_then_word_document_length / 
+			(float) cdoc->word_count));
+		  else if (bow_event_model == bow_event_word)
+		    {
+		      float addition = cdoc->class_probs[ci] *
+			(float) dv->entry[dvi].count;
+		      bow_dv_row_add 
+			(row, ci, 
+			 1,  /* hopelessly dummy value */
+			 addition);
+		    }
+		  else
+		    bow_error("No implementation of this event model.");
+		}
+	    }
+	}
+    }
+}
+
 /* Create a class barrel with EM-style clustering on unlabeled
    docs */
 bow_barrel *
@@ -586,14 +809,10 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
   int max_wi;               /* max word index */
   int dvi;                  /* document vector index */
   int ci;                   /* class index */
-  bow_dv *dv;               /* document vector */
   int di;                   /* document index */
   int binary_neg_ci = -1;
   bow_dv_heap *test_heap=NULL;	/* we'll extract test WV's from here */
   bow_wv *query_wv;
-  bow_score *hits;
-  int actual_num_hits;
-  int hi;		     /* hit index */
   bow_cdoc *doc_cdoc;
   int num_tested;
   int em_runs = 0;
@@ -613,12 +832,12 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
   float total_weight;
   float labeled_weight_fraction;
   float new_labeled_fraction;
+  em_estep_docs *estep_docs = NULL;
+  em_estep_context estep;
 	  
 
 
   /* some sanity checks first */
-  assert(200 > bow_barrel_num_classes(doc_barrel));
-  assert(200 > bow_em_multi_hump_neg + 1);
   assert (!bow_em_multi_hump_neg || 
 	  (bow_em_binary_case && em_stat_method == nb_score));	  
   assert (!strcmp(doc_barrel->method->name, "em") ||
@@ -1056,70 +1275,9 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
       /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
 	 counts and weights for individual documents, grabbing only the
 	 training and unlabeled documents. */
-      for (wi = 0; wi < max_wi; wi++)
-	{
-	  dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
-	  if (!dv)
-	    continue;
-
-#if 0
-	  /* create the dv in the class barrel if there's an
-	     entry in the doc barrel.  This ensures that
-	     perplexity calculations happen correctly. */
-	  vpc_barrel->wi2dvf->entry[wi].dv = bow_dv_new (0);
-	  vpc_barrel->wi2dvf->entry[wi].seek_start = 2;
-	  (vpc_barrel->wi2dvf->num_words)++;
-#endif
-
-	  for (dvi = 0; dvi < dv->length; dvi++)
-	    {
-	      bow_cdoc *cdoc; 
-	      
-	      di = dv->entry[dvi].di;
-	      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-
-	      if (cdoc->type == bow_doc_train ||
-		  cdoc->type == bow_doc_unlabeled)
-		{
-		  assert(cdoc->word_count > 0);
-		  for (ci=0; ci < max_new_ci; ci++)
-		    {
-		      /* it's important to do this even when class_prob is 0 to 
-			 ensure that perplexity calculations happen ok. */
-
-#if 0
-		      if (cdoc->class_probs[ci] > 0)
-#endif
-			{
-			  if (bow_event_model == bow_event_document_then_word)
-			    bow_wi2dvf_add_wi_di_count_weight 
-			      (&(vpc_barrel->wi2dvf), 
-			       wi, ci, 
-			       1,  /* hopelessly dummy value */
-			       (cdoc->class_probs[ci] *
-				(float) dv->entry[dvi].count * 
-				(float) bow_event_document_then_word_document_length / 
-				(float) cdoc->word_count));
-			  else if (bow_event_model == bow_event_word)
-			    {
-			      float addition = cdoc->class_probs[ci] *
-				(float) dv->entry[dvi].count;
-			      bow_wi2dvf_add_wi_di_count_weight 
-				(&(vpc_barrel->wi2dvf), 
-				 wi, ci, 
-				 1,  /* hopelessly dummy value */
-				 addition);
-			    }
-			  else
-			    bow_error("No implementation of this event model.");
-			}
-		    }
-		}
-	    }
-
-	  if (wi % 100 == 0)
-	    bow_verbosify (bow_progress, "\b\b\b\b\b\b%6d", max_wi - wi);
-	}
+      bow_wi2dvf_read_in (doc_barrel->wi2dvf, max_wi);
+      bow_wi2dvf_fill_by_rows (&(vpc_barrel->wi2dvf), max_wi, max_new_ci,
+			       em_mstep_fill_wi, doc_barrel);
 
       bow_verbosify (bow_progress, "\n");
       
@@ -1237,80 +1395,21 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
 	  /* now classify the unknown documents */
 	  bow_verbosify(bow_progress, "\nClassifying unlabeled documents:       ");
 	  
-	  /* Initialize QUERY_WV so BOW_TEST_NEXT_WV() knows not to
-             try to free.  Create the heap from which we'll get
-             WV's. */
-	  query_wv = NULL;
-	  hits = alloca (sizeof (bow_score) * max_new_ci);
-	  num_tested = 0;
-	  test_heap = bow_test_new_heap (doc_barrel);
-	  
-	  /* Loop once for each unlabeled document. */
-	  while ((di = bow_heap_next_wv (test_heap, doc_barrel, &query_wv, 
-					 bow_cdoc_next_em_doc))
-		 != -1)
-	    {
-	      doc_cdoc = bow_array_entry_at_index (doc_barrel->cdocs, 
-						   di);
-	      bow_wv_set_weights (query_wv, vpc_barrel);
-	      bow_wv_normalize_weights (query_wv, vpc_barrel);
-	      actual_num_hits = 
-		bow_barrel_score (vpc_barrel, 
-				  query_wv, hits,
-				  max_new_ci, (int) NULL);
-	      assert (actual_num_hits == max_new_ci);
-
-	      if (em_stat_method == simple)
-		{
-		  /* set the class probs to 1 for the maximally likely class */
-		  for (ci = 0; ci < max_new_ci; ci++)
-		    doc_cdoc->class_probs[ci] = 0.0;
-		  
-		  doc_cdoc->class_probs[hits[0].di] = unlabeled_normalizer;
-		}
-	      else if (em_stat_method == nb_score)
-		{
-		  /* set the class probs to the naive bayes score */
-		  for (hi = 0; hi < actual_num_hits; hi++)
-		    doc_cdoc->class_probs[hits[hi].di] = unlabeled_normalizer *
-		      hits[hi].weight;
-		  
-		  /* this is a neg training doc.  Zero out the pos
-		     component. */		      
-		  if (bow_em_multi_hump_neg > 1 &&
-		      doc_cdoc->type == bow_doc_train)
-		    {
-		      double new_total = 0;
-
-		      doc_cdoc->class_probs[binary_pos_ci] = 0;
-		      for (ci = 0; ci < max_new_ci; ci++)
-			new_total += doc_cdoc->class_probs[ci];
-
-		      if (new_total != 0)
-			{
-			  for (ci = 0; ci < max_new_ci; ci++)
-			    doc_cdoc->class_probs[ci] = unlabeled_normalizer *
-			      doc_cdoc->class_probs[ci] / new_total;
-			}
-		      else
-			{
-			  /* blech.  we got hosed on roundoff. */
-			  for (ci = 0; ci < max_new_ci; ci++)
-			    doc_cdoc->class_probs[ci] = 
-			      (float) unlabeled_normalizer /
-			      ((float) max_new_ci - 1.0);
-			  doc_cdoc->class_probs[binary_pos_ci] = 0;
-			}
-		    }
-		}
-	      else
-		bow_error ("No method for this type.");
-	      
-	      if (num_tested % 100 == 0)
-		bow_verbosify (bow_progress, "\b\b\b\b\b\b%6d", num_tested);
-	      
-	      num_tested++;	  
-	    }
+	  /* Read the documents out of the heap the first time only;
+	     they are the same ones every round. */
+	  if (!estep_docs)
+	    estep_docs = em_estep_docs_new (doc_barrel, bow_cdoc_next_em_doc);
+	  estep.docs = estep_docs;
+	  estep.doc_barrel = doc_barrel;
+	  estep.vpc_barrel = vpc_barrel;
+	  estep.max_new_ci = max_new_ci;
+
+	  /* Printing word scores isn't something threads can share. */
+	  if (bow_print_word_scores)
+	    em_estep_range (0, estep_docs->length, 0, &estep);
+	  else
+	    bow_parallel_for (estep_docs->length, em_estep_range, &estep);
+	  num_tested = estep_docs->length;
 	  
 	  bow_verbosify(bow_progress, "\b\b\b\b\b\b%6d\n", num_tested);
 	}
@@ -1363,6 +1462,9 @@ bow_em_new_vpc_with_weights (bow_barrel *doc_barrel)
     }
 #endif
 
+  if (estep_docs)
+    em_estep_docs_free (estep_docs);
+
   bow_em_making_barrel = 0;  
   return vpc_barrel;
 }
@@ -2074,10 +2176,10 @@ bow_em_set_weights (bow_barrel *barrel)
   /* Gather the word count here instead of directly of in CDOC->WORD_COUNT
      so we avoid round-off error with each increment.  Remember,
      CDOC->WORD_COUNT is a int! */
-  float num_words_per_ci[200];
+  float *num_words_per_ci;
   int barrel_is_empty = 0;
 
-  assert (bow_barrel_num_classes (barrel) < 200);
+  num_words_per_ci = bow_malloc (barrel->cdocs->length * sizeof (float));
   /* We assume that we have already called BOW_BARREL_NEW_VPC() on
      BARREL, so BARREL already has one-document-per-class. */
 
@@ -2204,6 +2306,7 @@ bow_em_set_weights (bow_barrel *barrel)
   fprintf (stderr, "wi2dvf num_words %d, weight-setting num_words %d\n",
 	   barrel->wi2dvf->num_words, weight_setting_num_words);
 #endif
+  bow_free (num_words_per_ci);
 }
 
 
@@ -2229,7 +2332,7 @@ bow_em_score (bow_barrel *barrel, bow_wv *query_wv,
   float *loo_class_probs = (float *) loo_class_probs_as_int;
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (barrel->cdocs->length * sizeof (double));
+  scores = bow_thread_buffer (0, barrel->cdocs->length * sizeof (double));
   max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
 
   /* Instead of multiplying probabilities, we will sum up
@@ -2478,28 +2581,8 @@ bow_em_score (bow_barrel *barrel, bow_wv *query_wv,
   /* Return the SCORES by putting them (and the `class indices') into
      SCORES in sorted order. */
   {
-    num_scores = 0;
-    for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES, or
-	       (2) SCORES[CI] is larger than the smallest score there
-	       currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    bscores[dsi].di = ci;
-	  }
-      }
+    num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+					 bscores, bscores_len);
   }
 
   return num_scores;
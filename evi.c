@@ -126,10 +126,10 @@ bow_evi_score (bow_barrel *barrel, bow_wv *query_wv,
   int total_num_occur;
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (barrel->cdocs->length * sizeof (double));
-  pr_c_w = alloca (barrel->cdocs->length * sizeof (double));
-  pr_c = alloca (barrel->cdocs->length * sizeof (double));
-  occur_per_ci = alloca (barrel->cdocs->length * sizeof (int));
+  scores = bow_thread_buffer (0, barrel->cdocs->length * sizeof (double));
+  pr_c_w = bow_thread_buffer (1, barrel->cdocs->length * sizeof (double));
+  pr_c = bow_thread_buffer (2, barrel->cdocs->length * sizeof (double));
+  occur_per_ci = bow_thread_buffer (3, barrel->cdocs->length * sizeof (int));
 
   /* SCORES will start as the log() of an odds ratio, then get
      converted to a probability at the end. */
@@ -225,28 +225,8 @@ bow_evi_score (bow_barrel *barrel, bow_wv *query_wv,
   /* Return the SCORES by putting them (and the `class indices') into
      SCORES in sorted order. */
   {
-    num_scores = 0;
-    for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES, or
-	       (2) SCORES[CI] is larger than the smallest score there
-	       currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    bscores[dsi].di = ci;
-	  }
-      }
+    num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+					 bscores, bscores_len);
   }
 
   return num_scores;
@@ -23,6 +23,7 @@
 
 #include <bow/libbow.h>
 #include <math.h>
+#include <float.h>
 
 #if !HAVE_LOG2F
 #define log2f log
@@ -59,255 +60,441 @@ bow_entropy (float *counts, int num_counts)
   return entropy;
 }
 
-/* Return a malloc()'ed array containing an infomation-gain score for
-   each word index. */
-float *
-bow_infogain_per_wi_new_document_event (bow_barrel *barrel, int num_classes, 
-					int *size)
+/* Gathering the class counts of words. */
+
+/* Gather the rows of counts of the words LO through HI-1 that are
+   visible and whose rows are out of date. */
+static void
+bow_fstats_count_range (int lo, int hi, int thread, void *arg)
 {
-  float grand_totals[num_classes];  /* Totals for each class. */
-  float with_word[num_classes];	    /* Totals for the set of model docs
-				       with this word. */
-  float without_word[num_classes];  /* Totals for the set of model docs
-				       without this word. */
-  int max_wi;			    /* the highest "word index" in WI2DVF. */
-  bow_cdoc *doc;                    /* The working cdoc. */
-  double total_entropy;             /* The entropy of the total collection. */
-  double with_word_entropy;         /* The entropy of the set of docs with
-				       the word in question. */
-  double without_word_entropy;      /* The entropy of the set of docs without
-				       the word in question. */
-  float grand_total = 0; 
-  float with_word_total = 0;
-  float without_word_total = 0;
-  int i, j, wi, di;
+  bow_fstats *fs = arg;
+  int nc = fs->num_classes;
+  float *prior_row, *count_row;
+  int *doc_row;
+  int wi, dvi, di, ci;
   bow_dv *dv;
-  float *ret;
-
-  bow_verbosify (bow_progress, 
-		 "Calculating info gain... words ::          ");
 
-  max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
-  *size = max_wi;
-  ret = bow_malloc (max_wi * sizeof (float));
-
-  /* First set all the arrays to zero */
-  for(i = 0; i < num_classes; i++) 
+  for (wi = lo; wi < hi; wi++)
     {
-      grand_totals[i] = 0;
-      with_word[i] = 0;
-      without_word[i] = 0;
-    }
+      dv = bow_wi2dvf_dv (fs->wi2dvf, wi);
+      fs->wi_visible[wi] = (dv != NULL);
+      if (dv == NULL)
+	continue;
 
-  /* Now set up the grand totals. */
-  for (i = 0; i < barrel->cdocs->length ; i++)
-    {
-      doc = bow_cdocs_di2doc (barrel->cdocs, i);
-      if (doc->type == bow_doc_train) 
+      /* Keep the row if it was gathered from this same "document
+	 vector", and none of its documents have changed since. */
+      if (fs->wi_generation[wi] && fs->wi_dv_length[wi] == dv->length)
 	{
-	  grand_totals[doc->class] += doc->prior;
-	  grand_total += doc->prior;
+	  for (dvi = 0; dvi < dv->length; dvi++)
+	    if (fs->di_generation[dv->entry[dvi].di] > fs->wi_generation[wi])
+	      break;
+	  if (dvi == dv->length)
+	    continue;
 	}
-    }
-
-  /* Calculate the total entropy */
-  total_entropy = bow_entropy (grand_totals, num_classes);
 
-  /* Now loop over all words. */
-  for (wi = 0; wi < max_wi; wi++) 
-    {
-      /* Get this document vector */
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-      if (dv == NULL)
+      prior_row = fs->train_prior + (size_t)wi * nc;
+      count_row = fs->train_count + (size_t)wi * nc;
+      doc_row = fs->doc_count + (size_t)wi * nc;
+      for (ci = 0; ci < nc; ci++)
 	{
-	  ret[wi] = 0;
-	  continue;
+	  prior_row[ci] = 0;
+	  count_row[ci] = 0;
+	  doc_row[ci] = 0;
 	}
-
-      with_word_total = 0;
-
-      /* Create totals for this dv. */
-      for (j = 0; j < dv->length; j++)
+      for (dvi = 0; dvi < dv->length; dvi++)
 	{
-	  di = dv->entry[j].di;
-	  doc = bow_cdocs_di2doc (barrel->cdocs, di);
-	  if (doc->type == bow_doc_train)
+	  di = dv->entry[dvi].di;
+	  ci = fs->di_class[di];
+	  if (ci < 0)
+	    continue;
+	  doc_row[ci]++;
+	  if (fs->di_train[di])
 	    {
-	      with_word[doc->class] += doc->prior;
-	      with_word_total += doc->prior;
+	      prior_row[ci] += fs->di_prior[di];
+	      count_row[ci] += dv->entry[dvi].count;
 	    }
 	}
-
-      /* Create without word totals. */
-      for (j = 0; j < num_classes; j++)
-	{
-	  without_word[j] = grand_totals[j] - with_word[j];
-	}
-      without_word_total = grand_total - with_word_total;
-
-      /* Calculate entropies */
-      with_word_entropy = bow_entropy(with_word, num_classes);
-      without_word_entropy = bow_entropy(without_word, num_classes);
-
-      /* Calculate and store the information gain. */
-      ret[wi] = (total_entropy 
-		 - ((((double)with_word_total / (double)grand_total) 
-		     * with_word_entropy)
-		    + (((double)without_word_total / (double)grand_total) 
-		       * without_word_entropy)));
-      /* Not comparing with 0 here because of round-off error. */
-      assert (ret[wi] >= -1e-7);
-
-      if (ret[wi] < 0)
-	ret[wi] = 0;
-
-      /* Reset arrays to zero */
-      for(i = 0; i < num_classes; i++) 
-	{
-	  with_word[i] = 0;
-	  without_word[i] = 0;
-	}
-      if (wi % 100 == 0)
-	bow_verbosify (bow_progress,
-		       "\b\b\b\b\b\b\b\b\b%9d", max_wi - wi);
+      fs->wi_generation[wi] = fs->generation;
+      fs->wi_dv_length[wi] = dv->length;
     }
-  bow_verbosify (bow_progress, "\n");
-  return ret;
 }
 
-/* Return a malloc()'ed array containing an infomation-gain score for
-   each word index. */
-float *
-bow_infogain_per_wi_new_word_event (bow_barrel *barrel, int num_classes, 
-				    int *size)
+static bow_fstats *
+bow_fstats_new (bow_barrel *barrel, int num_classes, int max_wi)
 {
-  float grand_totals[num_classes];  /* Totals for each class. */
-  float with_word[num_classes];	    /* Totals for the set of model docs
-				       with this word. */
-  float without_word[num_classes];  /* Totals for the set of model docs
-				       without this word. */
-  int max_wi;			    /* the highest "word index" in WI2DVF. */
-  bow_cdoc *doc;                    /* The working cdoc. */
-  double total_entropy;             /* The entropy of the total collection. */
-  double with_word_entropy;         /* The entropy of the set of docs with
-				       the word in question. */
-  double without_word_entropy;      /* The entropy of the set of docs without
-				       the word in question. */
-  float grand_total; 
-  float with_word_total = 0;
-  float without_word_total = 0;
-  int i, j, wi, di;
-  bow_dv *dv;
-  float *ret;
-
-  bow_verbosify (bow_progress, 
-		 "Calculating info gain... words ::          ");
+  bow_fstats *fs;
+  int num_dis = barrel->cdocs->length;
+  size_t num_counts = (size_t)max_wi * num_classes;
+
+  fs = bow_malloc (sizeof (bow_fstats));
+  fs->num_classes = num_classes;
+  fs->num_dis = num_dis;
+  fs->max_wi = max_wi;
+  fs->wi2dvf = barrel->wi2dvf;
+  fs->generation = 0;
+  fs->di_class = bow_malloc (num_dis * sizeof (int));
+  fs->di_prior = bow_malloc (num_dis * sizeof (float));
+  fs->di_train = bow_malloc (num_dis);
+  fs->di_generation = bow_malloc (num_dis * sizeof (int));
+  memset (fs->di_generation, 0, num_dis * sizeof (int));
+  fs->wi_generation = bow_malloc (max_wi * sizeof (int));
+  memset (fs->wi_generation, 0, max_wi * sizeof (int));
+  fs->wi_dv_length = bow_malloc (max_wi * sizeof (int));
+  fs->wi_visible = bow_malloc (max_wi);
+  fs->train_prior = bow_malloc (num_counts * sizeof (float));
+  fs->train_count = bow_malloc (num_counts * sizeof (float));
+  fs->doc_count = bow_malloc (num_counts * sizeof (int));
+  fs->class_train_prior = bow_malloc (num_classes * sizeof (float));
+  fs->class_train_count = bow_malloc (num_classes * sizeof (float));
+  fs->class_doc_count = bow_malloc (num_classes * sizeof (int));
+  return fs;
+}
 
-  max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
-  *size = max_wi;
-  ret = bow_malloc (max_wi * sizeof (float));
+/* Free the memory held by FS. */
+void
+bow_fstats_free (bow_fstats *fs)
+{
+  bow_free (fs->di_class);
+  bow_free (fs->di_prior);
+  bow_free (fs->di_train);
+  bow_free (fs->di_generation);
+  bow_free (fs->wi_generation);
+  bow_free (fs->wi_dv_length);
+  bow_free (fs->wi_visible);
+  bow_free (fs->train_prior);
+  bow_free (fs->train_count);
+  bow_free (fs->doc_count);
+  bow_free (fs->class_train_prior);
+  bow_free (fs->class_train_count);
+  bow_free (fs->class_doc_count);
+  bow_free (fs);
+}
 
-  /* First set the arrays to zero */
-  for(i = 0; i < num_classes; i++) 
-    grand_totals[i] = 0;
-  grand_total = 0;
+/* Return BARREL's feature selection counts for NUM_CLASSES classes,
+   gathering them if this is the first call, or bringing up to date
+   the rows of the words whose documents have changed since the last
+   one.  The return value belongs to BARREL. */
+bow_fstats *
+bow_barrel_fstats (bow_barrel *barrel, int num_classes)
+{
+  bow_fstats *fs = barrel->fstats;
+  int max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
+  int changed = 0;
+  int di, wi, ci;
+  bow_cdoc *cdoc;
+  float *row;
+  double *class_train_count;
+
+  /* Start over if the barrel has been rebuilt underneath us. */
+  if (fs && (fs->num_classes != num_classes
+	     || fs->num_dis != barrel->cdocs->length
+	     || fs->max_wi != max_wi
+	     || fs->wi2dvf != barrel->wi2dvf))
+    {
+      bow_fstats_free (fs);
+      fs = NULL;
+    }
+  if (fs == NULL)
+    fs = barrel->fstats = bow_fstats_new (barrel, num_classes, max_wi);
 
-  /* Now set up the grand totals. */
-  for (wi = 0; wi < max_wi; wi++) 
+  /* Note which documents have changed since the counts were last
+     gathered, and total the document counts of each class. */
+  for (ci = 0; ci < num_classes; ci++)
     {
-      /* Get this document vector */
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-      if (dv == NULL)
-	continue;
-      for (j = 0; j < dv->length; j++)
+      fs->class_train_prior[ci] = 0;
+      fs->class_doc_count[ci] = 0;
+    }
+  for (di = 0; di < fs->num_dis; di++)
+    {
+      int class, train;
+
+      cdoc = bow_cdocs_di2doc (barrel->cdocs, di);
+      class = (cdoc->class >= 0 && cdoc->class < num_classes)
+	? cdoc->class : -1;
+      train = (cdoc->type == bow_doc_train);
+      if (fs->di_generation[di] == 0
+	  || fs->di_class[di] != class
+	  || fs->di_train[di] != train
+	  || fs->di_prior[di] != cdoc->prior)
 	{
-	  di = dv->entry[j].di;
-	  doc = bow_array_entry_at_index (barrel->cdocs, di);
-	  if (doc->type == bow_doc_train)
+	  if (!changed)
 	    {
-	      grand_totals[doc->class] += dv->entry[j].count;
-	      grand_total += dv->entry[j].count;
+	      fs->generation++;
+	      changed = 1;
 	    }
+	  fs->di_class[di] = class;
+	  fs->di_train[di] = train;
+	  fs->di_prior[di] = cdoc->prior;
+	  fs->di_generation[di] = fs->generation;
 	}
+      if (class < 0)
+	continue;
+      fs->class_doc_count[class]++;
+      if (train)
+	fs->class_train_prior[class] += cdoc->prior;
     }
 
-  /* Calculate the total entropy */
-  total_entropy = bow_entropy (grand_totals, num_classes);
+  /* Bring the rows of the visible words up to date.  The "document
+     vectors" must all be in memory before the threads look at them. */
+  bow_wi2dvf_read_in (fs->wi2dvf, max_wi);
+  bow_parallel_for (max_wi, bow_fstats_count_range, fs);
 
+  /* The occurrence totals depend on which words are visible. */
+  class_train_count = alloca (num_classes * sizeof (double));
+  for (ci = 0; ci < num_classes; ci++)
+    class_train_count[ci] = 0;
+  for (wi = 0; wi < max_wi; wi++)
+    {
+      if (!fs->wi_visible[wi])
+	continue;
+      row = fs->train_count + (size_t)wi * num_classes;
+      for (ci = 0; ci < num_classes; ci++)
+	class_train_count[ci] += row[ci];
+    }
+  for (ci = 0; ci < num_classes; ci++)
+    fs->class_train_count[ci] = class_train_count[ci];
+  return fs;
+}
+
+
+/* Computing scores from the class counts of words. */
 
-  /* Now calculate the information gain of each word. */
-  for (wi = 0; wi < max_wi; wi++) 
+/* bow_entropy() measures in bits if log2f() is available, and in
+   nats if not; the scores derived from it here must agree. */
+#if HAVE_LOG2F
+#define BOW_ENTROPY_UNIT M_LN2
+#else
+#define BOW_ENTROPY_UNIT 1.0
+#endif
+
+/* Return X ln X, or 0 when X is not positive. */
+static inline double
+bow_xlogx (double x)
+{
+  return (x > 0) ? x * log (x) : 0;
+}
+
+typedef struct _bow_fstats_scoring {
+  bow_fstats *fs;
+  float *counts;		/* The rows of counts to score by */
+  float *class_totals;		/* ...their per-class totals */
+  double *class_xlogx;		/* bow_xlogx() of each of CLASS_TOTALS */
+  double total;			/* The sum of CLASS_TOTALS */
+  float (*score) (struct _bow_fstats_scoring *s, float *row, double row_total);
+  float *ret;
+} bow_fstats_scoring;
+
+static void
+bow_fstats_score_range (int lo, int hi, int thread, void *arg)
+{
+  bow_fstats_scoring *s = arg;
+  int nc = s->fs->num_classes;
+  float *row;
+  double row_total;
+  int wi, ci;
+
+  for (wi = lo; wi < hi; wi++)
     {
-      /* Get this document vector */
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-      if (dv == NULL)
+      if (!s->fs->wi_visible[wi])
 	{
-	  ret[wi] = 0;
+	  s->ret[wi] = 0;
 	  continue;
 	}
+      row = s->counts + (size_t)wi * nc;
+      row_total = 0;
+      for (ci = 0; ci < nc; ci++)
+	row_total += row[ci];
+      s->ret[wi] = (*s->score) (s, row, row_total);
+    }
+}
 
-      /* Reset arrays to zero */
-      for(i = 0; i < num_classes; i++) 
-	{
-	  with_word[i] = 0;
-	  without_word[i] = 0;
-	}
-      with_word_total = 0;
-
-      /* Create totals for this dv. */
-      for (j = 0; j < dv->length; j++)
-	{
-	  di = dv->entry[j].di;
-	  doc = bow_cdocs_di2doc (barrel->cdocs, di);
-	  if (doc->type == bow_doc_train)
-	    {
-	      with_word[doc->class] += dv->entry[j].count;
-	      with_word_total += dv->entry[j].count;
-	    }
-	}
+/* Return a malloc()'ed array of the SCORE of each word by the rows
+   of COUNTS in FS, whose per-class totals are CLASS_TOTALS, putting
+   the number of entries in SIZE. */
+static float *
+bow_fstats_score (bow_fstats *fs, float *counts, float *class_totals,
+		  float (*score) (bow_fstats_scoring *s,
+				  float *row, double row_total),
+		  int *size)
+{
+  bow_fstats_scoring s;
+  int ci;
+
+  s.fs = fs;
+  s.counts = counts;
+  s.class_totals = class_totals;
+  s.class_xlogx = alloca (fs->num_classes * sizeof (double));
+  s.total = 0;
+  for (ci = 0; ci < fs->num_classes; ci++)
+    {
+      s.class_xlogx[ci] = bow_xlogx (class_totals[ci]);
+      s.total += class_totals[ci];
+    }
+  s.score = score;
+  s.ret = bow_malloc (fs->max_wi * sizeof (float));
+  bow_parallel_for (fs->max_wi, bow_fstats_score_range, &s);
+  *size = fs->max_wi;
+  return s.ret;
+}
 
-      /* Create without word totals. */
-      for (j = 0; j < num_classes; j++)
-	{
-	  without_word[j] = grand_totals[j] - with_word[j];
-	}
-      without_word_total = grand_total - with_word_total;
+/* The information gain of the word with counts ROW.  Writing the
+   entropy of counts C_I totalling T as (T ln T - SUM C_I ln C_I) / T,
+   the terms for the classes that don't contain the word cancel, so
+   only the non-zero entries of ROW need logarithms. */
+static float
+bow_fstats_infogain (bow_fstats_scoring *s, float *row, double row_total)
+{
+  double ig;
+  int ci;
+
+  if (s->total <= 0)
+    return 0;
+  ig = (bow_xlogx (s->total) - bow_xlogx (row_total)
+	- bow_xlogx (s->total - row_total));
+  for (ci = 0; ci < s->fs->num_classes; ci++)
+    if (row[ci] > 0)
+      ig += (bow_xlogx (row[ci])
+	     + bow_xlogx (s->class_totals[ci] - row[ci])
+	     - s->class_xlogx[ci]);
+  ig /= s->total * BOW_ENTROPY_UNIT;
+  /* Not comparing with 0 here because of round-off error. */
+  assert (ig >= -1e-7);
+  if (ig < 0)
+    ig = 0;
+  return ig;
+}
 
-      /* Calculate entropies */
-      with_word_entropy = bow_entropy(with_word, num_classes);
-      without_word_entropy = bow_entropy(without_word, num_classes);
+/* Fill in the two-by-two table of word presence against membership
+   in class CI: A is with both, B with the word only, C with the
+   class only, and D with neither. */
+#define BOW_FSTATS_TABLE(S,ROW,ROW_TOTAL,CI,A,B,C,D)	\
+do {							\
+  (A) = (ROW)[CI];					\
+  (B) = (ROW_TOTAL) - (A);				\
+  (C) = (S)->class_totals[CI] - (A);			\
+  (D) = (S)->total - (A) - (B) - (C);			\
+} while (0)
+
+static float
+bow_fstats_chi2 (bow_fstats_scoring *s, float *row, double row_total)
+{
+  double a, b, c, d, denom, chi2, max_chi2 = 0;
+  int ci;
 
-      /* Calculate and store the information gain. */
-      ret[wi] = (total_entropy 
-		 - ((((double)with_word_total / (double)grand_total) 
-		     * with_word_entropy)
-		    + (((double)without_word_total / (double)grand_total) 
-		       * without_word_entropy)));
-      /* Not comparing with 0 here because of round-off error. */
-      assert (ret[wi] >= -1e-7);
+  for (ci = 0; ci < s->fs->num_classes; ci++)
+    {
+      BOW_FSTATS_TABLE (s, row, row_total, ci, a, b, c, d);
+      denom = (a + c) * (b + d) * (a + b) * (c + d);
+      if (denom <= 0)
+	continue;
+      chi2 = s->total * (a * d - c * b) * (a * d - c * b) / denom;
+      if (chi2 > max_chi2)
+	max_chi2 = chi2;
+    }
+  return max_chi2;
+}
 
-      if (ret[wi] < 0)
-	ret[wi] = 0;
+static float
+bow_fstats_oddsratio (bow_fstats_scoring *s, float *row, double row_total)
+{
+  double a, b, c, d, p, q, or, max_or = -FLT_MAX;
+  int ci;
 
-      if (wi % 100 == 0)
-	bow_verbosify (bow_progress,
-		       "\b\b\b\b\b\b\b\b\b%9d", max_wi - wi);
+  for (ci = 0; ci < s->fs->num_classes; ci++)
+    {
+      BOW_FSTATS_TABLE (s, row, row_total, ci, a, b, c, d);
+      /* P(w|c) and P(w|~c), with half a document added to each cell
+	 to keep them away from 0 and 1. */
+      p = (a + 0.5) / (a + c + 1);
+      q = (b + 0.5) / (b + d + 1);
+      or = log ((p * (1 - q)) / ((1 - p) * q));
+      if (or > max_or)
+	max_or = or;
     }
-  bow_verbosify (bow_progress, "\n");
-  return ret;
+  return max_or;
+}
+
+/* Return a malloc()'ed array containing an infomation-gain score for
+   each word index, counting documents. */
+float *
+bow_infogain_per_wi_new_document_event (bow_barrel *barrel, int num_classes, 
+					int *size)
+{
+  bow_fstats *fs = bow_barrel_fstats (barrel, num_classes);
+
+  return bow_fstats_score (fs, fs->train_prior, fs->class_train_prior,
+			   bow_fstats_infogain, size);
+}
+
+/* Return a malloc()'ed array containing an infomation-gain score for
+   each word index, counting word occurrences. */
+float *
+bow_infogain_per_wi_new_word_event (bow_barrel *barrel, int num_classes, 
+				    int *size)
+{
+  bow_fstats *fs = bow_barrel_fstats (barrel, num_classes);
+
+  return bow_fstats_score (fs, fs->train_count, fs->class_train_count,
+			   bow_fstats_infogain, size);
 }
 
 float *
 bow_infogain_per_wi_new (bow_barrel *barrel, int num_classes, int *size)
 {
+  float *ret = NULL;
+
+  bow_verbosify (bow_progress, "Calculating info gain... ");
   if (bow_infogain_event_model == bow_event_word)
-    return bow_infogain_per_wi_new_word_event (barrel, num_classes, size);
+    ret = bow_infogain_per_wi_new_word_event (barrel, num_classes, size);
   else if (bow_infogain_event_model == bow_event_document)
-    return bow_infogain_per_wi_new_document_event (barrel, num_classes, size);
+    ret = bow_infogain_per_wi_new_document_event (barrel, num_classes, size);
   else if (bow_infogain_event_model == bow_event_document_then_word)
     bow_error ("document_then_word for infogain not implemented");
   else
     bow_error ("bad bow_infogain_event_model");
+  bow_verbosify (bow_progress, "done\n");
+  return ret;
+}
+
+/* Return a malloc()'ed array containing the chi-squared statistic
+   between each word's occurrence in a document and that document's
+   class, maximized over classes. */
+float *
+bow_chi2_per_wi_new (bow_barrel *barrel, int num_classes, int *size)
+{
+  bow_fstats *fs = bow_barrel_fstats (barrel, num_classes);
+
+  return bow_fstats_score (fs, fs->train_prior, fs->class_train_prior,
+			   bow_fstats_chi2, size);
+}
+
+/* Return a malloc()'ed array containing the log odds ratio of each
+   word's occurrence in a document of a class against its occurrence
+   in a document of any other class, maximized over classes. */
+float *
+bow_oddsratio_per_wi_new (bow_barrel *barrel, int num_classes, int *size)
+{
+  bow_fstats *fs = bow_barrel_fstats (barrel, num_classes);
+
+  return bow_fstats_score (fs, fs->train_prior, fs->class_train_prior,
+			   bow_fstats_oddsratio, size);
+}
+
+/* Return a malloc()'ed array containing the score of each word index
+   by the measure selected with `--prune-vocab-score'. */
+float *
+bow_feature_score_per_wi_new (bow_barrel *barrel, int num_classes, int *size)
+{
+  switch (bow_prune_vocab_score)
+    {
+    case bow_feature_score_infogain:
+      return bow_infogain_per_wi_new (barrel, num_classes, size);
+    case bow_feature_score_chi2:
+      return bow_chi2_per_wi_new (barrel, num_classes, size);
+    case bow_feature_score_oddsratio:
+      return bow_oddsratio_per_wi_new (barrel, num_classes, size);
+    }
+  bow_error ("bad bow_prune_vocab_score");
   return NULL;
 }
 
@@ -63,6 +63,7 @@ bow_int4str_init (bow_int4str *map, int capacity)
   map->str_hash = bow_malloc (map->str_hash_size * sizeof (int));
   for (i = 0; i < map->str_hash_size; i++)
     map->str_hash[i] = HASH_EMPTY;
+  map->str_hash_renamed = 0;
 }
 
 /* Allocate, initialize and return a new int/string mapping structure.
@@ -219,7 +220,8 @@ _str_hash_add (bow_int4str *map,
   assert (h >= 0);
   assert (str_array_index >= 0 && str_array_index < map->str_array_length);
   /* if (map->str_hash[h] == HASH_EMPTY) */
-  if (map->str_hash_size > map->str_array_length * 2)
+  if (map->str_hash_size
+      > (map->str_array_length + map->str_hash_renamed) * 2)
     {
       /* str_hash doesn't have to grow; just drop it in place.
 	 STR_ARRAY_INDEX is the index at which we can find STRING in
@@ -246,18 +248,22 @@ _str_hash_add (bow_int4str *map,
       map->str_hash = bow_malloc (map->str_hash_size * sizeof(int));
       for (i = map->str_hash_size, entry = map->str_hash; i > 0; i--, entry++)
 	*entry = HASH_EMPTY;
+      map->str_hash_renamed = 0;
 
-      /* Fill the new str_hash with the values from the old str_hash. */
+      /* Fill the new str_hash with the strings already in STR_ARRAY.
+	 They are taken from there rather than from the old str_hash,
+	 which has more than one entry for a string that has been
+	 renamed by bow_int4str_rename(). */
       {
-	for (i = 0; i < old_str_hash_size; i++)
-	  if (old_str_hash[i] != HASH_EMPTY)
+	for (i = 0; i < map->str_array_length; i++)
+	  if (i != str_array_index)
 	    {
-	      const char *old_string = map->str_array[old_str_hash[i]];
+	      const char *old_string = map->str_array[i];
 	      unsigned old_id = _str2id (old_string);
 	      _str_hash_add (map, old_string, old_id,
 			     _bow_str_hash_lookup (map, old_string, old_id, 
 						   &sd),
-			     old_str_hash[i]);
+			     i);
 	      assert (sd);      /* All these strings should be unique! */
 	    }
       }
@@ -327,6 +333,31 @@ bow_str2int (bow_int4str *map, const char *string)
   return _bow_str2int (map, string, _str2id (string));
 }
 
+/* Make STRING, which must not be in MAP already, the string at INDEX
+   of MAP in place of the one there.  The old string is no longer in
+   the mapping, and may be added again with a new index. */
+void
+bow_int4str_rename (bow_int4str *map, int index, const char *string)
+{
+  unsigned id = _str2id ((const unsigned char *) string);
+  int h, sd;
+
+  assert (index >= 0 && index < map->str_array_length);
+  assert (bow_str2int_no_add (map, string) == -1);
+  string = strdup (string);
+  if (!string)
+    bow_error ("Memory exhausted.");
+  /* The entry of STR_HASH for the old string keeps INDEX.  Searches
+     for the old string pass over it now, just as they pass over the
+     entry of any other string, and one for STRING finds it only if
+     that is where STRING would go. */
+  map->str_array[index] = string;
+  map->str_hash_renamed++;
+  h = _bow_str_hash_lookup (map, string, id, &sd);
+  if (sd)
+    _str_hash_add (map, string, id, h, index);
+}
+
 /* Create a new int-str mapping words fscanf'ed from FILE using %s. */
 bow_int4str *
 bow_int4str_new_from_string_file (const char *filename)
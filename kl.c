@@ -37,72 +37,63 @@
 #define M_EST_P  (1.0 / barrel->wi2dvf->num_words)
 #endif
 
-/* Function to assign `Naive Bayes'-style weights to each element of
-   each document vector. */
-void
-bow_kl_set_weights (bow_barrel *barrel)
+/* What the threads of bow_kl_set_weights() share. */
+typedef struct _bow_kl_weights {
+  bow_barrel *barrel;
+  int num_classes;
+  int **word_count;		/* per class, one row for each thread */
+  int **num_unique;		/* per class, one row for each thread */
+  int *total_num_words;		/* one for each thread */
+  int total;			/* the sum of TOTAL_NUM_WORDS */
+} bow_kl_weights;
+
+/* For the words LO through HI-1, add their occurrences into the
+   totals of thread THREAD, and put their total number of occurrences
+   in DV->IDF. */
+static void
+bow_kl_weights_count_range (int lo, int hi, int thread, void *arg)
 {
-  int ci;
-  bow_cdoc *cdoc;
-  int wi;			/* a "word index" into WI2DVF */
-  int max_wi;			/* the highest "word index" in WI2DVF. */
-  bow_dv *dv;			/* the "document vector" at index WI */
-  int dvi;			/* an index into the DV */
-  int weight_setting_num_words = 0;
+  bow_kl_weights *w = arg;
+  int *word_count = w->word_count[thread];
+  int *num_unique = w->num_unique[thread];
   int total_num_words = 0;
+  bow_dv *dv;
+  int wi, dvi, ci;
 
-  /* We assume that we have already called BOW_BARREL_NEW_VPC() on
-     BARREL, so BARREL already has one-document-per-class. */
-    
-  assert (!strcmp (barrel->method->name, "kl"));
-  max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
-
-  /* Get the total number of terms in each class; store this in
-     CDOC->WORD_COUNT. */
-  /* Get the total number of unique terms in each class; store this in
-     CDOC->NORMALIZER. */
-  /* Calculate the total number of occurrences of each word; store this
-     in DV->IDF. */
-  for (ci = 0; ci < barrel->cdocs->length; ci++)
+  for (ci = 0; ci < w->num_classes; ci++)
     {
-      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
-      cdoc->word_count = 0;
-      cdoc->normalizer = 0;
+      word_count[ci] = 0;
+      num_unique[ci] = 0;
     }
-  for (wi = 0; wi < max_wi; wi++) 
+  for (wi = lo; wi < hi; wi++) 
     {
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
       if (dv == NULL)
 	continue;
       dv->idf = 0;
       for (dvi = 0; dvi < dv->length; dvi++) 
 	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, 
-					   dv->entry[dvi].di);
-	  cdoc->word_count += dv->entry[dvi].count;
+	  word_count[dv->entry[dvi].di] += dv->entry[dvi].count;
 	  total_num_words += dv->entry[dvi].count;
 	  dv->idf += dv->entry[dvi].count;
-	  cdoc->normalizer++;
-	}
-    }
-  for (wi = 0; wi < max_wi; wi++) 
-    {
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-      if (dv == NULL)
-	continue;
-      for (dvi = 0; dvi < dv->length; dvi++) 
-	{
-	  float pr_w_c;
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, 
-					   dv->entry[dvi].di);
-	  pr_w_c = (float)dv->entry[dvi].count / cdoc->word_count;
+	  num_unique[dv->entry[dvi].di]++;
 	}
     }
+  w->total_num_words[thread] = total_num_words;
+}
 
+/* Set the weights of the words LO through HI-1. */
+static void
+bow_kl_weights_set_range (int lo, int hi, int thread, void *arg)
+{
+  bow_kl_weights *w = arg;
+  bow_barrel *barrel = w->barrel;
+  int total_num_words = w->total;
+  bow_cdoc *cdoc;
+  bow_dv *dv;
+  int wi, dvi;
 
-  /* Set the weights in the BARREL's WI2DVF so that they are
-     equal to the log likelihood-ratio, Pr(w|C)/Pr(w|~C). */
-  for (wi = 0; wi < max_wi; wi++) 
+  for (wi = lo; wi < hi; wi++) 
     {
       double pr_w = 0.0;
       dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
@@ -137,15 +128,74 @@ bow_kl_set_weights (bow_barrel *barrel)
 	  dv->entry[dvi].weight = log_likelihood_ratio;
 	  dv->entry[dvi].weight = pr_w_c * log_likelihood_ratio;
 	}
-      weight_setting_num_words++;
       /* Set the IDF.  Kl doesn't use it; make it have no effect */
       dv->idf = 1.0;
     }
+}
+
+/* Function to assign `Naive Bayes'-style weights to each element of
+   each document vector.  Both passes over the words are made in
+   several threads. */
+void
+bow_kl_set_weights (bow_barrel *barrel)
+{
+  int ci;
+  bow_cdoc *cdoc;
+  int max_wi;			/* the highest "word index" in WI2DVF. */
+  int num_classes = barrel->cdocs->length;
+  int nthreads, t;
+  bow_kl_weights w;
+
+  /* We assume that we have already called BOW_BARREL_NEW_VPC() on
+     BARREL, so BARREL already has one-document-per-class. */
+    
+  assert (!strcmp (barrel->method->name, "kl"));
+  max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
+
+  /* Get the total number of terms in each class; store this in
+     CDOC->WORD_COUNT. */
+  /* Get the total number of unique terms in each class; store this in
+     CDOC->NORMALIZER. */
+  /* Calculate the total number of occurrences of each word; store this
+     in DV->IDF. */
+  w.barrel = barrel;
+  w.num_classes = num_classes;
+  nthreads = bow_num_threads_for (max_wi);
+  w.word_count = alloca (nthreads * sizeof (int*));
+  w.num_unique = alloca (nthreads * sizeof (int*));
+  for (t = 0; t < nthreads; t++)
+    {
+      w.word_count[t] = bow_malloc (num_classes * sizeof (int));
+      w.num_unique[t] = bow_malloc (num_classes * sizeof (int));
+    }
+  w.total_num_words = alloca (nthreads * sizeof (int));
+  /* The threads may only read the "document vectors". */
+  bow_wi2dvf_read_in (barrel->wi2dvf, max_wi);
+  nthreads = bow_parallel_for (max_wi, bow_kl_weights_count_range, &w);
+
+  w.total = 0;
+  for (t = 0; t < nthreads; t++)
+    w.total += w.total_num_words[t];
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      cdoc->word_count = 0;
+      cdoc->normalizer = 0;
+      for (t = 0; t < nthreads; t++)
+	{
+	  cdoc->word_count += w.word_count[t][ci];
+	  cdoc->normalizer += w.num_unique[t][ci];
+	}
+    }
+  for (t = 0; t < nthreads; t++)
+    {
+      bow_free (w.word_count[t]);
+      bow_free (w.num_unique[t]);
+    }
 
-#if 0
-  fprintf (stderr, "wi2dvf num_words %d, weight-setting num_words %d\n",
-	   barrel->wi2dvf->num_words, weight_setting_num_words);
-#endif
+  /* Set the weights in the BARREL's WI2DVF so that they are
+     equal to the log likelihood-ratio, Pr(w|C)/Pr(w|~C). */
+  bow_parallel_for (max_wi, bow_kl_weights_set_range, &w);
 }
 
 int
@@ -174,7 +224,7 @@ bow_kl_score (bow_barrel *barrel, bow_wv *query_wv,
   double entropy_d = 0;
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (barrel->cdocs->length * sizeof (double));
+  scores = bow_thread_buffer (0, barrel->cdocs->length * sizeof (double));
 
   /* Calculate the total number of words in QUERY_WV.  Should we start
      at one to prevent getting a zero here?  Also, would this be
@@ -415,28 +465,8 @@ bow_kl_score (bow_barrel *barrel, bow_wv *query_wv,
   /* Return the SCORES by putting them (and the `class indices') into
      SCORES in sorted order. */
   {
-    num_scores = 0;
-    for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES, or
-	       (2) SCORES[CI] is larger than the smallest score there
-	       currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    bscores[dsi].di = ci;
-	  }
-      }
+    num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+					 bscores, bscores_len);
   }
 
 #if 0
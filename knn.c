@@ -64,6 +64,11 @@ static int knn_k = 30;
 static char query_weights[4] = "nnn";
 static char doc_weights[4] = "nnn";
 
+/* Upper bounds on the weights of each word's "document vector", for
+   skipping documents that can't be among the K nearest.  Reset each
+   time the weights are set. */
+static bow_topk_bounds *knn_bounds = NULL;
+
 /* The integer or single char used to represent this command-line option.
    Make sure it is unique across all libbow and rainbow. */
 #define KNN_K_KEY 4001
@@ -263,15 +268,43 @@ void bow_knn_normalise_weights (bow_barrel *barrel)
 }
 
 
+/* The method of the barrels returned by
+   bow_knn_classification_barrel(); a copy of bow_method_knn that
+   frees only the barrel itself. */
+static rainbow_method bow_method_knn_classifier;
+
+/* Free the barrel KNN_BARREL, but not the documents and words it
+   shares with the barrel it was made from. */
+static void
+bow_knn_free_classification_barrel (bow_barrel *knn_barrel)
+{
+  bow_free (knn_barrel);
+}
+
 bow_barrel *
 bow_knn_classification_barrel (bow_barrel *barrel)
 {
+  bow_barrel *knn_barrel;
+
   /* Just use the doc barrel - set the weights, normalise and return. */
 
   bow_knn_set_weights(barrel);
   bow_knn_normalise_weights(barrel);
+  if (knn_bounds)
+    {
+      bow_topk_bounds_free (knn_bounds);
+      knn_bounds = NULL;
+    }
 
-  return barrel;
+  /* Return a barrel sharing the documents and words of BARREL, so that
+     freeing it, as rainbow does before each trial, leaves BARREL
+     alone. */
+  knn_barrel = bow_malloc (sizeof (bow_barrel));
+  *knn_barrel = *barrel;
+  knn_barrel->fstats = NULL;
+  knn_barrel->nb_loo = NULL;
+  knn_barrel->method = &bow_method_knn_classifier;
+  return knn_barrel;
 }
 
 /* Set the weights for the query word vector according to the
@@ -343,140 +376,72 @@ bow_knn_normalise_query_weights (bow_wv *query)
     }
 }
 
-/* Little :) function lifted from tfidf.c and edited to do exactly
-   what we need here. Was originally called bow_tfidf_score */
+/* What bow_knn_score_doc() needs to know about the query. */
+struct _bow_knn_query {
+  bow_barrel *barrel;
+  bow_wv *query_wv;
+};
+
+/* The score of document DI against the query QUERY_WV, from the
+   TERMS at its entries.  The sum is taken in order of word index,
+   and normalized afterwards, as this always has been. */
+static double
+bow_knn_score_doc (int di, bow_topk_term **terms, int num_terms, void *ctx)
+{
+  struct _bow_knn_query *q = ctx;
+  double current_score = 0.0;
+  float tmp;
+  int i;
+
+  for (i = 0; i < num_terms; i++)
+    {
+      /* Multiply the tfidf weights */
+      tmp = terms[i]->weight * terms[i]->dv->entry[terms[i]->dvi].weight;
+      current_score += tmp;
+    }
+
+  /* Now check for normalisation */
+  if (NORM_C(query_weights))
+    current_score *= q->query_wv->normalizer;
+  if (NORM_C(doc_weights))
+    {
+      bow_cdoc *cdoc = bow_cdocs_di2doc (q->barrel->cdocs, di);
+      current_score *= cdoc->normalizer;
+    }
+  return current_score;
+}
+
+/* Put into SCORES the BEST training documents closest to QUERY_WV,
+   and return how many there are.  Documents are visited in order by
+   merging the "document vectors" of the query words, skipping those
+   whose words can't add up to a score among the best so far. */
 int
 bow_knn_get_k_best (bow_barrel *barrel, bow_wv *query_wv,  
 		    bow_score *scores, int best)
 {
-  bow_dv_heap *heap; 
-  bow_cdoc *doc; 
-  int num_scores = 0;           /* How many elements are in this array */ 
-  int current_di, wi, current_index, i; 
-  double current_score = 0.0, doc_tfidf; 
-  float tmp; 
-
-  /* Create the Heap of vectors of documents */ 
-  heap = bow_make_dv_heap_from_wv (barrel->wi2dvf, query_wv); 
- 
-  /* Keep looking at document/word entries until the heap is emptied */ 
-  while (heap->length > 0) 
-    { 
-      /* Get the index of the document we're currently working on */ 
-      current_di = heap->entry[0].current_di; 
- 
-      /* Get the document structure */ 
-      doc = bow_cdocs_di2doc (barrel->cdocs, current_di); 
-
-      /* If it's not a model document, then move on to next one */ 
-      if (doc->type != bow_doc_train) 
-        { 
-          do  
-            { 
-              bow_dv_heap_update (heap); 
-            } 
-          while ((current_di == heap->entry[0].current_di) 
-                 && (heap->length > 0)); 
-         
-          /* Try again */ 
-          continue; 
-        } 
- 
-      /* Reset the index into the query word vector */ 
-      current_index = 0; 
- 
-      /* Reset the score */ 
-      current_score = 0.0; 
- 
-      /* Loop over all the words this document has in common with our
-	 query document, summing up the score. We know the words come
-	 out of the heap in index order and we know the words in the
-	 query word vector are in index order as well. */
-      do 
-        { 
-          wi = heap->entry[0].wi; 
-          doc_tfidf = heap->entry[0].dv->entry[heap->entry[0].index].weight;
-
-	  /* Find the corresponding word in the query word vector */ 
-	  /* Note - we know this word is in the query because we built
-	     the heap using only the query words. */
-          while (wi > (query_wv->entry[current_index].wi)) 
-            current_index++; 
-          assert (wi == query_wv->entry[current_index].wi); 
-
-	  /* Now we can add something to the score. Normalisation
-	     happens outside this loop, we just need to check for the
-	     idf factor stuff. The tf weights are just fine. */
-
-	  /* Multiply the tfidf weights */
-	  /* printf("%f * %f\n", query_wv->entry[current_index].weight,
-		 doc_tfidf); */
-
-	  tmp = query_wv->entry[current_index].weight * doc_tfidf;
-
-	  /* Plop this into the current score */
-	  current_score += tmp;
-
-	  /* A test to make sure we haven't got NaN. */ 
-          assert (current_score == current_score); 
- 
-          /* Now we need to update the heap - moving this element on
-	     to its 
-             new position */ 
-          bow_dv_heap_update (heap); 
-        } 
-      while ((current_di == heap->entry[0].current_di) 
-             && (heap->length > 0)); 
-
-      /* Now check for normalisation */
-      if(NORM_C(query_weights))
-	{
-	  current_score *= query_wv->normalizer;
-	}
-      if(NORM_C(doc_weights))
-	{
-	  current_score *= doc->normalizer;
-	}
+  struct _bow_knn_query q;
+  int num_scores, i;
 
-      assert (current_score == current_score); /* checking for NaN */ 
-
-      /* We now hopefully have the correct score for doc */
-
-      /* Store the result in the SCORES array */ 
-      /* If we haven't filled the list, or we beat the last item in
-	 the list */ 
-      if ((num_scores < best) 
-          || (scores[num_scores - 1].weight < current_score)) 
-        { 
-          /* We're going to search up the list comparing element i-1 with 
-             our current score and moving it down the list if it's worse */ 
-          if (num_scores < best) 
-            { 
-              i = num_scores; 
-              num_scores++; 
-            } 
-          else 
-            i = num_scores - 1; 
-
-	  /* Shift down all the bits of the array that need shifting */ 
-          for (; (i > 0) && (scores[i - 1].weight < current_score); i--) 
-	    {
-	      scores[i].di = scores[i-1].di; 
-	      scores[i].weight = scores[i-1].weight; 
-	      scores[i].name = scores[i-1].name; 
-	    }
- 
-          /* Insert our new score */ 
-          scores[i].weight = current_score; 
-          scores[i].di = current_di;
-	  scores[i].name = doc->filename;
-        } 
-    } 
-
-  bow_free (heap); 
- 
-  /* All done - return the number of elements we have */ 
-  return num_scores; 
+  if (!knn_bounds || knn_bounds->wi2dvf != barrel->wi2dvf)
+    {
+      if (knn_bounds)
+	bow_topk_bounds_free (knn_bounds);
+      knn_bounds = bow_topk_bounds_new (barrel, NORM_C(doc_weights));
+    }
+
+  q.barrel = barrel;
+  q.query_wv = query_wv;
+  num_scores = bow_topk_search (barrel, knn_bounds, query_wv,
+				(NORM_C(query_weights)
+				 ? query_wv->normalizer : 1.0),
+				BOW_TOPK_TRAIN_ONLY, bow_knn_score_doc, &q,
+				scores, best, NULL);
+  for (i = 0; i < num_scores; i++)
+    {
+      bow_cdoc *cdoc = bow_cdocs_di2doc (barrel->cdocs, scores[i].di);
+      scores[i].name = cdoc->filename;
+    }
+  return num_scores;
 } 
 
 
@@ -507,7 +472,8 @@ bow_knn_score (bow_barrel *barrel, bow_wv *query_wv,
   count = bow_knn_get_k_best (barrel, query_wv, neighbors, knn_k);
 
   /* Allocate space for class scores */
-  scores = alloca (bow_barrel_num_classes (barrel) * sizeof (double));
+  scores = bow_thread_buffer (0, (bow_barrel_num_classes (barrel)
+				 * sizeof (double)));
   for (ci=0; ci < bow_barrel_num_classes (barrel); ci++)
     scores[ci] = 0.0;
 
@@ -520,34 +486,11 @@ bow_knn_score (bow_barrel *barrel, bow_wv *query_wv,
       scores_sum += neighbors[ni].weight;
     }
 
-  num_scores = 0;
-
   /* Put SCORES into BSCORES in sorted order */
-  /* Each round, find the best remainaing score and put it into bscores */
-  for (ci=0; ci < bow_barrel_num_classes (barrel); ci++)
-    {
-      if (num_scores < bscores_len
-	  || bscores[num_scores-1].weight < scores[ci])
-	{
-	  int dsi;
-	  /* We are going to put this score and class index into SCORES
-	   * because either 1) there is an empty space in SCORES, or 2)
-	   * SCORES[CI] is larger than the smallest score currently there */
-	  if (num_scores < bscores_len)
-	    num_scores++;
-	  dsi = num_scores - 1;
-	  /* Shift down all the entries that are smaller than SCORES[CI] */
-	  for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	    {
-	      bscores[dsi].weight = bscores[dsi-1].weight;
-	      bscores[dsi].name = bscores[dsi-1].name;
-	      bscores[dsi].di = bscores[dsi-1].di;
-	    }
-	  bscores[dsi].weight = scores[ci];
-	  bscores[dsi].di = ci;
-	  bscores[dsi].name = "default";
-	}
-    }
+  num_scores = bow_scores_select_top (scores, bow_barrel_num_classes (barrel),
+				       bscores, bscores_len);
+  for (ci = 0; ci < num_scores; ci++)
+    bscores[ci].name = "default";
   return num_scores;
 }
 
@@ -570,6 +513,8 @@ rainbow_method bow_method_knn =
 void _register_method_knn () __attribute__ ((constructor));
 void _register_method_knn ()
 {
+  bow_method_knn_classifier = bow_method_knn;
+  bow_method_knn_classifier.free_barrel = bow_knn_free_classification_barrel;
   bow_method_register_with_name ((bow_method*)&bow_method_knn, "knn",
 				 sizeof (rainbow_method),
 				 &knn_argp_child);
@@ -77,6 +77,12 @@ static int maxent_prune_features_by_count = 0;
 /* whether or not to use unlabeled docs in setting the constraints */
 static int maxent_constraint_use_unlabeled = 0;
 
+/* whether to train with L-BFGS instead of improved iterative scaling */
+static int maxent_use_lbfgs = 0;
+
+/* the number of past steps L-BFGS remembers */
+static int maxent_lbfgs_memory = 7;
+
 #if 0
 static int maxent_print_constraints = 1;
 static int maxent_print_lambdas = 1;
@@ -100,6 +106,8 @@ enum {
   MAXENT_PRIOR_VARY_BY_COUNT_LINEAR,
   MAXENT_ITERATION_DOCS,
   MAXENT_CONSTRAINT_DOCS,
+  MAXENT_LBFGS,
+  MAXENT_LBFGS_MEMORY,
 };
 
 static struct argp_option maxent_options[] =
@@ -117,7 +125,14 @@ static struct argp_option maxent_options[] =
    "When running maxent, halt iterations using the accuracy of documents.  TYPE is type of documents"
    "to test.  See `--em-halt-using-perplexity` for choices for TYPE"},
   {"maxent-iterations", MAXENT_ITERATIONS, "NUM", 0,
-   "The number of iterative scaling iterations to perform.  The default is 40."},
+   "The number of iterative scaling (or L-BFGS) iterations to perform.  "
+   "The default is 40."},
+  {"maxent-lbfgs", MAXENT_LBFGS, 0, 0,
+   "Maximize the conditional log-likelihood with limited-memory BFGS "
+   "instead of improved iterative scaling.  Only for the word event model."},
+  {"maxent-lbfgs-memory", MAXENT_LBFGS_MEMORY, "NUM", 0,
+   "The number of past steps L-BFGS uses to approximate the Hessian.  "
+   "The default is 7."},
   {"maxent-keep-features-by-mi", MAXENT_WORDS_PER_CLASS, "NUM", 0,
    "The number of top words by mutual information per class to use as features.  Zero"
    "implies no pruning and is the default."},
@@ -213,6 +228,14 @@ maxent_parse_opt (int key, char *arg, struct argp_state *state)
     case MAXENT_ITERATIONS:
       maxent_num_iterations = atoi (arg);
       break;
+    case MAXENT_LBFGS:
+      maxent_use_lbfgs = 1;
+      break;
+    case MAXENT_LBFGS_MEMORY:
+      maxent_lbfgs_memory = atoi (arg);
+      if (maxent_lbfgs_memory <= 0)
+	argp_error (state, "--maxent-lbfgs-memory must be at least 1");
+      break;
     case MAXENT_WORDS_PER_CLASS:
       maxent_words_per_class = atoi (arg);
       break;
@@ -619,7 +642,7 @@ bow_maxent_new_vpc_with_weights_doc_then_word (bow_barrel *doc_barrel)
   bow_wi2dvf *constraint_wi2dvf;
   int max_ci;
   int rounds = 0;
-  double total_count_per_ci[200];
+  double *total_count_per_ci;
   int total_num_docs = 0;
   float old_log_prob = -FLT_MAX;
   float new_log_prob = -FLT_MAX / 2;
@@ -633,7 +656,6 @@ bow_maxent_new_vpc_with_weights_doc_then_word (bow_barrel *doc_barrel)
   bow_maxent_model_building = 1;
 
   /* some sanity checks first */
-  assert (200 > bow_barrel_num_classes(doc_barrel));
   assert (doc_barrel->classnames);
   assert (bow_event_model == bow_event_document_then_word);
   assert (!maxent_scoring_hack);
@@ -643,6 +665,8 @@ bow_maxent_new_vpc_with_weights_doc_then_word (bow_barrel *doc_barrel)
 
   max_wi = MIN (doc_barrel->wi2dvf->size, bow_num_words ());
   max_ci = bow_barrel_num_classes (doc_barrel);
+  total_count_per_ci = bow_malloc (sizeof (double) * max_ci);
+  hits = bow_malloc (sizeof (bow_score) * max_ci);
 
   newton_poly = bow_malloc (sizeof (maxent_polynomial) +
 			    sizeof (maxent_coefficient) * 3);
@@ -863,7 +887,6 @@ bow_maxent_new_vpc_with_weights_doc_then_word (bow_barrel *doc_barrel)
       /* classify all the documents, and put their contribution into the 
 	 different lambdas */
       query_wv = NULL;
-      hits = alloca (sizeof (bow_score) * max_ci);
       num_tested = 0;
       test_heap = bow_test_new_heap (doc_barrel);
 	  
@@ -1016,6 +1039,8 @@ bow_maxent_new_vpc_with_weights_doc_then_word (bow_barrel *doc_barrel)
     }
 
   bow_free (newton_poly);
+  bow_free (total_count_per_ci);
+  bow_free (hits);
   bow_wi2dvf_free (constraint_wi2dvf);
   bow_maxent_model_building = 0;
 
@@ -1053,6 +1078,495 @@ bow_maxent_new_vpc_with_weights_doc_then_word (bow_barrel *doc_barrel)
 }
 
 
+/* The training documents as a sparse matrix, one row per document, for
+   computing the gradient of the log-likelihood in one pass.  The
+   lambdas are flattened into one vector; those of word WI are
+   LAMBDA_START[WI] through LAMBDA_START[WI]+LAMBDA_LENGTH[WI]-1, in the
+   order of the entries of WI's "document vector" in the class barrel,
+   and LAMBDA_CI gives the class of each. */
+typedef struct _maxent_csr {
+  int num_docs;
+  int *row_start;		/* NUM_DOCS+1 offsets into WI and COUNT */
+  int *class;			/* the class of each document */
+  int *wi;
+  float *count;
+  int num_lambdas;
+  int *lambda_start;		/* indexed by word */
+  int *lambda_length;
+  int *lambda_ci;		/* indexed by lambda */
+  double *empirical;		/* the training expectation of each feature */
+  double *excess;		/* how much the constraint exceeds it */
+  char *frozen;			/* lambdas of classes without training data */
+} maxent_csr;
+
+/* Build the sparse matrix of the training documents of DOC_BARREL,
+   keeping only the words that have lambdas in VPC_BARREL. */
+static maxent_csr *
+maxent_csr_new (bow_barrel *doc_barrel, bow_barrel *vpc_barrel,
+		bow_wi2dvf *constraint_wi2dvf, int max_wi)
+{
+  maxent_csr *m = bow_malloc (sizeof (maxent_csr));
+  int *doc_row = bow_malloc (sizeof (int) * doc_barrel->cdocs->length);
+  int *fill;
+  bow_dv *dv, *lambda_dv, *constraint_dv;
+  bow_cdoc *cdoc;
+  int wi, dvi, di, li, ei;
+
+  /* Number the training documents. */
+  m->num_docs = 0;
+  for (di = 0; di < doc_barrel->cdocs->length; di++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
+      doc_row[di] = (cdoc->type == bow_doc_train) ? m->num_docs++ : -1;
+    }
+  m->row_start = bow_malloc (sizeof (int) * (m->num_docs + 1));
+  m->class = bow_malloc (sizeof (int) * MAX (m->num_docs, 1));
+  for (di = 0; di < m->num_docs + 1; di++)
+    m->row_start[di] = 0;
+
+  /* Number the lambdas, and count the entries in each row. */
+  m->lambda_start = bow_malloc (sizeof (int) * MAX (max_wi, 1));
+  m->lambda_length = bow_malloc (sizeof (int) * MAX (max_wi, 1));
+  m->num_lambdas = 0;
+  for (wi = 0; wi < max_wi; wi++)
+    {
+      m->lambda_start[wi] = m->num_lambdas;
+      m->lambda_length[wi] = 0;
+      lambda_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
+      constraint_dv = bow_wi2dvf_dv (constraint_wi2dvf, wi);
+      dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+      if (!lambda_dv || !constraint_dv || !dv)
+	continue;
+      assert (lambda_dv->length == constraint_dv->length);
+      m->lambda_length[wi] = lambda_dv->length;
+      m->num_lambdas += lambda_dv->length;
+      for (dvi = 0; dvi < dv->length; dvi++)
+	if (doc_row[dv->entry[dvi].di] >= 0)
+	  m->row_start[doc_row[dv->entry[dvi].di] + 1]++;
+    }
+  for (di = 0; di < m->num_docs; di++)
+    m->row_start[di + 1] += m->row_start[di];
+
+  /* Fill the rows, each in order of word index. */
+  m->wi = bow_malloc (sizeof (int) * MAX (m->row_start[m->num_docs], 1));
+  m->count = bow_malloc (sizeof (float) * MAX (m->row_start[m->num_docs], 1));
+  fill = bow_malloc (sizeof (int) * MAX (m->num_docs, 1));
+  for (di = 0; di < m->num_docs; di++)
+    fill[di] = m->row_start[di];
+  m->lambda_ci = bow_malloc (sizeof (int) * MAX (m->num_lambdas, 1));
+  m->empirical = bow_malloc (sizeof (double) * MAX (m->num_lambdas, 1));
+  m->excess = bow_malloc (sizeof (double) * MAX (m->num_lambdas, 1));
+  m->frozen = bow_malloc (MAX (m->num_lambdas, 1));
+  for (wi = 0; wi < max_wi; wi++)
+    {
+      if (m->lambda_length[wi] == 0)
+	continue;
+      lambda_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
+      constraint_dv = bow_wi2dvf_dv (constraint_wi2dvf, wi);
+      for (dvi = 0; dvi < lambda_dv->length; dvi++)
+	{
+	  li = m->lambda_start[wi] + dvi;
+	  assert (lambda_dv->entry[dvi].di == constraint_dv->entry[dvi].di);
+	  m->lambda_ci[li] = lambda_dv->entry[dvi].di;
+	  m->empirical[li] = 0;
+	  m->excess[li] = constraint_dv->entry[dvi].weight;
+	  /* Like iterative scaling, leave alone the lambdas of classes
+	     for which there is no training data. */
+	  cdoc = bow_array_entry_at_index (vpc_barrel->cdocs, 
+					   lambda_dv->entry[dvi].di);
+	  m->frozen[li] = (cdoc->word_count == 0);
+	}
+      dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+      for (dvi = 0; dvi < dv->length; dvi++)
+	{
+	  di = doc_row[dv->entry[dvi].di];
+	  if (di < 0)
+	    continue;
+	  m->wi[fill[di]] = wi;
+	  m->count[fill[di]] = dv->entry[dvi].weight;
+	  fill[di]++;
+	}
+    }
+  for (di = 0; di < doc_barrel->cdocs->length; di++)
+    if (doc_row[di] >= 0)
+      {
+	cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
+	m->class[doc_row[di]] = cdoc->class;
+      }
+
+  /* Recompute the empirical expectations in double precision.  The
+     constraints only differ from them by smoothing, or by the rounding
+     of having been stored as floats; drop the latter, or with
+     separable data the lambdas grow until it swamps the objective. */
+  for (di = 0; di < m->num_docs; di++)
+    for (ei = m->row_start[di]; ei < m->row_start[di+1]; ei++)
+      {
+	wi = m->wi[ei];
+	for (li = m->lambda_start[wi];
+	     li < m->lambda_start[wi] + m->lambda_length[wi]; li++)
+	  if (m->lambda_ci[li] == m->class[di])
+	    m->empirical[li] += m->count[ei] / m->num_docs;
+      }
+  for (li = 0; li < m->num_lambdas; li++)
+    {
+      m->excess[li] -= m->empirical[li];
+      if (fabs (m->excess[li]) <= 1e-6 * m->empirical[li])
+	m->excess[li] = 0;
+    }
+
+  bow_free (fill);
+  bow_free (doc_row);
+  return m;
+}
+
+static void
+maxent_csr_free (maxent_csr *m)
+{
+  bow_free (m->row_start);
+  bow_free (m->class);
+  bow_free (m->wi);
+  bow_free (m->count);
+  bow_free (m->lambda_start);
+  bow_free (m->lambda_length);
+  bow_free (m->lambda_ci);
+  bow_free (m->empirical);
+  bow_free (m->excess);
+  bow_free (m->frozen);
+  bow_free (m);
+}
+
+/* What the threads computing the gradient share. */
+typedef struct _maxent_gradient_context {
+  maxent_csr *m;
+  int max_ci;
+  const double *lambda;
+  double **gradient;		/* one per thread */
+  double *log_prob;		/* one per thread */
+} maxent_gradient_context;
+
+/* For the documents BEGIN through END-1, add into the gradient of
+   thread THREAD the model expectation of each feature, and add up the
+   negative log-probability of each document's class. */
+static void
+maxent_gradient_range (int begin, int end, int thread, void *arg)
+{
+  maxent_gradient_context *c = arg;
+  maxent_csr *m = c->m;
+  double *g = c->gradient[thread];
+  double *scores = alloca (sizeof (double) * c->max_ci);
+  double max_score, sum, log_prob = 0;
+  int di, ei, li, ci, wi;
+
+  for (li = 0; li < m->num_lambdas; li++)
+    g[li] = 0;
+  for (di = begin; di < end; di++)
+    {
+      for (ci = 0; ci < c->max_ci; ci++)
+	scores[ci] = 0;
+      for (ei = m->row_start[di]; ei < m->row_start[di+1]; ei++)
+	{
+	  wi = m->wi[ei];
+	  for (li = m->lambda_start[wi];
+	       li < m->lambda_start[wi] + m->lambda_length[wi]; li++)
+	    scores[m->lambda_ci[li]] += c->lambda[li] * m->count[ei];
+	}
+      log_prob -= scores[m->class[di]];
+      max_score = -DBL_MAX;
+      for (ci = 0; ci < c->max_ci; ci++)
+	if (scores[ci] > max_score)
+	  max_score = scores[ci];
+      sum = 0;
+      for (ci = 0; ci < c->max_ci; ci++)
+	{
+	  scores[ci] = exp (scores[ci] - max_score);
+	  sum += scores[ci];
+	}
+      log_prob += max_score + log (sum);
+      /* SCORES now become P(c|d) */
+      for (ci = 0; ci < c->max_ci; ci++)
+	scores[ci] /= sum;
+      for (ei = m->row_start[di]; ei < m->row_start[di+1]; ei++)
+	{
+	  wi = m->wi[ei];
+	  for (li = m->lambda_start[wi];
+	       li < m->lambda_start[wi] + m->lambda_length[wi]; li++)
+	    g[li] += scores[m->lambda_ci[li]] * m->count[ei];
+	}
+    }
+  c->log_prob[thread] = log_prob;
+}
+
+/* Return the objective that iterative scaling also minimizes at
+   LAMBDA, and put its gradient in GRADIENT: the negative conditional
+   log-likelihood of the training documents per document, less the
+   lambdas times the smoothing of their constraints, plus the penalty
+   of the Gaussian prior if we're using one.  SCRATCH holds a gradient
+   for each thread. */
+static double
+maxent_objective (maxent_csr *m, int max_ci, const double *lambda,
+		  double *gradient, double **scratch)
+{
+  maxent_gradient_context c;
+  double value = 0;
+  int nthreads, t, li;
+
+  c.m = m;
+  c.max_ci = max_ci;
+  c.lambda = lambda;
+  c.gradient = scratch;
+  c.log_prob = alloca (sizeof (double) * bow_num_threads_for (m->num_docs));
+  nthreads = bow_parallel_for (m->num_docs, maxent_gradient_range, &c);
+
+  for (li = 0; li < m->num_lambdas; li++)
+    gradient[li] = 0;
+  for (t = 0; t < nthreads; t++)
+    {
+      value += c.log_prob[t];
+      for (li = 0; li < m->num_lambdas; li++)
+	gradient[li] += scratch[t][li];
+    }
+  value /= m->num_docs;
+  for (li = 0; li < m->num_lambdas; li++)
+    {
+      if (m->frozen[li])
+	{
+	  gradient[li] = 0;
+	  continue;
+	}
+      gradient[li] = (gradient[li] / m->num_docs - m->empirical[li]
+		      - m->excess[li]);
+      value -= lambda[li] * m->excess[li];
+      if (maxent_gaussian_prior)
+	{
+	  gradient[li] += lambda[li] / maxent_prior_variance;
+	  value += lambda[li] * lambda[li] / (2 * maxent_prior_variance);
+	}
+    }
+  return value;
+}
+
+static double
+maxent_dot (const double *a, const double *b, int n)
+{
+  double sum = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+/* Copy the flattened LAMBDA into the weights of the class barrel. */
+static void
+maxent_csr_set_lambdas (maxent_csr *m, bow_barrel *vpc_barrel, int max_wi,
+			const double *lambda)
+{
+  bow_dv *lambda_dv;
+  int wi, dvi;
+
+  for (wi = 0; wi < max_wi; wi++)
+    {
+      if (m->lambda_length[wi] == 0)
+	continue;
+      lambda_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
+      for (dvi = 0; dvi < lambda_dv->length; dvi++)
+	lambda_dv->entry[dvi].weight = lambda[m->lambda_start[wi] + dvi];
+    }
+}
+
+/* Set the lambdas of VPC_BARREL by maximizing the conditional
+   log-likelihood of the training documents of DOC_BARREL with
+   limited-memory BFGS, subject to the constraints in
+   CONSTRAINT_WI2DVF.  Halts by the same criteria as iterative
+   scaling, or when the gradient vanishes or no step can be made. */
+static void
+maxent_train_lbfgs (bow_barrel *doc_barrel, bow_barrel *vpc_barrel,
+		    bow_wi2dvf *constraint_wi2dvf, int max_wi, int max_ci)
+{
+  maxent_csr *m;
+  int n, mem = maxent_lbfgs_memory;
+  double *x, *g, *x_new, *g_new, *d, *alpha, *rho;
+  double **s, **y, **scratch;
+  double f, f_new, step, gd, beta;
+  int num_pairs = 0, newest = -1;
+  int rounds = 0;
+  int i, k, t, nthreads;
+  float old_log_prob = -FLT_MAX;
+  float new_log_prob = -FLT_MAX / 2;
+  float old_accuracy = -1;
+  float new_accuracy = 0;
+
+  bow_wi2dvf_read_in (doc_barrel->wi2dvf, max_wi);
+  m = maxent_csr_new (doc_barrel, vpc_barrel, constraint_wi2dvf, max_wi);
+  n = m->num_lambdas;
+  assert (m->num_docs > 0);
+
+  x = bow_malloc (sizeof (double) * MAX (n, 1));
+  g = bow_malloc (sizeof (double) * MAX (n, 1));
+  x_new = bow_malloc (sizeof (double) * MAX (n, 1));
+  g_new = bow_malloc (sizeof (double) * MAX (n, 1));
+  d = bow_malloc (sizeof (double) * MAX (n, 1));
+  alpha = bow_malloc (sizeof (double) * mem);
+  rho = bow_malloc (sizeof (double) * mem);
+  s = bow_malloc (sizeof (double *) * mem);
+  y = bow_malloc (sizeof (double *) * mem);
+  for (k = 0; k < mem; k++)
+    {
+      s[k] = bow_malloc (sizeof (double) * MAX (n, 1));
+      y[k] = bow_malloc (sizeof (double) * MAX (n, 1));
+    }
+  nthreads = bow_num_threads_for (m->num_docs);
+  scratch = bow_malloc (sizeof (double *) * nthreads);
+  for (t = 0; t < nthreads; t++)
+    scratch[t] = bow_malloc (sizeof (double) * MAX (n, 1));
+
+  /* Start from all lambdas zero, as iterative scaling does. */
+  for (i = 0; i < n; i++)
+    x[i] = 0;
+  f = maxent_objective (m, max_ci, x, g, scratch);
+
+  while  (maxent_logprob_docs ? 
+	  new_log_prob > old_log_prob : 
+	  (maxent_halt_accuracy_docs ? 
+	   new_accuracy > old_accuracy : 
+	   rounds < maxent_num_iterations)) 
+    {
+      rounds++;
+
+      /* The search direction, D = -H G, by the two-loop recursion. */
+      for (i = 0; i < n; i++)
+	d[i] = -g[i];
+      for (k = 0; k < num_pairs; k++)
+	{
+	  int j = (newest - k + mem) % mem;
+	  alpha[j] = rho[j] * maxent_dot (s[j], d, n);
+	  for (i = 0; i < n; i++)
+	    d[i] -= alpha[j] * y[j][i];
+	}
+      if (num_pairs > 0)
+	{
+	  double gamma = (maxent_dot (s[newest], y[newest], n)
+			  / maxent_dot (y[newest], y[newest], n));
+	  for (i = 0; i < n; i++)
+	    d[i] *= gamma;
+	}
+      for (k = num_pairs - 1; k >= 0; k--)
+	{
+	  int j = (newest - k + mem) % mem;
+	  beta = rho[j] * maxent_dot (y[j], d, n);
+	  for (i = 0; i < n; i++)
+	    d[i] += (alpha[j] - beta) * s[j][i];
+	}
+      gd = maxent_dot (g, d, n);
+      if (gd >= 0)
+	{
+	  /* Not a descent direction; forget the curvature history. */
+	  num_pairs = 0;
+	  for (i = 0; i < n; i++)
+	    d[i] = -g[i];
+	  gd = maxent_dot (g, d, n);
+	}
+      if (gd == 0)
+	{
+	  bow_verbosify (bow_progress, "Gradient is zero, halting.\n");
+	  break;
+	}
+
+      /* Backtrack until the objective decreases enough. */
+      step = num_pairs ? 1.0 : 1.0 / sqrt (-gd);
+      for (k = 0; k < 30; k++)
+	{
+	  for (i = 0; i < n; i++)
+	    x_new[i] = x[i] + step * d[i];
+	  f_new = maxent_objective (m, max_ci, x_new, g_new, scratch);
+	  if (f_new <= f + 1e-4 * step * gd)
+	    break;
+	  step /= 2;
+	}
+      if (k == 30)
+	{
+	  bow_verbosify (bow_progress, "Line search failed, halting.\n");
+	  break;
+	}
+
+      /* Remember this step's change in lambdas and gradient, unless
+	 it shows no positive curvature. */
+      beta = 0;
+      for (i = 0; i < n; i++)
+	beta += (x_new[i] - x[i]) * (g_new[i] - g[i]);
+      if (beta > 0)
+	{
+	  newest = (newest + 1) % mem;
+	  for (i = 0; i < n; i++)
+	    {
+	      s[newest][i] = x_new[i] - x[i];
+	      y[newest][i] = g_new[i] - g[i];
+	    }
+	  rho[newest] = 1.0 / beta;
+	  if (num_pairs < mem)
+	    num_pairs++;
+	}
+
+      memcpy (x, x_new, sizeof (double) * n);
+      memcpy (g, g_new, sizeof (double) * n);
+      f = f_new;
+      maxent_csr_set_lambdas (m, vpc_barrel, max_wi, x);
+
+      bow_verbosify (bow_progress, 
+		     "%4d Objective: %f Gradient norm: %g\n",
+		     rounds, f, sqrt (maxent_dot (g, g, n)));
+      if (maxent_accuracy_docs)
+	bow_verbosify (bow_progress, 
+		       "%4d Selected Correct: %f\n", rounds,
+		       maxent_calculate_accuracy(doc_barrel, vpc_barrel, 
+						 maxent_accuracy_docs, 1));
+
+      /* calculate the new accuracy or log_prob for the halting check */
+      if (maxent_logprob_docs)
+	{
+	  old_log_prob = new_log_prob;
+	  new_log_prob = maxent_calculate_accuracy(doc_barrel, vpc_barrel, 
+						   maxent_logprob_docs, 2);
+	  bow_verbosify (bow_progress, "Halting Log Prob: %f\n", new_log_prob);
+	}
+      else if (maxent_halt_accuracy_docs)
+	{
+	  old_accuracy = new_accuracy;
+	  new_accuracy = maxent_calculate_accuracy (doc_barrel, vpc_barrel, 
+						    maxent_halt_accuracy_docs,
+						    1);
+	  bow_verbosify (bow_progress, "Halting Accuracy: %f\n", new_accuracy);
+	}
+
+      if (maxent_dot (g, g, n) <= 1e-10 * MAX (1.0, maxent_dot (x, x, n)))
+	{
+	  bow_verbosify (bow_progress, "Converged, halting.\n");
+	  break;
+	}
+    }
+
+  maxent_csr_set_lambdas (m, vpc_barrel, max_wi, x);
+
+  for (t = 0; t < nthreads; t++)
+    bow_free (scratch[t]);
+  bow_free (scratch);
+  for (k = 0; k < mem; k++)
+    {
+      bow_free (s[k]);
+      bow_free (y[k]);
+    }
+  bow_free (s);
+  bow_free (y);
+  bow_free (alpha);
+  bow_free (rho);
+  bow_free (x);
+  bow_free (g);
+  bow_free (x_new);
+  bow_free (g_new);
+  bow_free (d);
+  maxent_csr_free (m);
+}
+
 bow_barrel *
 bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
 {
@@ -1075,7 +1589,7 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
   int total_num_docs = 0;
   int **f_sharp;
   int max_f_sharp = 0;
-  double *coefficients[200];
+  double **coefficients;
   bow_dv *doc_dv;
   bow_dv *constraint_dv;
   bow_dv *lambda_dv;
@@ -1085,20 +1599,23 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
   maxent_polynomial *newton_poly;
   double log_prob_model;
   double beta;
-  double num_words_per_ci[200];
-  int num_unique_words_per_ci[200];
+  double *num_words_per_ci;
+  int *num_unique_words_per_ci;
   float old_log_prob = -FLT_MAX;
   float new_log_prob = -FLT_MAX / 2;
   float old_accuracy = -1;
   float new_accuracy = 0;
 
   if (bow_event_model == bow_event_document_then_word)
-    return (bow_maxent_new_vpc_with_weights_doc_then_word (doc_barrel));
+    {
+      if (maxent_use_lbfgs)
+	bow_error ("--maxent-lbfgs only works with the word event model.");
+      return (bow_maxent_new_vpc_with_weights_doc_then_word (doc_barrel));
+    }
 
   bow_maxent_model_building = 1;
 
   /* some sanity checks first */
-  assert (200 > bow_barrel_num_classes(doc_barrel));
   assert (doc_barrel->classnames);
   assert (bow_event_model == bow_event_word);
   assert (!maxent_words_per_class || !maxent_scoring_hack);
@@ -1111,6 +1628,9 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
 
   max_wi = MIN (doc_barrel->wi2dvf->size, bow_num_words ());
   max_ci = bow_barrel_num_classes (doc_barrel);
+  num_words_per_ci = bow_malloc (sizeof (double) * max_ci);
+  num_unique_words_per_ci = bow_malloc (sizeof (int) * max_ci);
+  hits = bow_malloc (sizeof (bow_score) * max_ci);
   f_sharp = bow_malloc (sizeof (int *) * doc_barrel->cdocs->length);
 
   for (di = 0; di < doc_barrel->cdocs->length; di++)
@@ -1315,6 +1835,21 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
 	}
     }
 
+  if (maxent_use_lbfgs)
+    {
+      maxent_train_lbfgs (doc_barrel, vpc_barrel, constraint_wi2dvf,
+			  max_wi, max_ci);
+      for (di = 0; di < doc_barrel->cdocs->length; di++)
+	bow_free (f_sharp[di]);
+      bow_free (f_sharp);
+      bow_free (num_words_per_ci);
+      bow_free (num_unique_words_per_ci);
+      bow_free (hits);
+      bow_wi2dvf_free (constraint_wi2dvf);
+      bow_maxent_model_building = 0;
+      return (vpc_barrel);
+    }
+
   /* set f_sharp of each document/class combination to be the sum of
      all the feature weights for that class for that doc.  set
      max_f_sharp to be the maximum of all the f_sharp values.  Note
@@ -1355,6 +1890,7 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
   max_f_sharp++;
 
   /* allocate space for the coefficients */
+  coefficients = bow_malloc (sizeof (double *) * max_ci);
   for (ci = 0; ci < max_ci; ci++)
     coefficients[ci] = bow_malloc (sizeof (double) * (max_f_sharp));
 
@@ -1382,7 +1918,6 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
       /* classify all the training documents, and store the class
 	 membership probs in each document's cdoc->class_probs */
       query_wv = NULL;
-      hits = alloca (sizeof (bow_score) * max_ci);
       num_tested = 0;
       test_heap = bow_test_new_heap (doc_barrel);
       log_prob_model = 0;
@@ -1556,6 +2091,10 @@ bow_maxent_new_vpc_with_weights (bow_barrel *doc_barrel)
   bow_free (newton_poly);
   for (ci = 0; ci < max_ci; ci++)
     bow_free (coefficients[ci]);
+  bow_free (coefficients);
+  bow_free (num_words_per_ci);
+  bow_free (num_unique_words_per_ci);
+  bow_free (hits);
   bow_maxent_model_building = 0;
   return (vpc_barrel);      
 }
@@ -1584,7 +2123,8 @@ bow_maxent_score (bow_barrel *barrel, bow_wv *query_wv,
 	  bow_barrel_num_classes (barrel) == bscores_len);
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (bow_barrel_num_classes (barrel) * sizeof (double));
+  scores = bow_thread_buffer (0, (bow_barrel_num_classes (barrel)
+				 * sizeof (double)));
   max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
   max_ci = bow_barrel_num_classes (barrel);
 
@@ -1718,28 +2258,8 @@ bow_maxent_score (bow_barrel *barrel, bow_wv *query_wv,
      SCORES in sorted order. */
   if (!bow_maxent_model_building)
     {
-      num_scores = 0;
-      for (ci = 0; ci < barrel->cdocs->length; ci++)
-	{
-	  if (num_scores < bscores_len
-	      || bscores[num_scores-1].weight < scores[ci])
-	    {
-	      /* We are going to put this score and CI into SCORES
-		 because either: (1) there is empty space in SCORES, or
-		 (2) SCORES[CI] is larger than the smallest score there
-		 currently. */
-	      int dsi;		/* an index into SCORES */
-	      if (num_scores < bscores_len)
-		num_scores++;
-	      dsi = num_scores - 1;
-	      /* Shift down all the entries that are smaller than SCORES[CI] */
-	      for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-		bscores[dsi] = bscores[dsi-1];
-	      /* Insert the new score */
-	      bscores[dsi].weight = scores[ci];
-	      bscores[dsi].di = ci;
-	    }
-	}
+      num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+					   bscores, bscores_len);
     }
   else
     {
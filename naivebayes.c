@@ -47,6 +47,10 @@ static bow_barrel *bow_naivebayes_goodturing_barrel = NULL;
 double *bow_naivebayes_dirichlet_alphas = NULL;
 double bow_naivebayes_dirichlet_total = 0;
 
+/* Bumped whenever the Good-Turing discounts or the Dirichlet alphas
+   above are recomputed, so that cached probabilities can tell. */
+static int bow_naivebayes_smoothing_generation = 0;
+
 /* The integer or single char used to represent this command-line option.
    Make sure it is unique across all libbow and rainbow. */
 #define NB_M_EST_M_KEY 3001
@@ -134,6 +138,7 @@ bow_naivebayes_initialize_goodturing (bow_barrel *barrel)
     }
 
   bow_naivebayes_goodturing_barrel = barrel;
+  bow_naivebayes_smoothing_generation++;
   bow_naivebayes_goodturing_discounts = bow_malloc (sizeof (double *) * 
 				     bow_barrel_num_classes(barrel));
   for (k = 0; k < bow_barrel_num_classes(barrel) ; k++)
@@ -224,6 +229,7 @@ bow_naivebayes_load_dirichlet_alphas ()
   if (bow_naivebayes_dirichlet_alphas)
     bow_free (bow_naivebayes_dirichlet_alphas);
   bow_naivebayes_dirichlet_alphas = bow_malloc (sizeof (double) * max_wi);
+  bow_naivebayes_smoothing_generation++;
   for (wi = 0; wi < max_wi; wi++)
     bow_naivebayes_dirichlet_alphas[wi] = 0.0;
   
@@ -248,6 +254,7 @@ bow_naivebayes_initialize_dirichlet_smoothing (bow_barrel *barrel)
   int wi;
   
   bow_naivebayes_dirichlet_total = 0;
+  bow_naivebayes_smoothing_generation++;
 
   /* make sure all the alphas are > 0 and calculate the sum */
   for (wi = 0; wi < max_wi; wi++)
@@ -261,6 +268,99 @@ bow_naivebayes_initialize_dirichlet_smoothing (bow_barrel *barrel)
     }
 }
 
+/* Return the probability of word WI in class CI of BARREL, whose
+   BOW_CDOC is CDOC, given that WI occurs NUM_WI_CI times among the
+   NUM_W_CI words of the class, according to the event model and
+   smoothing method. */
+static double
+bow_naivebayes_pr_from_counts (bow_barrel *barrel, int wi, int ci,
+			       bow_cdoc *cdoc,
+			       double num_wi_ci, double num_w_ci)
+{
+  double m_est_m;
+  double m_est_p;
+  double pr_w_c;
+
+  if (bow_event_model == bow_event_document)
+    {
+      /* This corresponds to adding two training pseudo-data points:
+	 one that has all features, and one that has no features. */
+      pr_w_c = ((num_wi_ci + 1)
+		/ (num_w_ci + 2));
+    }
+  else if (bow_smoothing_method == bow_smoothing_laplace
+	   || bow_smoothing_method == bow_smoothing_mestimate)
+    {
+      /* xxx This is not exactly right, because 
+	 BARREL->WI2DVF->NUM_WORDS might have changed with the
+	 removal of QUERY_WV's document. */
+      if (/* naivebayes_argp_m_est_m == 0 
+	     || */ bow_smoothing_method == bow_smoothing_laplace)
+	m_est_m = barrel->wi2dvf->num_words;
+      else
+	m_est_m = naivebayes_argp_m_est_m;
+      m_est_p = 1.0 / barrel->wi2dvf->num_words;
+      pr_w_c = ((num_wi_ci + m_est_m * m_est_p)
+		/ (num_w_ci + m_est_m));
+    }
+  else if (bow_smoothing_method == bow_smoothing_wittenbell)
+    {
+      /* Here CDOC->NORMALIZER is the number of unique terms in the class */
+      if (num_wi_ci > 0)
+	pr_w_c =
+	  (num_wi_ci / (num_w_ci + cdoc->normalizer));
+      else
+	{
+	  if (cdoc->word_count)
+	    /* There is training data for this class */
+	    pr_w_c = 
+	      (cdoc->normalizer
+	       / ((num_w_ci + cdoc->normalizer)
+		  * (barrel->wi2dvf->num_words - cdoc->normalizer)));
+	  else
+	    /* There no training data for this class */
+	    pr_w_c = 1.0 / barrel->wi2dvf->num_words;
+	}
+    }
+  else if (bow_smoothing_method == bow_smoothing_goodturing)
+    {
+      assert(barrel == bow_naivebayes_goodturing_barrel);
+      /* don't adjust if above k */
+      if (num_wi_ci > bow_smoothing_goodturing_k)
+	pr_w_c = num_wi_ci / num_w_ci;
+      /* if zero, just grab the stored weight */
+      else if (num_wi_ci == 0)
+	pr_w_c = bow_naivebayes_goodturing_discounts[ci][0];
+      /* else adjust by discount factor */
+      else
+	pr_w_c = bow_naivebayes_goodturing_discounts[ci][(int) num_wi_ci] * 
+	  num_wi_ci / num_w_ci;
+    }
+  else if (bow_smoothing_method == bow_smoothing_dirichlet)
+    {
+      pr_w_c = (num_wi_ci + bow_naivebayes_dirichlet_alphas[wi]) / 
+	(num_w_ci + bow_naivebayes_dirichlet_total);
+    }
+  else
+    {
+      bow_error ("Naivebayes does not implement smoothing method %d",
+		 bow_smoothing_method);
+      pr_w_c = 0;		/* to avoid gcc warning */
+    }
+
+#if 0
+  if (pr_w_c <= 0)
+    bow_error ("A negative word probability was calculated. "
+	       "This can happen if you are using\n"
+	       "--test-files-loo and the test files are "
+	       "not being lexed in the same way as they\n"
+	       "were when the model was built");
+  assert (pr_w_c > 0 && pr_w_c <= 1);
+#endif
+
+  return pr_w_c;
+}
+
 /* Return the probability of word WI in class CI. 
    If LOO_CLASS is non-negative, then we are doing 
    leave-out-one-document evaulation.  LOO_CLASS is the index
@@ -286,9 +386,6 @@ bow_naivebayes_pr_wi_ci (bow_barrel *barrel,
   double num_wi_ci;		/* the number of times wi occurs in class */
   double num_w_ci;		/* the number of words in class. */
   int dvi;
-  double m_est_m;
-  double m_est_p;
-  double pr_w_c;
 
   cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
   if (last_dv && *last_dv)
@@ -343,84 +440,150 @@ bow_naivebayes_pr_wi_ci (bow_barrel *barrel,
 	bow_error ("foo %g %g\n", num_wi_ci, num_w_ci);
     }
 
-  if (bow_event_model == bow_event_document)
-    {
-      /* This corresponds to adding two training pseudo-data points:
-	 one that has all features, and one that has no features. */
-      pr_w_c = ((num_wi_ci + 1)
-		/ (num_w_ci + 2));
-    }
-  else if (bow_smoothing_method == bow_smoothing_laplace
-	   || bow_smoothing_method == bow_smoothing_mestimate)
-    {
-      /* xxx This is not exactly right, because 
-	 BARREL->WI2DVF->NUM_WORDS might have changed with the
-	 removal of QUERY_WV's document. */
-      if (/* naivebayes_argp_m_est_m == 0 
-	     || */ bow_smoothing_method == bow_smoothing_laplace)
-	m_est_m = barrel->wi2dvf->num_words;
-      else
-	m_est_m = naivebayes_argp_m_est_m;
-      m_est_p = 1.0 / barrel->wi2dvf->num_words;
-      pr_w_c = ((num_wi_ci + m_est_m * m_est_p)
-		/ (num_w_ci + m_est_m));
-    }
-  else if (bow_smoothing_method == bow_smoothing_wittenbell)
+  return bow_naivebayes_pr_from_counts (barrel, wi, ci, cdoc,
+					num_wi_ci, num_w_ci);
+}
+
+/* Free the memory held by LOO. */
+void
+bow_naivebayes_loo_free (bow_naivebayes_loo *loo)
+{
+  bow_free (loo->word_count);
+  bow_free (loo->normalizer);
+  bow_free (loo->count);
+  bow_free (loo->log_pr);
+  bow_free (loo);
+}
+
+/* Fill in the rows of counts and log-probabilities of the words LO
+   through HI-1 of the barrel CTX. */
+static void
+bow_naivebayes_loo_fill_range (int lo, int hi, int thread, void *ctx)
+{
+  bow_barrel *barrel = ctx;
+  bow_naivebayes_loo *loo = barrel->nb_loo;
+  int num_classes = loo->num_classes;
+  bow_cdoc *cdoc;
+  bow_dv *dv;
+  float *count;
+  int wi, ci, dvi;
+
+  for (wi = lo; wi < hi; wi++)
     {
-      /* Here CDOC->NORMALIZER is the number of unique terms in the class */
-      if (num_wi_ci > 0)
-	pr_w_c =
-	  (num_wi_ci / (num_w_ci + cdoc->normalizer));
-      else
+      count = loo->count + (size_t)wi * num_classes;
+      for (ci = 0; ci < num_classes; ci++)
+	count[ci] = 0;
+      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+      if (!dv)
+	continue;
+      for (dvi = 0; dvi < dv->length; dvi++)
+	count[dv->entry[dvi].di] = dv->entry[dvi].weight;
+      for (ci = 0; ci < num_classes; ci++)
 	{
-	  if (cdoc->word_count)
-	    /* There is training data for this class */
-	    pr_w_c = 
-	      (cdoc->normalizer
-	       / ((num_w_ci + cdoc->normalizer)
-		  * (barrel->wi2dvf->num_words - cdoc->normalizer)));
-	  else
-	    /* There no training data for this class */
-	    pr_w_c = 1.0 / barrel->wi2dvf->num_words;
+	  cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+	  loo->log_pr[(size_t)wi * num_classes + ci] =
+	    log (bow_naivebayes_pr_from_counts (barrel, wi, ci, cdoc,
+						count[ci], cdoc->word_count));
 	}
     }
-  else if (bow_smoothing_method == bow_smoothing_goodturing)
+}
+
+bow_naivebayes_loo *
+bow_barrel_naivebayes_loo (bow_barrel *barrel)
+{
+  bow_naivebayes_loo *loo = barrel->nb_loo;
+  int num_classes = barrel->cdocs->length;
+  int max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
+  size_t num_counts = (size_t)max_wi * num_classes;
+  bow_cdoc *cdoc;
+  int ci;
+
+  /* Start over if the barrel has been rebuilt underneath us. */
+  if (loo && (loo->num_classes != num_classes
+	      || loo->max_wi != max_wi
+	      || loo->wi2dvf != barrel->wi2dvf
+	      || loo->num_words != barrel->wi2dvf->num_words
+	      || loo->event_model != bow_event_model
+	      || loo->smoothing_method != bow_smoothing_method
+	      || loo->m_est_m != naivebayes_argp_m_est_m
+	      || loo->smoothing_generation
+	         != bow_naivebayes_smoothing_generation))
     {
-      assert(barrel == bow_naivebayes_goodturing_barrel);
-      /* don't adjust if above k */
-      if (num_wi_ci > bow_smoothing_goodturing_k)
-	pr_w_c = num_wi_ci / num_w_ci;
-      /* if zero, just grab the stored weight */
-      else if (num_wi_ci == 0)
-	pr_w_c = bow_naivebayes_goodturing_discounts[ci][0];
-      /* else adjust by discount factor */
-      else
-	pr_w_c = bow_naivebayes_goodturing_discounts[ci][(int) num_wi_ci] * 
-	  num_wi_ci / num_w_ci;
+      bow_naivebayes_loo_free (loo);
+      loo = barrel->nb_loo = NULL;
     }
-  else if (bow_smoothing_method == bow_smoothing_dirichlet)
+  for (ci = 0; loo && ci < num_classes; ci++)
     {
-      pr_w_c = (num_wi_ci + bow_naivebayes_dirichlet_alphas[wi]) / 
-	(num_w_ci + bow_naivebayes_dirichlet_total);
+      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      if (loo->word_count[ci] != cdoc->word_count
+	  || loo->normalizer[ci] != cdoc->normalizer)
+	{
+	  bow_naivebayes_loo_free (loo);
+	  loo = barrel->nb_loo = NULL;
+	}
     }
-  else
+  if (loo)
+    return loo;
+
+  loo = bow_malloc (sizeof (bow_naivebayes_loo));
+  loo->num_classes = num_classes;
+  loo->max_wi = max_wi;
+  loo->wi2dvf = barrel->wi2dvf;
+  loo->num_words = barrel->wi2dvf->num_words;
+  loo->event_model = bow_event_model;
+  loo->smoothing_method = bow_smoothing_method;
+  loo->m_est_m = naivebayes_argp_m_est_m;
+  loo->smoothing_generation = bow_naivebayes_smoothing_generation;
+  loo->word_count = bow_malloc (num_classes * sizeof (int));
+  loo->normalizer = bow_malloc (num_classes * sizeof (float));
+  for (ci = 0; ci < num_classes; ci++)
     {
-      bow_error ("Naivebayes does not implement smoothing method %d",
-		 bow_smoothing_method);
-      pr_w_c = 0;		/* to avoid gcc warning */
+      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      loo->word_count[ci] = cdoc->word_count;
+      loo->normalizer[ci] = cdoc->normalizer;
     }
+  loo->count = bow_malloc (num_counts * sizeof (float));
+  loo->log_pr = bow_malloc (num_counts * sizeof (double));
+  barrel->nb_loo = loo;
+
+  /* The "document vectors" must all be in memory before the threads
+     look at them. */
+  bow_wi2dvf_read_in (barrel->wi2dvf, max_wi);
+  bow_parallel_for (max_wi, bow_naivebayes_loo_fill_range, barrel);
+  return loo;
+}
 
-#if 0
-  if (pr_w_c <= 0)
-    bow_error ("A negative word probability was calculated. "
-	       "This can happen if you are using\n"
-	       "--test-files-loo and the test files are "
-	       "not being lexed in the same way as they\n"
-	       "were when the model was built");
-  assert (pr_w_c > 0 && pr_w_c <= 1);
-#endif
+/* Free BARREL, along with its dense class counts. */
+void
+bow_naivebayes_free_barrel (bow_barrel *barrel)
+{
+  if (barrel->nb_loo)
+    bow_naivebayes_loo_free (barrel->nb_loo);
+  bow_barrel_free (barrel);
+}
 
-  return pr_w_c;
+/* Return the probability of word WI in class LOO_CLASS of BARREL,
+   whose dense counts are LOO, once a document containing LOO_WI_COUNT
+   of it among LOO_W_COUNT words has been removed from the class. */
+static double
+bow_naivebayes_loo_pr_wi (bow_barrel *barrel, bow_naivebayes_loo *loo,
+			  int wi, int loo_class,
+			  float loo_wi_count, float loo_w_count)
+{
+  bow_cdoc *cdoc = bow_array_entry_at_index (barrel->cdocs, loo_class);
+  double num_wi_ci;
+  double num_w_ci;
+
+  num_wi_ci = loo->count[(size_t)wi * loo->num_classes + loo_class];
+  if (num_wi_ci == 0)
+    bow_error ("There should be data for WI,CI");
+  num_w_ci = cdoc->word_count;
+  num_wi_ci -= loo_wi_count;
+  num_w_ci -= loo_w_count;
+  if (!(num_wi_ci >= 0 && num_w_ci >= 0))
+    bow_error ("foo %g %g\n", num_wi_ci, num_w_ci);
+  return bow_naivebayes_pr_from_counts (barrel, wi, loo_class, cdoc,
+					num_wi_ci, num_w_ci);
 }
 
 double
@@ -615,25 +778,139 @@ bow_naivebayes_set_cdoc_word_count_from_wi2dvf_weights (bow_barrel *barrel)
 }
 
 
+/* What the threads of bow_naivebayes_set_weights() share.  The
+   arrays of totals have one row for each thread. */
+typedef struct _bow_naivebayes_weights {
+  bow_barrel *barrel;
+  int num_classes;
+  int max_wi;
+  float *num_words_per_ci;	/* number of words in each class */
+  int **num_unique_per_ci;	/* number of unique words in each class */
+  int *num_unique_words;
+  int *total_num_words;
+  double total;			/* the sum of TOTAL_NUM_WORDS */
+  double **pr_all_w_c;		/* P(w|c) summed over words */
+} bow_naivebayes_weights;
+
+/* For the words LO through HI-1, add their occurrences into the totals
+   of thread THREAD, and put their total number of occurrences in
+   DV->IDF.  The number of words in each class is left to
+   bow_naivebayes_weights_class_range(). */
+static void
+bow_naivebayes_weights_count_range (int lo, int hi, int thread, void *arg)
+{
+  bow_naivebayes_weights *w = arg;
+  int *num_unique_per_ci = w->num_unique_per_ci[thread];
+  int num_unique_words = 0;
+  int total_num_words = 0;
+  bow_dv *dv;
+  int wi, dvi, ci;
+
+  for (ci = 0; ci < w->num_classes; ci++)
+    num_unique_per_ci[ci] = 0;
+  for (wi = lo; wi < hi; wi++) 
+    {
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
+      if (dv == NULL)
+	continue;
+      num_unique_words++;
+      dv->idf = 0.0;
+      for (dvi = 0; dvi < dv->length; dvi++) 
+	{
+	  num_unique_per_ci[dv->entry[dvi].di]++;
+	  dv->idf += dv->entry[dvi].weight;
+	  total_num_words += dv->entry[dvi].weight;
+	}
+    }
+  w->num_unique_words[thread] = num_unique_words;
+  w->total_num_words[thread] = total_num_words;
+}
+
+/* Total the weights of all words in each of the classes LO through
+   HI-1.  The sums are taken in order of word index, so they don't
+   depend on the number of threads. */
+static void
+bow_naivebayes_weights_class_range (int lo, int hi, int thread, void *arg)
+{
+  bow_naivebayes_weights *w = arg;
+  bow_dv *dv;
+  int wi, dvi, ci;
+
+  for (ci = lo; ci < hi; ci++)
+    w->num_words_per_ci[ci] = 0;
+  for (wi = 0; wi < w->max_wi; wi++) 
+    {
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
+      if (dv == NULL)
+	continue;
+      for (dvi = bow_dv_index_at_di (dv, lo);
+	   dvi < dv->length && dv->entry[dvi].di < hi; dvi++)
+	w->num_words_per_ci[dv->entry[dvi].di] += dv->entry[dvi].weight;
+    }
+}
+
+/* Divide the DV->IDF of the words LO through HI-1 by the total number
+   of words, so it is P(w). */
+static void
+bow_naivebayes_weights_idf_range (int lo, int hi, int thread, void *arg)
+{
+  bow_naivebayes_weights *w = arg;
+  bow_dv *dv;
+  int wi;
+
+  for (wi = lo; wi < hi; wi++) 
+    {
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
+      if (dv == NULL)
+	continue;
+      dv->idf /= w->total;
+    }
+}
+
+/* Add P(w|c) of the words LO through HI-1 into the sums of thread
+   THREAD. */
+static void
+bow_naivebayes_weights_check_range (int lo, int hi, int thread, void *arg)
+{
+  bow_naivebayes_weights *w = arg;
+  double *pr_all_w_c = w->pr_all_w_c[thread];
+  double pr_w_c;
+  bow_dv *dv;
+  int wi, ci;
+
+  for (ci = 0; ci < w->num_classes; ci++)
+    pr_all_w_c[ci] = 0;
+  for (wi = lo; wi < hi; wi++) 
+    {
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
+      /* If the model doesn't know about this word, skip it. */
+      if (dv == NULL)
+	continue;
+      for (ci = 0; ci < w->num_classes; ci++)
+	{
+	  pr_w_c = bow_naivebayes_pr_wi_ci (w->barrel, wi, ci, -1, 0, 0,
+					    NULL, NULL);
+	  assert (pr_w_c <= 1);
+	  pr_all_w_c[ci] += pr_w_c;
+	}
+    }
+}
+
 /* Function to assign `Naive Bayes'-style weights to each element of
-   each document vector. */
+   each document vector.  The passes over the words are made in
+   several threads, each totalling its own range of words. */
 void
 bow_naivebayes_set_weights (bow_barrel *barrel)
 {
   int ci;
   bow_cdoc *cdoc;
-  int wi;			/* a "word index" into WI2DVF */
   int max_wi;			/* the highest "word index" in WI2DVF. */
-  bow_dv *dv;			/* the "document vector" at index WI */
-  int dvi;			/* an index into the DV */
-  int weight_setting_num_words = 0;
-  double *pr_all_w_c = alloca (barrel->cdocs->length * sizeof (double));
-  double pr_w_c;
+  int num_classes = barrel->cdocs->length;
+  int nthreads, t;
+  bow_naivebayes_weights w;
+  int num_unique_words = 0;
+  double pr_all_w_c;
   int total_num_words = 0;
-  /* Gather the word count here instead of directly of in CDOC->WORD_COUNT
-     so we avoid round-off error with each increment.  Remember,
-     CDOC->WORD_COUNT is a int! */
-  float num_words_per_ci[bow_barrel_num_classes (barrel)];
   int barrel_is_empty = 0;
 
   /* We assume that we have already called BOW_BARREL_NEW_VPC() on
@@ -650,15 +927,33 @@ bow_naivebayes_set_weights (bow_barrel *barrel)
      verify it. */
   /* Get the total number of unique terms in each class; store this in
      CDOC->NORMALIZER. */
-  for (ci = 0; ci < barrel->cdocs->length; ci++)
+  for (ci = 0; ci < num_classes; ci++)
     {
       cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
       assert (cdoc->prior >= 0);
-      pr_all_w_c[ci] = 0;
       cdoc->normalizer = 0;
-      num_words_per_ci[ci] = 0;
     }
 
+  w.barrel = barrel;
+  w.num_classes = num_classes;
+  w.max_wi = max_wi;
+  /* Gather the word count here instead of directly of in CDOC->WORD_COUNT
+     so we avoid round-off error with each increment.  Remember,
+     CDOC->WORD_COUNT is a int! */
+  w.num_words_per_ci = alloca (num_classes * sizeof (float));
+  nthreads = bow_num_threads_for (max_wi);
+  w.num_unique_per_ci = alloca (nthreads * sizeof (int*));
+  w.pr_all_w_c = alloca (nthreads * sizeof (double*));
+  for (t = 0; t < nthreads; t++)
+    {
+      w.num_unique_per_ci[t] = bow_malloc (num_classes * sizeof (int));
+      w.pr_all_w_c[t] = bow_malloc (num_classes * sizeof (double));
+    }
+  w.num_unique_words = alloca (nthreads * sizeof (int));
+  w.total_num_words = alloca (nthreads * sizeof (int));
+  /* The threads may only read the "document vectors". */
+  bow_wi2dvf_read_in (barrel->wi2dvf, max_wi);
+
   /* Set the CDOC->WORD_COUNT for each class.  If we are using a
      document (binomial) model, then we'll just use the value of
      WORD_COUNT set in bow_barrel_new_vpc(), which is the total number
@@ -670,30 +965,20 @@ bow_naivebayes_set_weights (bow_barrel *barrel)
 	 CDOC->WORD_COUNT. */
       /* Calculate the total number of unique words, and make sure it is
 	 the same as BARREL->WI2DVF->NUM_WORDS. */
-      int num_unique_words = 0;
-
-      for (wi = 0; wi < max_wi; wi++) 
+      bow_parallel_for (num_classes, bow_naivebayes_weights_class_range, &w);
+      nthreads = bow_parallel_for (max_wi,
+				   bow_naivebayes_weights_count_range, &w);
+      for (ci = 0; ci < num_classes; ci++)
 	{
-	  dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-	  if (dv == NULL)
-	    continue;
-	  num_unique_words++;
-	  dv->idf = 0.0;
-	  for (dvi = 0; dvi < dv->length; dvi++) 
-	    {
-	      cdoc = bow_array_entry_at_index (barrel->cdocs, 
-					       dv->entry[dvi].di);
-	      ci = dv->entry[dvi].di;
-	      num_words_per_ci[ci] += dv->entry[dvi].weight;
-	      cdoc->normalizer++;
-	      dv->idf += dv->entry[dvi].weight;
-	      total_num_words += dv->entry[dvi].weight;
-	    }
+	  cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+	  for (t = 0; t < nthreads; t++)
+	    cdoc->normalizer += w.num_unique_per_ci[t][ci];
+	  cdoc->word_count = (int) rint (w.num_words_per_ci[ci]);
 	}
-      for (ci = 0; ci < barrel->cdocs->length; ci++)
+      for (t = 0; t < nthreads; t++)
 	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
-	  cdoc->word_count = (int) rint (num_words_per_ci[ci]);
+	  num_unique_words += w.num_unique_words[t];
+	  total_num_words += w.total_num_words[t];
 	}
       assert (num_unique_words == barrel->wi2dvf->num_words);
 
@@ -701,13 +986,8 @@ bow_naivebayes_set_weights (bow_barrel *barrel)
 	 P(w). */
       if (total_num_words)
 	{
-	  for (wi = 0; wi < max_wi; wi++) 
-	    {
-	      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-	      if (dv == NULL)
-		continue;
-	      dv->idf /= total_num_words;
-	    }
+	  w.total = total_num_words;
+	  bow_parallel_for (max_wi, bow_naivebayes_weights_idf_range, &w);
 	}
       else
 	{
@@ -729,34 +1009,23 @@ bow_naivebayes_set_weights (bow_barrel *barrel)
     {
       /* Now loop through all the classes, verifying the
 	 the probability of all in each class sums to one. */
-      total_num_words = 0;
-      for (wi = 0; wi < max_wi; wi++) 
-	{
-	  dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-	  /* If the model doesn't know about this word, skip it. */
-	  if (dv == NULL)
-	    continue;
-	  for (ci = 0; ci < barrel->cdocs->length; ci++)
-	    {
-	      pr_w_c = bow_naivebayes_pr_wi_ci (barrel, wi, ci, -1, 0, 0,
-						NULL, NULL);
-	      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
-	      assert (pr_w_c <= 1);
-	      pr_all_w_c[ci] += pr_w_c;
-	    }
-	  weight_setting_num_words++;
-	}
-      for (ci = 0; ci < barrel->cdocs->length; ci++)
+      nthreads = bow_parallel_for (max_wi,
+				   bow_naivebayes_weights_check_range, &w);
+      for (ci = 0; ci < num_classes; ci++)
 	{
+	  pr_all_w_c = 0;
+	  for (t = 0; t < nthreads; t++)
+	    pr_all_w_c += w.pr_all_w_c[t][ci];
 	  /* Is this too much round-off error to expect? */
-	  assert (pr_all_w_c[ci] < 1.01 && pr_all_w_c[ci] > 0.99);
+	  assert (pr_all_w_c < 1.01 && pr_all_w_c > 0.99);
 	}
     }
 
-#if 0
-  fprintf (stderr, "wi2dvf num_words %d, weight-setting num_words %d\n",
-	   barrel->wi2dvf->num_words, weight_setting_num_words);
-#endif
+  for (t = 0; t < bow_num_threads_for (max_wi); t++)
+    {
+      bow_free (w.num_unique_per_ci[t]);
+      bow_free (w.pr_all_w_c[t]);
+    }
 }
 
 #define IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR 999.99
@@ -782,15 +1051,23 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
   int hi;
   int max_wi;
   double query_wv_total_weight;
+  int in_query;			/* non-zero if WI is in QUERY_WV */
+  float query_weight;		/* the weight of WI in QUERY_WV, or 0 */
+  bow_naivebayes_loo *loo = NULL;
   
   /* Binomial event model with LOO processing doesn't work yet. */
   assert (bow_event_model != bow_event_document
 	  || loo_class == -1);
+
+  /* With leave-one-out evaluation, take the probabilities of the
+     classes the document wasn't removed from from the dense counts. */
+  if (loo_class >= 0)
+    loo = bow_barrel_naivebayes_loo (barrel);
   
   max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (barrel->cdocs->length * sizeof (double));
+  scores = bow_thread_buffer (0, barrel->cdocs->length * sizeof (double));
 
   /* Instead of multiplying probabilities, we will sum up
      log-probabilities, (so we don't loose floating point resolution),
@@ -866,8 +1143,8 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
 	 over all words in the vocabulary or over words in the query. */
       if (bow_event_model == bow_event_document)
 	{
-	  if (query_wv->entry[wvi].wi < wi
-	      && wvi < query_wv->num_entries)
+	  if (wvi < query_wv->num_entries
+	      && query_wv->entry[wvi].wi < wi)
 	    {
 	      assert (query_wv->entry[wvi].wi == wi-1);
 	      wvi++;
@@ -883,7 +1160,13 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
       if (!dv)
 	continue;
 
-      if (wi == query_wv->entry[wvi].wi && query_wv->num_entries)
+      /* Once past the last word of the query, WVI is off the end of
+	 its entries, so don't look there. */
+      in_query = (wvi < query_wv->num_entries
+		  && wi == query_wv->entry[wvi].wi);
+      query_weight = in_query ? query_wv->entry[wvi].weight : 0;
+
+      if (in_query)
 	{
 	  pr_w_d = ((double)query_wv->entry[wvi].count) / num_words_in_query;
 	  h_w_d -= pr_w_d * log (pr_w_d);
@@ -892,7 +1175,7 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
       if (bow_print_word_scores)
 	printf ("%-30s (queryweight=%.8f)\n",
 		bow_int2word (wi), 
-		query_wv->entry[wvi].weight * query_wv->normalizer);
+		query_weight * query_wv->normalizer);
 
       rescaler = DBL_MAX;
 
@@ -902,26 +1185,49 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
 	{
 	  if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
 	    continue;
-	  pr_w_c = bow_naivebayes_pr_wi_ci (barrel, wi, ci, 
-					    loo_class, 
-					    query_wv->entry[wvi].weight, 
-					    query_wv_total_weight,
-					    &dv, &dvi);
-	  /* If this is a word that does not occur in the document,
-	     then use the probability it does not occur in the class.
-	     This occurs only if we are using the document event model. */
-	  if (query_wv->num_entries == 0 || wi != query_wv->entry[wvi].wi)
-	    pr_w_c = 1.0 - pr_w_c;
-	  assert (pr_w_c > 0 && pr_w_c <= 1);
-
-	  /* Put the probability in log-space */
-	  log_pr_tf = log (pr_w_c);
+	  if (loo && wi < loo->max_wi)
+	    {
+	      /* Only the class the document was removed from differs
+		 from the model as it was built. */
+	      if (ci == loo_class)
+		{
+		  pr_w_c = bow_naivebayes_loo_pr_wi (barrel, loo, wi, ci,
+						     query_weight,
+						     query_wv_total_weight);
+		  assert (pr_w_c > 0 && pr_w_c <= 1);
+		  log_pr_tf = log (pr_w_c);
+		}
+	      else
+		{
+		  log_pr_tf = loo->log_pr[(size_t)wi * loo->num_classes + ci];
+		  assert (log_pr_tf <= 0);
+		  pr_w_c = exp (log_pr_tf);
+		}
+	    }
+	  else
+	    {
+	      pr_w_c = bow_naivebayes_pr_wi_ci (barrel, wi, ci, 
+						loo_class, 
+						query_weight, 
+						query_wv_total_weight,
+						&dv, &dvi);
+	      /* If this is a word that does not occur in the document,
+		 then use the probability it does not occur in the class.
+		 This occurs only if we are using the document event
+		 model. */
+	      if (!in_query)
+		pr_w_c = 1.0 - pr_w_c;
+	      assert (pr_w_c > 0 && pr_w_c <= 1);
+
+	      /* Put the probability in log-space */
+	      log_pr_tf = log (pr_w_c);
+	    }
 	  assert (log_pr_tf > -FLT_MAX + 1.0e5);
 
 	  /* Take into consideration the number of times it occurs in 
 	     the query document */
 	  if (bow_event_model != bow_event_document)
-	    log_pr_tf *= query_wv->entry[wvi].weight;
+	    log_pr_tf *= query_weight;
 	  assert (log_pr_tf > -FLT_MAX + 1.0e5);
 
 	  scores[ci] += log_pr_tf;
@@ -1093,30 +1399,11 @@ bow_naivebayes_score (bow_barrel *barrel, bow_wv *query_wv,
     /* Return the SCORES by putting them (and the `class indices') into
        SCORES in sorted order. */
 
-    num_scores = 0;
     for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
-	  scores[ci] = -DBL_MAX;
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES, or
-	       (2) SCORES[CI] is larger than the smallest score there
-	       currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    bscores[dsi].di = ci;
-	  }
-      }
+      if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
+	scores[ci] = -DBL_MAX;
+    num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+					 bscores, bscores_len);
   }
 
   return num_scores;
@@ -1140,7 +1427,7 @@ rainbow_method bow_method_naivebayes =
   bow_naivebayes_score,
   bow_wv_set_weights_to_count,
   NULL,				/* no need for extra weight normalization */
-  bow_barrel_free,
+  bow_naivebayes_free_barrel,
   &bow_naivebayes_params
 };
 
@@ -94,7 +94,7 @@ bow_nbsimple_score (bow_barrel *barrel, bow_wv *query_wv,
   vocabulary_size = barrel->wi2dvf->num_words;
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (barrel->cdocs->length * sizeof (double));
+  scores = bow_thread_buffer (0, barrel->cdocs->length * sizeof (double));
 
   /* Instead of multiplying probabilities, we will sum up
      log-probabilities, (so we don't loose floating point resolution),
@@ -223,33 +223,14 @@ bow_nbsimple_score (bow_barrel *barrel, bow_wv *query_wv,
       scores[ci] /= scores_sum;
  
   /* Return the SCORES by putting them (and the `class indices') into
-     SCORES in sorted order.  Do it by insertion sort because the
+     SCORES in sorted order.  Select them with a heap because the
      number of scores that were requested to be returned may be much
      smaller than the actually number of classes. */
-  num_scores = 0;
   for (ci = 0; ci < barrel->cdocs->length; ci++)
-    {
-      if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
-	scores[ci] = -DBL_MAX;
-      if (num_scores < bscores_len
-	  || bscores[num_scores-1].weight < scores[ci])
-	{
-	  /* We are going to put this score and CI into SCORES
-	     because either: (1) there is empty space in SCORES, or
-	     (2) SCORES[CI] is larger than the smallest score there
-	     currently. */
-	  int dsi;		/* an index into SCORES */
-	  if (num_scores < bscores_len)
-	    num_scores++;
-	  dsi = num_scores - 1;
-	  /* Shift down all the entries that are smaller than SCORES[CI] */
-	  for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	    bscores[dsi] = bscores[dsi-1];
-	  /* Insert the new score */
-	  bscores[dsi].weight = scores[ci];
-	  bscores[dsi].di = ci;
-	}
-    }
+    if (scores[ci] == IMPOSSIBLE_SCORE_FOR_ZERO_CLASS_PRIOR)
+      scores[ci] = -DBL_MAX;
+  num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+				       bscores, bscores_len);
 
   return num_scores;
 }
@@ -50,88 +50,157 @@ _finalize_for_summing (float total)
 }
 
 
+/* What the threads of _bow_barrel_normalize_weights() share. */
+struct _bow_normalize_context {
+  bow_barrel *barrel;
+  int num_docs;
+  float (*accumulator)(float, float);
+  float (*finalizer)(float);
+  int **next;			/* per document, one row for each thread */
+  int *start;			/* where each document's weights begin */
+  float *weights;		/* the weights of each document in turn */
+};
+
+/* Count the entries of the words LO through HI-1 that belong to
+   training documents into the row of thread THREAD. */
+static void
+_bow_barrel_normalize_count_range (int lo, int hi, int thread, void *arg)
+{
+  struct _bow_normalize_context *c = arg;
+  int *count = c->next[thread];
+  bow_cdoc *cdoc;
+  bow_dv *dv;
+  int wi, dvi, di;
+
+  for (di = 0; di < c->num_docs; di++)
+    count[di] = 0;
+  for (wi = lo; wi < hi; wi++)
+    {
+      dv = bow_wi2dvf_dv (c->barrel->wi2dvf, wi);
+      if (!dv)
+	continue;
+      assert (dv->idf == dv->idf);  /* NaN */
+      for (dvi = 0; dvi < dv->length; dvi++)
+	{
+	  cdoc = bow_cdocs_di2doc (c->barrel->cdocs, dv->entry[dvi].di);
+	  if (cdoc->type == bow_doc_train)
+	    count[dv->entry[dvi].di]++;
+	}
+    }
+}
+
+/* Copy the weights of the words LO through HI-1 that belong to
+   training documents into WEIGHTS, each at the next place thread
+   THREAD has for its document. */
+static void
+_bow_barrel_normalize_fill_range (int lo, int hi, int thread, void *arg)
+{
+  struct _bow_normalize_context *c = arg;
+  int *next = c->next[thread];
+  bow_cdoc *cdoc;
+  bow_dv *dv;
+  int wi, dvi, di;
+
+  for (wi = lo; wi < hi; wi++)
+    {
+      dv = bow_wi2dvf_dv (c->barrel->wi2dvf, wi);
+      if (!dv)
+	continue;
+      for (dvi = 0; dvi < dv->length; dvi++)
+	{
+	  di = dv->entry[dvi].di;
+	  cdoc = bow_cdocs_di2doc (c->barrel->cdocs, di);
+	  if (cdoc->type == bow_doc_train)
+	    c->weights[next[di]++] = dv->entry[dvi].weight;
+	}
+    }
+}
+
+/* Set the normalizer of the training documents LO through HI-1 that
+   have any words, from their weights in order of word index. */
+static void
+_bow_barrel_normalize_finish_range (int lo, int hi, int thread, void *arg)
+{
+  struct _bow_normalize_context *c = arg;
+  float norm_total;		/* the length of the word vector */
+  bow_cdoc *cdoc;		/* The document we're working on */
+  int di, i;
+
+  for (di = lo; di < hi; di++)
+    {
+      /* xxx Why isn't NORM_TOTAL always non-zero? -am */
+      if (c->start[di] == c->start[di + 1])
+	continue;
+      norm_total = 0.0;
+      for (i = c->start[di]; i < c->start[di + 1]; i++)
+	norm_total = (*c->accumulator)(norm_total, c->weights[i]);
+      /* Do final processing of, and store the result. */
+      cdoc = bow_cdocs_di2doc (c->barrel->cdocs, di);
+      cdoc->normalizer = (*c->finalizer)(norm_total);
+    }
+}
+
 /* Calculate the normalizing factor by which each weight should be 
-   multiplied.  Store it in each cdoc->normalizer. */
+   multiplied.  Store it in each cdoc->normalizer.  The words are
+   shared out among several threads, which gather the weights of each
+   document together in order of word index; then the documents are
+   shared out to add them up, so the result doesn't depend on the
+   number of threads. */
 static void
 _bow_barrel_normalize_weights (bow_barrel *barrel,
 			       float (*accumulator)(float, float),
 			       float (*finalizer)(float))
 				    
 {
-  int current_di;		/* the index of the document for which
-				   we are currently normalizing the
-				   "word vector". */
-  float norm_total;		/* the length of the word vector */
-  float weight;			/* the weight of a single wi/di entry */
-  bow_dv_heap *heap;		/* a heap of "document vectors" */
-  bow_cdoc *cdoc;		/* The document we're working on */
+  struct _bow_normalize_context c;
+  int max_wi;
+  int nthreads, t, di, n;
 
   assert (barrel);
 
-  heap = bow_make_dv_heap_from_wi2dvf (barrel->wi2dvf);
-
-  bow_verbosify (bow_progress, "Normalizing weights:          ");
-
-  /* Keep going until the heap is empty */
-  while (heap->length > 0)
+  bow_verbosify (bow_progress, "Normalizing weights... ");
+
+  c.barrel = barrel;
+  c.num_docs = barrel->cdocs->length;
+  c.accumulator = accumulator;
+  c.finalizer = finalizer;
+  max_wi = MIN (barrel->wi2dvf->size, bow_num_words ());
+  nthreads = bow_num_threads_for (max_wi);
+  c.next = alloca (nthreads * sizeof (int*));
+  for (t = 0; t < nthreads; t++)
+    c.next[t] = bow_malloc (c.num_docs * sizeof (int));
+  c.start = bow_malloc ((c.num_docs + 1) * sizeof (int));
+  bow_wi2dvf_read_in (barrel->wi2dvf, max_wi);
+  nthreads = bow_parallel_for (max_wi, _bow_barrel_normalize_count_range, &c);
+
+  /* Turn the counts into the place where each thread puts the first
+     weight it has for each document. */
+  n = 0;
+  for (di = 0; di < c.num_docs; di++)
     {
-      /* Set the current document we're working on */
-      current_di = heap->entry[0].current_di;
-      assert (heap->entry[0].dv->idf == heap->entry[0].dv->idf);  /* NaN */
-
-      if (current_di % 10 == 0)
-	bow_verbosify (bow_progress, "\b\b\b\b\b\b%6d", current_di);
-
-      /* Here we should check if this di is part of some training set and
-	 move on if it isn't. */
-    
-      /* Get the document */
-      cdoc = bow_cdocs_di2doc (barrel->cdocs, current_di);
-
-      /* If it's not a model document, then move on to next one */
-      if (cdoc->type != bow_doc_train)
+      c.start[di] = n;
+      for (t = 0; t < nthreads; t++)
 	{
-	  do 
-	    {
-	      bow_dv_heap_update (heap);
-	    }
-	  while ((current_di == heap->entry[0].current_di)
-		 && (heap->length > 0));
-	  
-	  /* Try again */
-	  continue;
+	  int count = c.next[t][di];
+	  c.next[t][di] = n;
+	  n += count;
 	}
-    
-      /* Reset the length */
-      norm_total = 0.0;
-
-      /* Loop over all words in this document, summing up the score */
-      do 
-	{
-	  weight = heap->entry[0].dv->entry[heap->entry[0].index].weight;
-	  norm_total = (*accumulator)(norm_total, weight);
-
-	  /* Update the heap, we are done with this di, move it to its
-	     new position */
-	  bow_dv_heap_update (heap);
-	} 
-      while ((current_di == heap->entry[0].current_di)
-	     && (heap->length > 0));
-
-      /* xxx Why isn't this always true? -am */
-      /* assert (norm_total != 0); */
-
-      /* Do final processing of, and store the result. */
-      cdoc->normalizer = (*finalizer)(norm_total);
-
     }
+  c.start[c.num_docs] = n;
+  c.weights = bow_malloc ((n ? n : 1) * sizeof (float));
+  bow_parallel_for (max_wi, _bow_barrel_normalize_fill_range, &c);
+  for (t = 0; t < nthreads; t++)
+    bow_free (c.next[t]);
+
+  bow_parallel_for (c.num_docs, _bow_barrel_normalize_finish_range, &c);
+  bow_free (c.weights);
+  bow_free (c.start);
 
   /* xxx We could actually re-set the weights using the normalizer now
      and avoid storing the normalizer.  This would be easier than
      figuring out the normalizer, because we don't have to use the heap
      again, we can just loop through all the WI's and DVI's. */
 
-  bow_free (heap);
   bow_verbosify (bow_progress, "\n"); 
 }
 
@@ -25,6 +25,9 @@ int bow_prune_vocab_by_infogain_n = 0;
 /* Remove words that occur less than N times */
 int bow_prune_vocab_by_occur_count_n = 0;
 
+/* The measure by which `--prune-vocab-by-infogain' ranks words. */
+bow_feature_scores bow_prune_vocab_score = bow_feature_score_infogain;
+
 /* The weight-setting and scoring method set on the command-line. */
 bow_method *bow_argp_method = NULL;
 
@@ -67,6 +70,10 @@ int bow_prune_words_by_doc_count_n = 0;
 /* Random seed to use for srand, if not equal to -1 */
 int bow_random_seed = -1;
 
+/* Number of threads to use for the parts of training and scoring that
+   run in parallel; 0 means one per processor. */
+int bow_num_threads = 1;
+
 /* What "event-model" we will use for the probabilistic models. */
 bow_event_models bow_event_model = bow_event_word;
 
@@ -128,6 +135,8 @@ enum {
   XXX_WORDS_ONLY_KEY,
   MAX_NUM_WORDS_PER_DOCUMENT_KEY,
   USE_UNKNOWN_WORD_KEY,
+  NUM_THREADS_KEY,
+  PRUNE_VOCAB_SCORE_KEY,
 };
 
 static struct argp_option bow_options[] =
@@ -148,6 +157,9 @@ static struct argp_option bow_options[] =
    "The non-negative integer to use for seeding the random number generator"},
   {"annotations", ANNOTATION_KEY, "FILE", 0,
    "The sarray file containing annotations for the files in the index"},
+  {"num-threads", NUM_THREADS_KEY, "N", 0,
+   "Use N threads for the parts of training and scoring that can run "
+   "in parallel.  0 means one per processor.  Default is 1."},
 
 #if HAVE_HDB
   {"hdb", HDB_KEY, 0, 0,
@@ -226,6 +238,9 @@ static struct argp_option bow_options[] =
   {"prune-vocab-by-infogain", 'T', "N", 0,
    "Remove all but the top N words by selecting words with highest "
    "information gain."},
+  {"prune-vocab-score", PRUNE_VOCAB_SCORE_KEY, "SCORE", 0,
+   "Rank words for --prune-vocab-by-infogain by SCORE instead, which can "
+   "be one of: infogain, chi2, odds-ratio.  Default is `infogain'."},
   {"prune-vocab-by-occur-count", 'O', "N", 0,
    "Remove words that occur less than N times."},
   {"prune-vocab-by-doc-count", 'D', "N", 0,
@@ -288,6 +303,15 @@ parse_bow_opt (int opt, char *arg, struct argp_state *state)
       /* Set name of the directory in which we'll store word-vector data. */
       bow_data_dirname = arg;
       break;
+    case NUM_THREADS_KEY:
+      bow_num_threads = atoi (arg);
+      if (bow_num_threads < 0)
+	{
+	  fprintf (stderr,
+		   "--num-threads: N must be non-negative.\n");
+	  return ARGP_ERR_UNKNOWN;
+	}
+      break;
     case SCORE_PRINT_PRECISION:
       /* Set the number of digits to print */
       bow_score_print_precision = atoi(optarg);
@@ -446,6 +470,16 @@ parse_bow_opt (int opt, char *arg, struct argp_state *state)
 	 information gain */
       bow_prune_vocab_by_infogain_n = atoi (arg);
       break;
+    case PRUNE_VOCAB_SCORE_KEY:
+      if (!strcmp (arg, "infogain"))
+	bow_prune_vocab_score = bow_feature_score_infogain;
+      else if (!strcmp (arg, "chi2"))
+	bow_prune_vocab_score = bow_feature_score_chi2;
+      else if (!strcmp (arg, "odds-ratio"))
+	bow_prune_vocab_score = bow_feature_score_oddsratio;
+      else
+	bow_error ("--prune-vocab-score: No such score `%s'", arg);
+      break;
     case 'O':
       /* Remove words that occur less than N times */
       bow_prune_vocab_by_occur_count_n = atoi (arg);
@@ -87,60 +87,44 @@ static struct argp_child prind_argp_child =
 };
 
 
-/* Function to assign `PrInd'-style weights to each element of
-   each document vector. */
-void
-bow_prind_set_weights (bow_barrel *barrel)
+/* What the threads of bow_prind_set_weights() share. */
+typedef struct _bow_prind_weights {
+  bow_barrel *barrel;
+  int num_classes;
+  int **word_count;		/* per class, one row for each thread */
+  int *total_term_count;	/* one for each thread */
+  int total;			/* the sum of TOTAL_TERM_COUNT */
+} bow_prind_weights;
+
+/* For the words LO through HI-1, add their occurrences in training
+   classes into the totals of thread THREAD, and put their total
+   number of occurrences in DV->IDF. */
+static void
+bow_prind_weights_count_range (int lo, int hi, int thread, void *arg)
 {
-  int ci;
+  bow_prind_weights *w = arg;
+  int *word_count = w->word_count[thread];
+  int total_term_count = 0;
   bow_cdoc *cdoc;
-  int wi;			/* a "word index" into WI2DVF */
-  int max_wi;			/* the highest "word index" in WI2DVF. */
-  bow_dv *dv;			/* the "document vector" at index WI */
-  int dvi;			/* an index into the DV */
-  int total_term_count;
-
-  /* We assume that we have already called BOW_BARREL_NEW_VPC() on
-     BARREL, so BARREL already has one-document-per-class. */
-    
-  assert (!strcmp (barrel->method->name, "prind"));
-  max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
-
-  /* The CDOC->PRIOR should have been set in bow_barrel_new_vpc();
-     verify it. */
-  for (ci = 0; ci < barrel->cdocs->length; ci++)
-    {
-      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
-      assert (cdoc->prior >= 0);
-    }
-
-  /* Get the total number of terms in each class; temporarily store
-     this in cdoc->word_count.  Also, get the total count for each
-     term across all classes, and store it in the IDF of the
-     respective word vector.  (WARNING: this is an odd use of the IDF
-     variable.)  Also, get the total number of terms, across all
-     terms, all classes, put it in TOTAL_TERM_COUNT. */
+  bow_dv *dv;
+  int wi, dvi, ci;
 
-  for (ci = 0; ci < barrel->cdocs->length; ci++)
+  for (ci = 0; ci < w->num_classes; ci++)
+    word_count[ci] = 0;
+  for (wi = lo; wi < hi; wi++) 
     {
-      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
-      cdoc->word_count = 0;
-    }
-  total_term_count = 0;
-  for (wi = 0; wi < max_wi; wi++) 
-    {
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
       if (dv == NULL)
 	continue;
       dv->idf = 0;
       for (dvi = 0; dvi < dv->length; dvi++) 
 	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, 
+	  cdoc = bow_array_entry_at_index (w->barrel->cdocs, 
 					   dv->entry[dvi].di);
 	  if (cdoc->type != bow_doc_train)
 	    continue;
 	  /* Summing total number of words in each class */
-	  cdoc->word_count += dv->entry[dvi].count;
+	  word_count[dv->entry[dvi].di] += dv->entry[dvi].count;
 	  /* Summing total word occurrences across all classes. */
 	  dv->idf += dv->entry[dvi].count;
 	  assert (dv->idf > 0);
@@ -148,14 +132,21 @@ bow_prind_set_weights (bow_barrel *barrel)
 	  total_term_count += dv->entry[dvi].count;
 	}
     }
+  w->total_term_count[thread] = total_term_count;
+}
 
-  /* Set the weights in the BARREL's WI2DVF so that they are
-     equal to P(w|C)/P(w), the probability of a class given a word,
-     divided by the probability of a word across all classes.   This
-     combination is equal to P(C|w), but without the prior P(C). */
-  for (wi = 0; wi < max_wi; wi++) 
+/* Set the weights of the words LO through HI-1. */
+static void
+bow_prind_weights_set_range (int lo, int hi, int thread, void *arg)
+{
+  bow_prind_weights *w = arg;
+  bow_cdoc *cdoc;
+  bow_dv *dv;
+  int wi, dvi;
+
+  for (wi = lo; wi < hi; wi++) 
     {
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
       if (dv == NULL)
 	continue;
       /* Now loop through all the elements, setting their weights */
@@ -163,7 +154,7 @@ bow_prind_set_weights (bow_barrel *barrel)
 	{
 	  float pr_x_c;
 	  float pr_x;
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, 
+	  cdoc = bow_array_entry_at_index (w->barrel->cdocs, 
 					   dv->entry[dvi].di);
 	  /* Skip this document/class if it is not part of the model. */
 	  if (cdoc->type != bow_doc_train)
@@ -178,13 +169,77 @@ bow_prind_set_weights (bow_barrel *barrel)
 	  pr_x_c = 
 	    (float)(dv->entry[dvi].count) / cdoc->word_count;
 	  /* The probability of a word across all classes. */
-	  pr_x = dv->idf / total_term_count;
+	  pr_x = dv->idf / w->total;
 	  dv->entry[dvi].weight = pr_x_c / pr_x;
 	  assert (dv->entry[dvi].weight >= 0);
 	}
 
       /* Don't reset the DV->IDF; we'll use its current value later */
     }
+}
+
+/* Function to assign `PrInd'-style weights to each element of
+   each document vector.  Both passes over the words are made in
+   several threads. */
+void
+bow_prind_set_weights (bow_barrel *barrel)
+{
+  int ci;
+  bow_cdoc *cdoc;
+  int max_wi;			/* the highest "word index" in WI2DVF. */
+  int num_classes = barrel->cdocs->length;
+  int nthreads, t;
+  bow_prind_weights w;
+
+  /* We assume that we have already called BOW_BARREL_NEW_VPC() on
+     BARREL, so BARREL already has one-document-per-class. */
+    
+  assert (!strcmp (barrel->method->name, "prind"));
+  max_wi = MIN (barrel->wi2dvf->size, bow_num_words());
+
+  /* The CDOC->PRIOR should have been set in bow_barrel_new_vpc();
+     verify it. */
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      assert (cdoc->prior >= 0);
+    }
+
+  /* Get the total number of terms in each class; temporarily store
+     this in cdoc->word_count.  Also, get the total count for each
+     term across all classes, and store it in the IDF of the
+     respective word vector.  (WARNING: this is an odd use of the IDF
+     variable.)  Also, get the total number of terms, across all
+     terms, all classes, put it in TOTAL_TERM_COUNT. */
+  w.barrel = barrel;
+  w.num_classes = num_classes;
+  nthreads = bow_num_threads_for (max_wi);
+  w.word_count = alloca (nthreads * sizeof (int*));
+  for (t = 0; t < nthreads; t++)
+    w.word_count[t] = bow_malloc (num_classes * sizeof (int));
+  w.total_term_count = alloca (nthreads * sizeof (int));
+  /* The threads may only read the "document vectors". */
+  bow_wi2dvf_read_in (barrel->wi2dvf, max_wi);
+  nthreads = bow_parallel_for (max_wi, bow_prind_weights_count_range, &w);
+
+  w.total = 0;
+  for (t = 0; t < nthreads; t++)
+    w.total += w.total_term_count[t];
+  for (ci = 0; ci < num_classes; ci++)
+    {
+      cdoc = bow_array_entry_at_index (barrel->cdocs, ci);
+      cdoc->word_count = 0;
+      for (t = 0; t < nthreads; t++)
+	cdoc->word_count += w.word_count[t][ci];
+    }
+  for (t = 0; t < nthreads; t++)
+    bow_free (w.word_count[t]);
+
+  /* Set the weights in the BARREL's WI2DVF so that they are
+     equal to P(w|C)/P(w), the probability of a class given a word,
+     divided by the probability of a word across all classes.   This
+     combination is equal to P(C|w), but without the prior P(C). */
+  bow_parallel_for (max_wi, bow_prind_weights_set_range, &w);
   /* NOTE: These weights are missing the prior probabilities P(C), and
      are not normalized to sum to one. */
 }
@@ -207,7 +262,7 @@ bow_prind_score (bow_barrel *barrel, bow_wv *query_wv,
 #endif
 
   /* Allocate space to store scores for *all* classes (documents) */
-  scores = alloca (barrel->cdocs->length * sizeof (double));
+  scores = bow_thread_buffer (0, barrel->cdocs->length * sizeof (double));
 
   /* Initialize the SCORES to zero. */
   for (ci = 0; ci < barrel->cdocs->length; ci++)
@@ -314,30 +369,11 @@ bow_prind_score (bow_barrel *barrel, bow_wv *query_wv,
   /* Return the SCORES by putting them (and the `class indices') into
      SCORES in sorted order. */
   {
-    num_scores = 0;
+    /* Check for NaN. */
     for (ci = 0; ci < barrel->cdocs->length; ci++)
-      {
-	if (num_scores < bscores_len
-	    || bscores[num_scores-1].weight < scores[ci])
-	  {
-	    /* We are going to put this score and CI into SCORES
-	       because either: (1) there is empty space in SCORES,
-	       or (2) SCORES[CI] is larger than the smallest score
-	       there currently. */
-	    int dsi;		/* an index into SCORES */
-	    if (num_scores < bscores_len)
-	      num_scores++;
-	    dsi = num_scores - 1;
-	    /* Shift down all the entries that are smaller than SCORES[CI] */
-	    for (; dsi > 0 && bscores[dsi-1].weight < scores[ci]; dsi--)
-	      bscores[dsi] = bscores[dsi-1];
-	    /* Insert the new score */
-	    bscores[dsi].weight = scores[ci];
-	    /* Check for NaN. */
-	    assert (bscores[dsi].weight == bscores[dsi].weight);
-	    bscores[dsi].di = ci;
-	  }
-      }
+      assert (scores[ci] == scores[ci]);
+    num_scores = bow_scores_select_top (scores, barrel->cdocs->length,
+					 bscores, bscores_len);
   }
 
   return num_scores;
@@ -23,18 +23,28 @@
 
 #include <bow/libbow.h>
 #include <bow/archer.h>
+#include <stddef.h>		/* for offsetof() */
 
 #define PV_DEBUG 1
 
 
 
-/* The total amount of memory consumed by PVM's */
-int bow_pvm_total_bytes = 0;
-
-/* The maximum memory we will allow PVM's to take before we flush them
-   to disk.  Currently set to 128M */
+/* The maximum memory we will allow the PVM's of one WI2PV to take
+   before we flush them to disk.  Currently set to 128M */
 int bow_pvm_max_total_bytes = 128 * 1024 * 1024;
 
+/* The size of the blocks on which bow_pv_compact() lays out PV's. */
+int bow_pv_block_size = 4096;
+
+/* The largest number of bytes that bow_pv_cursor_next_di_pi() reads
+   from disk at once into the buffer of a cursor. */
+int bow_pv_read_block_size = 64 * 1024;
+
+/* The least number of entries between the skip entries of a PV.
+   bow_pv_add_di_pi() adds one at the first document to begin after
+   this many entries since the last. */
+int bow_pv_skip_interval = 128;
+
 /* Allocate and return a new PVM that can hold SIZE bytes */
 bow_pvm *
 bow_pvm_new (int size)
@@ -43,7 +53,6 @@ bow_pvm_new (int size)
   ret->size = size;
   ret->read_end = 0;
   ret->write_end = 0;
-  bow_pvm_total_bytes += sizeof (bow_pvm) + size;
   return ret;
 }
 
@@ -53,15 +62,9 @@ void
 bow_pvm_grow (bow_pvm **pvm)
 {
   if ((*pvm)->size < 64 * 1024)
-    {
-      (*pvm)->size *= 2;
-      bow_pvm_total_bytes += (*pvm)->size;
-    }
+    (*pvm)->size *= 2;
   else
-    {
-      (*pvm)->size += 64 * 1024;
-      bow_pvm_total_bytes += 64 * 1024;
-    }
+    (*pvm)->size += 64 * 1024;
   *pvm = bow_realloc (*pvm, sizeof (bow_pvm) + (*pvm)->size);
 }
 
@@ -72,13 +75,6 @@ bow_pvm_free (bow_pvm *pvm)
   bow_free (pvm);
 }
 
-/* Put the PVM's reader-pointer back to the beginning */
-static inline void
-bow_pvm_rewind (bow_pvm *pvm)
-{
-  pvm->read_end = 0;
-}
-
 
 
 /* PV functions */
@@ -100,8 +96,11 @@ bow_pv_init (bow_pv *pv, FILE *fp)
 {
   //pv->byte_count = 0;
   pv->word_count = 0;
-  //pv->document_count = 0;
+  pv->document_count = 0;
+  pv->max_document_word_count = 0;
+  pv->write_document_word_count = 0;
   pv->pvm = NULL;
+  pv->skips = NULL;
   pv->seek_start = 0; //-1
   pv->read_seek_end = 0;
   pv->read_segment_bytes_remaining = -1;
@@ -109,31 +108,30 @@ bow_pv_init (bow_pv *pv, FILE *fp)
   pv->read_last_pi = -1;
   pv->write_last_di = -1;
   pv->write_last_pi = -1;
-  pv->write_seek_last_tailer = 0;	/* This value must match READ_SEEK_END */
+  /* This value must match the READ_SEEK_END of a new bow_pv_cursor */
+  pv->write_seek_last_tailer = 0;
 }
 
-/* Write this PV's PVM to disk, and free the PVM. */
+/* Write this PV's PVM to disk, and free the PVM.  FP must be
+   positioned at its end, and is left there. */
 void
 bow_pv_flush (bow_pv *pv, FILE *fp)
 {
   off_t seek_new_segment;
   off_t seek_new_tailer;
+  int i;
 
   if (pv->pvm == NULL || pv->pvm->write_end == 0)
     return;
 
-  /* Seek to the end of the file, which is the position at which this
-     segment of the PV will begin. */
-  fseeko (fp, 0, SEEK_END);
+  /* This segment of the PV begins at the end of the file, where FP
+     already is.  Seeking there would write out FP's buffer every time,
+     and so every PV flushed. */
   seek_new_segment = ftello (fp);
   /* If none of this PV has ever been written to disk, remember this
-     position as the start position so that we can rewind there later. */
+     position as the start position so that we can read from there. */
   if (pv->seek_start == 0) //-1
-    {
-      pv->seek_start = seek_new_segment;
-      pv->read_seek_end = seek_new_segment;
-      pv->read_segment_bytes_remaining = pv->pvm->write_end;
-    }
+    pv->seek_start = seek_new_segment;
   /* Write the "header", which is the number of contents data bytes in
      this segment. */
   bow_fwrite_int (pv->pvm->write_end, fp);
@@ -151,13 +149,147 @@ bow_pv_flush (bow_pv *pv, FILE *fp)
     {
       fseeko (fp, pv->write_seek_last_tailer, SEEK_SET);
       bow_fwrite_off_t (seek_new_segment, fp);
+      fseeko (fp, 0, SEEK_END);
     }
   pv->write_seek_last_tailer = seek_new_tailer;
-  bow_pvm_total_bytes -= sizeof (bow_pvm) + pv->pvm->size;
+  /* The skip entries into this segment now have a place on disk. */
+  if (pv->skips)
+    for (i = pv->skips->length - 1;
+	 i >= 0 && pv->skips->entry[i].segment_bytes_remaining < 0; i--)
+      {
+	bow_pv_skip *skip = &(pv->skips->entry[i]);
+	skip->segment_bytes_remaining = pv->pvm->write_end - skip->seek;
+	skip->seek += seek_new_segment + sizeof (int);
+      }
   bow_pvm_free (pv->pvm);
   pv->pvm = NULL;
 }
 
+/* Call FN on each segment of PV that is on disk in FP, in order,
+   passing the seek position of its contents data and the number of
+   bytes there.  Returns the total number of bytes. */
+static off_t
+bow_pv_map_segments (bow_pv *pv, FILE *fp,
+		     void (*fn) (off_t seek, int bytes, void *ctx), void *ctx)
+{
+  off_t seek_segment = pv->seek_start;
+  off_t seek_tailer;
+  off_t total = 0;
+  int bytes;
+
+  for (;;)
+    {
+      fseeko (fp, seek_segment, SEEK_SET);
+      bow_fread_int (&bytes, fp);
+      assert (bytes > 0);
+      if (fn)
+	(*fn) (seek_segment + sizeof (int), bytes, ctx);
+      total += bytes;
+      seek_tailer = seek_segment + sizeof (int) + bytes;
+      if (seek_tailer == pv->write_seek_last_tailer)
+	return total;
+      fseeko (fp, seek_tailer, SEEK_SET);
+      bow_fread_off_t (&seek_segment, fp);
+      assert (seek_segment > 0);
+    }
+}
+
+/* Where bow_pv_compact_copy() copies from and to, and the skip
+   entries it moves along. */
+struct _bow_pv_compact_copy {
+  FILE *fp;
+  FILE *new_fp;
+  off_t seek_new;
+  off_t seek_new_end;		/* the end of the new segment's contents */
+  bow_pv_skips *skips;
+  int skip_index;		/* the next of SKIPS to be moved */
+};
+
+/* Append the BYTES bytes at SEEK in one file to the other, which is
+   already positioned at its end. */
+static void
+bow_pv_compact_copy (off_t seek, int bytes, void *ctx)
+{
+  struct _bow_pv_compact_copy *c = ctx;
+  char buf[8192];
+  int n;
+
+  while (c->skips && c->skip_index < c->skips->length
+	 && c->skips->entry[c->skip_index].seek < seek + bytes)
+    {
+      bow_pv_skip *skip = &(c->skips->entry[c->skip_index++]);
+      assert (skip->seek >= seek);
+      skip->seek = c->seek_new + (skip->seek - seek);
+      skip->segment_bytes_remaining = c->seek_new_end - skip->seek;
+    }
+  while (bytes > 0)
+    {
+      n = MIN (bytes, (int) sizeof (buf));
+      fseeko (c->fp, seek, SEEK_SET);
+      if (fread (buf, 1, n, c->fp) != n)
+	bow_error ("Couldn't read position vector segment");
+      fwrite (buf, 1, n, c->new_fp);
+      seek += n;
+      c->seek_new += n;
+      bytes -= n;
+    }
+}
+
+/* Copy the segments of PV on FP into a single segment at the end of
+   NEW_FP, which must be positioned there, and make PV refer to that
+   one.  The data of the segments simply run on from one to
+   the next, so the contents of the new segment are their
+   concatenation.  A segment that fits in a block of BOW_PV_BLOCK_SIZE
+   bytes is placed so that it doesn't cross into the next block; a
+   larger one starts at the beginning of a block.  The skip entries of
+   PV are moved to the new segment along with the data. */
+void
+bow_pv_compact (bow_pv *pv, FILE *fp, FILE *new_fp)
+{
+  struct _bow_pv_compact_copy c;
+  off_t seek_new_segment;
+  off_t total;
+  int block_offset;
+  int pad;
+
+  /* Compacting other PV's moves FP about. */
+  if (pv->pvm)
+    {
+      fseeko (fp, 0, SEEK_END);
+      bow_pv_flush (pv, fp);
+      fflush (fp);
+    }
+  if (pv->seek_start == 0)
+    return;
+  total = bow_pv_map_segments (pv, fp, NULL, NULL);
+  assert (total < INT_MAX);
+
+  seek_new_segment = ftello (new_fp);
+  block_offset = seek_new_segment % bow_pv_block_size;
+  if (block_offset != 0
+      && (sizeof (int) + total + sizeof (off_t) > bow_pv_block_size
+	  || (block_offset + sizeof (int) + total + sizeof (off_t)
+	      > bow_pv_block_size)))
+    {
+      for (pad = bow_pv_block_size - block_offset; pad > 0; pad--)
+	fputc (0, new_fp);
+      seek_new_segment += bow_pv_block_size - block_offset;
+    }
+  bow_fwrite_int (total, new_fp);
+
+  c.fp = fp;
+  c.new_fp = new_fp;
+  c.seek_new = seek_new_segment + sizeof (int);
+  c.seek_new_end = c.seek_new + total;
+  c.skips = pv->skips;
+  c.skip_index = 0;
+  bow_pv_map_segments (pv, fp, bow_pv_compact_copy, &c);
+  bow_fwrite_off_t (0, new_fp);
+
+  pv->seek_start = seek_new_segment;
+  pv->write_seek_last_tailer = c.seek_new;
+}
+
 /* Write to PVM the unsigned integer I, marked with the special flag
    saying if it is a DI or a PI, (as indicated by IS_DI).  Assumes
    there is enough space there in this PVM to write the info.  Returns
@@ -202,18 +334,19 @@ bow_pvm_write_unsigned_int (bow_pvm *pvm, unsigned int i, int is_di)
   return byte_count;
 }
 
-/* Read an unsigned integer into I, and indicate whether it is a
-   "document index" or a "position index" by the value of IS_DI.
-   Returns the number of bytes read. */
+/* Read an unsigned integer into I from the bytes at CONTENTS, and
+   indicate whether it is a "document index" or a "position index" by
+   the value of IS_DI.  Returns the number of bytes read. */
 static inline int
-bow_pvm_read_unsigned_int (bow_pvm *pvm, unsigned int *i, int *is_di)
+bow_pvb_read_unsigned_int (const unsigned char *contents,
+			   unsigned int *i, int *is_di)
 {
   bow_pe pe;
   int index;
   int shift = 6;
   int byte_count = 1;
 
-  pe.byte = pvm->contents[pvm->read_end++];
+  pe.byte = *contents++;
   if (pe.bits.is_di)
     *is_di = 1;
   else
@@ -222,37 +355,7 @@ bow_pvm_read_unsigned_int (bow_pvm *pvm, unsigned int *i, int *is_di)
   while (pe.bits.is_more)
     /* The above test relies on pe.bits.is_more == pe.bits_more.is_more */
     {
-      pe.byte = pvm->contents[pvm->read_end++];
-      byte_count++;
-      index |= pe.bits_more.index << shift;
-      shift += 7;
-    }
-  *i = index;
-  return byte_count;
-}
-
-/* Read an unsigned integer into I, and indicate whether it is a
-   "document index" or a "position index" by the value of IS_DI.
-   Assumes that FP is already seek'ed to the correct position. Returns
-   the number of bytes read. */
-static inline int
-bow_pv_read_unsigned_int (unsigned int *i, int *is_di, FILE *fp)
-{
-  bow_pe pe;
-  int index;
-  int shift = 6;
-  int byte_count = 1;
-
-  pe.byte = fgetc (fp);
-  if (pe.bits.is_di)
-    *is_di = 1;
-  else
-    *is_di = 0;
-  index = pe.bits.index;
-  while (pe.bits.is_more)
-    /* The above test relies on pe.bits.is_more == pe.bits_more.is_more */
-    {
-      pe.byte = fgetc (fp);
+      pe.byte = *contents++;
       byte_count++;
       index |= pe.bits_more.index << shift;
       shift += 7;
@@ -282,16 +385,6 @@ bow_pv_write_size_di_pi (bow_pv *pv, int di, int pi)
   return size;
 }
 
-static inline int
-bow_pv_read_size_di_pi (bow_pv *pv, int di, int pi)
-{
-  int size = 0;
-  if (pv->read_last_di != di)
-    size += PV_WRITE_SIZE_INT (di - pv->read_last_di);
-  size += PV_WRITE_SIZE_INT (pi - pv->read_last_pi);
-  return size;
-}
-
 /* Write "document index" DI and "position index" PI to FP.  Assumes
    that PV->PVM is already created, and there is space there in this
    PVM segment to write the info.  Returns the number of bytes
@@ -318,75 +411,62 @@ bow_pv_write_next_di_pi (bow_pv *pv, int di, int pi)
   return bytes_written;
 }
 
-/* Read "document index" DI and "position index" PI from FP.  Assumes
-   that FP is already seek'ed to the correct position.  Returns the
-   number of bytes read. */
+/* Decode the "document index" DI and "position index" PI of the
+   entry that begins at CONTENTS, following on from the last ones
+   CURSOR read.  Returns the number of bytes read. */
 static inline int
-bow_pv_read_next_di_pi (bow_pv *pv, int *di, int *pi, FILE *fp)
+bow_pv_cursor_decode_di_pi (bow_pv_cursor *cursor,
+			    const unsigned char *contents, int *di, int *pi)
 {
   unsigned int incr;
   int bytes_read = 0;
   int is_di;
 
-  bytes_read += bow_pv_read_unsigned_int (&incr, &is_di, fp);
+  bytes_read += bow_pvb_read_unsigned_int (contents, &incr, &is_di);
   if (is_di)
     {
-      pv->read_last_di += incr;
-      pv->read_last_pi = -1;
-      bytes_read += bow_pv_read_unsigned_int (&incr, &is_di, fp);
+      cursor->read_last_di += incr;
+      cursor->read_last_pi = -1;
+      bytes_read += bow_pvb_read_unsigned_int (contents + bytes_read,
+					       &incr, &is_di);
       assert (!is_di);
     }
-  pv->read_last_pi += incr;
-  *di = pv->read_last_di;
-  *pi = pv->read_last_pi;
+  cursor->read_last_pi += incr;
+  *di = cursor->read_last_di;
+  *pi = cursor->read_last_pi;
   return bytes_read;
 }
 
-int
-bow_pvm_read_next_di_pi (bow_pv *pv, int *di, int *pi)
-{
-  unsigned int incr;
-  int bytes_read = 0;
-  int is_di;
-
-  assert (pv->pvm);
 
-  /* If the special flag was set by bow_pv_unnext(), then return the
-     same values returned last time without reading the next entry,
-     and unset the flag. */
-  if (pv->read_seek_end < 0)
-    {
-      *di = pv->read_last_di;
-      *pi = pv->read_last_pi;
-      pv->read_seek_end = -pv->read_seek_end;
-      assert (pv->read_seek_end > 0);
-      return 0;
-    }
+/* Remember that the entries for document DI begin at the write
+   position of PV's PVM, to be given a place on disk when the PVM is
+   flushed. */
+static void
+bow_pv_add_skip (bow_pv *pv, int di)
+{
+  bow_pv_skip *skip;
 
-  /* If we are about to read from the same location as we would write,
-     then we are at the end of the PV.  Return special DI and PI
-     values indicate that we are at the end. */
-  if (pv->pvm->read_end == pv->pvm->write_end)
+  if (pv->skips == NULL)
     {
-      *di = *pi = -1;
-      return 0;
+      pv->skips = bow_malloc (sizeof (bow_pv_skips) + 4 * sizeof (bow_pv_skip));
+      pv->skips->size = 4;
+      pv->skips->length = 0;
     }
-
-  bytes_read += bow_pvm_read_unsigned_int (pv->pvm, &incr, &is_di);
-  if (is_di)
+  else if (pv->skips->length == pv->skips->size)
     {
-      pv->read_last_di += incr;
-      pv->read_last_pi = -1;
-      bytes_read += bow_pvm_read_unsigned_int (pv->pvm, &incr, &is_di);
-      assert (!is_di);
+      pv->skips->size *= 2;
+      pv->skips = bow_realloc (pv->skips, (sizeof (bow_pv_skips)
+					   + (pv->skips->size
+					      * sizeof (bow_pv_skip))));
     }
-  pv->read_last_pi += incr;
-  *di = pv->read_last_di;
-  *pi = pv->read_last_pi;
-  return bytes_read;
+  skip = &(pv->skips->entry[pv->skips->length++]);
+  skip->di = di;
+  skip->last_di = pv->write_last_di;
+  skip->count = pv->word_count;
+  skip->segment_bytes_remaining = -1;
+  skip->seek = pv->pvm->write_end;
 }
 
-
 /* Add "document index" DI and "position index" PI to PV by writing... */
 void
 bow_pv_add_di_pi (bow_pv *pv, int di, int pi, FILE *fp)
@@ -395,116 +475,359 @@ bow_pv_add_di_pi (bow_pv *pv, int di, int pi, FILE *fp)
      segment to write another DI and PI.  Will grow the PVM segment if
      necessary.  Assumes that both DI and PI are greater than or equal
      to the last DI and PI written, respectively.  */
-  pv->word_count++;
-  //if (di != pv->write_last_di) pv->document_count++;
   if (pv->pvm == NULL)
     pv->pvm = bow_pvm_new (bow_pv_sizeof_first_segment);
   if (pv->pvm->size - pv->pvm->write_end < bow_pv_max_sizeof_di_pi)
     bow_pvm_grow (&(pv->pvm));
+  if (di != pv->write_last_di && pv->write_last_di >= 0
+      && (pv->word_count
+	  - (pv->skips ? pv->skips->entry[pv->skips->length-1].count : 0)
+	  >= bow_pv_skip_interval))
+    bow_pv_add_skip (pv, di);
+  pv->word_count++;
+  if (pv->document_count >= 0)
+    {
+      if (di != pv->write_last_di)
+	{
+	  pv->document_count++;
+	  pv->write_document_word_count = 0;
+	}
+      pv->write_document_word_count++;
+      if (pv->write_document_word_count > pv->max_document_word_count)
+	pv->max_document_word_count = pv->write_document_word_count;
+    }
   //pv->byte_count += 
   bow_pv_write_next_di_pi (pv, di, pi);
 }
 
 
-/* Read the next "document index" DI and "position index" PI.  Does
-   not assume that FP is already seek'ed to the correct position.
-   Will jump to a new PV segment on disk if necessary. */
+/* Read BYTES bytes at disk position SEEK of FP into BUF, without
+   disturbing the stream position of FP.  Anything bow_pv_flush()
+   wrote to FP must have been flushed out of its buffer already. */
+static void
+bow_pv_pread (FILE *fp, void *buf, int bytes, off_t seek)
+{
+  ssize_t n;
+
+  while (bytes > 0)
+    {
+      n = pread (fileno (fp), buf, bytes, seek);
+      if (n <= 0)
+	{
+	  perror ("bow_pv_pread");
+	  bow_error ("Couldn't read position vector");
+	}
+      buf = (char*)buf + n;
+      seek += n;
+      bytes -= n;
+    }
+}
+
+/* Make sure CURSOR's read buffer holds the next NEEDED bytes at
+   CURSOR->READ_SEEK_END, refilling it if not.  The buffer is refilled
+   with as much of the rest of the current segment as fits, and grows,
+   up to BOW_PV_READ_BLOCK_SIZE bytes, each time it is refilled. */
+static inline void
+bow_pv_cursor_fill (bow_pv_cursor *cursor, int needed)
+{
+  int size;
+
+  if (cursor->pvb
+      && cursor->read_seek_end >= cursor->pvb->seek
+      && (cursor->read_seek_end + needed
+	  <= cursor->pvb->seek + cursor->pvb->length))
+    return;
+
+  if (cursor->pvb == NULL)
+    {
+      /* Guess at the size of the whole PV from its number of words. */
+      size = MIN (bow_pv_read_block_size,
+		  MAX (64, 4 * cursor->pv->word_count));
+      cursor->pvb = bow_malloc (sizeof (bow_pvb) + size);
+      cursor->pvb->size = size;
+    }
+  else if (cursor->pvb->size < bow_pv_read_block_size)
+    {
+      size = MIN (bow_pv_read_block_size, 2 * cursor->pvb->size);
+      cursor->pvb = bow_realloc (cursor->pvb, sizeof (bow_pvb) + size);
+      cursor->pvb->size = size;
+    }
+  cursor->pvb->seek = cursor->read_seek_end;
+  cursor->pvb->length = MIN (cursor->pvb->size,
+			     cursor->read_segment_bytes_remaining);
+  assert (cursor->pvb->length >= needed);
+  bow_pv_pread (cursor->fp, cursor->pvb->contents, cursor->pvb->length,
+		cursor->pvb->seek);
+}
+
+/* Set up CURSOR for reading PV, whose segments are on disk in FP, from
+   its beginning.  PV may be NULL, for a word with no entries.  Nothing
+   is read until the first call to bow_pv_cursor_next_di_pi(). */
+void
+bow_pv_cursor_init (bow_pv_cursor *cursor, bow_pv *pv, FILE *fp)
+{
+  cursor->pv = pv;
+  cursor->fp = fp;
+  /* A PV that has never been flushed is read from its PVM, and then
+     this value matches its WRITE_SEEK_LAST_TAILER of 0. */
+  if (pv && pv->seek_start != 0)
+    cursor->read_seek_end = pv->seek_start + sizeof (int);
+  else
+    cursor->read_seek_end = 0;
+  cursor->read_segment_bytes_remaining = -1;
+  cursor->read_last_di = -1;
+  cursor->read_last_pi = -1;
+  cursor->pvm_read_end = 0;
+  cursor->unnext = 0;
+  cursor->pvb = NULL;
+}
+
+/* Free the memory held by CURSOR, but not CURSOR itself. */
 void
-bow_pv_next_di_pi (bow_pv *pv, int *di, int *pi, FILE *fp)
+bow_pv_cursor_free (bow_pv_cursor *cursor)
 {
+  if (cursor->pvb)
+    {
+      bow_free (cursor->pvb);
+      cursor->pvb = NULL;
+    }
+}
+
+/* Read the next "document index" DI and "position index" PI at
+   CURSOR.  Will jump to a new PV segment on disk if necessary.  Both
+   are -1 at the end of the PV. */
+void
+bow_pv_cursor_next_di_pi (bow_pv_cursor *cursor, int *di, int *pi)
+{
+  bow_pv *pv = cursor->pv;
   int byte_count;
 
-  /* If the special flag was set by bow_pv_unnext(), then return the
+  /* If the flag was set by bow_pv_cursor_unnext(), then return the
      same values returned last time without reading the next entry,
      and unset the flag. */
-  if (pv->read_seek_end < 0)
+  if (cursor->unnext)
     {
-      *di = pv->read_last_di;
-      *pi = pv->read_last_pi;
-      pv->read_seek_end = -pv->read_seek_end;
-      assert (pv->read_seek_end > 0);
+      *di = cursor->read_last_di;
+      *pi = cursor->read_last_pi;
+      cursor->unnext = 0;
       return;
     }
 
   /* If we are about to read from the location of the tailer of the
      last segment written, then we are at the end of the PV on disk.
      Go look for the next entry in memory in the PVM, if the PVM exists. */
-  if (pv->read_seek_end == pv->write_seek_last_tailer)
+  if (pv == NULL || cursor->read_seek_end == pv->write_seek_last_tailer)
     {
-      if (pv->pvm)
-	bow_pvm_read_next_di_pi (pv, di, pi);
+      if (pv && pv->pvm && cursor->pvm_read_end < pv->pvm->write_end)
+	cursor->pvm_read_end += bow_pv_cursor_decode_di_pi
+	  (cursor, pv->pvm->contents + cursor->pvm_read_end, di, pi);
       else
-	*di = *pi = -1;
+	{
+	  *di = *pi = -1;
+	  /* Nothing more will be read from disk. */
+	  bow_pv_cursor_free (cursor);
+	}
       return;
     }
 
+  /* If nothing has been read yet, read the number of bytes in the
+     first segment. */
+  if (cursor->read_segment_bytes_remaining < 0)
+    {
+      bow_pv_pread (cursor->fp, &(cursor->read_segment_bytes_remaining),
+		    sizeof (int), pv->seek_start);
+      cursor->read_segment_bytes_remaining =
+	ntohl (cursor->read_segment_bytes_remaining);
+      assert (cursor->read_segment_bytes_remaining > 0);
+    }
+
   /* Make sure that there was definitely enough room in this segment
      to have written another DI and PI.  If not, then it was written
      in the next segment, so go there and get set up for reading from
      it.  We know that there really is another segment because
      otherwise the above test would have been true. */
-  if (pv->read_segment_bytes_remaining == 0)
+  if (cursor->read_segment_bytes_remaining == 0)
     {
       off_t seek_new_segment;
-      /* Go to the "tailer" of this segment, and read the seek
-         position of the next segment. */
-      fseeko (fp, pv->read_seek_end, SEEK_SET);
-      bow_fread_off_t (&seek_new_segment, fp);
-      fseeko (fp, seek_new_segment, SEEK_SET);
-      /* Read the number of bytes in this segment, and remember it. */
-      bow_fread_int (&(pv->read_segment_bytes_remaining), fp);
+      /* Read the seek position of the next segment from the "tailer"
+	 of this one, and the number of bytes in that segment from its
+	 "header". */
+      bow_pv_pread (cursor->fp, &seek_new_segment, sizeof (off_t),
+		    cursor->read_seek_end);
+      bow_pv_pread (cursor->fp, &(cursor->read_segment_bytes_remaining),
+		    sizeof (int), seek_new_segment);
+      cursor->read_segment_bytes_remaining =
+	ntohl (cursor->read_segment_bytes_remaining);
       /* Remember the new position from which to read the next DI and PI */
-      pv->read_seek_end = ftello (fp);
-#if 0
-      /* When would this happen now? */
-      /* If this segment has not yet been written to, we are at end of PV */
-      if (pv->read_seek_end == pv->write_seek_end)
-	goto return_end_of_pv;
-#endif
+      cursor->read_seek_end = seek_new_segment + sizeof (int);
     }
 
-  /* Seek to the correct position, read the DI and PI, decrement our
-     count of the number of bytes remaining in this segment, and
-     update the seek position for reading the next DI and PI. */
-  fseeko (fp, pv->read_seek_end, SEEK_SET);
-  byte_count =
-    bow_pv_read_next_di_pi (pv, di, pi, fp);
-  pv->read_segment_bytes_remaining -= byte_count;
-  pv->read_seek_end += byte_count;
-  assert (pv->read_segment_bytes_remaining >= 0);
+  /* Read the DI and PI from the read buffer, decrement our count of
+     the number of bytes remaining in this segment, and update the
+     seek position for reading the next DI and PI. */
+  bow_pv_cursor_fill (cursor, MIN (bow_pv_max_sizeof_di_pi,
+				   cursor->read_segment_bytes_remaining));
+  byte_count = bow_pv_cursor_decode_di_pi
+    (cursor, (cursor->pvb->contents
+	      + (cursor->read_seek_end - cursor->pvb->seek)), di, pi);
+  cursor->read_segment_bytes_remaining -= byte_count;
+  cursor->read_seek_end += byte_count;
+  assert (cursor->read_segment_bytes_remaining >= 0);
 }
 
-/* Undo the effect of the last call to bow_pv_next_di_pi().  That is,
-   make the next call to bow_pv_next_di_pi() return the same DI and PI
-   as the last call did.  This function may not be called multiple
-   times in a row without calling bow_pv_next_di_pi() in between. */
+/* Read up to N of the next "document index" and "position index"
+   pairs at CURSOR into the arrays DI and PI, and return how many were
+   read.  Fewer than N means the end of the PV was reached. */
+int
+bow_pv_cursor_next_di_pi_batch (bow_pv_cursor *cursor,
+				int *di, int *pi, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      bow_pv_cursor_next_di_pi (cursor, &(di[i]), &(pi[i]));
+      if (di[i] == -1)
+	break;
+    }
+  return i;
+}
+
+/* Move CURSOR forward, so that the next call to
+   bow_pv_cursor_next_di_pi() returns the first entry of its PV with a
+   "document index" of DI or more.  If a skip entry on disk lies
+   between the read position and DI, reading resumes at the last such
+   one; the entries from there on are read and passed over until DI is
+   reached. */
 void
-bow_pv_unnext (bow_pv *pv)
+bow_pv_cursor_skip_to_di (bow_pv_cursor *cursor, int di)
 {
-  /* Make sure that this function wasn't called two times in a row. */
-  assert (pv->read_seek_end > 0);
-  pv->read_seek_end = -pv->read_seek_end;
+  bow_pv_skips *skips;
+  bow_pv_skip *skip;
+  int lo, hi, mid;
+  int next_di, next_pi;
+
+  /* The next entry, the last one read again if
+     bow_pv_cursor_unnext() was called, is at least this far along
+     already. */
+  if (cursor->read_last_di >= di)
+    return;
+  cursor->unnext = 0;
+
+  /* Find the last skip entry on disk that is at or before DI.  Those
+     on disk come before those still in the PVM. */
+  skips = cursor->pv ? cursor->pv->skips : NULL;
+  if (skips)
+    {
+      lo = 0;
+      hi = skips->length;
+      while (lo < hi)
+	{
+	  mid = (lo + hi) / 2;
+	  if (skips->entry[mid].segment_bytes_remaining >= 0
+	      && skips->entry[mid].di <= di)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      if (lo > 0 && skips->entry[lo-1].di > cursor->read_last_di)
+	{
+	  skip = &(skips->entry[lo-1]);
+	  cursor->read_seek_end = skip->seek;
+	  cursor->read_segment_bytes_remaining =
+	    skip->segment_bytes_remaining;
+	  cursor->read_last_di = skip->last_di;
+	  cursor->read_last_pi = -1;
+	}
+    }
+
+  do
+    bow_pv_cursor_next_di_pi (cursor, &next_di, &next_pi);
+  while (next_di != -1 && next_di < di);
+  if (next_di != -1)
+    bow_pv_cursor_unnext (cursor);
+}
+
+/* Write the skip entries of PV to FP. */
+void
+bow_pv_write_skips (bow_pv *pv, FILE *fp)
+{
+  bow_pv_skip *skip;
+  int i;
+
+  bow_fwrite_int (pv->skips ? pv->skips->length : 0, fp);
+  for (i = 0; pv->skips && i < pv->skips->length; i++)
+    {
+      skip = &(pv->skips->entry[i]);
+      assert (skip->segment_bytes_remaining >= 0);
+      bow_fwrite_int (skip->di, fp);
+      bow_fwrite_int (skip->last_di, fp);
+      bow_fwrite_int (skip->count, fp);
+      bow_fwrite_int (skip->segment_bytes_remaining, fp);
+      bow_fwrite_off_t (skip->seek, fp);
+    }
 }
 
-/* Rewind the read position to the beginning of the PV */
+/* Read the skip entries of PV from FP, as written by
+   bow_pv_write_skips(). */
 void
-bow_pv_rewind (bow_pv *pv, FILE *fp)
+bow_pv_read_skips (bow_pv *pv, FILE *fp)
 {
-  /* If PV is already rewound, just return immediately */
-  if (pv->read_seek_end == pv->seek_start + sizeof (int)
-      && pv->read_last_di == -1 && pv->read_last_pi == -1)
+  bow_pv_skip *skip;
+  int length, i;
+
+  if (pv->skips)
+    bow_free (pv->skips);
+  pv->skips = NULL;
+  bow_fread_int (&length, fp);
+  if (length == 0)
     return;
-  if (pv->seek_start != -1)
+  pv->skips = bow_malloc (sizeof (bow_pv_skips)
+			  + length * sizeof (bow_pv_skip));
+  pv->skips->size = pv->skips->length = length;
+  for (i = 0; i < length; i++)
     {
-      fseeko (fp, pv->seek_start, SEEK_SET);
-      bow_fread_int (&(pv->read_segment_bytes_remaining), fp);
-      assert (pv->read_segment_bytes_remaining > 0);
-      pv->read_seek_end = ftello (fp);
+      skip = &(pv->skips->entry[i]);
+      bow_fread_int (&(skip->di), fp);
+      bow_fread_int (&(skip->last_di), fp);
+      bow_fread_int (&(skip->count), fp);
+      bow_fread_int (&(skip->segment_bytes_remaining), fp);
+      bow_fread_off_t (&(skip->seek), fp);
     }
-  pv->read_last_di = -1;
-  pv->read_last_pi = -1;
-  if (pv->pvm)
-    bow_pvm_rewind (pv->pvm);
+}
+
+/* Write the document counts of PV to FP.  Those of a stub PV, with a
+   negative WORD_COUNT, are written as unknown. */
+void
+bow_pv_write_document_counts (bow_pv *pv, FILE *fp)
+{
+  int unknown = (pv->word_count < 0);
+
+  bow_fwrite_int (unknown ? -1 : pv->document_count, fp);
+  bow_fwrite_int (unknown ? -1 : pv->max_document_word_count, fp);
+  bow_fwrite_int (unknown ? -1 : pv->write_document_word_count, fp);
+}
+
+/* Read the document counts of PV from FP, as written by
+   bow_pv_write_document_counts(). */
+void
+bow_pv_read_document_counts (bow_pv *pv, FILE *fp)
+{
+  bow_fread_int (&(pv->document_count), fp);
+  bow_fread_int (&(pv->max_document_word_count), fp);
+  bow_fread_int (&(pv->write_document_word_count), fp);
+}
+
+/* Undo the effect of the last call to bow_pv_cursor_next_di_pi().
+   That is, make the next call return the same DI and PI as the last
+   call did.  This function may not be called multiple times in a row
+   without calling bow_pv_cursor_next_di_pi() in between. */
+void
+bow_pv_cursor_unnext (bow_pv_cursor *cursor)
+{
+  /* Make sure that this function wasn't called two times in a row. */
+  assert (!cursor->unnext);
+  cursor->unnext = 1;
 }
 
 /* Write the in-memory portion of PV to FP */
@@ -514,7 +837,8 @@ bow_pv_write (bow_pv *pv, FILE *fp, FILE *pvfp)
   bow_pv_flush (pv, pvfp);
 #define FAST_PV_WRITE 1
 #if FAST_PV_WRITE
-  fwrite (pv, sizeof (bow_pv) - sizeof(void*), 1, fp);
+  /* Everything before the PVM, the part that is in memory only. */
+  fwrite (pv, offsetof (bow_pv, pvm), 1, fp);
 #else
   //bow_fwrite_int (pv->byte_count, fp);
   bow_fwrite_int (pv->word_count, fp);
@@ -535,7 +859,7 @@ void
 bow_pv_read (bow_pv *pv, FILE *fp)
 {
 #if FAST_PV_WRITE
-  fread (pv, sizeof (bow_pv) - sizeof(void*), 1, fp);
+  fread (pv, offsetof (bow_pv, pvm), 1, fp);
 #else
   //bow_fread_int (&pv->byte_count, fp);
   bow_fread_int (&pv->word_count, fp);
@@ -549,4 +873,10 @@ bow_pv_read (bow_pv *pv, FILE *fp)
   bow_fread_int (&pv->write_last_pi, fp);
   bow_fread_off_t (&pv->write_seek_last_tailer, fp);
 #endif
+  pv->pvm = NULL;
+  pv->skips = NULL;
+  /* Unknown, unless read by bow_pv_read_document_counts() */
+  pv->document_count = -1;
+  pv->max_document_word_count = -1;
+  pv->write_document_word_count = -1;
 }
@@ -88,6 +88,7 @@ enum {
   USE_SAVED_CLASSIFIER_KEY,
   PRINT_DOC_LENGTH_KEY,
   INDEX_LINES_KEY,
+  CV_FOLDS_KEY,
 };
 
 static struct argp_option rainbow_options[] =
@@ -159,6 +160,13 @@ static struct argp_option rainbow_options[] =
   {"test-on-training", TEST_ON_TRAINING_KEY, "N", 0,
    "Like `--test', but instead of classifing the held-out test documents "
    "classify the training data in leave-one-out fashion.  Perform N trials."},
+  {"cv-folds", CV_FOLDS_KEY, "K", 0,
+   "With `--test', instead of testing on the test set of each trial, "
+   "divide the training and test documents of the trial into K folds, "
+   "and classify the documents of each fold in turn with a model of the "
+   "other K-1.  Each fold is output as a trial of its own.  For methods "
+   "whose model only sums the word counts of each class, the counts of "
+   "each fold are gathered once per trial, not once per fold."},
 #if 0
   {"no-lisp-score-truncation", NO_LISP_SCORE_TRUNCATION_KEY, 0, 0,
    "Normally scores that are lower than 1e-35 are printed as 0, "
@@ -284,6 +292,9 @@ struct rainbow_arg_state
 #endif
   int print_doc_length;
   const char *indexing_lines_filename;
+  /* If non-zero, the number of folds for cross-validation in each
+     test trial */
+  int num_folds;
 } rainbow_arg_state;
 
 static error_t
@@ -347,6 +358,11 @@ rainbow_parse_opt (int key, char *arg, struct argp_state *state)
       rainbow_arg_state.test_on_training = 1;
       rainbow_arg_state.num_trials = atoi (arg);
       break;
+    case CV_FOLDS_KEY:
+      rainbow_arg_state.num_folds = atoi (arg);
+      if (rainbow_arg_state.num_folds < 2)
+	bow_error ("--cv-folds needs at least 2 folds");
+      break;
     case NO_LISP_SCORE_TRUNCATION_KEY:
       rainbow_arg_state.use_lisp_score_truncation = 0;
       break;
@@ -1273,6 +1289,7 @@ rainbow_lisp_setup (char *datadirname)
   rainbow_arg_state.use_lisp_score_truncation = 1;
   rainbow_arg_state.loo_cv = 0;
   rainbow_arg_state.indexing_lines_filename = NULL;
+  rainbow_arg_state.num_folds = 0;
 
   argp_parse (&rainbow_argp, argc, argv, 0, 0, &rainbow_arg_state);
 
@@ -1337,6 +1354,324 @@ rainbow_lisp_query (const char *query_file,
 
 
 extern FILE *svml_test_file;
+
+/* Prune the vocabulary of RAINBOW_DOC_BARREL, as requested on the
+   command line, for the training documents of a new trial. */
+static void
+rainbow_prune_vocab_for_trial ()
+{
+  if (bow_prune_vocab_by_infogain_n)
+    {
+      /* Change barrel by removing words with small information gain. */
+      bow_barrel_keep_top_words_by_infogain
+	(bow_prune_vocab_by_infogain_n, rainbow_doc_barrel, 
+	 bow_barrel_num_classes (rainbow_class_barrel));
+    }
+  if (bow_prune_vocab_by_occur_count_n)
+    bow_error ("Sorry, `-O' implemented only for --index, not --test");
+  if (bow_prune_words_by_doc_count_n)
+    bow_error ("Sorry, `-D' implemented only for --index, not --test");
+
+  /* Infogain pruning must be done before this vocab_map pruning,
+     because infogain pruning first unhides all words! */
+  if (rainbow_arg_state.vocab_map)
+    {
+      bow_barrel_prune_words_not_in_map (rainbow_doc_barrel,
+					 rainbow_arg_state.vocab_map);
+    }
+  if (rainbow_arg_state.hide_vocab_map)
+    {
+      bow_barrel_prune_words_in_map (rainbow_doc_barrel,
+				     rainbow_arg_state.hide_vocab_map);
+    }
+  if (rainbow_arg_state.hide_vocab_indices_filename)
+    {
+      FILE *fp = 
+	bow_fopen (rainbow_arg_state.hide_vocab_indices_filename, "r");
+      int wi;
+      int num_hidden = 0;
+      while (fscanf (fp, "%d", &wi) == 1)
+	{
+	  bow_wi2dvf_hide_wi (rainbow_doc_barrel->wi2dvf, wi);
+	  num_hidden++;
+	}
+      fclose (fp);
+      bow_verbosify (bow_progress, "%d words hidden by index\n", 
+		     num_hidden);
+    }
+}
+
+/* Print to TEST_FP the line for test document DOC_CDOC of the output
+   of --test: its name, its class, the NUM_HITS class scores in HITS
+   and, if requested, DOC_LENGTH. */
+static void
+rainbow_print_test_result (FILE *test_fp, bow_cdoc *doc_cdoc,
+			   bow_score *hits, int num_hits, int doc_length)
+{
+  int hi;			/* hit index */
+
+  fprintf (test_fp, "%s %s ", 
+	   doc_cdoc->filename, 
+	   bow_barrel_classname_at_index (rainbow_doc_barrel,
+					  doc_cdoc->class));
+  for (hi = 0; hi < num_hits; hi++)
+    {
+      /* For the sake CommonLisp, don't print numbers smaller than
+	 1e-35, because it can't `(read)' them. */
+      if (rainbow_arg_state.use_lisp_score_truncation
+	  && hits[hi].weight < 1e-35
+	  && hits[hi].weight > 0)
+	hits[hi].weight = 0;
+      fprintf (test_fp, "%s:%.*g ", 
+	       bow_barrel_classname_at_index
+	       (rainbow_class_barrel, hits[hi].di),
+	       bow_score_print_precision,
+	       hits[hi].weight);
+    }
+  if (rainbow_arg_state.print_doc_length)
+    fprintf (test_fp, "%d", doc_length);
+  fprintf (test_fp, "\n");
+}
+
+static int
+rainbow_cdoc_is_train_or_test (bow_cdoc *cdoc)
+{
+  return (cdoc->type == bow_doc_train || cdoc->type == bow_doc_test);
+}
+
+/* Put each of the training and test documents of RAINBOW_DOC_BARREL
+   into one of NUM_FOLDS folds at random, dealing out the documents of
+   each class in turn so that every fold gets the same share of each
+   class, give or take one.  The other documents get fold -1. */
+static void
+rainbow_assign_folds (int *fold_of_di, int num_folds)
+{
+  int num_docs = rainbow_doc_barrel->cdocs->length;
+  int num_classes = bow_barrel_num_classes (rainbow_doc_barrel);
+  int *order;
+  int *next_fold;
+  int num_order = 0;
+  int i, j, tmp, di, ci;
+  bow_cdoc *cdoc;
+
+  order = bow_malloc (num_docs * sizeof (int));
+  next_fold = bow_malloc (num_classes * sizeof (int));
+  for (di = 0; di < num_docs; di++)
+    {
+      cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
+      fold_of_di[di] = -1;
+      if (rainbow_cdoc_is_train_or_test (cdoc))
+	order[num_order++] = di;
+    }
+  bow_random_set_seed ();
+  for (i = num_order - 1; i > 0; i--)
+    {
+      j = random () % (i + 1);
+      tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+  for (ci = 0; ci < num_classes; ci++)
+    next_fold[ci] = random () % num_folds;
+  for (i = 0; i < num_order; i++)
+    {
+      cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, order[i]);
+      fold_of_di[order[i]] = next_fold[cdoc->class];
+      next_fold[cdoc->class] = (next_fold[cdoc->class] + 1) % num_folds;
+    }
+  bow_free (order);
+  bow_free (next_fold);
+}
+
+/* The documents of a cross-validation trial, read out of the document
+   barrel once for all of its folds, and the scores of those of the
+   fold being tested. */
+typedef struct _rainbow_cv_trial {
+  int length;
+  int *dis;			/* their document indices, in order */
+  bow_wv **wvs;			/* their word vectors */
+  int max_num_entries;
+  int num_classes;
+  int *fold_docs;		/* indices into DIS of the fold's documents */
+  int num_fold_docs;
+  bow_score *hits;		/* NUM_CLASSES per document of the fold */
+  int *num_hits;		/* or -1 if it has no words */
+  int *doc_length;
+} rainbow_cv_trial;
+
+/* Classify the documents LO through HI-1 of the fold being tested in
+   the trial ARG with RAINBOW_CLASS_BARREL, which is only read. */
+static void
+rainbow_cv_score_range (int begin, int end, int thread, void *arg)
+{
+  rainbow_cv_trial *t = arg;
+  bow_wv *query_wv;
+  bow_cdoc *doc_cdoc;
+  int i, j;
+
+  /* Setting the weights changes the word vector, so score a copy. */
+  query_wv = bow_wv_new (t->max_num_entries);
+  for (i = begin; i < end; i++)
+    {
+      j = t->fold_docs[i];
+      query_wv->num_entries = t->wvs[j]->num_entries;
+      query_wv->normalizer = t->wvs[j]->normalizer;
+      memcpy (query_wv->entry, t->wvs[j]->entry,
+	      t->wvs[j]->num_entries * sizeof (bow_we));
+      /* As in rainbow_test(), pass over documents with no words in
+	 the vocabulary of this fold. */
+      bow_wv_prune_words_not_in_wi2dvf (query_wv, rainbow_doc_barrel->wi2dvf);
+      if (query_wv->num_entries == 0)
+	{
+	  t->num_hits[i] = -1;
+	  continue;
+	}
+      doc_cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs,
+					   t->dis[j]);
+      /* Remove words not in the class_barrel */
+      bow_wv_prune_words_not_in_wi2dvf (query_wv, 
+					rainbow_class_barrel->wi2dvf);
+      bow_wv_set_weights (query_wv, rainbow_class_barrel);
+      bow_wv_normalize_weights (query_wv, rainbow_class_barrel);
+      if (svml_test_file)
+	fprintf (svml_test_file,"%d ",-1*((doc_cdoc->class*2)-1));
+      t->num_hits[i] =
+	bow_barrel_score (rainbow_class_barrel, query_wv,
+			  t->hits + i * t->num_classes, t->num_classes,
+			  (strcmp (rainbow_class_barrel->method->name, "em")
+			   ? -1 : 0));
+      t->doc_length[i] = bow_wv_word_count (query_wv);
+    }
+  bow_wv_free (query_wv);
+}
+
+/* Run the trials of --test as K-fold cross-validation, K being
+   RAINBOW_ARG_STATE.NUM_FOLDS, outputing the results of each fold as a
+   trial of its own.  When the method's class barrel only sums the
+   word counts of each class, the counts of each fold are summed once
+   per trial, each fold's class barrel is made from the counts of the
+   other folds, and the documents of a fold are classified in several
+   threads; otherwise each fold's class barrel is made from the
+   documents as usual. */
+static void
+rainbow_test_folds (FILE *test_fp)
+{
+  int num_folds = rainbow_arg_state.num_folds;
+  int num_docs = rainbow_doc_barrel->cdocs->length;
+  int *fold_of_di;
+  bow_vpc_folds *folds;
+  rainbow_cv_trial t;
+  bow_dv_heap *heap;
+  bow_wv *query_wv;
+  bow_cdoc *cdoc;
+  int tn, fold, di, i;
+
+  if (rainbow_arg_state.test_on_training)
+    bow_error ("--cv-folds can't be used with --test-on-training");
+
+  fold_of_di = bow_malloc (num_docs * sizeof (int));
+  t.num_classes = bow_barrel_num_classes (rainbow_doc_barrel);
+  for (tn = 0; tn < rainbow_arg_state.num_trials; tn++)
+    {
+      bow_set_doc_types_for_barrel (rainbow_doc_barrel);
+      rainbow_assign_folds (fold_of_di, num_folds);
+
+      /* Infogain pruning first unhides all words, so sum the counts
+	 of all of them, for any fold that may need them. */
+      if (bow_prune_vocab_by_infogain_n)
+	bow_wi2dvf_unhide_all_wi (rainbow_doc_barrel->wi2dvf);
+      folds = NULL;
+      if (bow_barrel_vpc_is_sum_of_counts (rainbow_doc_barrel))
+	folds = bow_vpc_folds_new (rainbow_doc_barrel, num_folds, fold_of_di);
+
+      /* Read the documents once for all the folds. */
+      t.length = 0;
+      t.max_num_entries = 0;
+      t.dis = bow_malloc (num_docs * sizeof (int));
+      t.wvs = bow_malloc (num_docs * sizeof (bow_wv*));
+      query_wv = NULL;
+      heap = bow_make_dv_heap_from_wi2dvf_hidden
+	(rainbow_doc_barrel->wi2dvf, 0);
+      while ((di = bow_heap_next_wv (heap, rainbow_doc_barrel, &query_wv,
+				     rainbow_cdoc_is_train_or_test)) != -1)
+	{
+	  t.dis[t.length] = di;
+	  t.wvs[t.length] = bow_wv_copy (query_wv);
+	  t.wvs[t.length]->normalizer = query_wv->normalizer;
+	  if (query_wv->num_entries > t.max_num_entries)
+	    t.max_num_entries = query_wv->num_entries;
+	  t.length++;
+	}
+      t.fold_docs = bow_malloc ((t.length + 1) * sizeof (int));
+      t.hits = bow_malloc ((t.length + 1) * t.num_classes
+			   * sizeof (bow_score));
+      t.num_hits = bow_malloc ((t.length + 1) * sizeof (int));
+      t.doc_length = bow_malloc ((t.length + 1) * sizeof (int));
+
+      for (fold = 0; fold < num_folds; fold++)
+	{
+	  for (di = 0; di < num_docs; di++)
+	    {
+	      if (fold_of_di[di] < 0)
+		continue;
+	      cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs, di);
+	      cdoc->type = (fold_of_di[di] == fold
+			    ? bow_doc_test : bow_doc_train);
+	    }
+	  if (bow_uniform_class_priors)
+	    bow_barrel_set_cdoc_priors_to_class_uniform (rainbow_doc_barrel);
+	  rainbow_prune_vocab_for_trial ();
+
+	  bow_free_barrel (rainbow_class_barrel);
+	  if (folds)
+	    rainbow_class_barrel = bow_barrel_new_vpc_for_fold (folds, fold);
+	  else
+	    rainbow_class_barrel = 
+	      bow_barrel_new_vpc_with_weights (rainbow_doc_barrel);
+	  if (rainbow_class_barrel->method->vpc_set_priors)
+	    (*rainbow_class_barrel->method->vpc_set_priors)
+	      (rainbow_class_barrel, rainbow_doc_barrel);
+
+	  fprintf (test_fp, "#%d\n", tn * num_folds + fold);
+
+	  t.num_fold_docs = 0;
+	  for (i = 0; i < t.length; i++)
+	    if (fold_of_di[t.dis[i]] == fold)
+	      t.fold_docs[t.num_fold_docs++] = i;
+	  /* The class barrels made from the sums only get read while
+	     scoring, as in the EM E-step; don't assume that of others.
+	     The SVM-light test file is written in the order of scoring. */
+	  if (folds && !svml_test_file)
+	    bow_parallel_for (t.num_fold_docs, rainbow_cv_score_range, &t);
+	  else
+	    rainbow_cv_score_range (0, t.num_fold_docs, 0, &t);
+
+	  for (i = 0; i < t.num_fold_docs; i++)
+	    {
+	      if (t.num_hits[i] < 0)
+		continue;
+	      cdoc = bow_array_entry_at_index (rainbow_doc_barrel->cdocs,
+					       t.dis[t.fold_docs[i]]);
+	      rainbow_print_test_result (test_fp, cdoc,
+					 t.hits + i * t.num_classes,
+					 t.num_hits[i], t.doc_length[i]);
+	    }
+	}
+
+      for (i = 0; i < t.length; i++)
+	bow_wv_free (t.wvs[i]);
+      bow_free (t.wvs);
+      bow_free (t.dis);
+      bow_free (t.fold_docs);
+      bow_free (t.hits);
+      bow_free (t.num_hits);
+      bow_free (t.doc_length);
+      if (folds)
+	bow_vpc_folds_free (folds);
+    }
+  bow_free (fold_of_di);
+}
+
 /* Run test trials, outputing results to TEST_FP.  The results are
    indended to be read and processed by the Perl script
    ./rainbow-stats. */
@@ -1350,7 +1685,6 @@ rainbow_test (FILE *test_fp)
   bow_score *hits = NULL;
   int num_hits_to_retrieve=0;
   int actual_num_hits;
-  int hi;			/* hit index */
   bow_cdoc *doc_cdoc;
   bow_cdoc *class_cdoc;
   int (*classify_cdoc_p)(bow_cdoc*);
@@ -1359,6 +1693,12 @@ rainbow_test (FILE *test_fp)
   if (bow_argp_method)
     rainbow_doc_barrel->method = (rainbow_method*)bow_argp_method;
 
+  if (rainbow_arg_state.num_folds)
+    {
+      rainbow_test_folds (test_fp);
+      return;
+    }
+
   hits = NULL;
 
   /* Loop once for each trial. */
@@ -1369,45 +1709,7 @@ rainbow_test (FILE *test_fp)
       if (bow_uniform_class_priors)
 	bow_barrel_set_cdoc_priors_to_class_uniform (rainbow_doc_barrel);
 
-      if (bow_prune_vocab_by_infogain_n)
-	{
-	  /* Change barrel by removing words with small information gain. */
-	  bow_barrel_keep_top_words_by_infogain
-	    (bow_prune_vocab_by_infogain_n, rainbow_doc_barrel, 
-	     bow_barrel_num_classes (rainbow_class_barrel));
-	}
-      if (bow_prune_vocab_by_occur_count_n)
-	bow_error ("Sorry, `-O' implemented only for --index, not --test");
-      if (bow_prune_words_by_doc_count_n)
-	bow_error ("Sorry, `-D' implemented only for --index, not --test");
-
-      /* Infogain pruning must be done before this vocab_map pruning,
-	 because infogain pruning first unhides all words! */
-      if (rainbow_arg_state.vocab_map)
-	{
-	  bow_barrel_prune_words_not_in_map (rainbow_doc_barrel,
-					     rainbow_arg_state.vocab_map);
-	}
-      if (rainbow_arg_state.hide_vocab_map)
-	{
-	  bow_barrel_prune_words_in_map (rainbow_doc_barrel,
-					 rainbow_arg_state.hide_vocab_map);
-	}
-      if (rainbow_arg_state.hide_vocab_indices_filename)
-	{
-	  FILE *fp = 
-	    bow_fopen (rainbow_arg_state.hide_vocab_indices_filename, "r");
-	  int wi;
-	  int num_hidden = 0;
-	  while (fscanf (fp, "%d", &wi) == 1)
-	    {
-	      bow_wi2dvf_hide_wi (rainbow_doc_barrel->wi2dvf, wi);
-	      num_hidden++;
-	    }
-	  fclose (fp);
-	  bow_verbosify (bow_progress, "%d words hidden by index\n", 
-			 num_hidden);
-	}
+      rainbow_prune_vocab_for_trial ();
 
       /* Re-create the vector-per-class barrel in accordance with the
 	 new train/test settings. */
@@ -1503,30 +1805,8 @@ rainbow_test (FILE *test_fp)
 	  else
 	    printf ("0\n");
 #endif
-	  fprintf (test_fp, "%s %s ", 
-		   doc_cdoc->filename, 
-		   bow_barrel_classname_at_index (rainbow_doc_barrel,
-						  doc_cdoc->class));
-	  for (hi = 0; hi < actual_num_hits; hi++)
-	    {
-	      class_cdoc = 
-		bow_array_entry_at_index (rainbow_class_barrel->cdocs,
-					  hits[hi].di);
-	      /* For the sake CommonLisp, don't print numbers smaller than
-		 1e-35, because it can't `(read)' them. */
-	      if (rainbow_arg_state.use_lisp_score_truncation
-		  && hits[hi].weight < 1e-35
-		  && hits[hi].weight > 0)
-		hits[hi].weight = 0;
-	      fprintf (test_fp, "%s:%.*g ", 
-		       bow_barrel_classname_at_index
-		       (rainbow_class_barrel, hits[hi].di),
-		       bow_score_print_precision,
-		       hits[hi].weight);
-	    }
-	  if (rainbow_arg_state.print_doc_length)
-	    fprintf (test_fp, "%d", bow_wv_word_count (query_wv));
-	  fprintf (test_fp, "\n");
+	  rainbow_print_test_result (test_fp, doc_cdoc, hits, actual_num_hits,
+				     bow_wv_word_count (query_wv));
 	}
       /* Don't free the heap here because bow_test_next_wv() does it
 	 for us. */
@@ -1932,6 +2212,7 @@ main (int argc, char *argv[])
   rainbow_arg_state.forking_server = 0;
   rainbow_arg_state.print_doc_length = 0;
   rainbow_arg_state.indexing_lines_filename = NULL;
+  rainbow_arg_state.num_folds = 0;
 #ifdef VPC_ONLY
   rainbow_arg_state.vpc_only = 0;
 #endif
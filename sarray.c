@@ -122,6 +122,16 @@ bow_sarray_index_at_keystr (bow_sarray *sa, const char *keystr)
   return bow_str2int_no_add (sa->i4k, keystr);
 }
 
+/* Associate the entry at index INDEX with the string KEYSTR, which
+   must not be in use already, instead of its old one. */
+void
+bow_sarray_set_keystr_at_index (bow_sarray *sa, int index,
+				const char *keystr)
+{
+  assert (keystr && keystr[0]);
+  bow_int4str_rename (sa->i4k, index, keystr);
+}
+
 /* Write the sarray SARRAY to the file-pointer FP, using the function
    WRITE_FUNC to write each of the entries in SARRAY. */
 void
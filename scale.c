@@ -21,37 +21,72 @@
 
 #include <bow/libbow.h>
 
-/* Multiply each weight by the information gain of that word. */
-void
-bow_barrel_scale_weights_by_given_infogain (bow_barrel *barrel, 
-					    float *wi2ig, int wi2ig_size)
+/* What the threads of the functions below share. */
+struct _bow_scale_context {
+  bow_barrel *barrel;
+  float *wi2ig;			/* the gain of each word, or */
+  float **fig_per_wi_ci;	/* the gain of each word and class */
+};
+
+/* Scale the weights of the words LO through HI-1 by their gain. */
+static void
+bow_barrel_scale_weights_range (int lo, int hi, int thread, void *arg)
 {
-  int wi, max_wi, j;
+  struct _bow_scale_context *c = arg;
+  int wi, dvi;
   bow_dv *dv;
+  bow_cdoc *cdoc;
 
-  bow_verbosify (bow_progress, 
-		 "Scaling weights by information gain over words: "
-		 "           ");
-
-  max_wi = wi2ig_size;
-  for (wi = 0; wi < max_wi; wi++) 
+  for (wi = lo; wi < hi; wi++) 
     {
       /* Get this document vector */
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+      dv = bow_wi2dvf_dv (c->barrel->wi2dvf, wi);
       if (dv == NULL)
 	continue;
 
       /* Scale all the elements using this gain. */
-      for (j = 0; j < dv->length; j++)
+      if (c->wi2ig)
 	{
-	  dv->entry[j].weight *= wi2ig[wi];
+	  for (dvi = 0; dvi < dv->length; dvi++)
+	    dv->entry[dvi].weight *= c->wi2ig[wi];
+	  continue;
+	}
+      for (dvi = 0; dvi < dv->length; dvi++)
+	{
+	  cdoc = bow_array_entry_at_index (c->barrel->cdocs,
+					   dv->entry[dvi].di);
+	  dv->entry[dvi].weight *= c->fig_per_wi_ci[wi][cdoc->class];
+	  /* Catch cases in which it's NaN */
+	  assert (dv->entry[dvi].weight == dv->entry[dvi].weight);
 	}
-
-      /* Done */
-      if (wi % 100 == 0)
-	bow_verbosify (bow_progress, "\b\b\b\b\b\b\b\b\b%9d", 
-		       max_wi - wi - 1); 
     }
+}
+
+/* Scale the weights of the first NUM_WI words of BARREL as C says,
+   dividing the words among several threads. */
+static void
+bow_barrel_scale_weights_by_context (bow_barrel *barrel, int num_wi,
+				     struct _bow_scale_context *c)
+{
+  num_wi = MIN (num_wi, barrel->wi2dvf->size);
+  c->barrel = barrel;
+  /* The threads may only read the "document vectors". */
+  bow_wi2dvf_read_in (barrel->wi2dvf, num_wi);
+  bow_parallel_for (num_wi, bow_barrel_scale_weights_range, c);
+}
+
+/* Multiply each weight by the information gain of that word. */
+void
+bow_barrel_scale_weights_by_given_infogain (bow_barrel *barrel, 
+					    float *wi2ig, int wi2ig_size)
+{
+  struct _bow_scale_context c;
+
+  bow_verbosify (bow_progress, 
+		 "Scaling weights by information gain over words... ");
+  c.wi2ig = wi2ig;
+  c.fig_per_wi_ci = NULL;
+  bow_barrel_scale_weights_by_context (barrel, wi2ig_size, &c);
   bow_verbosify (bow_progress, "\n");
 }
 
@@ -63,35 +98,13 @@ bow_barrel_scale_weights_by_given_foilgain (bow_barrel *barrel,
 					    float **fig_per_wi_ci,
 					    int num_wi, int num_ci)
 {
-  int wi, dvi;
-  bow_dv *dv;
-  bow_cdoc *cdoc;
+  struct _bow_scale_context c;
 
   bow_verbosify (bow_progress, 
-		 "Scaling weights by Foil-gain over words: "
-		 "           ");
-  
-  for (wi = 0; wi < num_wi; wi++) 
-    {
-      /* Get this document vector */
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-      if (dv == NULL)
-	continue;
-
-      /* Scale all the elements using this gain. */
-      for (dvi = 0; dvi < dv->length; dvi++)
-	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, dv->entry[dvi].di);
-	  dv->entry[dvi].weight *= fig_per_wi_ci[wi][cdoc->class];
-	  /* Catch cases in which it's NaN */
-	  assert (dv->entry[dvi].weight == dv->entry[dvi].weight);
-	}
-
-      /* Done */
-      if (wi % 10 == 0)
-	bow_verbosify (bow_progress, "\b\b\b\b\b\b\b\b\b%9d", 
-		       num_wi - wi - 1); 
-    }
+		 "Scaling weights by Foil-gain over words... ");
+  c.wi2ig = NULL;
+  c.fig_per_wi_ci = fig_per_wi_ci;
+  bow_barrel_scale_weights_by_context (barrel, num_wi, &c);
   bow_verbosify (bow_progress, "\n");
 }
 
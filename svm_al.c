@@ -49,7 +49,7 @@ struct al_test_data {
   int *docs_added;
   int *test_yvect, *apvect, *anvect;
   int *train_apvect, *train_anvect, *query_apvect, *query_anvect;
-  int *nsv_vect, *nbsv_vect, *time_vect, *nkce_vect;
+  int *nsv_vect, *nbsv_vect, *time_vect, *nkce_vect, *nkev_vect, *rtime_vect;
   int *npos_added, *nneg_added;
 
   double *prb, *scores_added;
@@ -81,6 +81,7 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
   int          n_trans_correct;
   int          num_words;
   int         *old_svbitmap;
+  double      *pool_scores;
   int          qsize;    /* query size, size of chunks to grow training set by */
   struct di   *train_scores, *train_cscores;
   int         *train_sat_vect;
@@ -95,6 +96,7 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
   sub_ndocs = MIN(ndocs,svm_init_al_tset);
 
   train_scores = (struct di *) malloc(sizeof(struct di)*ndocs);
+  pool_scores = (double *) malloc(sizeof(double)*ndocs);
   tvals = (double *) malloc(sizeof(double)*ndocs);
   tdocs = (int *) malloc(sizeof(int)*ndocs);
 
@@ -204,6 +206,7 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
 
   for (nloop=0; ;nloop++) {
     struct tms t1, t2;
+    clock_t rt1, rt2;
 
     /* BEGIN LOGGING CODE */
 
@@ -237,12 +240,13 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
     }
 
     svm_nkc_calls = 0;
+    svm_nkernel_evals = 0;
     /* END LOGGING CODE */
 
 
     fprintf(stderr,"\r%dth AL iteration",nloop);
 
-    times(&t1);
+    rt1 = times(&t1);
     if (nloop==2) {
       //exit(1);
     }
@@ -254,10 +258,12 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
 				     tvals, &tb, W, nleft+nperm_unlabeled, ndocs, &nsv);
       }
     } else {
-      changed = svm_trans_or_chunk(train_docs, train_yvect, cur_hyp_yvect, weights,
-				   tvals, &tb, W, 0, sub_ndocs, &nsv);
+      /* the docs added since the last round enter with zero weights, so
+       * the old solution is a feasible place to resume from */
+      changed = svm_resume(train_docs, train_yvect, weights, tvals, &tb, W, 
+			   last_subndocs, sub_ndocs, &nsv);
     }
-    times(&t2);
+    rt2 = times(&t2);
 
 
     /* BEGIN LOGGING CODE */
@@ -277,6 +283,17 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
     }
     if (astd->nkce_vect) 
       astd->nkce_vect[nloop] = svm_nkc_calls;
+    if (astd->nkev_vect) 
+      astd->nkev_vect[nloop] = svm_nkernel_evals;
+    if (astd->rtime_vect)
+      astd->rtime_vect[nloop] = (int) ((rt2 - rt1) * 1000 / sysconf(_SC_CLK_TCK));
+
+    if (bow_verbosity_level > 1) {
+      fprintf(stderr, "\nround %d: %d docs (%d new), %d sv's, %d ms, "
+	      "%d kernel evaluations\n", nloop, sub_ndocs, sub_ndocs-last_subndocs,
+	      nsv, (int) ((rt2 - rt1) * 1000 / sysconf(_SC_CLK_TCK)), 
+	      svm_nkernel_evals);
+    }
 
     /* END LOGGING CODE */
 
@@ -284,18 +301,13 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
     /* the scores need to be recalculated if any of the weights changed... */
     if (changed) {
       train_cscores = train_scores;
-      if (svm_kernel_type == 0) {
-	for (j=sub_ndocs,nleft=0; j<nplabeled; j++) {
-	  train_scores[nleft].d = fabs(evaluate_model_hyperplane(*W, tb, train_docs[j]));
-	  train_scores[nleft].i = j;
-	  nleft ++;
-	}
-      } else {
-	for (j=sub_ndocs,nleft=0; j<nplabeled; j++) {
-	  train_scores[nleft].d = fabs(evaluate_model_cache(train_docs, weights, hyp_yvect, tb, train_docs[j], nsv));
-	  train_scores[nleft].i = j;
-	  nleft ++;
-	}
+      svm_evaluate_pool(train_docs, weights, hyp_yvect, tb, nsv, 
+			((svm_kernel_type == 0) ? *W : NULL), 
+			&(train_docs[sub_ndocs]), nplabeled-sub_ndocs, pool_scores);
+      for (j=sub_ndocs,nleft=0; j<nplabeled; j++) {
+	train_scores[nleft].d = fabs(pool_scores[nleft]);
+	train_scores[nleft].i = j;
+	nleft ++;
       }
 
       /* BEGIN LOGGING CODE */      
@@ -618,6 +630,7 @@ int al_svm_guts(bow_wv **train_docs, int *train_yvect, double *weights,
   free(hyp_yvect);
   
   free(train_scores);
+  free(pool_scores);
   free(tvals);
 
   if (sv_sat_vect) {
@@ -702,6 +715,8 @@ int al_svm_test_wrapper(bow_wv **docs, int *yvect, double *weights, double *b,
   altd.prb = (double *) malloc(sizeof(double)*max_iter);
   altd.nkce_vect = (int *) malloc(sizeof(int)*max_iter);
   altd.time_vect = (int *) malloc(sizeof(int)*max_iter);
+  altd.nkev_vect = (int *) malloc(sizeof(int)*max_iter);
+  altd.rtime_vect = (int *) malloc(sizeof(int)*max_iter);
   
   altd.query_anvect = (int *) malloc(sizeof(int)*max_iter);
   altd.query_apvect = (int *) malloc(sizeof(int)*max_iter);
@@ -833,6 +848,14 @@ int al_svm_test_wrapper(bow_wv **docs, int *yvect, double *weights, double *b,
   for (j=0; j<i; j++) {
     printf(" %d", altd.nkce_vect[j]);
   }
+  printf("\nelapsed times (ms): ");
+  for (j=0; j<i; j++) {
+    printf("  %d", altd.rtime_vect[j]);
+  }
+  printf("\nkernel evaluations: ");
+  for (j=0; j<i; j++) {
+    printf(" %d", altd.nkev_vect[j]);
+  }
   for (k=0; k<NDIM_INSPECTED; k++) {
     /* following is only good if the 0'th # of dimensions == 1 */
     int num_words = altd.train_dim_sat_vect[0][i-1];
@@ -881,6 +904,8 @@ int al_svm_test_wrapper(bow_wv **docs, int *yvect, double *weights, double *b,
   free(altd.sv_dim_sat_vect);
   free(altd.train_dim_sat_vect);
   free(altd.nkce_vect);
+  free(altd.nkev_vect);
+  free(altd.rtime_vect);
   free(altd.npos_added);
   free(altd.nneg_added);
   free(altd.query_anvect);
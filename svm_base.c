@@ -3,6 +3,9 @@
 /* "main" file for all of the svm related code - any svm stuff should
  * pass through some function here */
 #include <bow/svm.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #if !HAVE_SQRTF
 #define sqrtf sqrt
@@ -43,6 +46,7 @@
 #define TRANS_IGNORE_BIAS_ARG          14028
 #define TRANS_HYP_REFRESH_ARG          14029
 #define TRANS_SMART_VALS_ARG           14030
+#define MODEL_FILE_ARG                 14031
 
 #define AGAINST_ALL 0
 #define PAIRWISE    1
@@ -66,6 +70,7 @@ static int transduce_class=(1 << bow_doc_unlabeled);
 static int transduce_class_overriding=0; /* gets set to 1 when args are 
 					  * passed to override */
 static char *svml_basename=NULL;
+static char *svm_model_filename=NULL; /* compact copy of the trained models */
 FILE *svml_test_file=NULL;
 
 #ifdef HAVE_LOQO
@@ -84,6 +89,7 @@ int svm_kernel_type=0;          /* 0=linear */
 int svm_remove_misclassified=0;
 int svm_weight_style;
 int svm_nkc_calls;
+int svm_nkernel_evals;
 
 int svm_trans_npos;
 int svm_trans_nobias=0;
@@ -109,8 +115,8 @@ static int df_counts=bow_tfidf_occurrences;
 struct model_bucket {
   bow_wv    **docs;
   float     **oweights;  /* original weights (after norm & tf scaling) 
-			    note - this only matters when tf_transform is set &
-			    some weight_per_model scheme is used */
+			    note - this only matters when some weight_per_model
+			    scheme is used */
   /* note - these are regular vectors instead of wv's to save time 
    * (O(# qwv features) instead of O((# qwv features) + (# of features)) */
   union {
@@ -126,10 +132,12 @@ struct model_bucket {
   bow_barrel *barrel;
   int         ndocs;
   int         nmodels;
+  char       *map;      /* non-NULL if the arrays point into a model file */
+  size_t      map_size;
 };
 
 static struct model_bucket model_cache = {NULL, NULL, {NULL}, NULL, NULL, NULL, 
-					  NULL, NULL, NULL, 0, 0};
+					  NULL, NULL, NULL, NULL, 0, 0, NULL, 0};
 
 double dprod(bow_wv *wv1, bow_wv *wv2);
 double kernel_poly(bow_wv *wv1, bow_wv *wv2);
@@ -138,6 +146,12 @@ double kernel_sig(bow_wv *wv1, bow_wv *wv2);
 
 /* by default use the dot product as the kernel */
 static double (*kernel)(bow_wv *, bow_wv *) = dprod;
+double dprod_dense(bow_wv *wv, bow_wvd *d);
+double kernel_poly_dense(bow_wv *wv, bow_wvd *d);
+double kernel_rbf_dense(bow_wv *wv, bow_wvd *d);
+double kernel_sig_dense(bow_wv *wv, bow_wvd *d);
+/* NULL if the kernel has no version for dense vectors */
+static double (*kernel_dense)(bow_wv *, bow_wvd *) = dprod_dense;
 
 /* Command-line options specific to SVMs */
 static struct argp_option svm_options[] = {
@@ -162,6 +176,9 @@ static struct argp_option svm_options[] = {
    "Use active learning to query the labels & incrementally (by arg_size) build the barrels."},
   {"svm-epsilon_a", EA_TYPE, "", 0,
    "tolerance for the bounds of the lagrange multipliers (default 0.0001)."},
+  {"svm-model-file", MODEL_FILE_ARG, "FILE", 0,
+   "Write the trained models to FILE in a compact form, & map them from "
+   "there when classifying instead of unpacking the class barrel."},
   {"svm-kernel", KERNEL_TYPE, "", 0,
    "type of kernel to use (0=linear, 1=polynomial, 2=gassian, 3=sigmoid, 4=fisher kernel)."},
   {"svm-al_init_tsetsize", INITIAL_AL_TSET_ARG, "", 0,
@@ -228,6 +245,32 @@ union kern_param {
 
 union kern_param kparm;
 
+/* point kernel & kernel_dense at the functions for kernel type t */
+static void set_kernel_fns(int t) {
+  switch (t) {
+  case 0:
+    kernel = dprod;
+    kernel_dense = dprod_dense;
+    break;
+  case 1:
+    kernel = kernel_poly;
+    kernel_dense = kernel_poly_dense;
+    break;
+  case 2:
+    kernel = kernel_rbf;
+    kernel_dense = kernel_rbf_dense;
+    break;
+  case 3:
+    kernel = kernel_sig;
+    kernel_dense = kernel_sig_dense;
+    break;
+  case 4:
+    kernel = svm_kernel_fisher;
+    kernel_dense = NULL;
+    break;
+  }
+}
+
 error_t svm_parse_opt (int key, char *arg, struct argp_state *state) {
   switch (key) {
   case START_AT_ARG:
@@ -240,28 +283,23 @@ error_t svm_parse_opt (int key, char *arg, struct argp_state *state) {
       return ARGP_ERR_UNKNOWN;
     }
     switch (svm_kernel_type) {
-    case 0:
-      kernel = dprod;
-      break;
     case 1:
       kparm.poly.const_co = 1.0;
       kparm.poly.lin_co = 1.0;
       kparm.poly.degree = 4.0;
-      kernel = kernel_poly;
       break;
     case 2:
       kparm.rbf.gamma = 1.0;
-      kernel = kernel_rbf;
       break;
     case 3:
       kparm.sig.lin_co = 1.0;
       kparm.sig.const_co = 0.0;
-      kernel = kernel_sig;
-      break;
-    case 4:
-      kernel = svm_kernel_fisher;
       break;
     }
+    set_kernel_fns(svm_kernel_type);
+    break;
+  case MODEL_FILE_ARG:
+    svm_model_filename = arg;
     break;
   case AL_TEST_IN_TRAIN_ARG:
     test_in_train = 1;
@@ -475,29 +513,7 @@ void svm_unpermute_data(int *permute_table, bow_wv **docs, int *yvect, int ndocs
 
 /* Right now, the vectors it looks at are the raw freq vectors */
 double dprod(bow_wv *wv1, bow_wv *wv2) {
-  double sum;
-  bow_we *v1, *v2;
-  int i1, i2;
-
-  i1 = i2 = 0;
-  sum = 0.0;
-  v1 = wv1->entry;
-  v2 = wv2->entry;
-
-  while ((i1 < wv1->num_entries) && (i2 < wv2->num_entries)) {
-    if(v1[i1].wi > v2[i2].wi) {
-      i2++;
-    }
-    else if (v1[i1].wi < v2[i2].wi) {
-      i1++;
-    }
-    else {
-      sum += (v1[i1].weight) * (v2[i2].weight);
-      i1++;
-      i2++;
-    }
-  }
-  return(sum);
+  return (bow_wv_dot(wv1, wv2));
 }
 
 /* dot product between a sparce & non-sparse vector */
@@ -519,31 +535,7 @@ double dprod_sd(bow_wv *wv, double *W) {
 
 /* this is a whole different function just because the kernel is the biggest bottleneck */
 double ddprod(bow_wv *wv1, bow_wv *wv2) {
-  double tmp;
-  double sum;
-  bow_we *v1, *v2;
-  int i1, i2;
-
-  i1 = i2 = 0;
-  sum = 0.0;
-  v1 = wv1->entry;
-  v2 = wv2->entry;
-
-  while ((i1 < wv1->num_entries) && (i2 < wv2->num_entries)) {
-    if(v1[i1].wi > v2[i2].wi) {
-      i2++;
-    }
-    else if (v1[i1].wi < v2[i2].wi) {
-      i1++;
-    }
-    else {
-      tmp = (v1[i1].weight) - (v2[i2].weight);
-      sum += tmp*tmp;
-      i1++;
-      i2++;
-    }
-  }
-  return(sum);
+  return (bow_wv_dist2_common(wv1, wv2));
 }
 
 /* End of command-line options specific to SVMs */
@@ -560,6 +552,35 @@ double kernel_sig(bow_wv *wv1, bow_wv *wv2) {
   return(tanh(kparm.sig.lin_co * dprod(wv1,wv2)+kparm.sig.const_co));
 }
 
+/* the same kernels, with one of the vectors already scattered into a
+ * dense array - used when one vector is evaluated against many others */
+double dprod_dense(bow_wv *wv, bow_wvd *d) {
+  return (bow_wvd_dot(d, wv));
+}
+
+double kernel_poly_dense(bow_wv *wv, bow_wvd *d) {
+  return (pow(kparm.poly.lin_co * bow_wvd_dot(d,wv) + 
+	      kparm.poly.const_co, kparm.poly.degree));
+}
+
+double kernel_rbf_dense(bow_wv *wv, bow_wvd *d) {
+  return (exp(-1*kparm.rbf.gamma * (bow_wvd_dist2_common(d,wv))));
+}
+
+double kernel_sig_dense(bow_wv *wv, bow_wvd *d) {
+  return(tanh(kparm.sig.lin_co * bow_wvd_dot(d,wv)+kparm.sig.const_co));
+}
+
+/* evaluate the kernel between wv & the vector scattered into d (which
+ * must have been scattered from dwv), without using the cache */
+double svm_kernel_dense(bow_wv *wv, bow_wvd *d, bow_wv *dwv) {
+  if (kernel_dense) {
+    return (kernel_dense(wv, d));
+  } else {
+    return (kernel(dwv, wv));
+  }
+}
+
 
 static int rlength;
 typedef struct _kc_el {
@@ -575,6 +596,7 @@ void kcache_init(int nwide) {
   int i;
   max_age = 1;
   svm_nkc_calls = 0;
+  svm_nkernel_evals = 0;
   rlength = nwide;
   if ((harray = (kc_el *) malloc(sizeof(kc_el)*cache_size)) == NULL) {
     cache_size = cache_size/2;
@@ -599,7 +621,9 @@ void kcache_age() {
 
 #define NHASHES   3
 static int sub_nkcc=0; /* this makes nkc_calls = actual calls / 100 */
-double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2) {
+/* if dense is non-NULL, it must hold dwv (one of wv1 or wv2) & is used
+ * to evaluate the kernel on a miss */
+static double kcache_get(bow_wv *wv1, bow_wv *wv2, bow_wvd *dense, bow_wv *dwv) {
   int h_index;
   int k;
   unsigned int min_age, min_from;
@@ -639,7 +663,12 @@ double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2) {
     }
   }
 
-  d = kernel(wv1,wv2);
+  svm_nkernel_evals ++;
+  if (dense) {
+    d = svm_kernel_dense((dwv == wv1) ? wv2 : wv1, dense, dwv);
+  } else {
+    d = kernel(wv1,wv2);
+  }
   harray[min_from].i = wv1;
   harray[min_from].j = wv2;
   harray[min_from].val = d;
@@ -647,6 +676,16 @@ double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2) {
   return (d);
 }
 
+double svm_kernel_cache(bow_wv *wv1, bow_wv *wv2) {
+  return (kcache_get(wv1, wv2, NULL, NULL));
+}
+
+/* same as svm_kernel_cache, but on a miss the kernel is computed 
+ * against d, which must hold the scattered weights of wv1 */
+double svm_kernel_cache_dense(bow_wv *wv1, bow_wvd *d, bow_wv *wv2) {
+  return (kcache_get(wv1, wv2, d, wv1));
+}
+
 /* don't add the evaluation (useful if the items are getting deleted from a set) */
 double svm_kernel_cache_lookup(bow_wv *wv1, bow_wv *wv2) {
   int h_index;
@@ -1158,6 +1197,7 @@ inline int solve_svm(bow_wv **docs, int *yvect, double *weights, double *ab,
     x = build_svm_guts(docs, yvect, weights, ab, W, ndocs, tvals, cvect, nsv);
 #else
     bow_error("Must build rainbow with pr_loqo to use this solver!\n");
+    x = 0;
 #endif
   }
 
@@ -1186,6 +1226,29 @@ int svm_trans_or_chunk(bow_wv **docs, int *yvect, int *trans_yvect,
   }
 }
 
+/* like svm_trans_or_chunk without transduction, but docs [0,nold) 
+ * already hold a solution (in weights, tvals, ab & W) that training
+ * resumes from.  The solvers that can't warm start just start over. */
+int svm_resume(bow_wv **docs, int *yvect, double *weights, double *tvals, 
+	       double *ab, double **W, int nold, int ndocs, int *nsv) {
+  int i;
+  float *cvect = (float *) alloca(sizeof(float)*ndocs);
+
+  for (i=0; i<ndocs; i++) {
+    cvect[i] = svm_C;
+  }
+
+  if (!svm_use_smo || svm_remove_misclassified || nold == 0) {
+    for (i=nold; i<ndocs; i++) {
+      weights[i] = 0.0;
+      tvals[i] = 0.0;
+    }
+    return(solve_svm(docs, yvect, weights, ab, W, ndocs, tvals, cvect, nsv));
+  }
+
+  return(smo_resume(docs, yvect, weights, ab, W, nold, ndocs, tvals, cvect, nsv));
+}
+
 /* cover for all the functions */
 /* this function does a small amount of pre & post-processing for the
  * algorithm independent stuff (like randomly permuting everything &
@@ -1381,13 +1444,77 @@ int make_doc_array(bow_barrel *barrel, bow_wv **docs, int *tdocs, int(*dec_fn)(b
   return ndocs;
 }
 
-/* C sucks - this is just a fn to pass to bow_heap_next_wv */
-static int silly_currying_global_v1, silly_currying_global_v2;
-int use_train_and_submodel(bow_cdoc *cdoc) {
-  return ((cdoc->type == bow_doc_train && 
-	   (silly_currying_global_v1 == cdoc->class ||  
-	    silly_currying_global_v2 == cdoc->class)) ? 
-	  1 : 0);
+static void setup_docs(bow_barrel *barrel, int nclasses, int nmodels);
+static void clear_model_cache();
+static void svm_model_write(const char *filename, bow_barrel *barrel,
+			    int nclasses);
+
+/* The documents of svm_vpc_merge, tf-transformed once & packed back
+ * to back into a single block - a CSR matrix whose rows are also
+ * usable as bow_wv's by the solvers & the kernel cache.  base & bnorm
+ * hold the weights & normalizer each row had before any per-model
+ * weighting, so a model resets its rows instead of going back through
+ * the barrel with make_doc_array. */
+struct svm_doc_matrix {
+  int      nrows;
+  int     *row;        /* row i's weights start at base[row[i]] */
+  char    *block;      /* the packed bow_wv's */
+  float   *base;       /* weights after the tf_transform */
+  float   *bnorm;      /* normalizers from make_doc_array */
+};
+
+/* packs docs (as filled in by make_doc_array) into m, freeing them &
+ * replacing them with pointers to the packed rows */
+static void doc_matrix_pack(struct svm_doc_matrix *m, bow_wv **docs, int ndocs) {
+  size_t size;
+  char  *p;
+  int    i, j, nnz;
+
+  for (i=nnz=0, size=0; i<ndocs; i++) {
+    nnz += docs[i]->num_entries;
+    size += sizeof(bow_wv) + sizeof(bow_we)*docs[i]->num_entries;
+  }
+
+  m->nrows = ndocs;
+  m->row = (int *) malloc(sizeof(int)*(ndocs+1));
+  m->block = (char *) malloc(size);
+  m->base = (float *) malloc(sizeof(float)*(nnz+1));
+  m->bnorm = (float *) malloc(sizeof(float)*(ndocs+1));
+
+  for (i=nnz=0, p=m->block; i<ndocs; i++) {
+    int n = docs[i]->num_entries;
+    memcpy(p, docs[i], sizeof(bow_wv) + sizeof(bow_we)*n);
+    m->row[i] = nnz;
+    m->bnorm[i] = docs[i]->normalizer;
+    for (j=0; j<n; j++) {
+      m->base[nnz+j] = docs[i]->entry[j].weight;
+    }
+    nnz += n;
+    bow_wv_free(docs[i]);
+    docs[i] = (bow_wv *) p;
+    p += sizeof(bow_wv) + sizeof(bow_we)*n;
+  }
+  m->row[ndocs] = nnz;
+}
+
+/* restores the weights & normalizer of row i (which is docs[i]) */
+static inline void doc_matrix_reset(struct svm_doc_matrix *m, bow_wv **docs, int i) {
+  bow_wv *wv = docs[i];
+  float  *base = m->base + m->row[i];
+  int     j;
+
+  for (j=0; j<wv->num_entries; j++) {
+    wv->entry[j].weight = base[j];
+  }
+  wv->normalizer = m->bnorm[i];
+}
+
+static void doc_matrix_free(struct svm_doc_matrix *m) {
+  free(m->row);
+  free(m->block);
+  free(m->base);
+  free(m->bnorm);
+  m->nrows = 0;
 }
 
 int use_transduction_docs(bow_cdoc *cdoc) {
@@ -1511,6 +1638,7 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
   double       *weights;     /* lagrange multipliers */
   bow_wv      **W;           /* hyperplane for lin. folding */
   int          *yvect;
+  struct svm_doc_matrix dmat; /* the docs, when weights are set per model */
 
   int i,j;
 
@@ -1531,6 +1659,11 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
   model_weights = NULL;
   W = NULL;
   yvect = NULL;
+  memset(&dmat, 0, sizeof(dmat));
+
+  /* the models cached for an earlier class barrel are stale, even if
+   * the new one is allocated in its place */
+  clear_model_cache();
 
   /* note - this OVER allocates - uses ALL, instead of just those for training */
   docs = (bow_wv **) alloca(sizeof(bow_wv *)*total_docs);
@@ -1582,15 +1715,18 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
     for (i=0; i<ndocs; i++) {
       utdocs[i] = i;
     }
-    sub_docs = docs;
+    if (vote_type == PAIRWISE) {
+      /* pairwise models pick their docs out of docs, so don't alias it */
+      sub_docs = alloca(sizeof(bow_wv *)*ndocs);
+    } else {
+      sub_docs = docs;
+    }
     mdocs = ndocs;
 
     svm_set_barrel_weights(docs, NULL, ndocs, &weight_vect);
 
     kcache_init(ndocs);
   } else {
-    /* the ndocs value is the number of training documents that will
-     * actually be used - this is done now JUST to fill up the tdocs array. */
     ntrain = make_doc_array(src_barrel, docs, tdocs, bow_cdoc_is_train);
    
     if (ntrain < 2) {
@@ -1601,22 +1737,32 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
       return NULL;
     }    
 
-    /* figure out the # of ntrans */
     ntrans = make_doc_array(src_barrel, &(docs[ntrain]), &(tdocs[ntrain]),
 			    use_transduction_docs);
     
     ndocs = ntrain + ntrans;
 
-    /* since we don't need the docs for a while, free them */
-    for (i=0; i<ndocs; i++) {
-      bow_wv_free(docs[i]);
-    }
+    /* the docs only get built once - each model resets the weights of
+     * the rows it uses & then sets its own */
+    doc_matrix_pack(&dmat, docs, ndocs);
 
-    model_weights = (bow_wv **) malloc(sizeof(bow_wv *)*nclasses);
+    if (vote_type == PAIRWISE) {
+      model_weights = (bow_wv **) malloc(sizeof(bow_wv *)*(nclasses-1)*nclasses/2);
+    } else {
+      model_weights = (bow_wv **) malloc(sizeof(bow_wv *)*nclasses);
+    }
 
     utdocs = (int *) alloca(sizeof(int)*ndocs);
-    /* the sub_docs vector will be rewritten with wv's to be used each iteration */
-    sub_docs = alloca(sizeof(bow_wv *)*ndocs);
+    if (vote_type == PAIRWISE) {
+      /* the sub_docs vector will be rewritten with wv's to be used each iteration */
+      sub_docs = alloca(sizeof(bow_wv *)*ndocs);
+    } else {
+      for (i=0; i<ndocs; i++) {
+	utdocs[i] = i;
+      }
+      sub_docs = docs;
+      mdocs = ndocs;
+    }
   }
   
   /* build the naive bayes model for the kernel... */
@@ -1670,62 +1816,27 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
 	cto = npass+1;
       }
 
-      if (svm_weight_style == WEIGHTS_PER_MODEL) {
-	silly_currying_global_v1 = npass;
-	silly_currying_global_v2 = cto;
-	/* this gets called here since the doctype labels are in the barrel */
-	/* utdocs is filled with actual indices, not indices of the train set */
-	mdocs = make_doc_array(src_barrel, sub_docs, utdocs, use_train_and_submodel);
-		
-	/* put the labels in for the labeled docs. */
-	for (i=0; i<mdocs; i++) {
-	  bow_cdoc *cdoc = (GET_CDOC_ARRAY_EL(src_barrel,utdocs[i]));
-	  yvect[i] = map_class_to_y(npass, cdoc->class);
-	}
-
-	/* even though this set of docs is always the same (since all of the 
-	 * unlabeled data is used for each pairwise document [this is not 
-	 * suggested to with a barrel w/ more than 2 classes] is used) we 
-	 * still grab it, since the starting position for the unlabeled data
-	 * isn't known beforehand (its a slight hack) */
-	ntrans = make_doc_array(src_barrel, &(sub_docs[mdocs]), 
-				&(utdocs[mdocs]), use_transduction_docs);
-
-	/* this says that it is unlabelled */
-	for (i=0; i<ntrans; i++) {
-	  yvect[i+mdocs] = 0;
+      for (i=j=0; i<ntrain; i++) {
+	bow_cdoc *cdoc = (GET_CDOC_ARRAY_EL(src_barrel,tdocs[i]));
+	if ((cdoc->class == npass) || (cdoc->class == cto)) {
+	  sub_docs[j] = docs[i];
+	  yvect[j] = map_class_to_y(npass, cdoc->class);
+	  utdocs[j] = i;
+	  j++;
 	}
+      }
+      for (i=0; i<ntrans; j++,i++) {
+	sub_docs[j] = docs[i+ntrain];
+	utdocs[j] = i+ntrain;
+	yvect[j] = 0;
+      }
 
-	mdocs = mdocs + ntrans;
+      mdocs = j;
 
-	/* utdocs holds the barrel indices we're interested in the sub-model
-	 * indices - so we need to remap utdocs */
-	for (i=j=0; j<mdocs; i++) {
-	  if (tdocs[i] < utdocs[j]) {
-	    continue;
-	  } else {
-	    utdocs[j] = i;
-	    j++;
-	  }
-	}
-
-      } else {
-	for (i=j=0; i<ntrain; i++) {
-	  bow_cdoc *cdoc = (GET_CDOC_ARRAY_EL(src_barrel,tdocs[i]));
-	  if ((cdoc->class == npass) || (cdoc->class == cto)) {
-	    sub_docs[j] = docs[i];
-	    yvect[j] = map_class_to_y(npass, cdoc->class);
-	    utdocs[j] = i;
-	    j++;
-	  }
-	}
-	for (i=0; i<ntrans; j++,i++) {
-	    sub_docs[j] = docs[i+ntrain];
-	    utdocs[j] = i+ntrain;
-	    yvect[j] = 0;
+      if (svm_weight_style == WEIGHTS_PER_MODEL) {
+	for (i=0; i<mdocs; i++) {
+	  doc_matrix_reset(&dmat, docs, utdocs[i]);
 	}
-
-	mdocs = j;
       }
 
     } else {
@@ -1744,10 +1855,9 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
       }
       
       if (svm_weight_style == WEIGHTS_PER_MODEL) {
+	/* the weight values are not correct - they include the last values */
 	for (i=0; i<mdocs; i++) {
-	  /* the weight values are not correct - they include the last values */
-	  /* make_doc_array does this for pairwise voting */
-	  tf_transform(docs[i]);
+	  doc_matrix_reset(&dmat, docs, i);
 	}
       }
     }
@@ -1805,12 +1915,6 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
       }
     }
 
-    if (vote_type == PAIRWISE && weight_type) {
-      for (i=0; i<mdocs; i++) {
-	bow_wv_free(sub_docs[i]);
-      }
-    }
-
     if (max_nsv < nsv) {
       max_nsv = nsv;
     }
@@ -1868,16 +1972,6 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
     free(model_weights);
   }
 
-  /* the docs were freed before just to save memory - now we need them again
-   * & the optimizer's done, so a lot of memory is no longer being used */
-  if (svm_weight_style == WEIGHTS_PER_MODEL && vote_type == PAIRWISE) {
-    make_doc_array(src_barrel, docs, tdocs, bow_cdoc_is_train);
-
-    /* append these trans docs to the arrays that were filled in above */
-    make_doc_array(src_barrel, &(docs[ntrain]), &(tdocs[ntrain]),
-			    use_transduction_docs);
-  }
-
   /* now add all of the documents from the doc barrel to the class barrel */
   for (i=0; i<ndocs; i++) {
     /* add the i'th document to the class_barrel */
@@ -1917,8 +2011,19 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
     bow_str2int(class_barrel->classnames, bow_int2str(src_barrel->classnames, i));
   }
 
-  for (i=0; i<ndocs; i++) {
-    bow_wv_free(docs[i]);
+  /* unpack the models the way svm_score would & save them */
+  if (svm_model_filename) {
+    setup_docs(class_barrel, nclasses, nloops);
+    svm_model_write(svm_model_filename, class_barrel, nclasses);
+    clear_model_cache();
+  }
+
+  if (svm_weight_style == WEIGHTS_PER_MODEL) {
+    doc_matrix_free(&dmat);
+  } else {
+    for (i=0; i<ndocs; i++) {
+      bow_wv_free(docs[i]);
+    }
   }
   
   return class_barrel;
@@ -1926,11 +2031,17 @@ bow_barrel *svm_vpc_merge(bow_barrel *src_barrel) {
 
 inline double evaluate_model(bow_wv **docs, double *weights, int *yvect, double b, 
 			     bow_wv *query_wv, int nsv) {
+  bow_wvd *dq;
   double sum,tmp;
   int i,j;
+
+  /* scatter the query once, rather than merging it against each sv */
+  dq = bow_thread_wvd(0, bow_num_words());
+  bow_wvd_scatter(dq, query_wv);
+
   for (i=j=0, sum=0.0; j<nsv; i++) {
     if (weights[i] != 0.0) {
-      tmp = kernel(docs[i],query_wv);
+      tmp = svm_kernel_dense(docs[i],dq,query_wv);
       sum += yvect[i]*weights[i]*tmp;
       j++;
     }
@@ -1941,11 +2052,16 @@ inline double evaluate_model(bow_wv **docs, double *weights, int *yvect, double
 /* similar to above, but to only for when the cache should be used */
 inline double evaluate_model_cache(bow_wv **docs, double *weights, int *yvect, double b, 
 			     bow_wv *query_wv, int nsv) {
+  bow_wvd *dq;
   double sum,tmp;
   int i,j;
+
+  dq = bow_thread_wvd(0, bow_num_words());
+  bow_wvd_scatter(dq, query_wv);
+
   for (i=j=0, sum=0.0; j<nsv; i++) {
     if (weights[i] != 0.0) {
-      tmp = svm_kernel_cache(docs[i],query_wv);
+      tmp = svm_kernel_cache_dense(query_wv,dq,docs[i]);
       sum += yvect[i]*weights[i]*tmp;
       j++;
     }
@@ -1957,12 +2073,111 @@ inline double evaluate_model_hyperplane(double *W, double b, bow_wv *query_wv) {
   return (dprod_sd(query_wv,W)-b);
 }
 
+struct svm_pool_ctx {
+  bow_wv **sv_docs;    /* the sv's, gathered once for all the threads */
+  double  *sv_coefs;   /* y*alpha of each sv */
+  int      nsv;
+  double  *W;          /* non-NULL for the linear kernel */
+  double   b;
+  int      num_words;
+  bow_wv **pool;
+  double  *scores;
+};
+
+static void svm_evaluate_pool_range(int lo, int hi, int thread, void *arg) {
+  struct svm_pool_ctx *c = arg;
+  bow_wvd *dq;
+  double sum;
+  int i,j;
+
+  if (c->W) {
+    for (i=lo; i<hi; i++) {
+      c->scores[i] = evaluate_model_hyperplane(c->W, c->b, c->pool[i]);
+    }
+    return;
+  }
+
+  /* each thread scatters its queries into its own scratch vector */
+  dq = bow_wvd_new(c->num_words);
+  for (i=lo; i<hi; i++) {
+    bow_wvd_scatter(dq, c->pool[i]);
+    for (j=0, sum=0.0; j<c->nsv; j++) {
+      sum += c->sv_coefs[j] * svm_kernel_dense(c->sv_docs[j], dq, c->pool[i]);
+    }
+    c->scores[i] = sum - c->b;
+  }
+  bow_wvd_free(dq);
+}
+
+/* put the output of the model (the nsv sv's among docs, or the 
+ * hyperplane W if it isn't NULL) on each of the npool docs in pool into
+ * scores.  The pool is split among bow_num_threads threads.  None of 
+ * the evaluations go through the kernel cache, so a large pool doesn't
+ * push the rows of the training docs out of it. */
+void svm_evaluate_pool(bow_wv **docs, double *weights, int *yvect, double b,
+		       int nsv, double *W, bow_wv **pool, int npool, 
+		       double *scores) {
+  struct svm_pool_ctx c;
+  int i,j;
+
+  c.W = W;
+  c.b = b;
+  c.nsv = nsv;
+  c.num_words = bow_num_words();
+  c.pool = pool;
+  c.scores = scores;
+  c.sv_docs = NULL;
+  c.sv_coefs = NULL;
+
+  if (!W) {
+    c.sv_docs = (bow_wv **) malloc(sizeof(bow_wv *)*nsv);
+    c.sv_coefs = (double *) malloc(sizeof(double)*nsv);
+    for (i=j=0; j<nsv; i++) {
+      if (weights[i] != 0.0) {
+	c.sv_docs[j] = docs[i];
+	c.sv_coefs[j] = yvect[i]*weights[i];
+	j++;
+      }
+    }
+  }
+
+  /* the fisher kernel has no dense form & keeps state of its own */
+  if (W || kernel_dense) {
+    bow_parallel_for(npool, svm_evaluate_pool_range, &c);
+  } else {
+    svm_evaluate_pool_range(0, npool, 0, &c);
+  }
+
+  if (!W) {
+    free(c.sv_docs);
+    free(c.sv_coefs);
+  }
+}
+
 /* this & setup_docs are for "caching" the barrel into its wv form */
 static void clear_model_cache () {
   int i;
-  if (model_cache.barrel) {
+  if (model_cache.barrel && model_cache.map) {
+    /* everything but the arrays of pointers lives in the mapped file */
+    free(model_cache.docs);
+    free(model_cache.indices);
+    free(model_cache.weights);
+    free(model_cache.yvect);
+    if (svm_weight_style == WEIGHTS_PER_MODEL) {
+      free(model_cache.oweights);
+      free(model_cache.word_weights.sub_model);
+    }
+    if (svm_kernel_type == 0) {
+      free(model_cache.W);
+    }
+    munmap(model_cache.map, model_cache.map_size);
+    model_cache.map = NULL;
+  } else if (model_cache.barrel) {
     for (i=0; i<model_cache.ndocs; i++) {
       bow_wv_free(model_cache.docs[i]);
+      if (svm_weight_style == WEIGHTS_PER_MODEL) {
+	free(model_cache.oweights[i]);
+      }
     }
 
     for (i=0; i<model_cache.nmodels; i++) {
@@ -1984,6 +2199,7 @@ static void clear_model_cache () {
     free(model_cache.bvect);
     free(model_cache.sizes);
     if (svm_weight_style == WEIGHTS_PER_MODEL) {
+      free(model_cache.oweights);
       free(model_cache.word_weights.sub_model);
     } else if (svm_weight_style == WEIGHTS_PER_BARREL) {
       free(model_cache.word_weights.barrel);
@@ -2058,8 +2274,7 @@ static void setup_docs(bow_barrel *barrel, int nclasses, int nmodels) {
     if (vote_type == PAIRWISE || weight_type == INFOGAIN) {
       svm_weight_style = WEIGHTS_PER_MODEL;
       model_cache.word_weights.sub_model = (float **) malloc(sizeof(float *)*nmodels);
-      if (tf_transform_type) 
-	model_cache.oweights = (float **) malloc(sizeof(float *)*ndocs);
+      model_cache.oweights = (float **) malloc(sizeof(float *)*ndocs);
     } else {
       svm_weight_style = WEIGHTS_PER_BARREL;
       model_cache.word_weights.barrel = (float *) malloc(sizeof(float *)*total_words);
@@ -2209,7 +2424,7 @@ static void setup_docs(bow_barrel *barrel, int nclasses, int nmodels) {
 
     /* this means that the weights will change with every model & 
      * therefore we need to keep track of what they were initially (after the tf_transform) */
-    if (svm_weight_style == WEIGHTS_PER_MODEL && tf_transform_type) {
+    if (svm_weight_style == WEIGHTS_PER_MODEL) {
       model_cache.oweights[h] = (float *) malloc(sizeof(float)*dtmp->num_entries);
       for (j=0; j<model_cache.docs[h]->num_entries; j++) {
 	model_cache.oweights[h][j] = model_cache.docs[h]->entry[j].weight;
@@ -2241,6 +2456,325 @@ static void setup_docs(bow_barrel *barrel, int nclasses, int nmodels) {
   model_cache.nmodels = nmodels;
 }
 
+/* The model file holds everything setup_docs builds, laid out so that
+ * it can be mapped & used in place.  All offsets are in bytes from the
+ * start of the file & every section starts on an 8 byte boundary.  The
+ * documents are packed back to back as bow_wv's (a CSR matrix whose rows
+ * are usable by the kernels), and a model's multipliers, labels & doc
+ * indices are concatenated with those of all the other models. */
+#define SVM_MODEL_MAGIC 0x62737632  /* "bsv2" */
+
+struct svm_model_header {
+  int    magic;
+  int    nclasses;
+  int    nmodels;
+  int    ndocs;
+  int    nbarrel_docs;     /* cdocs in the class barrel, to catch stale files */
+  int    total_words;
+  unsigned int checksum;   /* of the class barrel & the parameters */
+  int    kernel_type;
+  int    weight_type;
+  int    tf_transform_type;
+  int    weight_style;
+  union kern_param kparm;
+  long   docs_off;         /* the packed bow_wv's */
+  long   wv_off;           /* long[ndocs], offset of each wv from docs_off */
+  long   nz_off;           /* int[ndocs+1], entry offset of each doc */
+  long   oweights_off;     /* float[nnz], if weights are set per model */
+  long   mo_off;           /* int[nmodels+1], offset of each model's arrays */
+  long   sizes_off;        /* int[nmodels] */
+  long   bvect_off;        /* double[nmodels] */
+  long   indices_off;      /* int[], indices into the docs */
+  long   weights_off;      /* double[], the lagrange multipliers */
+  long   yvect_off;        /* int[] */
+  long   W_off;            /* double[nmodels][total_words], if linear */
+  long   word_weights_off; /* float[nmodels or 1][total_words] */
+};
+
+/* adds the size bytes at data into the FNV-1a hash h */
+static unsigned int model_hash(unsigned int h, const void *data, size_t size) {
+  const unsigned char *p = data;
+  size_t i;
+
+  for (i=0; i<size; i++) {
+    h = (h ^ p[i]) * 16777619;
+  }
+  return h;
+}
+
+/* returns a checksum of the contents of the class barrel & of the
+ * parameters that setup_docs would unpack it with, so that a model file
+ * is only used for the models it was written from */
+static unsigned int model_checksum(bow_barrel *barrel) {
+  unsigned int h = 2166136261U;
+  bow_cdoc *cdoc;
+  bow_dv   *dv;
+  int i, wi;
+
+  for (i=0; i<barrel->cdocs->length; i++) {
+    cdoc = bow_array_entry_at_index(barrel->cdocs, i);
+    h = model_hash(h, &cdoc->type, sizeof(cdoc->type));
+    h = model_hash(h, &cdoc->class, sizeof(cdoc->class));
+    h = model_hash(h, &cdoc->word_count, sizeof(cdoc->word_count));
+    h = model_hash(h, &cdoc->normalizer, sizeof(cdoc->normalizer));
+    h = model_hash(h, &cdoc->prior, sizeof(cdoc->prior));
+  }
+  for (wi=0; wi<barrel->wi2dvf->size; wi++) {
+    dv = bow_wi2dvf_dv(barrel->wi2dvf, wi);
+    if (dv) {
+      h = model_hash(h, &wi, sizeof(wi));
+      h = model_hash(h, dv->entry, sizeof(bow_de)*dv->length);
+    }
+  }
+  h = model_hash(h, &svm_kernel_type, sizeof(svm_kernel_type));
+  h = model_hash(h, &weight_type, sizeof(weight_type));
+  h = model_hash(h, &tf_transform_type, sizeof(tf_transform_type));
+  h = model_hash(h, &vote_type, sizeof(vote_type));
+  h = model_hash(h, &kparm, sizeof(kparm));
+  return h;
+}
+
+/* writes n items of size bytes at data to fp, clearing *ok if it can't */
+static void model_write(FILE *fp, const void *data, size_t size, size_t n, 
+			int *ok) {
+  if (n && fwrite(data, size, n, fp) != n) {
+    *ok = 0;
+  }
+}
+
+/* pads fp to an 8 byte boundary, writes size bytes of data & returns
+ * the offset it was written at, clearing *ok if it can't */
+static long model_write_section(FILE *fp, void *data, size_t size, int *ok) {
+  static const char zeros[8] = {0};
+  long off = ftell(fp);
+
+  if (off % 8) {
+    model_write(fp, zeros, 1, 8 - (off % 8), ok);
+    off += 8 - (off % 8);
+  }
+  model_write(fp, data, 1, size, ok);
+  return off;
+}
+
+/* write the contents of model_cache to filename, by way of a new file
+ * that replaces it only once it is complete, or warn if that fails */
+static void svm_model_write(const char *filename, bow_barrel *barrel,
+			    int nclasses) {
+  struct svm_model_header hdr;
+  char  *new_filename;
+  FILE  *fp;
+  long  *wv_off;
+  int   *nz_off, *mo;
+  int    nnz, total;
+  int    i, m;
+  int    ok = 1;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SVM_MODEL_MAGIC;
+  hdr.nclasses = nclasses;
+  hdr.nmodels = model_cache.nmodels;
+  hdr.ndocs = model_cache.ndocs;
+  hdr.nbarrel_docs = barrel->cdocs->length;
+  hdr.total_words = bow_num_words();
+  hdr.checksum = model_checksum(barrel);
+  hdr.kernel_type = svm_kernel_type;
+  hdr.weight_type = weight_type;
+  hdr.tf_transform_type = tf_transform_type;
+  hdr.weight_style = svm_weight_style;
+  hdr.kparm = kparm;
+
+  new_filename = (char *) malloc(strlen(filename) + 5);
+  sprintf(new_filename, "%s-new", filename);
+  fp = bow_fopen(new_filename, "wb");
+  /* the header gets rewritten once the offsets are known */
+  model_write(fp, &hdr, sizeof(hdr), 1, &ok);
+
+  wv_off = (long *) malloc(sizeof(long)*(hdr.ndocs+1));
+  nz_off = (int *) malloc(sizeof(int)*(hdr.ndocs+1));
+  hdr.docs_off = model_write_section(fp, NULL, 0, &ok);
+  for (i=nnz=0; i<hdr.ndocs; i++) {
+    bow_wv *wv = model_cache.docs[i];
+    wv_off[i] = model_write_section(fp, wv, sizeof(bow_wv) + 
+				    sizeof(bow_we)*wv->num_entries, &ok) - hdr.docs_off;
+    nz_off[i] = nnz;
+    nnz += wv->num_entries;
+  }
+  nz_off[hdr.ndocs] = nnz;
+  hdr.wv_off = model_write_section(fp, wv_off, sizeof(long)*hdr.ndocs, &ok);
+  hdr.nz_off = model_write_section(fp, nz_off, sizeof(int)*(hdr.ndocs+1), 
+				   &ok);
+  if (svm_weight_style == WEIGHTS_PER_MODEL) {
+    hdr.oweights_off = model_write_section(fp, NULL, 0, &ok);
+    for (i=0; i<hdr.ndocs; i++) {
+      model_write(fp, model_cache.oweights[i], sizeof(float), 
+		  model_cache.docs[i]->num_entries, &ok);
+    }
+  }
+  free(wv_off);
+  free(nz_off);
+
+  mo = (int *) malloc(sizeof(int)*(hdr.nmodels+1));
+  for (m=total=0; m<hdr.nmodels; m++) {
+    mo[m] = total;
+    total += model_cache.sizes[m];
+  }
+  mo[hdr.nmodels] = total;
+  hdr.mo_off = model_write_section(fp, mo, sizeof(int)*(hdr.nmodels+1), &ok);
+  hdr.sizes_off = model_write_section(fp, model_cache.sizes, 
+				      sizeof(int)*hdr.nmodels, &ok);
+  hdr.bvect_off = model_write_section(fp, model_cache.bvect, 
+				      sizeof(double)*hdr.nmodels, &ok);
+  hdr.indices_off = model_write_section(fp, NULL, 0, &ok);
+  for (m=0; m<hdr.nmodels; m++) {
+    model_write(fp, model_cache.indices[m], sizeof(int), model_cache.sizes[m],
+		&ok);
+  }
+  hdr.weights_off = model_write_section(fp, NULL, 0, &ok);
+  for (m=0; m<hdr.nmodels; m++) {
+    model_write(fp, model_cache.weights[m], sizeof(double), 
+		model_cache.sizes[m], &ok);
+  }
+  hdr.yvect_off = model_write_section(fp, NULL, 0, &ok);
+  for (m=0; m<hdr.nmodels; m++) {
+    model_write(fp, model_cache.yvect[m], sizeof(int), model_cache.sizes[m],
+		&ok);
+  }
+  free(mo);
+
+  if (svm_kernel_type == 0) {
+    hdr.W_off = model_write_section(fp, NULL, 0, &ok);
+    for (m=0; m<hdr.nmodels; m++) {
+      model_write(fp, model_cache.W[m], sizeof(double), hdr.total_words, &ok);
+    }
+  }
+
+  if (svm_weight_style == WEIGHTS_PER_MODEL) {
+    hdr.word_weights_off = model_write_section(fp, NULL, 0, &ok);
+    for (m=0; m<hdr.nmodels; m++) {
+      model_write(fp, model_cache.word_weights.sub_model[m], sizeof(float), 
+		  hdr.total_words, &ok);
+    }
+  } else if (svm_weight_style == WEIGHTS_PER_BARREL) {
+    hdr.word_weights_off = 
+      model_write_section(fp, model_cache.word_weights.barrel,
+			  sizeof(float)*hdr.total_words, &ok);
+  }
+
+  if (fseek(fp, 0, SEEK_SET) != 0) {
+    ok = 0;
+  }
+  model_write(fp, &hdr, sizeof(hdr), 1, &ok);
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  if (!ok || rename(new_filename, filename) != 0) {
+    fprintf(stderr, "Couldn't write SVM model file `%s'.\n", filename);
+    unlink(new_filename);
+  }
+  free(new_filename);
+}
+
+/* map filename & point model_cache into it - returns 0 (& leaves
+ * model_cache empty) if the file is missing or doesn't match barrel */
+static int svm_model_read(const char *filename, bow_barrel *barrel, 
+			  int nclasses, int nmodels) {
+  struct svm_model_header *hdr;
+  struct stat st;
+  char  *map;
+  long  *wv_off;
+  int   *nz_off, *mo;
+  int    fd, i, m;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    return 0;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct svm_model_header)) {
+    close(fd);
+    return 0;
+  }
+  /* private & writable, since make_sub_model scales the weights in place */
+  map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+
+  hdr = (struct svm_model_header *) map;
+  if (hdr->magic != SVM_MODEL_MAGIC || hdr->nclasses != nclasses 
+      || hdr->nmodels != nmodels || hdr->nbarrel_docs != barrel->cdocs->length
+      || hdr->total_words != bow_num_words()
+      || hdr->checksum != model_checksum(barrel)) {
+    fprintf(stderr, "SVM model file `%s' doesn't match the class barrel, "
+	    "ignoring it.\n", filename);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  clear_model_cache();
+
+  /* the checksum covers these, but weight_style is derived from them */
+  svm_kernel_type = hdr->kernel_type;
+  weight_type = hdr->weight_type;
+  tf_transform_type = hdr->tf_transform_type;
+  svm_weight_style = hdr->weight_style;
+  kparm = hdr->kparm;
+  set_kernel_fns(svm_kernel_type);
+
+  model_cache.map = map;
+  model_cache.map_size = st.st_size;
+  model_cache.ndocs = hdr->ndocs;
+  model_cache.nmodels = nmodels;
+
+  wv_off = (long *) (map + hdr->wv_off);
+  nz_off = (int *) (map + hdr->nz_off);
+  model_cache.docs = (bow_wv **) malloc(sizeof(bow_wv *)*hdr->ndocs);
+  for (i=0; i<hdr->ndocs; i++) {
+    model_cache.docs[i] = (bow_wv *) (map + hdr->docs_off + wv_off[i]);
+  }
+  if (svm_weight_style == WEIGHTS_PER_MODEL) {
+    float *ow = (float *) (map + hdr->oweights_off);
+    model_cache.oweights = (float **) malloc(sizeof(float *)*hdr->ndocs);
+    for (i=0; i<hdr->ndocs; i++) {
+      model_cache.oweights[i] = ow + nz_off[i];
+    }
+  }
+
+  mo = (int *) (map + hdr->mo_off);
+  model_cache.sizes = (int *) (map + hdr->sizes_off);
+  model_cache.bvect = (double *) (map + hdr->bvect_off);
+  model_cache.indices = (int **) malloc(sizeof(int *)*nmodels);
+  model_cache.weights = (double **) malloc(sizeof(double *)*nmodels);
+  model_cache.yvect = (int **) malloc(sizeof(int *)*nmodels);
+  for (m=0; m<nmodels; m++) {
+    model_cache.indices[m] = ((int *) (map + hdr->indices_off)) + mo[m];
+    model_cache.weights[m] = ((double *) (map + hdr->weights_off)) + mo[m];
+    model_cache.yvect[m] = ((int *) (map + hdr->yvect_off)) + mo[m];
+  }
+
+  if (svm_kernel_type == 0) {
+    model_cache.W = (double **) malloc(sizeof(double *)*nmodels);
+    for (m=0; m<nmodels; m++) {
+      model_cache.W[m] = ((double *) (map + hdr->W_off)) + m*hdr->total_words;
+    }
+  } else {
+    model_cache.W = NULL;
+  }
+
+  if (svm_weight_style == WEIGHTS_PER_MODEL) {
+    model_cache.word_weights.sub_model = (float **) malloc(sizeof(float *)*nmodels);
+    for (m=0; m<nmodels; m++) {
+      model_cache.word_weights.sub_model[m] = 
+	((float *) (map + hdr->word_weights_off)) + m*hdr->total_words;
+    }
+  } else if (svm_weight_style == WEIGHTS_PER_BARREL) {
+    model_cache.word_weights.barrel = (float *) (map + hdr->word_weights_off);
+  }
+
+  model_cache.barrel = barrel;
+  bow_verbosify(bow_progress, "Mapped SVM models from `%s'\n", filename);
+  return 1;
+}
+
 int svm_score(bow_barrel *barrel, bow_wv *query_wv, bow_score *bscores, 
 	      int bscores_len, int loo_class) {
   int          ci;
@@ -2279,7 +2813,10 @@ int svm_score(bow_barrel *barrel, bow_wv *query_wv, bow_score *bscores,
   }
 
   if (model_cache.barrel != barrel) {
-    setup_docs(barrel, nclasses, nmodels);
+    if (!svm_model_filename 
+	|| !svm_model_read(svm_model_filename, barrel, nclasses, nmodels)) {
+      setup_docs(barrel, nclasses, nmodels);
+    }
   }
   
   set_weights = svm_weight_style;
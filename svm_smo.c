@@ -122,15 +122,19 @@ double smo_evaluate_error(struct svm_smo_model *model, int ex) {
     double  *weights;
     int     *yvect;
     int i;
+    bow_wvd *dex;
 
     docs = model->docs;
     ndocs = model->ndocs;
     weights = model->weights;
     yvect = model->yvect;
  
+    dex = bow_thread_wvd(1, bow_num_words());
+    bow_wvd_scatter(dex, docs[ex]);
+
     for (i=0, sum=0.0; i<ndocs; i++) {
       if (weights[i] != 0.0) {
-	sum += yvect[i]*weights[i]*svm_kernel_cache(docs[i], docs[ex]);
+	sum += yvect[i]*weights[i]*svm_kernel_cache_dense(docs[ex], dex, docs[i]);
       }
     }
     return (sum - yvect[ex]);
@@ -407,14 +411,21 @@ int opt_pair(int ex1, int ex2, struct svm_smo_model *ms) {
     double *error = ms->error;
     int    *items;
     int     nitems;
+    bow_wvd *d1, *d2;
 
     items = ms->I0.items;
     nitems = ms->I0.ilength;
 
+    /* ex1 & ex2 get evaluated against every item, so scatter them */
+    d1 = bow_thread_wvd(2, bow_num_words());
+    d2 = bow_thread_wvd(3, bow_num_words());
+    bow_wvd_scatter(d1, docs[ex1]);
+    bow_wvd_scatter(d2, docs[ex2]);
+
     for (i=0; i<nitems; i++) {
       double a, b;
-      a = svm_kernel_cache(docs[ex1],docs[items[i]]);
-      b = svm_kernel_cache(docs[ex2],docs[items[i]]);
+      a = svm_kernel_cache_dense(docs[ex1],d1,docs[items[i]]);
+      b = svm_kernel_cache_dense(docs[ex2],d2,docs[items[i]]);
       error[items[i]]  +=  diff1*a + diff2*b;
     }
 
@@ -542,8 +553,11 @@ int opt_single(int ex2, struct svm_smo_model *ms) {
   }
 }
 
-int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W, 
-	int ndocs, double *error, float *cvect, int *nsv) {
+/* the first examine-all pass only looks at docs [first_new,ndocs) - the
+ * later passes look at everything */
+static int smo_guts(bow_wv **docs, int *yvect, double *weights, double *a_b, 
+		    double **W, int first_new, int ndocs, double *error, 
+		    float *cvect, int *nsv) {
   int          changed;
   int          inspect_all;
   struct svm_smo_model model;
@@ -691,8 +705,8 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
 
     if (1 && inspect_all) {
       int ub = ndocs;
-      i=j=random() % ndocs;
-      for (k=0; k<2; k++,ub=j,i=0) {
+      i=j=first_new + random() % (ndocs-first_new);
+      for (k=0; k<2; k++,ub=j,i=first_new) {
 	for (; i<ub; i++) {
 	  nchanged += opt_single(i, &model);
 
@@ -702,6 +716,7 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
 	}
       }
       inspect_all = 0;
+      first_new = 0;
     } else {
       /* greg's modification to keerthi, et al's modification 2 */
       /* loop of optimizing all pairwise in a row with all elements
@@ -794,6 +809,35 @@ int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W,
   return (changed);
 }
 
+int smo(bow_wv **docs, int *yvect, double *weights, double *a_b, double **W, 
+	int ndocs, double *error, float *cvect, int *nsv) {
+  return (smo_guts(docs, yvect, weights, a_b, W, 0, ndocs, error, cvect, nsv));
+}
+
+/* Warm start: docs [0,nold) hold the solution of a previous call (the
+ * weights, the error values of the unbound sv's, W & nsv), & docs
+ * [nold,ndocs) were just added.  The new docs enter with zero alphas,
+ * which keeps the old solution feasible, so everything that was computed
+ * for it is reused (including the rows still in the kernel cache).  Since
+ * the old docs already satisfied the KKT conditions, the first pass only 
+ * examines the new ones. */
+int smo_resume(bow_wv **docs, int *yvect, double *weights, double *a_b, 
+	       double **W, int nold, int ndocs, double *error, float *cvect, 
+	       int *nsv) {
+  int i;
+
+  for (i=nold; i<ndocs; i++) {
+    weights[i] = 0.0;
+    error[i] = 0.0;
+  }
+
+  if (nold >= ndocs) {
+    nold = 0;
+  }
+
+  return (smo_guts(docs, yvect, weights, a_b, W, nold, ndocs, error, cvect, nsv));
+}
+
 /* defunct fn. */
 inline double svm_smo_tval_to_err(double si, double b, int y) {
   return 0.0;
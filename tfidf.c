@@ -33,68 +33,36 @@
    Set in bow_tfidf_score(). */
 int bow_tfidf_num_hit_documents;
 
+/* If non-zero, bow_tfidf_score() sets the NAME of each score to the
+   query words that appear in its document. */
+int bow_tfidf_explain = 0;
+
 #define DOING_LOG_COUNTS 1
 
 
-/* Function to assign TFIDF weights to each element of each document
-   vector. */
+/* What the threads of bow_tfidf_set_weights() share. */
+typedef struct _bow_tfidf_weights {
+  bow_barrel *barrel;
+  int ndocs;			/* number of train documents */
+} bow_tfidf_weights;
+
+/* Calculate the IDF of the words LO through HI-1, then set the
+   weights of their entries. */
 static void
-bow_tfidf_set_weights (bow_barrel *barrel)
+bow_tfidf_set_weights_range (int lo, int hi, int thread, void *arg)
 {
+  bow_tfidf_weights *w = arg;
   int wi;			/* a "word index" into WI2DVF */
-  int max_wi;			/* the highest "word index" in WI2DVF. */
-  int ndocs;                    /* number of train documents looked at */
   double idf;			/* The IDF factor for a word */
   bow_dv *dv;			/* the "document vector" at index WI */
   double df;			/* "document frequency" */
-#if 0
-  int total_word_count;		/* total "document frequency" over all words */
-#endif
   int dvi;			/* an index into the DV */
   bow_cdoc *cdoc;
 
-  bow_verbosify (bow_progress, "Setting weights over words:          ");
-  max_wi = MIN(barrel->wi2dvf->size, bow_num_words());
-
-#if 0
-  /* For certain cases we need to loop over all dv's to compute the
-     total number of word counts across all words and all documents. */
-  /* xxx Shouldn't this be changed, and put in the `for(wi..' loop below? */
-  if (((bow_params_tfidf*)(barrel->method->params))->df_counts
-      == bow_tfidf_occurrences)
-    {
-      total_word_count = 0;
-      for (wi = 0; wi < max_wi; wi++) 
-	{
-	  dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
-	  if (dv == NULL)
-	    continue;
-	  /* We have the document information, so we can determine which
-	     documents are part the the training set. */
-	  for (dvi = 0; dvi < dv->length; dvi++) 
-	    {
-	      cdoc = bow_cdocs_di2doc (barrel->cdocs, dv->entry[dvi].di);
-	      if (cdoc->type == model)
-		total_word_count += dv->entry[dvi].count;
-	    }
-	}
-    }
-#endif
-
-  /* figure out the number of training documents */
-  for (wi=ndocs=0; wi<barrel->cdocs->length; wi++) {
-    cdoc = bow_array_entry_at_index (barrel->cdocs, wi);
-    if (cdoc->type == bow_doc_train) {
-      ndocs++;
-    }
-  }
-
-  /* Loop over all vectors of documents (i.e. each word), calculate
-     the IDF, then set the weights */
-  for (wi = 0; wi < max_wi; wi++) 
+  for (wi = lo; wi < hi; wi++) 
     {
       /* Get the document vector for this word WI */
-      dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+      dv = bow_wi2dvf_dv (w->barrel->wi2dvf, wi);
 
       if (dv == NULL)
 	continue;
@@ -105,10 +73,10 @@ bow_tfidf_set_weights (bow_barrel *barrel)
       df = 0;
       for (dvi = 0; dvi < dv->length; dvi++)
 	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, dv->entry[dvi].di);
+	  cdoc = bow_array_entry_at_index (w->barrel->cdocs, dv->entry[dvi].di);
 	  if (cdoc->type != bow_doc_train)
 	    continue;
-	  if (((bow_params_tfidf*)(barrel->method->params))->df_counts
+	  if (((bow_params_tfidf*)(w->barrel->method->params))->df_counts
 	      == bow_tfidf_occurrences)
 	    {
 	      /* Make DF be the number of documents in which word WI occurs 
@@ -117,7 +85,7 @@ bow_tfidf_set_weights (bow_barrel *barrel)
 		 model. */
 	      df++;
 	    }
-	  else if (((bow_params_tfidf*)(barrel->method->params))->df_counts
+	  else if (((bow_params_tfidf*)(w->barrel->method->params))->df_counts
 		   == bow_tfidf_words)
 	    {
 	      /* Make DF be the total number of times word WI appears
@@ -136,15 +104,15 @@ bow_tfidf_set_weights (bow_barrel *barrel)
 	}
       else
 	{
-	  if (((bow_params_tfidf*)(barrel->method->params))->df_transform
+	  if (((bow_params_tfidf*)(w->barrel->method->params))->df_transform
 	      == bow_tfidf_log)
-	    idf = log2f (ndocs / df);
-	  else if (((bow_params_tfidf*)(barrel->method->params))->df_transform
+	    idf = log2f (w->ndocs / df);
+	  else if (((bow_params_tfidf*)(w->barrel->method->params))->df_transform
 		   == bow_tfidf_sqrt)
-	    idf = sqrtf (ndocs / df);
-	  else if (((bow_params_tfidf*)(barrel->method->params))->df_transform
+	    idf = sqrtf (w->ndocs / df);
+	  else if (((bow_params_tfidf*)(w->barrel->method->params))->df_transform
 		   == bow_tfidf_straight)
-	    idf = ndocs / df;
+	    idf = w->ndocs / df;
 	  else
 	    {
 	      idf = 0;		/* to avoid gcc warning */
@@ -163,10 +131,69 @@ bow_tfidf_set_weights (bow_barrel *barrel)
       
       /* Record this word's idf */
       dv->idf = idf;
+    }
+}
+
+/* Function to assign TFIDF weights to each element of each document
+   vector.  The words are divided among several threads. */
+static void
+bow_tfidf_set_weights (bow_barrel *barrel)
+{
+  int wi;			/* a "word index" into WI2DVF */
+  int max_wi;			/* the highest "word index" in WI2DVF. */
+  int ndocs;                    /* number of train documents looked at */
+#if 0
+  double idf;			/* The IDF factor for a word */
+  bow_dv *dv;			/* the "document vector" at index WI */
+  int total_word_count;		/* total "document frequency" over all words */
+  int dvi;			/* an index into the DV */
+#endif
+  bow_cdoc *cdoc;
+  bow_tfidf_weights w;
+
+  bow_verbosify (bow_progress, "Setting weights over words... ");
+  max_wi = MIN(barrel->wi2dvf->size, bow_num_words());
+
+#if 0
+  /* For certain cases we need to loop over all dv's to compute the
+     total number of word counts across all words and all documents. */
+  /* xxx Shouldn't this be changed, and put in the `for(wi..' loop below? */
+  if (((bow_params_tfidf*)(barrel->method->params))->df_counts
+      == bow_tfidf_occurrences)
+    {
+      total_word_count = 0;
+      for (wi = 0; wi < max_wi; wi++) 
+	{
+	  dv = bow_wi2dvf_dv (barrel->wi2dvf, wi);
+	  if (dv == NULL)
+	    continue;
+	  /* We have the document information, so we can determine which
+	     documents are part the the training set. */
+	  for (dvi = 0; dvi < dv->length; dvi++) 
+	    {
+	      cdoc = bow_cdocs_di2doc (barrel->cdocs, dv->entry[dvi].di);
+	      if (cdoc->type == model)
+		total_word_count += dv->entry[dvi].count;
+	    }
+	}
+    }
+#endif
 
-      if (wi % 10 == 0)
-	bow_verbosify (bow_progress, "\b\b\b\b\b\b%6d", max_wi - wi - 1); 
+  /* figure out the number of training documents */
+  for (wi=ndocs=0; wi<barrel->cdocs->length; wi++) {
+    cdoc = bow_array_entry_at_index (barrel->cdocs, wi);
+    if (cdoc->type == bow_doc_train) {
+      ndocs++;
     }
+  }
+
+  /* Loop over all vectors of documents (i.e. each word), calculate
+     the IDF, then set the weights */
+  w.barrel = barrel;
+  w.ndocs = ndocs;
+  /* The threads may only read the "document vectors". */
+  bow_wi2dvf_read_in (barrel->wi2dvf, max_wi);
+  bow_parallel_for (max_wi, bow_tfidf_set_weights_range, &w);
   bow_verbosify (bow_progress, "\n");
 }
 
@@ -318,11 +345,14 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
 		 bow_score *scores, int scores_size, int loo_class)
 {
   int num_scores = 0;		/* How many elements are in this array */
-  int ci, i;
-  float *lscores;
-  int **wis;
-  int wvi, dvi;
+  float *lscores;		/* Kept all zero between queries */
+  int *touched;			/* The documents LSCORES was added to */
+  int num_touched = 0;
+  bow_dv **dvs;
+  int num_postings = 0;
+  int i, wvi, dvi, di;
   bow_cdoc *cdoc;
+  bow_score score;
   int num_hit_documents = 0;
 
 #if 0
@@ -330,15 +360,6 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
     bow_error ("PrInd cannot implement Leave-One-Out scoring.");
 #endif
 
-  /* Yuck.  This is inefficient. */
-  lscores = bow_malloc (barrel->cdocs->length * sizeof (float));
-  wis = bow_malloc (barrel->cdocs->length * sizeof (int*));
-  for (i = 0; i < barrel->cdocs->length; i++)
-    {
-      lscores[i] = 0;
-      wis[i] = NULL;
-    }
-
   /* Set the weights in the QUERY_WV.  Note: this is duplication of
      effort, since it was already done, but it was done incorrectly
      before, without the IDF. */
@@ -349,9 +370,27 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
 #endif
   bow_wv_normalize_weights_by_vector_length (query_wv);
 
+  dvs = bow_thread_buffer (1, (query_wv->num_entries + 1) * sizeof (bow_dv*));
   for (wvi = 0; wvi < query_wv->num_entries; wvi++)
     {
-      bow_dv *dv = bow_wi2dvf_dv (barrel->wi2dvf, query_wv->entry[wvi].wi);
+      dvs[wvi] = bow_wi2dvf_dv (barrel->wi2dvf, query_wv->entry[wvi].wi);
+      if (dvs[wvi])
+	num_postings += dvs[wvi]->length;
+    }
+
+  /* Rather than allocating and clearing scores for every document,
+     add into an array that is left all zero after each query, and
+     remember which documents were added to, so only those need
+     looking at and setting back to zero.  A document is entered in
+     TOUCHED each time its score is added to while zero, so at most
+     once per posting. */
+  lscores = bow_thread_cleared_buffer (0, (barrel->cdocs->length
+					   * sizeof (float)));
+  touched = bow_thread_buffer (0, (num_postings + 1) * sizeof (int));
+
+  for (wvi = 0; wvi < query_wv->num_entries; wvi++)
+    {
+      bow_dv *dv = dvs[wvi];
 
       /* If the model doesn't know about this word, skip it. */
       if (!dv)
@@ -361,89 +400,52 @@ bow_tfidf_score (bow_barrel *barrel, bow_wv *query_wv,
 	 and increment their score. */
       for (dvi = 0; dvi < dv->length; dvi++)
 	{
-	  cdoc = bow_array_entry_at_index (barrel->cdocs, dv->entry[dvi].di);
-	  lscores[dv->entry[dvi].di] += ((query_wv->entry[wvi].weight
-					  * query_wv->normalizer)
-					 * (dv->entry[dvi].weight
-					    * cdoc->normalizer));
-	  if (wis[dv->entry[dvi].di] == NULL)
-	    {
-	      int j;
-	      wis[dv->entry[dvi].di] = bow_malloc ((query_wv->num_entries+1)
-						   * sizeof (int));
-	      for (j = 0; j < (query_wv->num_entries+1); j++)
-		wis[dv->entry[dvi].di][j] = -1;
-	    }
-	  i = 0;
-	  while (wis[dv->entry[dvi].di][i] >= 0)
-	    i++;
-	  assert (i <= query_wv->num_entries);
-	  wis[dv->entry[dvi].di][i] = query_wv->entry[wvi].wi;
-	  /* Why was this here? 
-	     assert (wis[dv->entry[dvi].di][i] != 1); */
+	  di = dv->entry[dvi].di;
+	  cdoc = bow_array_entry_at_index (barrel->cdocs, di);
+	  if (lscores[di] == 0)
+	    touched[num_touched++] = di;
+	  lscores[di] += ((query_wv->entry[wvi].weight
+			   * query_wv->normalizer)
+			  * (dv->entry[dvi].weight
+			     * cdoc->normalizer));
 	}
     } 
 
-  for (ci = 0; ci < barrel->cdocs->length; ci++)
+  for (i = 0; i < num_touched; i++)
     {
-      if (lscores[ci] == 0)
+      di = touched[i];
+      if (lscores[di] == 0)
 	continue;
-      
       num_hit_documents++;
-      
-      /* Store the result in the SCORES array */
-      /* If we haven't filled the list, or we beat the last item in the list */
-      if ((num_scores < scores_size)
-	  || (scores[num_scores - 1].weight < lscores[ci]))
+      score.weight = lscores[di];
+      score.di = di;
+      score.name = NULL;
+      num_scores = bow_scores_offer (scores, num_scores, scores_size, &score);
+      lscores[di] = 0;
+    }
+  bow_scores_sort (scores, num_scores);
+
+  if (bow_tfidf_explain)
+    {
+      for (i = 0; i < num_scores; i++)
 	{
-	  /* We're going to search up the list comparing element i-1 with
-	     our current score and moving it down the list if it's worse */
-	  if (num_scores < scores_size)
+	  /* Store the appearing words in NAME. */
+	  char buf[BOW_MAX_WORD_LENGTH * query_wv->num_entries];
+
+	  buf[0] = '\0';
+	  for (wvi = 0; wvi < query_wv->num_entries; wvi++)
 	    {
-	      i = num_scores;
-	      num_scores++;
+	      if (dvs[wvi] && bow_dv_entry_at_di (dvs[wvi], scores[i].di))
+		{
+		  strcat (buf, bow_int2word (query_wv->entry[wvi].wi));
+		  strcat (buf, " ");
+		}
 	    }
-	  else
-	    i = num_scores - 1;
-
-	  /* Shift down all the bits of the array that need shifting */
-	  for (; (i > 0) && (scores[i - 1].weight < lscores[ci]); i--)
-	    scores[i] = scores[i-1];
-
-	  /* Insert our new score */
-	  scores[i].weight = lscores[ci];
-	  scores[i].di = ci;
-
-#if 1
-	  {
-	    /* Store the appearing words in NAME. */
-	    char buf[BOW_MAX_WORD_LENGTH * query_wv->num_entries];
-	    int j;
-
-	    assert (wis[ci]);
-	    buf[0] = '\0';
-	    for (j = 0; wis[ci][j] >= 0; j++)
-	      {
-		strcat (buf, bow_int2word (wis[ci][j]));
-		strcat (buf, " ");
-	      }
-	    scores[i].name = strdup (buf);
-	    assert (scores[i].name);
-	  }
-#else
-	  scores[i].name = NULL;
-#endif
+	  scores[i].name = strdup (buf);
+	  assert (scores[i].name);
 	}
     }
 
-  bow_free (lscores);
-  for (i = 0; i < barrel->cdocs->length; i++)
-    {
-      if (wis[i])
-	bow_free (wis[i]);
-    }
-  bow_free (wis);
-
   bow_tfidf_num_hit_documents = num_hit_documents;
 
   /* All done - return the number of elements we have */
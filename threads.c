@@ -0,0 +1,232 @@
+/* Running a loop over several threads. */
+
+/* Copyright (C) 1997, 1998, 1999 Andrew McCallum
+
+   Written by:  Andrew Kachites McCallum <mccallum@cs.cmu.edu>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* One thread's piece of the range. */
+typedef struct _bow_thread_piece {
+  int lo, hi, thread;
+  void (*fn) (int lo, int hi, int thread, void *ctx);
+  void *ctx;
+} bow_thread_piece;
+
+static void *
+bow_thread_piece_run (void *arg)
+{
+  bow_thread_piece *p = arg;
+
+  (*p->fn) (p->lo, p->hi, p->thread, p->ctx);
+  return NULL;
+}
+
+/* Return the number of threads that bow_parallel_for() will use for a
+   range of N elements. */
+int
+bow_num_threads_for (int n)
+{
+  int nthreads = bow_num_threads;
+
+  if (nthreads <= 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+      if (nthreads <= 0)
+	nthreads = 1;
+    }
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads < 1)
+    nthreads = 1;
+  return nthreads;
+}
+
+/* Split the range [0,N) into contiguous pieces, one per thread, and
+   call FN (LO, HI, THREAD, CTX) on each piece [LO,HI) in its own
+   thread, returning when they have all finished.  THREAD runs from 0
+   to one less than the number of threads, which is returned.  The
+   pieces depend only on N and the number of threads, so a caller that
+   combines per-thread results in order of THREAD gets the same answer
+   on every run. */
+int
+bow_parallel_for (int n, void (*fn) (int lo, int hi, int thread, void *ctx),
+		  void *ctx)
+{
+  int nthreads = bow_num_threads_for (n);
+  bow_thread_piece *pieces;
+  pthread_t *tids;
+  int t;
+
+  if (nthreads == 1)
+    {
+      (*fn) (0, n, 0, ctx);
+      return 1;
+    }
+
+  pieces = alloca (nthreads * sizeof (bow_thread_piece));
+  tids = alloca (nthreads * sizeof (pthread_t));
+  for (t = 0; t < nthreads; t++)
+    {
+      pieces[t].lo = (int) (((long long) n * t) / nthreads);
+      pieces[t].hi = (int) (((long long) n * (t + 1)) / nthreads);
+      pieces[t].thread = t;
+      pieces[t].fn = fn;
+      pieces[t].ctx = ctx;
+    }
+  /* The calling thread does the first piece itself.  If a thread
+     can't be created, its piece is done by the calling thread too. */
+  for (t = 1; t < nthreads; t++)
+    if (pthread_create (&tids[t], NULL, bow_thread_piece_run, &pieces[t]))
+      tids[t] = pthread_self ();
+  bow_thread_piece_run (&pieces[0]);
+  for (t = 1; t < nthreads; t++)
+    {
+      if (pthread_equal (tids[t], pthread_self ()))
+	bow_thread_piece_run (&pieces[t]);
+      else
+	pthread_join (tids[t], NULL);
+    }
+  return nthreads;
+}
+
+/* The scratch buffers of one thread. */
+typedef struct _bow_thread_buffers {
+  void *buffer[BOW_THREAD_BUFFERS];
+  size_t size[BOW_THREAD_BUFFERS];
+  void *cleared[BOW_THREAD_BUFFERS];
+  size_t cleared_size[BOW_THREAD_BUFFERS];
+  bow_wvd *wvd[BOW_THREAD_BUFFERS];
+} bow_thread_buffers;
+
+static pthread_key_t bow_thread_buffers_key;
+static pthread_once_t bow_thread_buffers_once = PTHREAD_ONCE_INIT;
+
+static void
+bow_thread_buffers_free (void *arg)
+{
+  bow_thread_buffers *b = arg;
+  int i;
+
+  for (i = 0; i < BOW_THREAD_BUFFERS; i++)
+    {
+      if (b->buffer[i])
+	free (b->buffer[i]);
+      if (b->cleared[i])
+	free (b->cleared[i]);
+      if (b->wvd[i])
+	bow_wvd_free (b->wvd[i]);
+    }
+  bow_free (b);
+}
+
+static void
+bow_thread_buffers_init ()
+{
+  if (pthread_key_create (&bow_thread_buffers_key, bow_thread_buffers_free))
+    bow_error ("Couldn't create the key for per-thread buffers.");
+}
+
+/* Return the calling thread's buffers, creating them on first use. */
+static bow_thread_buffers *
+bow_thread_buffers_get ()
+{
+  bow_thread_buffers *b;
+
+  pthread_once (&bow_thread_buffers_once, bow_thread_buffers_init);
+  b = pthread_getspecific (bow_thread_buffers_key);
+  if (b == NULL)
+    {
+      b = bow_malloc (sizeof (bow_thread_buffers));
+      memset (b, 0, sizeof (bow_thread_buffers));
+      pthread_setspecific (bow_thread_buffers_key, b);
+    }
+  return b;
+}
+
+/* Return a buffer of at least SIZE bytes, aligned to a cache line,
+   that belongs to the calling thread.  The thread gets the same buffer
+   back from later calls with the same WHICH, from 0 to
+   BOW_THREAD_BUFFERS-1, so a function called once per query can use
+   it instead of allocating; its contents are not kept when it grows.
+   Freed when the thread exits. */
+void *
+bow_thread_buffer (int which, size_t size)
+{
+  bow_thread_buffers *b;
+
+  assert (which >= 0 && which < BOW_THREAD_BUFFERS);
+  b = bow_thread_buffers_get ();
+  if (b->size[which] < size)
+    {
+      if (b->buffer[which])
+	free (b->buffer[which]);
+      /* Grow by half again, so a slowly growing SIZE doesn't
+	 reallocate every time. */
+      b->size[which] = MAX (size, b->size[which] + b->size[which] / 2);
+      if (posix_memalign (&b->buffer[which], BOW_CACHE_LINE_SIZE,
+			  b->size[which]))
+	bow_error ("Memory exhausted.");
+    }
+  return b->buffer[which];
+}
+
+/* Like bow_thread_buffer(), but the buffer is all zeros when it is
+   first returned and whenever it grows.  The caller must set back to
+   zero whatever it changed before the thread's next call with the
+   same WHICH, which is then spared clearing the whole buffer. */
+void *
+bow_thread_cleared_buffer (int which, size_t size)
+{
+  bow_thread_buffers *b;
+
+  assert (which >= 0 && which < BOW_THREAD_BUFFERS);
+  b = bow_thread_buffers_get ();
+  if (b->cleared_size[which] < size)
+    {
+      if (b->cleared[which])
+	free (b->cleared[which]);
+      b->cleared_size[which] = MAX (size, (b->cleared_size[which]
+					   + b->cleared_size[which] / 2));
+      if (posix_memalign (&b->cleared[which], BOW_CACHE_LINE_SIZE,
+			  b->cleared_size[which]))
+	bow_error ("Memory exhausted.");
+      memset (b->cleared[which], 0, b->cleared_size[which]);
+    }
+  return b->cleared[which];
+}
+
+/* Return a dense vector that belongs to the calling thread and is
+   reused by its later calls with the same WHICH, from 0 to
+   BOW_THREAD_BUFFERS-1, made with room for SIZE words the first time.
+   What was scattered into it is not kept for the caller. */
+bow_wvd *
+bow_thread_wvd (int which, int size)
+{
+  bow_thread_buffers *b;
+
+  assert (which >= 0 && which < BOW_THREAD_BUFFERS);
+  b = bow_thread_buffers_get ();
+  if (b->wvd[which] == NULL)
+    b->wvd[which] = bow_wvd_new (size);
+  return b->wvd[which];
+}
@@ -0,0 +1,280 @@
+/* Retrieving the K documents with the highest dot product with a query. */
+
+/* Copyright (C) 1997, 1998, 1999 Andrew McCallum
+
+   Written by:  Andrew Kachites McCallum <mccallum@cs.cmu.edu>
+
+   This file is part of the Bag-Of-Words Library, `libbow'.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License
+   as published by the Free Software Foundation, version 2.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA */
+
+#include <bow/libbow.h>
+#include <limits.h>
+#include <math.h>
+
+/* A score can come out a little above the sum of the bounds of its
+   terms, because of the rounding in its float products, so the bounds
+   are stretched by this fraction. */
+#define BOW_TOPK_BOUND_SLACK 1e-5
+
+/* Create an empty set of bounds for the "document vectors" of
+   BARREL, each to be filled in the first time it is needed.  If
+   USE_NORMALIZER is non-zero, the weights are taken multiplied by
+   the NORMALIZER of their documents. */
+bow_topk_bounds *
+bow_topk_bounds_new (bow_barrel *barrel, int use_normalizer)
+{
+  bow_topk_bounds *bounds;
+  int wi;
+
+  bounds = bow_malloc (sizeof (bow_topk_bounds));
+  bounds->wi2dvf = barrel->wi2dvf;
+  bounds->use_normalizer = use_normalizer;
+  bounds->size = MIN (barrel->wi2dvf->size, bow_num_words ());
+  bounds->bound = bow_malloc (bounds->size * sizeof (float));
+  for (wi = 0; wi < bounds->size; wi++)
+    bounds->bound[wi] = -1;
+  return bounds;
+}
+
+/* Free the memory held by BOUNDS. */
+void
+bow_topk_bounds_free (bow_topk_bounds *bounds)
+{
+  bow_free (bounds->bound);
+  bow_free (bounds);
+}
+
+/* Return the largest absolute weight among the entries of DV, the
+   "document vector" of word WI in BARREL, remembering it in BOUNDS. */
+static float
+bow_topk_bound (bow_topk_bounds *bounds, bow_barrel *barrel,
+		int wi, bow_dv *dv)
+{
+  float max = 0, w;
+  int dvi;
+
+  if (wi < bounds->size && bounds->bound[wi] >= 0)
+    return bounds->bound[wi];
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      w = fabs (dv->entry[dvi].weight);
+      if (bounds->use_normalizer)
+	{
+	  bow_cdoc *cdoc = bow_cdocs_di2doc (barrel->cdocs, dv->entry[dvi].di);
+	  w *= fabs (cdoc->normalizer);
+	}
+      if (w > max)
+	max = w;
+    }
+  if (wi < bounds->size)
+    bounds->bound[wi] = max;
+  return max;
+}
+
+/* Move the cursor of TERM forward to its first entry whose document
+   index is DI or more, probing at growing distances, then bisecting. */
+static void
+bow_topk_term_seek (bow_topk_term *term, int di)
+{
+  bow_de *entry = term->dv->entry;
+  int n = term->dv->length;
+  int lo = term->dvi, hi, step = 1;
+
+  if (lo >= n || entry[lo].di >= di)
+    return;
+  /* Invariant: ENTRY[LO].di < DI */
+  while (lo + step < n && entry[lo + step].di < di)
+    {
+      lo += step;
+      step *= 2;
+    }
+  hi = (lo + step < n) ? lo + step : n;
+  while (hi - lo > 1)
+    {
+      int mid = (lo + hi) / 2;
+      if (entry[mid].di < di)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  term->dvi = hi;
+  term->di = (hi < n) ? entry[hi].di : INT_MAX;
+}
+
+/* Restore the order of the NUM_TERMS entries of ORDER by the document
+   at their cursors, after some of the first of them have moved. */
+static void
+bow_topk_sort_terms (bow_topk_term **order, int num_terms)
+{
+  bow_topk_term *tmp;
+  int i, j;
+
+  for (i = num_terms - 2; i >= 0; i--)
+    for (j = i; j + 1 < num_terms && order[j]->di > order[j+1]->di; j++)
+      {
+	tmp = order[j];
+	order[j] = order[j+1];
+	order[j+1] = tmp;
+      }
+}
+
+static int
+bow_topk_term_compare_wi (const void *t1, const void *t2)
+{
+  return ((bow_topk_term*)t1)->wi - ((bow_topk_term*)t2)->wi;
+}
+
+/* Put into SCORES, highest first, the K documents of BARREL that
+   SCORER gives the highest scores, and return how many were put
+   there.  Ties go to the lower document index.
+
+   The documents considered are those containing at least one word of
+   QUERY_WV.  They are visited in order of document index by merging
+   the "document vectors" of those words, and SCORER is called on each
+   one with the terms whose cursors are at it, in order of word index.
+   If FLAGS includes BOW_TOPK_TRAIN_ONLY, documents that aren't of type
+   bow_doc_train are passed over; if it includes BOW_TOPK_NONZERO, so
+   are documents that SCORER gives exactly 0.
+
+   If BOUNDS is non-NULL, SCORER must never return more than SCALE
+   times the sum, over the terms it is given, of the absolute value
+   of the query weight times the bound that BOUNDS has for the word.
+   Then, once K documents have been found, the merge skips over any
+   document whose bounds add up to no more than the lowest of them.
+   This is the WAND method of Broder et al.  If NUM_HITS is non-NULL,
+   no documents are skipped, and it is set to the number that scored
+   other than 0. */
+int
+bow_topk_search (bow_barrel *barrel, bow_topk_bounds *bounds,
+		 bow_wv *query_wv, double scale, int flags,
+		 bow_topk_scorer scorer, void *ctx,
+		 bow_score *scores, int k, int *num_hits)
+{
+  bow_topk_term *terms;
+  bow_topk_term **order;	/* TERMS by the document at their cursor */
+  bow_topk_term **at;		/* The terms at the current document */
+  int num_terms = 0, num_at;
+  int length = 0, hits = 0;
+  int prune = (bounds != NULL && num_hits == NULL);
+  int wvi, i, p, di;
+  bow_score score;
+  bow_dv *dv;
+
+  if (k <= 0 && num_hits == NULL)
+    return 0;
+
+  terms = bow_malloc ((query_wv->num_entries + 1) * sizeof (bow_topk_term));
+  order = bow_malloc ((query_wv->num_entries + 1) * sizeof (bow_topk_term*));
+  at = bow_malloc ((query_wv->num_entries + 1) * sizeof (bow_topk_term*));
+  for (wvi = 0; wvi < query_wv->num_entries; wvi++)
+    {
+      dv = bow_wi2dvf_dv (barrel->wi2dvf, query_wv->entry[wvi].wi);
+      if (dv == NULL || dv->length == 0)
+	continue;
+      terms[num_terms].wi = query_wv->entry[wvi].wi;
+      terms[num_terms].weight = query_wv->entry[wvi].weight;
+      terms[num_terms].dv = dv;
+      terms[num_terms].dvi = 0;
+      terms[num_terms].di = dv->entry[0].di;
+      terms[num_terms].bound = 0;
+      if (prune)
+	terms[num_terms].bound =
+	  (fabs (terms[num_terms].weight * scale)
+	   * bow_topk_bound (bounds, barrel, terms[num_terms].wi, dv)
+	   * (1 + BOW_TOPK_BOUND_SLACK));
+      num_terms++;
+    }
+  /* SCORER sees the terms in order of word index. */
+  qsort (terms, num_terms, sizeof (bow_topk_term), bow_topk_term_compare_wi);
+  for (i = 0; i < num_terms; i++)
+    order[i] = &terms[i];
+  bow_topk_sort_terms (order, num_terms);
+
+  while (num_terms > 0 && order[0]->di != INT_MAX)
+    {
+      if (prune && length == k)
+	{
+	  /* Find the pivot: the first term by which the bounds of the
+	     terms before it add up to more than the lowest score kept.
+	     No document before the pivot's can beat that score. */
+	  double sum = 0;
+	  for (p = 0; p < num_terms && order[p]->di != INT_MAX; p++)
+	    {
+	      sum += order[p]->bound;
+	      if (sum > scores[0].weight)
+		break;
+	    }
+	  if (p == num_terms || order[p]->di == INT_MAX)
+	    break;
+	  di = order[p]->di;
+	  if (order[0]->di != di)
+	    {
+	      for (i = 0; i < p && order[i]->di < di; i++)
+		bow_topk_term_seek (order[i], di);
+	      bow_topk_sort_terms (order, num_terms);
+	      continue;
+	    }
+	}
+      else
+	di = order[0]->di;
+
+      /* The terms at DI are now the first ones in ORDER. */
+      for (num_at = 0; num_at < num_terms && order[num_at]->di == di;
+	   num_at++)
+	at[num_at] = order[num_at];
+
+      if (!(flags & BOW_TOPK_TRAIN_ONLY)
+	  || (((bow_cdoc*) bow_cdocs_di2doc (barrel->cdocs, di))->type
+	      == bow_doc_train))
+	{
+	  /* Put the terms at DI in order of word index. */
+	  for (i = 1; i < num_at; i++)
+	    {
+	      bow_topk_term *t = at[i];
+	      for (p = i; p > 0 && at[p-1]->wi > t->wi; p--)
+		at[p] = at[p-1];
+	      at[p] = t;
+	    }
+	  score.weight = (*scorer) (di, at, num_at, ctx);
+	  assert (score.weight == score.weight); /* checking for NaN */
+	  if (score.weight != 0)
+	    hits++;
+	  if (score.weight != 0 || !(flags & BOW_TOPK_NONZERO))
+	    {
+	      score.di = di;
+	      score.name = NULL;
+	      length = bow_scores_offer (scores, length, k, &score);
+	    }
+	}
+
+      /* Move past DI. */
+      for (i = 0; i < num_at; i++)
+	{
+	  order[i]->dvi++;
+	  order[i]->di = (order[i]->dvi < order[i]->dv->length
+			  ? order[i]->dv->entry[order[i]->dvi].di
+			  : INT_MAX);
+	}
+      bow_topk_sort_terms (order, num_terms);
+    }
+
+  bow_free (terms);
+  bow_free (order);
+  bow_free (at);
+  bow_scores_sort (scores, length);
+  if (num_hits)
+    *num_hits = hits;
+  return length;
+}
@@ -39,158 +39,167 @@ double bow_wi2dvf_sum (bow_wi2dvf *wi2dvf)
   return sum;
 }
 
-/* Given a barrel of documents, create and return another barrel with
-   only one vector per class. The classes will be represented as
-   "documents" in this new barrel. */
-bow_barrel *
-bow_barrel_new_vpc (bow_barrel *doc_barrel)
+/* Add into entry RI of ROW the count and weight that the entry DE of
+   a word's "document vector" contributes to the class of its
+   document CDOC, according to the event model. */
+static inline void
+bow_barrel_vpc_add_de (bow_dv_row *row, int ri, bow_de *de, bow_cdoc *cdoc)
 {
-  bow_barrel* vpc_barrel;	/* The vector per class barrel */
-  int max_ci = -1;		/* The highest index of encountered classes */
-  int num_classes = bow_barrel_num_classes (doc_barrel);
-  int wi;
-  int max_wi;
-  int dvi;
-  int ci;
+  float weight;
+
+  /* The old version of bow_wi2dvf_add_di_text_fp() initialized
+     the dv WEIGHT to 0 instead of the word count.  If the weight 
+     is zero, then use the count instead.  Note, however, that
+     the TFIDF method might have set the weight, so we don't
+     want to use the count all the time. */
+  if (de->weight)
+    weight = de->weight;
+  else
+    weight = de->count;
+
+  if (bow_event_model == bow_event_document)
+    {
+      assert (de->count);
+      bow_dv_row_add (row, ri, 1, 1);
+    }
+  else if (bow_event_model == bow_event_document_then_word)
+    {
+      bow_dv_row_add
+	(row, ri, de->count,
+	 (bow_event_document_then_word_document_length
+	  * weight / cdoc->word_count));
+    }
+  else
+    {
+      bow_dv_row_add (row, ri, de->count, weight);
+    }
+}
+
+/* Add into ROW, indexed by class, the counts and weights of word WI
+   in the training documents of the document barrel ARG. */
+static void
+bow_barrel_vpc_fill_wi (int wi, bow_dv_row *row, void *arg)
+{
+  bow_barrel *doc_barrel = arg;
   bow_dv *dv;
-  bow_dv *vpc_dv;
-  int di;
-  int num_docs_per_ci[num_classes];
   bow_cdoc *cdoc;
-  double sum = 0;
+  int dvi;
 
-  assert (doc_barrel->classnames);
+  dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+  if (!dv)
+    return;
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, dv->entry[dvi].di);
+      if (cdoc->type == bow_doc_train)
+	bow_barrel_vpc_add_de (row, cdoc->class, &(dv->entry[dvi]), cdoc);
+    }
+  /* Set the IDF of the class's wi2dvf directly from the doc's wi2dvf */
+  row->idf = dv->idf;
+}
 
-  max_wi = MIN (doc_barrel->wi2dvf->size, bow_num_words ());
+/* What the threads of bow_barrel_vpc_count_doc_words() share. */
+struct _bow_vpc_doc_words {
+  bow_barrel *doc_barrel;
+  int num_docs;
+  int **word_count;		/* per document, one row for each thread */
+};
+
+/* Add the occurrences of the words LO through HI-1 into the document
+   totals of thread THREAD. */
+static void
+bow_barrel_vpc_count_doc_words_range (int lo, int hi, int thread, void *arg)
+{
+  struct _bow_vpc_doc_words *c = arg;
+  int *word_count = c->word_count[thread];
+  bow_dv *dv;
+  int di, wi, dvi;
+
+  for (di = 0; di < c->num_docs; di++)
+    word_count[di] = 0;
+  for (wi = lo; wi < hi; wi++)
+    {
+      dv = bow_wi2dvf_dv (c->doc_barrel->wi2dvf, wi);
+      if (!dv)
+	continue;
+      for (dvi = 0; dvi < dv->length; dvi++)
+	word_count[dv->entry[dvi].di] += dv->entry[dvi].count;
+    }
+}
+
+/* Set the WORD_COUNT of each document of DOC_BARREL to the number of
+   its occurrences of words below MAX_WI that aren't hidden, straight
+   from the "document vectors".  The words are shared out among
+   several threads, and their totals added up afterwards. */
+static void
+bow_barrel_vpc_count_doc_words (bow_barrel *doc_barrel, int max_wi)
+{
+  struct _bow_vpc_doc_words c;
+  bow_cdoc *cdoc;
+  int nthreads, t, di;
+
+  c.doc_barrel = doc_barrel;
+  c.num_docs = doc_barrel->cdocs->length;
+  nthreads = bow_num_threads_for (max_wi);
+  c.word_count = alloca (nthreads * sizeof (int*));
+  for (t = 0; t < nthreads; t++)
+    c.word_count[t] = bow_malloc (c.num_docs * sizeof (int));
+  bow_wi2dvf_read_in (doc_barrel->wi2dvf, max_wi);
+  nthreads = bow_parallel_for (max_wi, bow_barrel_vpc_count_doc_words_range,
+			       &c);
+
+  for (di = 0; di < c.num_docs; di++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
+      cdoc->word_count = 0;
+      for (t = 0; t < nthreads; t++)
+	cdoc->word_count += c.word_count[t][di];
+    }
+  for (t = 0; t < nthreads; t++)
+    bow_free (c.word_count[t]);
+}
+
+/* Create an empty `vector-per-class' barrel for DOC_BARREL. */
+static bow_barrel *
+bow_barrel_vpc_new_empty (bow_barrel *doc_barrel)
+{
+  bow_barrel *vpc_barrel;
 
-  /* Create an empty barrel; we fill fill it with vector-per-class
-     data and return it. */
   /* This assertion can fail when DOC_BARREL was read from a disk
      archive that was created before CLASS_PROBS was added to BOW_CDOC */
   assert (doc_barrel->cdocs->entry_size >= sizeof (bow_cdoc));
   vpc_barrel = bow_barrel_new (doc_barrel->wi2dvf->size,
-			       num_classes,
+			       bow_barrel_num_classes (doc_barrel),
 			       doc_barrel->cdocs->entry_size,
 			       doc_barrel->cdocs->free_func);
   vpc_barrel->method = doc_barrel->method;
   vpc_barrel->classnames = bow_int4str_new (0);
   /* Make sure to set the VPC indicator */
   vpc_barrel->is_vpc = 1;
+  return vpc_barrel;
+}
 
-  bow_verbosify (bow_verbose, "Making vector-per-class... words ::       ");
+/* Append to VPC_BARREL a BOW_CDOC for each class of DOC_BARREL, whose
+   WORD_COUNT is the number of training documents in the class, and
+   set their priors. */
+static void
+bow_barrel_vpc_add_classes (bow_barrel *vpc_barrel, bow_barrel *doc_barrel)
+{
+  int num_classes = bow_barrel_num_classes (doc_barrel);
+  int num_docs_per_ci[num_classes];
+  int ci;
+  int di;
 
   /* Count the number of documents in each class */
   for (ci = 0; ci < num_classes; ci++)
     num_docs_per_ci[ci] = 0;
   for (di = 0; di < doc_barrel->cdocs->length; di++)
     {
-      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
+      bow_cdoc *cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
       if (cdoc->type == bow_doc_train)
 	num_docs_per_ci[cdoc->class]++;
     }
 
-  /* Update the CDOC->WORD_COUNT in the DOC_BARREL in order to match
-     the (potentially) pruned vocabulary. */
-  {
-    bow_wv *wv = NULL;
-    int wvi;
-    bow_dv_heap *heap = bow_test_new_heap (doc_barrel);
-    while ((di = bow_heap_next_wv (heap, doc_barrel, &wv,
-				   bow_cdoc_yes)) != -1)
-      {
-	cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	cdoc->word_count = 0;
-	for (wvi = 0; wvi < wv->num_entries; wvi++)
-	  {
-	    if (bow_wi2dvf_dv (doc_barrel->wi2dvf, wv->entry[wvi].wi))
-	      cdoc->word_count += wv->entry[wvi].count;
-	  }
-      }
-  }
-
-  /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
-     counts and weights for individual documents, grabbing only the
-     training documents. */
-  for (wi = 0; wi < max_wi; wi++)
-    {
-      dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
-      if (!dv)
-	continue;
-      for (dvi = 0; dvi < dv->length; dvi++)
-	{
-	  di = dv->entry[dvi].di;
-	  cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	  ci = cdoc->class;
-	  assert (ci >= 0);
-	  assert (ci < num_classes);
-	  if (ci > max_ci)
-	    max_ci = ci;
-	  if (cdoc->type == bow_doc_train)
-	    {
-	      float weight;
-
-	      /* The old version of bow_wi2dvf_add_di_text_fp() initialized
-		 the dv WEIGHT to 0 instead of the word count.  If the weight 
-		 is zero, then use the count instead.  Note, however, that
-		 the TFIDF method might have set the weight, so we don't
-		 want to use the count all the time. */
-	      if (dv->entry[dvi].weight)
-		weight = dv->entry[dvi].weight;
-	      else
-		weight = dv->entry[dvi].count;
-
-	      if (bow_event_model == bow_event_document)
-		{
-		  assert (dv->entry[dvi].count);
-		  bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-						     wi, ci, 1, 1);
-		}
-	      else if (bow_event_model == bow_event_document_then_word)
-		{
-		  bow_wi2dvf_add_wi_di_count_weight
-		    (&(vpc_barrel->wi2dvf), wi, ci, dv->entry[dvi].count,
-		     (bow_event_document_then_word_document_length
-		      * weight / cdoc->word_count));
-		  sum += (bow_event_document_then_word_document_length
-			  * weight / cdoc->word_count);
-		}
-	      else
-		{
-		  bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-						     wi, ci, 
-						     dv->entry[dvi].count,
-						     weight);
-		}
-	    }
-	}
-      /* Set the IDF of the class's wi2dvf directly from the doc's wi2dvf */
-      vpc_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
-      if (vpc_dv)		/* this could be null if all of this word's
-				   occurrences are in non training docs */
-	vpc_dv->idf = dv->idf;
-      if (max_wi - wi % 100 == 0)
-	bow_verbosify (bow_verbose, "\b\b\b\b\b\b%6d", max_wi - wi);
-    }
-#if 0
-  bow_verbosify (bow_progress, "vpc_sum=%f\n", sum);
-  bow_verbosify (bow_progress, "wi2dvf_sum=%f\n", 
-		 bow_wi2dvf_sum (vpc_barrel->wi2dvf));
-#endif
-  bow_verbosify (bow_verbose, "\b\b\b\b\b\b");
-  /* xxx OK to have some classes with no words
-     assert (num_classes-1 == max_ci); */
-  if (max_ci < 0)
-    {
-      int i;
-      bow_verbosify (bow_progress, "%s: No data found for ",
-		     __PRETTY_FUNCTION__);
-      for (i = 0; i < num_classes; i++)
-	bow_verbosify (bow_progress, "%s ", 
-		       bow_barrel_classname_at_index (doc_barrel, i));
-      bow_verbosify (bow_progress, "\n");
-    }
-  bow_verbosify (bow_verbose, "\n");
-
   /* Initialize the CDOCS and CLASSNAMES parts of the VPC_BARREL.
      Create BOW_CDOC structures for each class, and append them to the
      VPC->CDOCS array. */
@@ -242,7 +251,69 @@ bow_barrel_new_vpc (bow_barrel *doc_barrel)
 	  cdoc->prior = -1;
 	}
     }
+}
 
+/* Given a barrel of documents, create and return another barrel with
+   only one vector per class. The classes will be represented as
+   "documents" in this new barrel. */
+bow_barrel *
+bow_barrel_new_vpc (bow_barrel *doc_barrel)
+{
+  bow_barrel* vpc_barrel;	/* The vector per class barrel */
+  int max_ci = -1;		/* The highest index of encountered classes */
+  int num_classes = bow_barrel_num_classes (doc_barrel);
+  int max_wi;
+  int di;
+  bow_cdoc *cdoc;
+
+  assert (doc_barrel->classnames);
+
+  max_wi = MIN (doc_barrel->wi2dvf->size, bow_num_words ());
+
+  /* Create an empty barrel; we fill fill it with vector-per-class
+     data and return it. */
+  vpc_barrel = bow_barrel_vpc_new_empty (doc_barrel);
+
+  bow_verbosify (bow_verbose, "Making vector-per-class... words ::       ");
+
+  /* Update the CDOC->WORD_COUNT in the DOC_BARREL in order to match
+     the (potentially) pruned vocabulary. */
+  bow_barrel_vpc_count_doc_words (doc_barrel, max_wi);
+
+  /* Find the highest class that has any words. */
+  for (di = 0; di < doc_barrel->cdocs->length; di++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
+      if (cdoc->word_count <= 0)
+	continue;
+      assert (cdoc->class >= 0);
+      assert (cdoc->class < num_classes);
+      if (cdoc->class > max_ci)
+	max_ci = cdoc->class;
+    }
+
+  /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
+     counts and weights for individual documents, grabbing only the
+     training documents. */
+  bow_wi2dvf_read_in (doc_barrel->wi2dvf, max_wi);
+  bow_wi2dvf_fill_by_rows (&(vpc_barrel->wi2dvf), max_wi, num_classes,
+			   bow_barrel_vpc_fill_wi, doc_barrel);
+  bow_verbosify (bow_verbose, "\b\b\b\b\b\b");
+  /* xxx OK to have some classes with no words
+     assert (num_classes-1 == max_ci); */
+  if (max_ci < 0)
+    {
+      int i;
+      bow_verbosify (bow_progress, "%s: No data found for ",
+		     __PRETTY_FUNCTION__);
+      for (i = 0; i < num_classes; i++)
+	bow_verbosify (bow_progress, "%s ", 
+		       bow_barrel_classname_at_index (doc_barrel, i));
+      bow_verbosify (bow_progress, "\n");
+    }
+  bow_verbosify (bow_verbose, "\n");
+
+  bow_barrel_vpc_add_classes (vpc_barrel, doc_barrel);
   return vpc_barrel;
 }
 
@@ -281,6 +352,146 @@ bow_barrel_new_vpc_weight_then_merge (bow_barrel *doc_barrel)
   return vpc_barrel;
 }
 
+/* Return non-zero if the class barrel that the method of DOC_BARREL
+   makes depends only on the sums, over the training documents of each
+   class, of their counts of each word, so that it can be made with
+   bow_barrel_new_vpc_for_fold(). */
+int
+bow_barrel_vpc_is_sum_of_counts (bow_barrel *doc_barrel)
+{
+  return (doc_barrel->method->vpc_with_weights
+	  == bow_barrel_new_vpc_merge_then_weight
+	  && bow_event_model != bow_event_document_then_word);
+}
+
+/* Add into ROW, at FOLD * NUM_CLASSES + CLASS, the counts and weights
+   of word WI in the documents of each fold and class of the
+   bow_vpc_folds ARG. */
+static void
+bow_vpc_folds_fill_wi (int wi, bow_dv_row *row, void *arg)
+{
+  bow_vpc_folds *folds = arg;
+  bow_dv *dv;
+  bow_cdoc *cdoc;
+  int dvi, fold;
+
+  dv = bow_wi2dvf_dv (folds->doc_barrel->wi2dvf, wi);
+  if (!dv)
+    return;
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      fold = folds->fold_of_di[dv->entry[dvi].di];
+      if (fold < 0)
+	continue;
+      cdoc = bow_array_entry_at_index (folds->doc_barrel->cdocs,
+				       dv->entry[dvi].di);
+      bow_barrel_vpc_add_de (row, fold * folds->num_classes + cdoc->class,
+			     &(dv->entry[dvi]), cdoc);
+    }
+  row->idf = dv->idf;
+}
+
+/* Split the documents of DOC_BARREL into NUM_FOLDS folds, document DI
+   going into fold FOLD_OF_DI[DI], or into none if that is negative,
+   and sum the counts of each word in each class of each fold.  This is
+   the only pass over the documents; afterwards the class barrel of any
+   fold's complement is made by bow_barrel_new_vpc_for_fold() from the
+   sums alone.  The sums are of the words not hidden now. */
+bow_vpc_folds *
+bow_vpc_folds_new (bow_barrel *doc_barrel, int num_folds,
+		   const int *fold_of_di)
+{
+  bow_vpc_folds *folds;
+  int max_wi;
+
+  assert (num_folds > 0);
+  folds = bow_malloc (sizeof (bow_vpc_folds));
+  folds->doc_barrel = doc_barrel;
+  folds->num_folds = num_folds;
+  folds->num_classes = bow_barrel_num_classes (doc_barrel);
+  folds->fold_of_di = bow_malloc (doc_barrel->cdocs->length * sizeof (int));
+  memcpy (folds->fold_of_di, fold_of_di,
+	  doc_barrel->cdocs->length * sizeof (int));
+  max_wi = MIN (doc_barrel->wi2dvf->size, bow_num_words ());
+  folds->wi2dvf = bow_wi2dvf_new (max_wi);
+  bow_wi2dvf_read_in (doc_barrel->wi2dvf, max_wi);
+  bow_wi2dvf_fill_by_rows (&(folds->wi2dvf), max_wi,
+			   num_folds * folds->num_classes,
+			   bow_vpc_folds_fill_wi, folds);
+  return folds;
+}
+
+/* Free the memory held by FOLDS. */
+void
+bow_vpc_folds_free (bow_vpc_folds *folds)
+{
+  bow_wi2dvf_free (folds->wi2dvf);
+  bow_free (folds->fold_of_di);
+  bow_free (folds);
+}
+
+/* What the threads of bow_barrel_new_vpc_for_fold() share. */
+struct _bow_vpc_fold_fill {
+  bow_vpc_folds *folds;
+  int held_out;
+};
+
+/* Add into ROW, indexed by class, the counts and weights of word WI
+   in every fold but one, if WI isn't hidden in the document barrel. */
+static void
+bow_barrel_vpc_fill_wi_from_folds (int wi, bow_dv_row *row, void *arg)
+{
+  struct _bow_vpc_fold_fill *c = arg;
+  int num_classes = c->folds->num_classes;
+  bow_dv *dv;
+  int dvi;
+
+  if (!bow_wi2dvf_dv (c->folds->doc_barrel->wi2dvf, wi))
+    return;
+  dv = bow_wi2dvf_dv (c->folds->wi2dvf, wi);
+  if (!dv)
+    return;
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      if (dv->entry[dvi].di / num_classes == c->held_out)
+	continue;
+      bow_dv_row_add (row, dv->entry[dvi].di % num_classes,
+		      dv->entry[dvi].count, dv->entry[dvi].weight);
+    }
+  row->idf = dv->idf;
+}
+
+/* Return the same class barrel as bow_barrel_new_vpc_merge_then_weight()
+   would for the documents of FOLDS' barrel, when the training documents
+   are those of every fold but HELD_OUT, but made from the sums in FOLDS
+   instead of from the documents.  The document types must already be
+   set that way, for the class priors and weights.  The method of the
+   document barrel must be one for which
+   bow_barrel_vpc_is_sum_of_counts(). */
+bow_barrel *
+bow_barrel_new_vpc_for_fold (bow_vpc_folds *folds, int held_out)
+{
+  bow_barrel *doc_barrel = folds->doc_barrel;
+  bow_barrel *vpc_barrel;
+  struct _bow_vpc_fold_fill c;
+
+  assert (bow_barrel_vpc_is_sum_of_counts (doc_barrel));
+  assert (held_out >= 0 && held_out < folds->num_folds);
+  vpc_barrel = bow_barrel_vpc_new_empty (doc_barrel);
+  c.folds = folds;
+  c.held_out = held_out;
+  bow_wi2dvf_fill_by_rows (&(vpc_barrel->wi2dvf),
+			   MIN (folds->wi2dvf->size, bow_num_words ()),
+			   folds->num_classes,
+			   bow_barrel_vpc_fill_wi_from_folds, &c);
+  bow_barrel_vpc_add_classes (vpc_barrel, doc_barrel);
+
+  bow_barrel_set_weights (vpc_barrel);
+  bow_barrel_scale_weights (vpc_barrel, doc_barrel);
+  bow_barrel_normalize_weights (vpc_barrel);
+  return vpc_barrel;
+}
+
 /* Set the class prior probabilities by counting the number of
    documents of each class. */
 void
@@ -352,6 +563,65 @@ bow_barrel_set_vpc_priors_by_counting (bow_barrel *vpc_barrel,
     }
 }
 
+/* Add into ROW, indexed by class, the counts and weights of word WI
+   in the training and unlabeled documents of the document barrel ARG,
+   spread over the classes by each document's CLASS_PROBS. */
+static void
+bow_barrel_vpc_fill_wi_using_class_probs (int wi, bow_dv_row *row, void *arg)
+{
+  bow_barrel *doc_barrel = arg;
+  int num_classes = row->num_dis;
+  bow_dv *dv;
+  bow_cdoc *cdoc;
+  int dvi, ci;
+
+  dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
+  if (!dv)
+    return;
+  for (dvi = 0; dvi < dv->length; dvi++)
+    {
+      cdoc = bow_array_entry_at_index (doc_barrel->cdocs, dv->entry[dvi].di);
+      if (cdoc->type == bow_doc_train ||
+	  cdoc->type == bow_doc_unlabeled)
+	{
+	  float weight;
+	      
+	  /* The old version of bow_wi2dvf_add_di_text_fp() initialized
+	     the dv WEIGHT to 0 instead of the word count.  If the weight 
+	     is zero, then use the count instead.  Note, however, that
+	     the TFIDF method might have set the weight, so we don't
+	     want to use the count all the time. */
+	  if (dv->entry[dvi].weight)
+	    weight = dv->entry[dvi].weight;
+	  else
+	    weight = dv->entry[dvi].count;
+
+	  for (ci = 0; ci < num_classes; ci++) 
+	    {
+	      /* do the right thing based on the event model */
+	      if (bow_event_model == bow_event_document)
+		{
+		  assert (dv->entry[dvi].count);
+		  bow_dv_row_add (row, ci, 1, cdoc->class_probs[ci]);
+		}
+	      else if (bow_event_model == bow_event_document_then_word)
+		{
+		  bow_dv_row_add
+		    (row, ci, 1,
+		     (bow_event_document_then_word_document_length
+		      * weight * cdoc->class_probs[ci] / cdoc->word_count));
+		}
+	      else
+		{
+		  bow_dv_row_add (row, ci, 1, weight * cdoc->class_probs[ci]);
+		}
+	    }
+	}
+    }
+  /* Set the IDF of the class's wi2dvf directly from the doc's wi2dvf */
+  row->idf = dv->idf;
+}
+
 /* Like bow_barrel_new_vpc, but uses both labeled and unlabeled data.
    It uses the class_probs of each doc to determine its class
    membership. The counts in the wi2dvf are set to bogus numbers.  The
@@ -367,12 +637,8 @@ bow_barrel_new_vpc_using_class_probs (bow_barrel *doc_barrel)
 {
   bow_barrel* vpc_barrel;	/* The vector per class barrel */
   int num_classes = bow_barrel_num_classes (doc_barrel);
-  int wi;
   int max_wi;
-  int dvi;
   int ci;
-  bow_dv *dv;
-  bow_dv *vpc_dv;
   int di;
   float num_docs_per_ci[num_classes];
   bow_cdoc *cdoc;
@@ -412,85 +678,15 @@ bow_barrel_new_vpc_using_class_probs (bow_barrel *doc_barrel)
 
   /* Update the CDOC->WORD_COUNT in the DOC_BARREL in order to match
      the (potentially) pruned vocabulary. */
-  {
-    bow_wv *wv = NULL;
-    int wvi;
-    bow_dv_heap *heap = bow_test_new_heap (doc_barrel);
-    while ((di = bow_heap_next_wv (heap, doc_barrel, &wv,
-				   bow_cdoc_yes)) != -1)
-      {
-	cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	cdoc->word_count = 0;
-	for (wvi = 0; wvi < wv->num_entries; wvi++)
-	  {
-	    if (bow_wi2dvf_dv (doc_barrel->wi2dvf, wv->entry[wvi].wi))
-	      cdoc->word_count += wv->entry[wvi].count;
-	  }
-      }
-  }
+  bow_barrel_vpc_count_doc_words (doc_barrel, max_wi);
 
   /* Initialize the WI2DVF part of the VPC_BARREL.  Sum together the
-     counts and weights for individual documents, grabbing only the
-     training documents. */
-  for (wi = 0; wi < max_wi; wi++)
-    {
-      dv = bow_wi2dvf_dv (doc_barrel->wi2dvf, wi);
-      if (!dv)
-	continue;
-      for (dvi = 0; dvi < dv->length; dvi++)
-	{
-	  di = dv->entry[dvi].di;
-	  cdoc = bow_array_entry_at_index (doc_barrel->cdocs, di);
-	  if (cdoc->type == bow_doc_train ||
-	      cdoc->type == bow_doc_unlabeled)
-	    {
-	      float weight;
-	      
-	      /* The old version of bow_wi2dvf_add_di_text_fp() initialized
-		 the dv WEIGHT to 0 instead of the word count.  If the weight 
-		 is zero, then use the count instead.  Note, however, that
-		 the TFIDF method might have set the weight, so we don't
-		 want to use the count all the time. */
-	      if (dv->entry[dvi].weight)
-		weight = dv->entry[dvi].weight;
-	      else
-		weight = dv->entry[dvi].count;
-
-	      for (ci = 0; ci < num_classes; ci++) 
-		{
-
-		  /* do the right thing based on the event model */
-		  if (bow_event_model == bow_event_document)
-		    {
-		      assert (dv->entry[dvi].count);
-		      bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-							 wi, ci, 1, 
-							 cdoc->class_probs[ci]);
-		    }
-		  else if (bow_event_model == bow_event_document_then_word)
-		    {
-		      bow_wi2dvf_add_wi_di_count_weight
-			(&(vpc_barrel->wi2dvf), wi, ci, 1,
-			 (bow_event_document_then_word_document_length
-			  * weight * cdoc->class_probs[ci] / cdoc->word_count));
-		    }
-		  else
-		    {
-		      bow_wi2dvf_add_wi_di_count_weight (&(vpc_barrel->wi2dvf), 
-							 wi, ci, 
-							 1,
-							 weight * cdoc->class_probs[ci]);
-		    }
-		}
-	    }
-	}
-      /* Set the IDF of the class's wi2dvf directly from the doc's wi2dvf */
-      vpc_dv = bow_wi2dvf_dv (vpc_barrel->wi2dvf, wi);
-      if (vpc_dv) 
-	vpc_dv->idf = dv->idf;
-      if (max_wi - wi % 100 == 0)
-	bow_verbosify (bow_verbose, "\b\b\b\b\b\b%6d", max_wi - wi);
-    }
+     counts and weights for individual documents, grabbing the training
+     and unlabeled documents. */
+  bow_wi2dvf_read_in (doc_barrel->wi2dvf, max_wi);
+  bow_wi2dvf_fill_by_rows (&(vpc_barrel->wi2dvf), max_wi, num_classes,
+			   bow_barrel_vpc_fill_wi_using_class_probs,
+			   doc_barrel);
 
   bow_verbosify (bow_verbose, "\b\b\b\b\b\b\n");
 
@@ -22,6 +22,7 @@
 #include <bow/libbow.h>
 #include <netinet/in.h>		/* for machine-independent byte-order */
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 
 #define INIT_BOW_DVF(DVF) { DVF.seek_start = -1; DVF.dv = NULL; }
@@ -195,6 +196,175 @@ bow_wi2dvf_add_wi_di_count_weight (bow_wi2dvf **wi2dvf, int wi,
   bow_dv_add_di_count_weight (&((*wi2dvf)->entry[wi].dv), di, count, weight);
 }
 
+/* Create a dense row of NUM_DIS per-"document" sums. */
+bow_dv_row *
+bow_dv_row_new (int num_dis)
+{
+  bow_dv_row *row;
+
+  row = bow_malloc (sizeof (bow_dv_row));
+  row->num_dis = num_dis;
+  row->count = bow_malloc (MAX (num_dis, 1) * sizeof (int));
+  row->weight = bow_malloc (MAX (num_dis, 1) * sizeof (float));
+  row->present = bow_malloc (MAX (num_dis, 1));
+  memset (row->count, 0, num_dis * sizeof (int));
+  memset (row->weight, 0, num_dis * sizeof (float));
+  memset (row->present, 0, num_dis);
+  row->length = 0;
+  row->idf = 0;
+  return row;
+}
+
+/* Increase by COUNT and WEIGHT the entry of ROW for "document index"
+   DI, the way bow_dv_add_di_count_weight() would. */
+void
+bow_dv_row_add (bow_dv_row *row, int di, int count, float weight)
+{
+  int new_count;
+
+  assert (di >= 0 && di < row->num_dis);
+  if (!row->present[di])
+    {
+      row->present[di] = 1;
+      row->length++;
+    }
+  new_count = row->count[di] + count;
+  if (new_count < row->count[di])
+    row->count[di] = (INT_MAX) - 1;
+  else
+    row->count[di] = new_count;
+  assert (row->count[di] > 0);
+  if (bow_binary_word_counts && row->count[di] > 1)
+    row->count[di] = 1;
+  row->weight[di] += weight;
+}
+
+/* Return a new "document vector" holding the entries of ROW, or NULL
+   if it has none, and clear ROW. */
+static bow_dv *
+bow_dv_row_flush (bow_dv_row *row)
+{
+  bow_dv *dv;
+  int di, dvi;
+
+  if (row->length == 0)
+    return NULL;
+  /* Not bow_dv_new(), so that this can run in several threads. */
+  dv = bow_malloc (sizeof (bow_dv) + sizeof (bow_de) * row->length);
+  dv->size = dv->length = row->length;
+  dv->idf = row->idf;
+  for (di = 0, dvi = 0; dvi < row->length; di++)
+    {
+      if (!row->present[di])
+	continue;
+      dv->entry[dvi].di = di;
+      dv->entry[dvi].count = row->count[di];
+      dv->entry[dvi].weight = row->weight[di];
+      row->count[di] = 0;
+      row->weight[di] = 0;
+      row->present[di] = 0;
+      dvi++;
+    }
+  row->length = 0;
+  row->idf = 0;
+  return dv;
+}
+
+void
+bow_dv_row_free (bow_dv_row *row)
+{
+  bow_free (row->count);
+  bow_free (row->weight);
+  bow_free (row->present);
+  bow_free (row);
+}
+
+/* What the threads of bow_wi2dvf_fill_by_rows() share. */
+struct _bow_wi2dvf_fill_context {
+  bow_wi2dvf *wi2dvf;
+  int num_dis;
+  void (*fill) (int wi, bow_dv_row *row, void *ctx);
+  void *ctx;
+  int *num_words;		/* the number of dv's made by each thread */
+};
+
+static void
+bow_wi2dvf_fill_range (int lo, int hi, int thread, void *arg)
+{
+  struct _bow_wi2dvf_fill_context *c = arg;
+  bow_dv_row *row = bow_dv_row_new (c->num_dis);
+  bow_dv *dv;
+  int wi;
+
+  c->num_words[thread] = 0;
+  for (wi = lo; wi < hi; wi++)
+    {
+      (*c->fill) (wi, row, c->ctx);
+      dv = bow_dv_row_flush (row);
+      if (dv)
+	{
+	  c->wi2dvf->entry[wi].dv = dv;
+	  /* This 2 is a flag to the hide/unhide code that this DV exists. */
+	  c->wi2dvf->entry[wi].seek_start = 2;
+	  c->num_words[thread]++;
+	}
+    }
+  bow_dv_row_free (row);
+}
+
+/* Make the "document vectors" of the words 0 through MAX_WI-1 in the
+   map WI2DVF, which must not have any for them yet.  For each word
+   WI, FILL (WI, ROW, CTX) adds the word's entries to ROW, a dense row
+   of NUM_DIS sums cleared beforehand, and the entries of ROW become
+   WI's "document vector".  This is much cheaper than calling
+   bow_wi2dvf_add_wi_di_count_weight() for each entry, and the words
+   are split among bow_num_threads threads.  FILL is called from
+   several threads at once, so it should only read shared data; in
+   particular, the "document vectors" it reads out of a WI2DVF backed
+   by a file should have been read in beforehand. */
+void
+bow_wi2dvf_fill_by_rows (bow_wi2dvf **wi2dvf, int max_wi, int num_dis,
+			 void (*fill) (int wi, bow_dv_row *row, void *ctx),
+			 void *ctx)
+{
+  struct _bow_wi2dvf_fill_context c;
+  int nthreads, t;
+
+  if (max_wi > (*wi2dvf)->size)
+    {
+      int wi = (*wi2dvf)->size;
+      (*wi2dvf)->size = max_wi;
+      (*wi2dvf) = bow_realloc (*wi2dvf, 
+			       (sizeof (bow_wi2dvf)
+				+ (sizeof (bow_dvf) * (*wi2dvf)->size)));
+      for ( ; wi < (*wi2dvf)->size; wi++)
+	INIT_BOW_DVF((*wi2dvf)->entry[wi]);
+    }
+
+  c.wi2dvf = *wi2dvf;
+  c.num_dis = num_dis;
+  c.fill = fill;
+  c.ctx = ctx;
+  c.num_words = alloca (bow_num_threads_for (max_wi) * sizeof (int));
+  nthreads = bow_parallel_for (max_wi, bow_wi2dvf_fill_range, &c);
+  for (t = 0; t < nthreads; t++)
+    {
+      (*wi2dvf)->num_words += c.num_words[t];
+      bow_dv_count += c.num_words[t];
+    }
+}
+
+/* Read in the "document vectors" of the words 0 through MAX_WI-1 that
+   haven't been read out of the file backing WI2DVF yet. */
+void
+bow_wi2dvf_read_in (bow_wi2dvf *wi2dvf, int max_wi)
+{
+  int wi;
+
+  for (wi = 0; wi < max_wi; wi++)
+    bow_wi2dvf_dv (wi2dvf, wi);
+}
+
 /* In the map WI2DVF, set to COUNT and WEIGHT our record of the
    number times and weight that the document with "document index" DI
    contains the word with "word index" WI. */
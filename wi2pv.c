@@ -24,6 +24,32 @@
 #include <bow/libbow.h>
 #include <bow/archer.h>
 
+/* Return the memory taken by the PVM of PV. */
+static inline int
+bow_wi2pv_pvm_bytes (bow_pv *pv)
+{
+  return pv->pvm ? sizeof (bow_pvm) + pv->pvm->size : 0;
+}
+
+/* Write PV, one of the PV's of WI2PV, to disk with bow_pv_flush(),
+   keeping count of the memory it frees. */
+static void
+bow_wi2pv_flush_pv (bow_wi2pv *wi2pv, bow_pv *pv)
+{
+  wi2pv->pvm_total_bytes -= bow_wi2pv_pvm_bytes (pv);
+  bow_pv_flush (pv, wi2pv->fp);
+  wi2pv->pvm_total_bytes += bow_wi2pv_pvm_bytes (pv);
+  wi2pv->fp_dirty = 1;
+}
+
+/* Make PV a "stub", an entry for a word that has no PV. */
+static void
+bow_wi2pv_stub (bow_pv *pv)
+{
+  memset (pv, 0, sizeof (bow_pv));
+  pv->word_count = -1;
+}
+
 bow_wi2pv *
 bow_wi2pv_new (int capacity, const char *pv_filename)
 {
@@ -42,6 +68,7 @@ bow_wi2pv_new (int capacity, const char *pv_filename)
   /* Write something so that no PV will start at seek offset 0.
      We use seek offset 0 in pv.c to have special meaning. */
   bow_fwrite_int(0, wi2pv->fp);
+  wi2pv->fp_dirty = 1;
   if (capacity)
     wi2pv->entry_count = capacity;
   else
@@ -49,14 +76,22 @@ bow_wi2pv_new (int capacity, const char *pv_filename)
   wi2pv->entry = bow_malloc (wi2pv->entry_count * sizeof (bow_pv));
   /* Initialize the entries with a special COUNT that means "stub" */
   for (i = 0; i < wi2pv->entry_count; i++)
-    wi2pv->entry[i].word_count = -1;
+    bow_wi2pv_stub (&(wi2pv->entry[i]));
+  wi2pv->pvm_total_bytes = 0;
+  wi2pv->pvm_max_total_bytes = bow_pvm_max_total_bytes;
   return wi2pv;
 }
 
 void
 bow_wi2pv_free (bow_wi2pv *wi2pv)
 {
+  int wi;
+
+  for (wi = 0; wi < wi2pv->entry_count; wi++)
+    if (wi2pv->entry[wi].word_count >= 0 && wi2pv->entry[wi].skips)
+      bow_free (wi2pv->entry[wi].skips);
   fclose (wi2pv->fp);
+  bow_free ((char*)wi2pv->pv_filename);
   bow_free (wi2pv->entry);
   bow_free (wi2pv);
 }
@@ -70,15 +105,17 @@ bow_wi2pv_flush (bow_wi2pv *wi2pv, int n)
     {
       /* Don't bother flushing it if it has less than ten bytes in it. */
       if (wi2pv->entry[wi].pvm && wi2pv->entry[wi].pvm->write_end > n)
-				bow_pv_flush (&(wi2pv->entry[wi]), wi2pv->fp);
+				bow_wi2pv_flush_pv (wi2pv, &(wi2pv->entry[wi]));
     }
-  assert (bow_pvm_total_bytes == 0);
+  assert (n > 0 || wi2pv->pvm_total_bytes == 0);
 }
 
-void
-bow_wi2pv_add_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi)
+/* Return the PV of word WI in WI2PV, making room for it and
+   initializing it first if WI2PV doesn't have one yet.  The words of
+   WI2PV needn't be all those below some word index. */
+static bow_pv *
+bow_wi2pv_wi_pv (bow_wi2pv *wi2pv, int wi)
 {
-  int count;
   /* If WI is so large that there isn't an entry for it, enlarge
      the array of PV's so that there is a place for it. */
   if (wi >= wi2pv->entry_count)
@@ -88,36 +125,46 @@ bow_wi2pv_add_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi)
 			{
 				if (wi2pv->entry_count > 60000)
 					wi2pv->entry_count += 20000;
-				else
+				else if (wi2pv->entry_count > 0)
 					wi2pv->entry_count *= 2;
+				else
+					wi2pv->entry_count = 1024;
 			}
-      while (wi > wi2pv->entry_count);
+      while (wi >= wi2pv->entry_count);
       wi2pv->entry = bow_realloc (wi2pv->entry, 
 				  wi2pv->entry_count * sizeof (bow_pv));
       /* Initialize the entries with a special COUNT that means "stub" */
       for (i = old_entry_count; i < wi2pv->entry_count; i++)
-				wi2pv->entry[i].word_count = -1;
+				bow_wi2pv_stub (&(wi2pv->entry[i]));
     }
 
   /* If WI's entry is just a stub, then initialize it. */
   if (wi2pv->entry[wi].word_count < 0)
     {
       bow_pv_init (&(wi2pv->entry[wi]), wi2pv->fp);
-      wi2pv->num_words++;
+      if (wi >= wi2pv->num_words)
+	wi2pv->num_words = wi + 1;
     }
+  return &(wi2pv->entry[wi]);
+}
+
+void
+bow_wi2pv_add_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi)
+{
+  int count;
 
   /* Add the DI and PI */
-  bow_pv_add_di_pi (&(wi2pv->entry[wi]), di, pi, wi2pv->fp);
+  bow_wi2pv_append_wi_di_pi (wi2pv, wi, di, pi);
 
 #if 1
-  if (bow_pvm_total_bytes > bow_pvm_max_total_bytes)
+  if (wi2pv->pvm_total_bytes > wi2pv->pvm_max_total_bytes)
     bow_wi2pv_flush (wi2pv, 0);
 #endif
 
-  if (bow_pvm_total_bytes > bow_pvm_max_total_bytes)
+  if (wi2pv->pvm_total_bytes > wi2pv->pvm_max_total_bytes)
     {
       for (count = 10 ; 
-	   count >= 0 && bow_pvm_total_bytes > bow_pvm_max_total_bytes;
+	   count >= 0 && wi2pv->pvm_total_bytes > wi2pv->pvm_max_total_bytes;
 	   count--)
 	{
 	  bow_verbosify (bow_progress, 
@@ -128,38 +175,41 @@ bow_wi2pv_add_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi)
     }
 }
 
+/* Add "document index" DI and "position index" PI to the PV of word
+   WI in WI2PV, like bow_wi2pv_add_wi_di_pi(), except that nothing is
+   written to disk to keep the PVM's within BOW_PVM_MAX_TOTAL_BYTES.
+   Write the PV with bow_wi2pv_flush_wi() when done adding to it. */
 void
-bow_wi2pv_rewind (bow_wi2pv *wi2pv)
+bow_wi2pv_append_wi_di_pi (bow_wi2pv *wi2pv, int wi, int di, int pi)
 {
-  int wi;
-  for (wi = 0; wi < wi2pv->entry_count; wi++)
-    {
-      /* Don't rewind if it is a stub (== -1) and if it has no words
-         in it (== 0) */
-      if (wi2pv->entry[wi].word_count > 0)
-	bow_pv_rewind (&(wi2pv->entry[wi]), wi2pv->fp);
-    }
+  bow_pv *pv = bow_wi2pv_wi_pv (wi2pv, wi);
+
+  wi2pv->pvm_total_bytes -= bow_wi2pv_pvm_bytes (pv);
+  bow_pv_add_di_pi (pv, di, pi, wi2pv->fp);
+  wi2pv->pvm_total_bytes += bow_wi2pv_pvm_bytes (pv);
 }
 
+/* Write to disk the PVM of word WI in WI2PV, if it has one. */
 void
-bow_wi2pv_wi_next_di_pi (bow_wi2pv *wi2pv, int wi, int *di, int *pi)
+bow_wi2pv_flush_wi (bow_wi2pv *wi2pv, int wi)
 {
-  if (wi >= wi2pv->entry_count || wi2pv->entry[wi].word_count < 0)
-    {
-      *di = -1;
-      *pi = -1;
-    }
-  else
-    {
-      bow_pv_next_di_pi (&(wi2pv->entry[wi]), di, pi, wi2pv->fp);
-    }
+  if (wi < wi2pv->entry_count && wi2pv->entry[wi].word_count >= 0)
+    bow_wi2pv_flush_pv (wi2pv, &(wi2pv->entry[wi]));
 }
 
+/* Set up CURSOR for reading the PV of word WI from its beginning.
+   Only CURSOR is changed by reading, so any number of cursors may
+   read WI2PV at once, as long as bow_wi2pv_sync() was called after
+   the last write. */
 void
-bow_wi2pv_wi_unnext (bow_wi2pv *wi2pv, int wi)
+bow_wi2pv_wi_cursor_init (bow_wi2pv *wi2pv, int wi, bow_pv_cursor *cursor)
 {
-  if (wi < wi2pv->entry_count && wi2pv->entry[wi].word_count >= 0)
-    bow_pv_unnext (&(wi2pv->entry[wi]));
+  if (wi2pv->fp_dirty)
+    bow_wi2pv_sync (wi2pv);
+  if (wi >= 0 && wi < wi2pv->entry_count && wi2pv->entry[wi].word_count > 0)
+    bow_pv_cursor_init (cursor, &(wi2pv->entry[wi]), wi2pv->fp);
+  else
+    bow_pv_cursor_init (cursor, NULL, wi2pv->fp);
 }
 
 int
@@ -174,7 +224,7 @@ void
 bow_wi2pv_write_to_filename (bow_wi2pv *wi2pv, const char *filename)
 {
   FILE *fp;
-  int wi;
+  int wi, count;
 
   fp = bow_fopen (filename, "wb");
   
@@ -184,10 +234,28 @@ bow_wi2pv_write_to_filename (bow_wi2pv *wi2pv, const char *filename)
   for (wi = 0; wi < wi2pv->num_words; wi++)
     /* This will also flush the PV->PVM's to disk */
     bow_pv_write (&(wi2pv->entry[wi]), fp, wi2pv->fp);
+  wi2pv->pvm_total_bytes = 0;
+  /* After the PV's come the skip entries of those that have any.
+     Files written before there were skip entries simply end here. */
+  for (count = 0, wi = 0; wi < wi2pv->num_words; wi++)
+    if (wi2pv->entry[wi].word_count > 0 && wi2pv->entry[wi].skips)
+      count++;
+  bow_fwrite_int (count, fp);
+  for (wi = 0; wi < wi2pv->num_words; wi++)
+    if (wi2pv->entry[wi].word_count > 0 && wi2pv->entry[wi].skips)
+      {
+	bow_fwrite_int (wi, fp);
+	bow_pv_write_skips (&(wi2pv->entry[wi]), fp);
+      }
+  /* Then the document counts of every PV.  Files written before
+     they were kept end before them. */
+  for (wi = 0; wi < wi2pv->num_words; wi++)
+    bow_pv_write_document_counts (&(wi2pv->entry[wi]), fp);
   fclose (fp);
 
   /* Make sure that all of the cached wi/di/pi matrix is written out. */
   fflush (wi2pv->fp);
+  wi2pv->fp_dirty = 0;
 }
 
 bow_wi2pv *
@@ -195,7 +263,7 @@ bow_wi2pv_new_from_filename (const char *filename)
 {
   FILE *fp;
   bow_wi2pv *wi2pv;
-  int wi;
+  int wi, count, c;
   char *foo;
   char pv_pathname[BOW_MAX_WORD_LENGTH];
 
@@ -210,6 +278,24 @@ bow_wi2pv_new_from_filename (const char *filename)
   wi2pv->entry = bow_malloc (wi2pv->entry_count * sizeof (bow_pv));
   for (wi = 0; wi < wi2pv->num_words; wi++)
     bow_pv_read (&(wi2pv->entry[wi]), fp);
+  /* Read the skip entries, if the file has them. */
+  if ((c = getc (fp)) != EOF)
+    {
+      ungetc (c, fp);
+      for (bow_fread_int (&count, fp); count > 0; count--)
+	{
+	  bow_fread_int (&wi, fp);
+	  assert (wi >= 0 && wi < wi2pv->num_words);
+	  bow_pv_read_skips (&(wi2pv->entry[wi]), fp);
+	}
+    }
+  /* Read the document counts, if the file has them. */
+  if ((c = getc (fp)) != EOF)
+    {
+      ungetc (c, fp);
+      for (wi = 0; wi < wi2pv->num_words; wi++)
+	bow_pv_read_document_counts (&(wi2pv->entry[wi]), fp);
+    }
   fclose (fp);
 
   /* Open the PV_FILENAME for reading and writing, but do not truncate */
@@ -218,6 +304,11 @@ bow_wi2pv_new_from_filename (const char *filename)
   else
     sprintf (pv_pathname, "%s/%s", bow_data_dirname, wi2pv->pv_filename);
   wi2pv->fp = bow_fopen (pv_pathname, "rb+");
+  /* Where bow_pv_flush() expects it to be. */
+  fseeko (wi2pv->fp, 0, SEEK_END);
+  wi2pv->fp_dirty = 0;
+  wi2pv->pvm_total_bytes = 0;
+  wi2pv->pvm_max_total_bytes = bow_pvm_max_total_bytes;
   return wi2pv;
 }
 
@@ -235,9 +326,67 @@ bow_wi2pv_reopen_pv (bow_wi2pv *wi2pv)
   else
     sprintf (pv_pathname, "%s/%s", bow_data_dirname, wi2pv->pv_filename);
   wi2pv->fp = bow_fopen (pv_pathname, "rb");
+  wi2pv->fp_dirty = 0;
+}
+
+/* Make everything written to the PV's of WI2PV readable by cursors,
+   which read its file descriptor directly.  Cursors do this
+   themselves when they need to, but several threads reading WI2PV at
+   once shouldn't, so call this after writing and before they start. */
+void
+bow_wi2pv_sync (bow_wi2pv *wi2pv)
+{
+  if (wi2pv->fp_dirty)
+    {
+      fflush (wi2pv->fp);
+      wi2pv->fp_dirty = 0;
+    }
 }
 
 
+/* Rewrite the PV's of WI2PV into a new file named PV_FILENAME in
+   BOW_DATA_DIRNAME, each one in a single contiguous segment, in order
+   of word index, and switch WI2PV over to the new file.  The old file
+   is left in place; it is still what the archive on disk refers to
+   until the WI2PV is written out again. */
+void
+bow_wi2pv_compact (bow_wi2pv *wi2pv, const char *pv_filename)
+{
+  char pv_pathname[BOW_MAX_WORD_LENGTH];
+  FILE *new_fp;
+  int wi;
+
+  assert (strchr (pv_filename, '/') == NULL);
+  assert (strcmp (pv_filename, wi2pv->pv_filename));
+  sprintf (pv_pathname, "%s/%s", bow_data_dirname, pv_filename);
+  new_fp = bow_fopen (pv_pathname, "wb+");
+  /* As in bow_wi2pv_new(), no PV may start at seek offset 0. */
+  bow_fwrite_int (0, new_fp);
+  /* Write out the PVM's first, so that FP need be flushed only once
+     before the segments are read back. */
+  bow_wi2pv_flush (wi2pv, 0);
+  bow_wi2pv_sync (wi2pv);
+  bow_verbosify (bow_progress, "Compacting position vectors:           ");
+  for (wi = 0; wi < wi2pv->num_words; wi++)
+    {
+      if (wi2pv->entry[wi].word_count > 0)
+	bow_pv_compact (&(wi2pv->entry[wi]), wi2pv->fp, new_fp);
+      if (wi % 1000 == 0)
+	bow_verbosify (bow_progress, "\b\b\b\b\b\b\b\b\b\b%10d",
+		       wi2pv->num_words - wi);
+    }
+  bow_verbosify (bow_progress, "\n");
+  fflush (new_fp);
+
+  fclose (wi2pv->fp);
+  wi2pv->fp = new_fp;
+  wi2pv->fp_dirty = 0;
+  wi2pv->pvm_total_bytes = 0;
+  bow_free ((char*)wi2pv->pv_filename);
+  wi2pv->pv_filename = strdup (pv_filename);
+  assert (wi2pv->pv_filename);
+}
+
 void
 bow_wi2pv_print_stats (bow_wi2pv *wi2pv)
 {